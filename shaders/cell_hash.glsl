@@ -0,0 +1,77 @@
+// Cells of the surfel grid, dense or in the sparse hash (rtxState.cellHash).
+// The dense grid stores the cell at its flatten index. The hash stores it in the first free slot
+// after getCellHashHome(index), the slot keys are in cellHashKeys and the slots claimed this frame
+// in cellHashOccupied, so surfel_prepare.comp only clears those.
+// Expects rtxState, cellBuffer, cellCounter, cellHashKeys and cellHashOccupied to be declared.
+
+// Entries of the cell buffer the scan and the sort go through
+uint getCellSlotCount()
+{
+    return rtxState.cellHash != 0 ? kCellHashCapacity : cellCounter.totalCellCount;
+}
+
+// Index of the cell in the cell buffer, kInvalidCell when no surfel was binned to it
+uint findCellIndex(ivec4 cellPos)
+{
+    uint key = getFlattenCellIndexNonUniform(cellPos);
+    if (rtxState.cellHash == 0)
+        return key;
+
+    uint home = getCellHashHome(key);
+    for (uint i = 0u; i < kCellHashMaxProbes; i++)
+    {
+        uint slot = (home + i) & (kCellHashCapacity - 1u);
+        uint slotKey = cellHashKeys[slot];
+        if (slotKey == key)
+            return slot;
+        if (slotKey == kCellHashEmpty)
+            break;
+    }
+    return kInvalidCell;
+}
+
+// Entries of the cell list inside cellToSurfel, the scatter drops the ones past its capacity until
+// the host grows it. The count itself stays exact for the update pass to patch.
+uint getCellListCount(CellInfo cell)
+{
+    uint capacity = cellCounter.cellToSurfelCapacity;
+    return cell.surfelOffset < capacity ? min(cell.surfelCount, capacity - cell.surfelOffset) : 0u;
+}
+
+// Offset and count of the surfels binned to the cell, none when it is not in the hash
+CellInfo getCellInfo(ivec4 cellPos)
+{
+    uint cellIndex = findCellIndex(cellPos);
+    if (cellIndex == kInvalidCell)
+        return CellInfo(0u, 0u);
+    CellInfo cell = cellBuffer[cellIndex];
+    return CellInfo(cell.surfelOffset, getCellListCount(cell));
+}
+
+// Index of the cell, added to the hash when missing. kInvalidCell when the probe sequence is full.
+// probes / maxProbe accumulate the slots visited for the statistics.
+uint insertCellIndex(ivec4 cellPos, inout uint probes, inout uint maxProbe)
+{
+    uint key = getFlattenCellIndexNonUniform(cellPos);
+    if (rtxState.cellHash == 0)
+        return key;
+
+    uint home = getCellHashHome(key);
+    for (uint i = 0u; i < kCellHashMaxProbes; i++)
+    {
+        uint slot = (home + i) & (kCellHashCapacity - 1u);
+        uint slotKey = atomicCompSwap(cellHashKeys[slot], kCellHashEmpty, key);
+        if (slotKey == kCellHashEmpty)
+            cellHashOccupied[atomicAdd(cellCounter.hashOccupied, 1u)] = slot;
+        if (slotKey == kCellHashEmpty || slotKey == key)
+        {
+            probes += i + 1u;
+            maxProbe = max(maxProbe, i + 1u);
+            return slot;
+        }
+    }
+    probes += kCellHashMaxProbes;
+    maxProbe = kCellHashMaxProbes;
+    atomicAdd(cellCounter.hashOverflow, 1u);
+    return kInvalidCell;
+}
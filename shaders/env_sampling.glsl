@@ -28,14 +28,12 @@
 #include "globals.glsl"
 #include "common.glsl"
 
-#include "sun_and_sky.glsl"
-
 
 //-------------------------------------------------------------------------------------------------
 // Environment Sampling (HDR)
 // See:  https://arxiv.org/pdf/1901.05423.pdf
 //-------------------------------------------------------------------------------------------------
-vec3 Environment_sample(sampler2D lat_long_tex, in vec3 randVal, out vec3 to_light, out float pdf)
+vec3 Environment_sample(sampler2D lat_long_tex, bool isSky, in vec3 randVal, out vec3 to_light, out float pdf)
 {
 
   // Uniformly pick a texel index idx in the environment map
@@ -50,8 +48,8 @@ vec3 Environment_sample(sampler2D lat_long_tex, in vec3 randVal, out vec3 to_lig
   // Fetch the sampling data for that texel, containing the ratio q between its
   // emitted radiance and the average of the environment map, the texel alias,
   // the probability distribution function (PDF) values for that texel and its
-  // alias
-  EnvAccel sample_data = envSamplingData[idx];
+  // alias. The baked sun & sky has its own table.
+  EnvAccel sample_data = isSky ? skySamplingData[idx] : envSamplingData[idx];
 
   uint env_idx;
 
@@ -107,28 +105,12 @@ vec4 EnvSample(inout vec3 radiance)
   vec3  lightDir;
   float pdf;
 
-  // Sun & Sky or HDR
+  // Sun & Sky or HDR, both are importance sampled lat-long maps
+  vec3 randVal = vec3(rand(prd.seed), rand(prd.seed), rand(prd.seed));
   if(_sunAndSky.in_use == 1)
-  {
-    // #TODO: find proper light direction + PDF
-    float sun_radius = (0.00465f * 10.0f) * _sunAndSky.sun_disk_scale;
-    vec3  T, B;
-    CreateCoordinateSystem(_sunAndSky.sun_direction, T, B);
-    vec3 dir;
-    dir.x = rand(prd.seed) * sun_radius;
-    dir.y = rand(prd.seed) * sun_radius;
-    dir.z = sqrt(max(0.0, 1.0 - dir.x * dir.x - dir.y * dir.y));
-
-    lightDir = normalize(T * dir.x + B * dir.y + _sunAndSky.sun_direction * dir.z);
-    radiance = sun_and_sky(_sunAndSky, lightDir);
-    pdf      = 0.5;
-  }
+    radiance = Environment_sample(skyLutTexture, true, randVal, lightDir, pdf);
   else
-  {
-    // Sampling the HDR with importance sampling
-    vec3 randVal = vec3(rand(prd.seed), rand(prd.seed), rand(prd.seed));
-    radiance     = Environment_sample(environmentTexture, randVal, lightDir, pdf);
-  }
+    radiance = Environment_sample(environmentTexture, false, randVal, lightDir, pdf);
 
   radiance *= rtxState.hdrMultiplier;
   return vec4(lightDir, pdf);
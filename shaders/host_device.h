@@ -31,6 +31,7 @@
 #include <stdint.h>
 // GLSL Type
 using ivec2 = glm::ivec2;
+using uvec4 = glm::uvec4;
 using vec2  = glm::vec2;
 using vec3  = glm::vec3;
 using vec4  = glm::vec4;
@@ -49,6 +50,14 @@ using uint  = unsigned int;
 #define END_ENUM()
 #endif
 
+#ifdef __cplusplus  // Surfel configuration: host variables of surfel_spec set before the surfel resources and pipelines are created (SurfelConfig::apply), specialization constants of the shaders
+#define SURFEL_CONSTANT(id, type, name, value) namespace surfel_spec { inline type name = value; }
+#define SURFEL_SPEC(name) surfel_spec::name
+#else
+#define SURFEL_CONSTANT(id, type, name, value) layout(constant_id = id) const type name = value
+#define SURFEL_SPEC(name) name
+#endif
+
 // Sets
 START_ENUM(SetBindings)
   S_ACCEL = 0,  // Acceleration structure
@@ -83,7 +92,10 @@ END_ENUM();
 START_ENUM(EnvBindings)
   eSunSky     = 0, 
   eHdr        = 1, 
-  eImpSamples = 2 
+  eImpSamples = 2,
+  eEnvSH      = 3,  // SH irradiance: [0] HDR, [1] sun & sky
+  eSkyLut     = 4,  // Sun & sky baked in lat-long
+  eSkySamples = 5   // Importance sampling of eSkyLut
 END_ENUM();
 
 START_ENUM(DebugMode)
@@ -136,14 +148,51 @@ struct MSMEData
 	float pad;
 };
 
+// Ray budget: each surfel is first given up to kSurfelMinRays, the rest of kMaxRayCount goes to the
+// priority levels from the highest (surfel_ray_budget.glsl)
+const uint kSurfelMinRays = 4u;
+const uint kRayPriorityLevels = 4u;
+// Amortized updates: levels of the surfel ranking the update pass counts (surfel_schedule.glsl)
+const uint kScheduleLevels = 16u;
+
 struct SurfelCounter
 {
 	uint aliveSurfelCnt;
 	uint deadSurfelCnt;
 	uint dirtySurfelCnt;
 	uint surfelRayCnt;
+
+	// Rays requested by the update pass: the first kSurfelMinRays of each surfel, then the rest of
+	// the requests of each priority level
+	uint rayRequestBase;
+	uint rayRequestExtra[kRayPriorityLevels];
+
+	// Surfels asking for rays this frame: the levels above scheduleLevel, scheduleShare / 0x10000 of
+	// that one, set by surfel_prepare.comp from the ranking of the last frame
+	uint scheduleLevel;
+	uint scheduleShare;
+	uint scheduledSurfels;
+	uint scheduleHistogram[kScheduleLevels];
+};
+
+// Rays a surfel asks for in the update pass, surfel_ray_budget.comp grants them
+struct SurfelRayRequest
+{
+	uint count;
+	uint priority;  // Level, kRayPriorityLevels - 1 is served first
 };
 
+// Indirect dispatch of the surfel passes sized by the live counters, one invocation per surfel or
+// per ray. xyz: workgroups of kSurfelGroupSize (VkDispatchIndirectCommand), w: live invocations
+struct SurfelDispatch
+{
+	uvec4 update;        // Alive surfels before the update pass
+	uvec4 aliveSurfels;  // Alive surfels after it: cellToSurfel, integrate
+	uvec4 rays;          // Rays allocated by it: raytrace
+};
+
+// Hot part of a surfel, 32 bytes: all the lookups (generation, finalizePathWithSurfel,
+// calcCellIndirectLighting, integrate sharing, binning) only need these
 struct Surfel 
 {
 	//0
@@ -153,8 +202,12 @@ struct Surfel
 	//4
 	vec3 radiance;
 	uint normal;
+};
 
-	// 8
+// Cold part, same index as Surfel: only update, raytrace, integrate and the creation in
+// generation touch it
+struct SurfelCold
+{
 	uint objID;
 	uint rayOffset;
 	uint rayCount;
@@ -171,7 +224,7 @@ struct SurfelRecycleInfo
 	uint life;
 	uint frame;
 	uint status;
-	uint lastSeenFrame;
+	uint staleFrames;  // Frames since the last update that asked for rays
 };
 
 
@@ -180,7 +233,7 @@ struct SurfelRay
 	uint surfelID;
 	uint dir_o;
 	float pdf;
-	float pad;
+	float pad;  // Bin of the ray between the binning phases of surfel_raytrace.comp
 
 	vec3 radiance;
 	float t;
@@ -196,6 +249,22 @@ struct CellCounter
 {
 	uint totalCellCount;
 	uint aliveSurfelInCell;
+
+	// Sparse cell hash (RtxState::cellHash), see cell_hash.glsl
+	uint hashOccupied;    // Slots claimed this frame, entries of cellHashOccupied
+	uint hashInsertions;  // Surfel / cell insertions of the update pass
+	uint hashProbes;      // Slots probed by these insertions
+	uint hashMaxProbe;    // Longest probe sequence of an insertion
+	uint hashOverflow;    // Insertions that found no free slot within kCellHashMaxProbes
+	uint hashedFrame;     // 1 when the cells of the last frame are in the hash
+
+	// Incremental binning (RtxState::cellRebuild)
+	uint rebuiltFrame;    // 1 when surfel_prepare.comp cleared the cells this frame
+	uint changedSurfels;  // Surfels of the update pass whose cell mask changed, 0 keeps the last lists
+
+	// cellToSurfel, grown by the host when aliveSurfelInCell passes its capacity
+	uint cellToSurfelCapacity;  // Entries of the buffer, written by the host
+	uint cellToSurfelDropped;   // Entries of this frame the scatter found past the capacity
 };
 
 //Uniform grid
@@ -205,16 +274,86 @@ const float surfelMinSizeRatio = 0.15f;
 const uint kCellDimension = 64u;
 const uint kCellCount = kCellDimension * kCellDimension * kCellDimension;
 
+// Binning: exclusive scan of the cell counts, one workgroup per block, then one over the block sums
+const uint kCellScanBlockSize = 1024u;
+const uint kCellScanMaxBlocks = 1024u;
+
+// Morton order of the alive list: LSD radix sort of the 30 bit keys of surfel_sort.glsl, in passes
+// of kSortDigitBits over the blocks of the cell scan. An even number of passes ends in surfelAlive.
+const uint kSortKeyBits = 30u;
+const uint kSortDigitBits = 4u;
+const uint kSortDigits = 1u << kSortDigitBits;
+const uint kSortPasses = (kSortKeyBits + kSortDigitBits - 1u) / kSortDigitBits;
+
+// Push constant of surfel_sort.comp, one radix pass
+struct SurfelSortConstants
+{
+	vec3 gridOrigin;  // RtxState::cellGridOrigin, center of the key space
+	uint shift;       // Lowest key bit of the digit
+	uint flip;        // 0: surfelAlive to surfelSortScratch, 1: back
+};
+
+// Coherence binning of the surfel rays (rtxState.surfelRayBinning): a counting sort of the rays by
+// the coarse cell of their origin, the top kRayBinCellBits of the surfel sort key, then by the
+// octahedral bin of their direction. surfelRayBins holds the counts then the bin offsets.
+const uint kRayBinDirSplits = 4u;
+const uint kRayBinDirections = kRayBinDirSplits * kRayBinDirSplits;
+const uint kRayBinCellBits = 12u;
+const uint kRayBinCount = kRayBinDirections << kRayBinCellBits;
+
+// Sparse cell hash: open addressing with linear probing in the first kCellHashCapacity entries of
+// the cell buffer, keyed by the dense index of the cell
+const uint kCellHashCapacity = 1u << 18;
+const uint kCellHashMaxProbes = 32u;
+const uint kCellHashEmpty = 0xffffffffu;
+const uint kInvalidCell = 0xffffffffu;
+
+// Specialization constants of the surfel configuration, after the phase selector of the passes
+START_ENUM(SurfelSpecConstants)
+  eSpecPhase          = 0,  // kScanPhase, kBinningPhase, kArgsStage
+  eSpecMaxSurfelCount = 1,
+  eSpecMaxRayCount    = 2,
+  eSpecMaxLife        = 3,
+  eSpecGridSize       = 4,  // d
+  eSpecGridSplits     = 5,  // n
+  eSpecGridRatio      = 6,  // p
+  eSpecGridLayers     = 7,  // m
+  eSpecCount          = 8
+END_ENUM();
+
 // Sufel
-const uint kMaxLife = 1200u;
-const uint kMaxSurfelCount = 150000u;
-const uint kMaxRayCount = kMaxSurfelCount * 64;
+SURFEL_CONSTANT(eSpecMaxLife, uint, kMaxLife, 1200u);
+SURFEL_CONSTANT(eSpecMaxSurfelCount, uint, kMaxSurfelCount, 150000u);
+SURFEL_CONSTANT(eSpecMaxRayCount, uint, kMaxRayCount, 9600000u); // 64 rays per surfel
+const uint kSurfelGroupSize = 32u;
+const uint kSurfelTileSize = 6u; // Texels of a surfel tile in the irradiance / depth atlas, per side
+const uint kSurfelGuideEntries = kSurfelTileSize * kSurfelTileSize;
+
+// Guided rays of a surfel: CDF of its irradiance tile in row-major texel order, written by
+// surfel_integrate.comp. Entries are unorm16 in pairs, the last one is 0xffff.
+struct SurfelGuide
+{
+	uint cdf[kSurfelGuideEntries / 2];
+};
+
+// Share of the guided rays spread evenly over the texels of the tile: the texels the tile rounds to
+// nothing stay reachable, and 1 / pdf stays within kSurfelGuideEntries / kSurfelGuideUniform times
+// the solid angle of a texel
+const float kSurfelGuideUniform = 0.1;
+
+// Surfel lists of the cells: initial entries of cellToSurfel, and the most it grows to. Surfels
+// binned over a range of cells have no bound on their entries, so the cap is the largest storage
+// buffer every device supports (maxStorageBufferRange of 2^27 bytes) rather than 27 a surfel. Past
+// it the scatter drops the entries and counts them in cellToSurfelDropped.
+const uint kCellToSurfelInitialSize = 1u << 19;
+const uint kCellToSurfelMaxSize = 1u << 25;
 
 //Non-uniform frustum
-const float d = 96.0;     // Size of the uniform cube
-const int n = 64; // Split count of the uniform cube & non-unifrom frustum, must be even
-const float p = 1.3; // Split ratio of the non-uniform frustum
-const int m = 16; // Layers of the non-uniform frustum
+SURFEL_CONSTANT(eSpecGridSize, float, d, 96.0);     // Size of the uniform cube
+SURFEL_CONSTANT(eSpecGridSplits, int, n, 64); // Split count of the uniform cube & non-unifrom frustum, must be even
+SURFEL_CONSTANT(eSpecGridRatio, float, p, 1.3); // Split ratio of the non-uniform frustum
+SURFEL_CONSTANT(eSpecGridLayers, int, m, 16); // Layers of the non-uniform frustum
+#define kCellGridSnap (SURFEL_SPEC(d) / float(SURFEL_SPEC(n))) // Step of RtxState::cellGridOrigin, the cube cell size
 
 // Camera of the scene
 struct SceneCamera
@@ -297,6 +436,8 @@ struct GltfShadeMaterial
 };
 
 
+const int kMaxReflectionCandidates = 16;
+
 // Use with PushConstant
 struct RtxState
 {
@@ -311,6 +452,15 @@ struct RtxState
   ivec2 size;                   // rendering size
   int   minHeatmap;             // Debug mode - heat map
   int   maxHeatmap;
+  int   cellHash;               // Surfel cells in the sparse hash instead of the dense grid
+  int   cellRebuild;            // 1: surfel cells cleared and binned again, 0: the last ones are patched
+  uint  surfelRayBudget;        // Rays surfel_ray_budget.comp grants at most, capped to kMaxRayCount
+  float surfelSpawnRate;        // Scale of the chance to spawn a surfel on an uncovered pixel
+  vec3  cellGridOrigin;         // Center of the surfel grid, the camera snapped to kCellGridSnap
+  int   reflectionCandidates;   // BSDF samples the reflection rays are resampled from, 1 to kMaxReflectionCandidates
+  float surfelUpdateFraction;   // Share of the surfels that ask for rays each frame, 1: all
+  int   surfelRayBinning;       // 1: the surfel rays are traced in the order of their coherence bins
+  ivec2 _pad1;
 };
 
 // Structure used for retrieving the primitive information in the closest hit
@@ -410,6 +560,14 @@ struct SunAndSky
   int   in_use;
 };
 
+// L2 spherical harmonics of the environment, already convolved with the
+// clamped cosine lobe: evaluating the basis gives irradiance E(n).
+// coeffs[0].w is 1 when surfels may be seeded from it, 0 otherwise.
+struct EnvSH
+{
+  vec4 coeffs[9];
+};
+
 
 
 #endif  // COMMON_HOST_DEVICE
\ No newline at end of file
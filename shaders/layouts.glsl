@@ -48,6 +48,9 @@ layout(set = S_SCENE, binding = eTextures	      )		uniform sampler2D		texturesMa
 layout(set = S_ENV, binding = eSunSky,		scalar)		uniform _SSBuffer		{ SunAndSky _sunAndSky; };
 layout(set = S_ENV, binding = eHdr)						uniform sampler2D		environmentTexture;
 layout(set = S_ENV, binding = eImpSamples,  scalar)		buffer _EnvAccel		{ EnvAccel envSamplingData[]; };
+layout(set = S_ENV, binding = eEnvSH,		scalar)		uniform _EnvSHBuffer	{ EnvSH envSH[2]; };
+layout(set = S_ENV, binding = eSkyLut)					uniform sampler2D		skyLutTexture;
+layout(set = S_ENV, binding = eSkySamples,  scalar)		buffer _SkyAccel		{ EnvAccel skySamplingData[]; };
 
 layout(buffer_reference, scalar) buffer Vertices { VertexAttributes v[]; };
 layout(buffer_reference, scalar) buffer Indices	 { uvec3 i[];            };
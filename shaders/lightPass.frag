@@ -110,7 +110,7 @@ void main()
     {
       vec3 env;
       if(_sunAndSky.in_use == 1)
-        env = sun_and_sky(_sunAndSky, camRay.direction);
+        env = texture(skyLutTexture, GetSphericalUv(camRay.direction)).rgb;  // Baked sun_and_sky()
       else
       {
         vec2 uv = GetSphericalUv(camRay.direction);  // See sampling.glsl
@@ -199,7 +199,7 @@ void main()
             fragColor.xyz = fract(sin(dot(cellPos, vec3(12.9898, 78.233, 45.164))) * vec3(43758.5453, 28001.8384, 50849.4141));
         }    
         else if (rtxState.debugging_mode == esNonUniformGrid) {
-            ivec4 cellPos4 = getCellPosNonUniform(worldPos, camPos);
+            ivec4 cellPos4 = getCellPosNonUniform(worldPos, rtxState.cellGridOrigin);
             uint index = getFlattenCellIndexNonUniform(cellPos4);
             if (cellPos4.w == 0){
                 fragColor.a = 0.0f;
@@ -1,7 +1,11 @@
 // ref: https://github.com/Apress/ray-tracing-gems/blob/master/Ch_25_Hybrid_Rendering_for_Real-Time_Ray_Tracing/MultiscaleMeanEstimator.hlsl
 
 
+#ifdef CPP
+vec3 MSME(vec3 y, MSMEData& data, float shortWindowBlend)
+#else
 vec3 MSME(vec3 y, inout MSMEData data, float shortWindowBlend)
+#endif
 {
     vec3 mean = data.mean;
     vec3 shortMean = data.shortMean;
@@ -12,7 +16,7 @@ vec3 MSME(vec3 y, inout MSMEData data, float shortWindowBlend)
     // suppress fireflies.
     {
         vec3 dev = sqrt(max(vec3(1e-5), variance));
-        vec3 highThreshold = 0.1 + shortMean + dev * 8.0;
+        vec3 highThreshold = 0.1f + shortMean + dev * 8.0f;
         vec3 overflow = max(vec3(0.0), y - highThreshold);
         y -= overflow;
     }
@@ -31,13 +35,13 @@ vec3 MSME(vec3 y, inout MSMEData data, float shortWindowBlend)
     float relativeDiff = dot(vec3(0.299, 0.587, 0.114), abs(shortDiff) / max(vec3(1e-5), dev));
     inconsistency = mix(inconsistency, relativeDiff, 0.08);
 
-    float varianceBasedBlendReduction = clamp(dot(vec3(0.299, 0.587, 0.114), 0.5 * shortMean / max(vec3(1e-5), dev)), 1.0 / 32, 1.0);
+    float varianceBasedBlendReduction = clamp(dot(vec3(0.299, 0.587, 0.114), 0.5f * shortMean / max(vec3(1e-5), dev)), 1.0f / 32.0f, 1.0f);
 
-    float catchUpBlend = clamp(smoothstep(0, 1, relativeDiff * max(0.02, inconsistency - 0.2)), 1.0 / 256, 1.0);
+    float catchUpBlend = clamp(smoothstep(0.0f, 1.0f, relativeDiff * max(0.02f, inconsistency - 0.2f)), 1.0f / 256.0f, 1.0f);
     catchUpBlend *= vbbr;
 
     vbbr = mix(vbbr, varianceBasedBlendReduction, 0.1);
-    mean = mix(mean, y, clamp(catchUpBlend, 0.0, 1.0));
+    mean = mix(mean, y, clamp(catchUpBlend, 0.0f, 1.0f));
 
     // Output
     data.mean = mean;
@@ -279,7 +279,7 @@ vec3 PathTrace(Ray r)
 
       vec3 env;
       if(_sunAndSky.in_use == 1)
-        env = sun_and_sky(_sunAndSky, r.direction);
+        env = texture(skyLutTexture, GetSphericalUv(r.direction)).rgb;  // Baked sun_and_sky()
       else
       {
         vec2 uv = GetSphericalUv(r.direction);  // See sampling.glsl
@@ -8,7 +8,7 @@ vec3 getCellPos(vec3 posW, vec3 cameraPosW)
 uint getFlattenCellIndex(vec3 cellPos)
 {
 
-    uvec3 unsignedPos = uvec3(cellPos + ivec3(kCellDimension / 2));
+    uvec3 unsignedPos = uvec3(cellPos + vec3(kCellDimension / 2));
 
     uint result = (unsignedPos.z * kCellDimension * kCellDimension) +
         (unsignedPos.y * kCellDimension) +
@@ -99,135 +99,99 @@ uint getFlattenCellIndexNonUniform(ivec4 cellPos)
     return 0;
 }
 
-bool isSurfelIntersectCellNonUniform(Surfel surfel, ivec4 cellPos, vec3 cameraPosW)
+// Bounds of the cube cells at `index` along an axis, relative to the grid origin
+vec2 getCubeCellBounds(int index)
 {
-    int region = cellPos.w;
-    vec3 minPos;
-    vec3 maxPos;
     float half_d = d / 2.0;
     float delta = d / float(n);
-	int half_n = n / 2;
-
-    if (region == 0)
-    {
-        // Inside the cube
-        
-        int x_index = cellPos.x;
-        int y_index = cellPos.y;
-        int z_index = cellPos.z;
-
-        minPos.x = -half_d + x_index * delta;
-        maxPos.x = minPos.x + delta;
-
-        minPos.y = -half_d + y_index * delta;
-        maxPos.y = minPos.y + delta;
 
-        minPos.z = -half_d + z_index * delta;
-        maxPos.z = minPos.z + delta;
-    }
-    else
-    {
-        // Inside the frustum
-        int s = region;
-        int k = cellPos.x;
-        int u = cellPos.y;
-        int v = cellPos.z;
-
-        if (u < half_n) u = u - half_n;
-		else u = u - half_n + 1;
-
-        if (v < half_n) v = v - half_n;
-        else v = v - half_n + 1;
-
-        // Compute s0 and s1
-        float s0 = delta * (1.0 - pow(p, float(k))) / (1.0 - p);
-        float s1 = delta * (1.0 - pow(p, float(k + 1))) / (1.0 - p);
+    float minPos = -half_d + index * delta;
+    return vec2(minPos, minPos + delta);
+}
 
-        float main_axis_min;
-        float main_axis_max;
+// Bounds of the frustum layer k along the main axis of the region, relative to the grid origin
+vec2 getFrustumLayerBounds(int k, int region)
+{
+    float half_d = d / 2.0;
+    float delta = d / float(n);
 
-        if (region % 2 == 0) // Negative direction
-        {
-            main_axis_min = -(half_d + s1);
-            main_axis_max = -(half_d + s0);
-        }
-		else { // Positive direction
-			main_axis_min = half_d + s0;
-			main_axis_max = half_d + s1;
-        }
+    // Compute s0 and s1
+    float s0 = delta * (1.0 - pow(p, float(k))) / (1.0 - p);
+    float s1 = delta * (1.0 - pow(p, float(k + 1))) / (1.0 - p);
 
-        // Other axis 1
-        float other_axis_a_1 = 0.0f;
-        float other_axis_b_1 = 0.0f;
-        float other_axis_c_1 = 0.0f;
-        float other_axis_d_1 = 0.0f;
-        if (u > 0) {
-            other_axis_a_1 =  2.0 * (u - 1) / n * (half_d + main_axis_min);
-            other_axis_b_1 =  2.0 * u / n * (half_d + main_axis_max);
-            other_axis_c_1 = 2.0 * (u - 1) / n * (half_d + main_axis_max);
-            other_axis_d_1 = 2.0 * u / n * (half_d + main_axis_min);
-        }
-        else {
-            other_axis_a_1 = 2.0 * (u + 1) / n * (half_d + main_axis_min);
-            other_axis_b_1 = 2.0 * u / n * (half_d + main_axis_max);
-            other_axis_c_1 = 2.0 * (u + 1) / n * (half_d + main_axis_max);
-            other_axis_d_1 = 2.0 * u / n * (half_d + main_axis_min);
-        }
+    if (region % 2 == 0) // Negative direction
+        return vec2(-(half_d + s1), -(half_d + s0));
+    return vec2(half_d + s0, half_d + s1); // Positive direction
+}
 
-        float other_axis_min_1 = min(min(other_axis_a_1, other_axis_b_1), min(other_axis_c_1, other_axis_d_1));
-        float other_axis_max_1 = max(max(other_axis_a_1, other_axis_b_1), max(other_axis_c_1, other_axis_d_1));
+// Bounds of the frustum column u along a side axis, in the layer spanning `layer` on the main axis
+vec2 getFrustumColumnBounds(int u, vec2 layer)
+{
+    float half_d = d / 2.0;
+    int half_n = n / 2;
+    float main_axis_min = layer.x;
+    float main_axis_max = layer.y;
+
+    if (u < half_n) u = u - half_n;
+    else u = u - half_n + 1;
+
+    float other_axis_a = 0.0f;
+    float other_axis_b = 0.0f;
+    float other_axis_c = 0.0f;
+    float other_axis_d = 0.0f;
+    if (u > 0) {
+        other_axis_a = 2.0 * (u - 1) / n * (half_d + main_axis_min);
+        other_axis_b = 2.0 * u / n * (half_d + main_axis_max);
+        other_axis_c = 2.0 * (u - 1) / n * (half_d + main_axis_max);
+        other_axis_d = 2.0 * u / n * (half_d + main_axis_min);
+    }
+    else {
+        other_axis_a = 2.0 * (u + 1) / n * (half_d + main_axis_min);
+        other_axis_b = 2.0 * u / n * (half_d + main_axis_max);
+        other_axis_c = 2.0 * (u + 1) / n * (half_d + main_axis_max);
+        other_axis_d = 2.0 * u / n * (half_d + main_axis_min);
+    }
 
-        // Other axis 2
-        float other_axis_a_2 = 0.0f;
-        float other_axis_b_2 = 0.0f;
-        float other_axis_c_2 = 0.0f;
-        float other_axis_d_2 = 0.0f;
+    return vec2(min(min(other_axis_a, other_axis_b), min(other_axis_c, other_axis_d)),
+                max(max(other_axis_a, other_axis_b), max(other_axis_c, other_axis_d)));
+}
 
-        if (v > 0) {
-            other_axis_a_2 = 2.0 * (v - 1) / n * (half_d + main_axis_min);
-            other_axis_b_2 = 2.0 * v / n * (half_d + main_axis_max);
-            other_axis_c_2 = 2.0 * (v - 1) / n * (half_d + main_axis_max);
-            other_axis_d_2 = 2.0 * v / n * (half_d + main_axis_min);
-        }
-        else {
-            other_axis_a_2 = 2.0 * (v + 1) / n * (half_d + main_axis_min);
-            other_axis_b_2 = 2.0 * v / n * (half_d + main_axis_max);
-            other_axis_c_2 = 2.0 * (v + 1) / n * (half_d + main_axis_max);
-            other_axis_d_2 = 2.0 * v / n * (half_d + main_axis_min);
-        }
+// World axis of each component of the cell position: x, y, z in the cube, k, u, v in the frustums
+ivec3 getCellAxes(int region)
+{
+    if (region == 3 || region == 4) return ivec3(1, 0, 2); // Y-axis frustums
+    if (region == 5 || region == 6) return ivec3(2, 0, 1); // Z-axis frustums
+    return ivec3(0, 1, 2);
+}
 
-        // Calculate min and max for Other axis 2
-        float other_axis_min_2 = min(min(other_axis_a_2, other_axis_b_2), min(other_axis_c_2, other_axis_d_2));
-        float other_axis_max_2 = max(max(other_axis_a_2, other_axis_b_2), max(other_axis_c_2, other_axis_d_2));
+bool isSurfelIntersectCellNonUniform(Surfel surfel, ivec4 cellPos, vec3 cameraPosW)
+{
+    int region = cellPos.w;
+    vec3 minPos;
+    vec3 maxPos;
 
-        // Assign minPos and maxPos based on region
-        if (region == 1 || region == 2) // X-axis frustums
-        {
-            minPos.x = main_axis_min;
-            maxPos.x = main_axis_max;
-            minPos.y = other_axis_min_1;
-            maxPos.y = other_axis_max_1;
-            minPos.z = other_axis_min_2;
-            maxPos.z = other_axis_max_2;
-        }
-        else if (region == 3 || region == 4) // Y-axis frustums
-        {
-            minPos.y = main_axis_min;
-            maxPos.y = main_axis_max;
-            minPos.x = other_axis_min_1;
-            maxPos.x = other_axis_max_1;
-            minPos.z = other_axis_min_2;
-            maxPos.z = other_axis_max_2;
-        }
-        else if (region == 5 || region == 6) // Z-axis frustums
-        {
-            minPos.z = main_axis_min;
-            maxPos.z = main_axis_max;
-            minPos.x = other_axis_min_1;
-            maxPos.x = other_axis_max_1;
-            minPos.y = other_axis_min_2;
-            maxPos.y = other_axis_max_2;
-        }
+    if (region == 0)
+    {
+        // Inside the cube
+        vec2 boundsX = getCubeCellBounds(cellPos.x);
+        vec2 boundsY = getCubeCellBounds(cellPos.y);
+        vec2 boundsZ = getCubeCellBounds(cellPos.z);
+        minPos = vec3(boundsX.x, boundsY.x, boundsZ.x);
+        maxPos = vec3(boundsX.y, boundsY.y, boundsZ.y);
+    }
+    else
+    {
+        // Inside the frustum, the AABB of the cell
+        ivec3 axes = getCellAxes(region);
+        vec2 layer = getFrustumLayerBounds(cellPos.x, region);
+        vec2 column1 = getFrustumColumnBounds(cellPos.y, layer);
+        vec2 column2 = getFrustumColumnBounds(cellPos.z, layer);
+        minPos[axes.x] = layer.x;
+        maxPos[axes.x] = layer.y;
+        minPos[axes.y] = column1.x;
+        maxPos[axes.y] = column1.y;
+        minPos[axes.z] = column2.x;
+        maxPos[axes.z] = column2.y;
     }
 
     // Convert to world coordinates
@@ -279,4 +243,184 @@ float getSurfelMaxSize(float distance) {
         int k = int(log(1 - n * s * (1 - p) / d) / log(p));
 		return d * 0.5f / float(n) * pow(p, float(k));
     }
-}
\ No newline at end of file
+}
+
+// i-th cell of the 3x3x3 neighbourhood, same order as the neighborOffset table
+ivec4 getNeighbourCellPos(ivec4 cellPos, uint i)
+{
+    return cellPos + ivec4(int(i / 3 % 3) - 1, int(i % 3) - 1, int(i / 9) - 1, 0);
+}
+
+// Cells a surfel is binned to around its home cell (getCellPosNonUniform of its position), cells
+// outside of the grid are left out. Two encodings in a uvec2, 0 when the surfel is in no cell:
+// - within the 3x3x3 neighbourhood, bit i of x set when the surfel overlaps the i-th neighbour
+//   cell: the same cells as isSurfelIntersectCellNonUniform on each of the 27 neighbours
+// - past it, kCellRangeFlag in x and the range of cells overlapped on each component, offsets from
+//   the home cell in [-kCellRangeMax, kCellRangeMax], 10 bits each: first and last of the main
+//   component and first of the second in x, the others in y. The whole box is binned, including
+//   corner cells the sphere misses. The lookups test the distance to each surfel anyway.
+// kCellRangeMax is past any grid dimension, a range is never clipped within the home region.
+const uint kCellRangeFlag = 0x80000000u;
+const int kCellRangeMax = 511;
+const uint kCellRangeBits = 10u;
+const uint kCellRangeFieldMask = (1u << kCellRangeBits) - 1u;
+
+// Offset from the surfel to the closest point of slab `index` of a component, 0 inside of it.
+// Frustum columns widen with the layer, they are taken in the layer spanning `layer`.
+float getCellSlabOffset(int region, int component, int index, vec2 layer, float pos, float origin)
+{
+    vec2 bounds = region == 0 ? getCubeCellBounds(index) :
+        component == 0 ? getFrustumLayerBounds(index, region) : getFrustumColumnBounds(index, layer);
+    return clamp(pos, bounds.x + origin, bounds.y + origin) - pos;
+}
+
+// Offsets from `home` of the first and last slab of a component within the radius, empty (x > y)
+// when none is. The slab distances grow on both sides of the closest slab, which is not the home
+// one for the columns of another frustum layer, nor for a home just past the grid: it is found
+// first, walking from the home slab clamped to the grid.
+ivec2 getCellSlabRange(int region, int component, int home, vec2 layer, float pos, float origin, float radiusSquared)
+{
+    int count = region != 0 && component == 0 ? m : n;
+    int start = clamp(home, 0, count - 1);
+    int closest = start;
+    float best = abs(getCellSlabOffset(region, component, start, layer, pos, origin));
+    for (int step = -1; step <= 1; step += 2)
+    {
+        for (int i = start + step; best > 0.f && i >= 0 && i < count && abs(i - home) <= kCellRangeMax; i += step)
+        {
+            float offset = abs(getCellSlabOffset(region, component, i, layer, pos, origin));
+            if (offset >= best)
+                break;
+            best = offset;
+            closest = i;
+        }
+    }
+    if (best * best > radiusSquared)
+        return ivec2(1, 0);
+
+    int first = closest;
+    int last = closest;
+    while (first > 0 && home - first < kCellRangeMax)
+    {
+        float offset = getCellSlabOffset(region, component, first - 1, layer, pos, origin);
+        if (offset * offset > radiusSquared)
+            break;
+        first--;
+    }
+    while (last + 1 < count && last - home < kCellRangeMax)
+    {
+        float offset = getCellSlabOffset(region, component, last + 1, layer, pos, origin);
+        if (offset * offset > radiusSquared)
+            break;
+        last++;
+    }
+    return ivec2(first - home, last - home);
+}
+
+// The slab ranges of the components are walked once, only the cells of their product sum their
+// axis distances. Frustum columns widen with the layer, their ranges are taken per layer and
+// merged for the range encoding.
+uvec2 getSurfelCellMask(Surfel surfel, ivec4 cellPos, vec3 cameraPosW)
+{
+    int region = cellPos.w;
+    if (region < 0 || region > 6)
+        return uvec2(0u);
+
+    float radiusSquared = surfel.radius * surfel.radius * surfel.radius;
+    ivec3 axes = getCellAxes(region);
+    vec3 pos = vec3(surfel.position[axes.x], surfel.position[axes.y], surfel.position[axes.z]);
+    vec3 origin = vec3(cameraPosW[axes.x], cameraPosW[axes.y], cameraPosW[axes.z]);
+
+    ivec2 layers = getCellSlabRange(region, 0, cellPos.x, vec2(0.f), pos.x, origin.x, radiusSquared);
+    ivec2 range0 = ivec2(kCellRangeMax, -kCellRangeMax);
+    ivec2 range1 = ivec2(kCellRangeMax, -kCellRangeMax);
+    ivec2 range2 = ivec2(kCellRangeMax, -kCellRangeMax);
+    uint mask = 0;
+    for (int i = layers.x; i <= layers.y; i++)
+    {
+        int k = cellPos.x + i;
+        vec2 layer = region == 0 ? vec2(0.f) : getFrustumLayerBounds(k, region);
+        ivec2 side1 = getCellSlabRange(region, 1, cellPos.y, layer, pos.y, origin.y, radiusSquared);
+        ivec2 side2 = getCellSlabRange(region, 2, cellPos.z, layer, pos.z, origin.z, radiusSquared);
+        if (side1.x > side1.y || side2.x > side2.y)
+            continue;
+        range0 = ivec2(min(range0.x, i), max(range0.y, i));
+        range1 = ivec2(min(range1.x, side1.x), max(range1.y, side1.y));
+        range2 = ivec2(min(range2.x, side2.x), max(range2.y, side2.y));
+        if (abs(i) > 1 || side1.x < -1 || side1.y > 1 || side2.x < -1 || side2.y > 1)
+            continue;  // Range encoding
+
+        float mainOffset = getCellSlabOffset(region, 0, k, layer, pos.x, origin.x);
+        for (int j = side1.x; j <= side1.y; j++)
+        {
+            float side1Offset = getCellSlabOffset(region, 1, cellPos.y + j, layer, pos.y, origin.y);
+            for (int l = side2.x; l <= side2.y; l++)
+            {
+                float side2Offset = getCellSlabOffset(region, 2, cellPos.z + l, layer, pos.z, origin.z);
+                if (mainOffset * mainOffset + side1Offset * side1Offset + side2Offset * side2Offset <= radiusSquared)
+                    mask |= 1u << uint((l + 1) * 9 + (i + 1) * 3 + j + 1); // getNeighbourCellPos order
+            }
+        }
+    }
+
+    if (range0.x > range0.y)
+        return uvec2(0u);
+    if (range0.x >= -1 && range0.y <= 1 && range1.x >= -1 && range1.y <= 1 && range2.x >= -1 && range2.y <= 1)
+        return uvec2(mask, 0u);
+    uvec3 first = uvec3(ivec3(range0.x, range1.x, range2.x) + kCellRangeMax);
+    uvec3 last = uvec3(ivec3(range0.y, range1.y, range2.y) + kCellRangeMax);
+    return uvec2(kCellRangeFlag | first.x | (last.x << kCellRangeBits) | (first.y << (2u * kCellRangeBits)),
+                 last.y | (first.z << kCellRangeBits) | (last.z << (2u * kCellRangeBits)));
+}
+
+// Offsets of the first and last cells of each component of a range encoded mask
+ivec3 getCellRangeFirst(uvec2 mask)
+{
+    return ivec3(uvec3(mask.x, mask.x >> (2u * kCellRangeBits), mask.y >> kCellRangeBits) & kCellRangeFieldMask) - kCellRangeMax;
+}
+
+ivec3 getCellRangeLast(uvec2 mask)
+{
+    return ivec3(uvec3(mask.x >> kCellRangeBits, mask.y, mask.y >> (2u * kCellRangeBits)) & kCellRangeFieldMask) - kCellRangeMax;
+}
+
+// Slots to walk for the cells of a mask, getCellMaskCellPos gives the cell of each
+uint getCellMaskSlotCount(uvec2 mask)
+{
+    if ((mask.x & kCellRangeFlag) == 0u)
+        return mask.x == 0u ? 0u : 27u;
+    ivec3 size = getCellRangeLast(mask) - getCellRangeFirst(mask) + 1;
+    return uint(size.x * size.y * size.z);
+}
+
+// Cell of slot i of the mask around the home cell, region -1 when the slot is not part of the mask
+ivec4 getCellMaskCellPos(ivec4 cellPos, uvec2 mask, uint i)
+{
+    if ((mask.x & kCellRangeFlag) == 0u)
+        return (mask.x & (1u << i)) != 0u ? getNeighbourCellPos(cellPos, i) : ivec4(-1);
+    ivec3 first = getCellRangeFirst(mask);
+    ivec3 size = getCellRangeLast(mask) - first + 1;
+    int slot = int(i);
+    return cellPos + ivec4(first + ivec3(slot % size.x, slot / size.x % size.y, slot / (size.x * size.y)), 0);
+}
+
+// True when the cell `offset` from the home cell is part of the mask
+bool isCellInMask(uvec2 mask, ivec3 offset)
+{
+    if ((mask.x & kCellRangeFlag) != 0u)
+        return all(greaterThanEqual(offset, getCellRangeFirst(mask))) && all(lessThanEqual(offset, getCellRangeLast(mask)));
+    if (any(greaterThan(abs(offset), ivec3(1))))
+        return false;
+    return (mask.x & (1u << uint((offset.z + 1) * 9 + (offset.x + 1) * 3 + offset.y + 1))) != 0u;
+}
+
+// First slot probed for a cell of the sparse hash, the key is the dense cell index
+uint getCellHashHome(uint key)
+{
+    key ^= key >> 16;
+    key *= 0x7feb352du;
+    key ^= key >> 15;
+    key *= 0x846ca68bu;
+    key ^= key >> 16;
+    return key & (kCellHashCapacity - 1u);
+}
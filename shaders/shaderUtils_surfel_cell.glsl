@@ -1,4 +1,5 @@
 #include "shaderUtil_grid.glsl"
+#include "cell_hash.glsl"
 // Surfel and cells
 
 vec3 getCameraPosition(SceneCamera camera)
@@ -48,9 +49,7 @@ vec3 calcCellIndirectLighting(vec3 camPos, vec3 worldPos, vec3 worldNor)
     //uint flattenIndex = getFlattenCellIndex(cellPosIndex);
 
     ivec4 cellPosIndex = getCellPosNonUniform(worldPos, camPos);
-    uint flattenIndex = getFlattenCellIndexNonUniform(cellPosIndex);
-
-    CellInfo cellInfo = cellBuffer[flattenIndex];
+    CellInfo cellInfo = getCellInfo(cellPosIndex);
     uint cellOffset = cellInfo.surfelOffset;
     uint cellSurfelCount = cellInfo.surfelCount;
 
@@ -140,15 +139,12 @@ float brdfWeight(vec3 V, vec3 N, vec3 L, float roughness)
 bool finalizePathWithSurfel(vec3 worldPos, vec3 worldNor, uint randSeed, inout vec4 irradiance)
 {
     irradiance = vec4(0.0f);
-    vec3 camPos = getCameraPosition(sceneCamera);
     //vec3 cellPosIndex = getCellPos(worldPos, camPos);
-    ivec4 cellPosIndex = getCellPosNonUniform(worldPos, camPos);
+    ivec4 cellPosIndex = getCellPosNonUniform(worldPos, rtxState.cellGridOrigin);
     if (!isCellValid(cellPosIndex))
         return false;
 
-    uint flattenIndex = getFlattenCellIndexNonUniform(cellPosIndex);
-
-    CellInfo cellInfo = cellBuffer[flattenIndex];
+    CellInfo cellInfo = getCellInfo(cellPosIndex);
     uint cellOffset = cellInfo.surfelOffset;
     uint cellSurfelCount = cellInfo.surfelCount;
 
@@ -309,7 +305,7 @@ vec3 surfelPathTrace(Ray r, int maxDepth, uint surfelIndex, inout float firstDep
         {
             vec3 env;
             if (_sunAndSky.in_use == 1)
-                env = sun_and_sky(_sunAndSky, r.direction);
+                env = texture(skyLutTexture, GetSphericalUv(r.direction)).rgb;  // Baked sun_and_sky()
             else
             {
                 vec2 uv = GetSphericalUv(r.direction);  // See sampling.glsl
@@ -472,7 +468,7 @@ vec3 surfelRefelctionTrace(Ray r, int maxDepth, inout float firstDepth, inout Bs
         {
             vec3 env;
             if (_sunAndSky.in_use == 1)
-                env = sun_and_sky(_sunAndSky, r.direction);
+                env = texture(skyLutTexture, GetSphericalUv(r.direction)).rgb;  // Baked sun_and_sky()
             else
             {
                 vec2 uv = GetSphericalUv(r.direction);  // See sampling.glsl
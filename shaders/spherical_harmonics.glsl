@@ -0,0 +1,31 @@
+//-------------------------------------------------------------------------------------------------
+// L2 spherical harmonics irradiance of the environment (see EnvSH in host_device.h)
+// The coefficients are projected on the CPU (spherical_harmonics.cpp), which also compiles this
+// file with CPP defined to validate the projection against a brute-force integration.
+//
+// ref: "An Efficient Representation for Irradiance Environment Maps", Ramamoorthi & Hanrahan 2001
+
+
+#ifndef SPHERICAL_HARMONICS_GLSL
+#define SPHERICAL_HARMONICS_GLSL
+
+
+vec3 shIrradiance(EnvSH sh, vec3 n)
+{
+  vec3 e = vec3(sh.coeffs[0]) * 0.282095f;
+
+  e += vec3(sh.coeffs[1]) * (0.488603f * n.y);
+  e += vec3(sh.coeffs[2]) * (0.488603f * n.z);
+  e += vec3(sh.coeffs[3]) * (0.488603f * n.x);
+
+  e += vec3(sh.coeffs[4]) * (1.092548f * n.x * n.y);
+  e += vec3(sh.coeffs[5]) * (1.092548f * n.y * n.z);
+  e += vec3(sh.coeffs[6]) * (0.315392f * (3.0f * n.z * n.z - 1.0f));
+  e += vec3(sh.coeffs[7]) * (1.092548f * n.x * n.z);
+  e += vec3(sh.coeffs[8]) * (0.546274f * (n.x * n.x - n.y * n.y));
+
+  // Ringing of the L2 approximation can dip below zero with strong sources
+  return max(e, vec3(0.0f));
+}
+
+#endif  // SPHERICAL_HARMONICS_GLSL
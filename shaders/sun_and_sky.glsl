@@ -26,6 +26,12 @@
 #define M_PI 3.1415926535f
 #endif
 
+// Compiled on the host when CPP is defined (see sky_model.cpp), GLSL parameter
+// qualifiers are dropped and the glm types stand in for the GLSL ones.
+#ifdef CPP
+#define in
+#endif
+
 /*helper functions for sun_and_sky*/
 
 float luminance(vec3 rgb)
@@ -336,7 +342,7 @@ vec3 arch_colortweak(vec3 tint, float saturation, float redness)
   }
   else
   {
-    out_tint = tint * saturation + intensity * (1.0 - saturation);
+    out_tint = tint * saturation + intensity * (1.0f - saturation);
     // boosted saturation can cause negatives
     if(saturation > 1.0)
     {
@@ -538,7 +544,7 @@ vec3 sun_and_sky(in SunAndSky ss, in vec3 in_direction)
       float sun_factor = (1.0 - sun_angle / sun_radius) * 10.0;
 
       sun_factor = (pow(sun_factor / 10.0, 3.0) * 2.0 * ss.sun_glow_intensity * sky_sunglow_scale
-                    + smoothstep(8.5, 9.5 + (local_haze / 50.0), sun_factor) * 100.0 * ss.sun_disk_intensity * sky_sundisk_scale);
+                    + smoothstep(8.5f, 9.5f + (local_haze / 50.0f), sun_factor) * 100.0 * ss.sun_disk_intensity * sky_sundisk_scale);
       tint += data_sun_color * sun_factor;
     }
   }
@@ -567,8 +573,8 @@ vec3 sun_and_sky(in SunAndSky ss, in vec3 in_direction)
       {
         dness = 1.0;
       }
-      dness        = smoothstep(0.0, 1.0, dness);
-      out_color    = out_color * (1.0 - dness) + downcolor * dness;
+      dness        = smoothstep(0.0f, 1.0f, dness);
+      out_color    = out_color * (1.0f - dness) + downcolor * dness;
       night_factor = 1.0 - dness;
     }
     else
@@ -600,4 +606,8 @@ vec3 sun_and_sky(in SunAndSky ss, in vec3 in_direction)
   return result;
 }
 
+#ifdef CPP
+#undef in
+#endif
+
 #endif  // SUN_AND_SKY_GLSL
@@ -0,0 +1,77 @@
+// Guided rays of the surfels. surfel_integrate.comp packs the CDF of the irradiance tile of each
+// surfel into its SurfelGuide, surfel_raytrace.comp picks a texel of the tile from it and a direction
+// within the texel. The CDF is read through SURFEL_GUIDE_WORD(j), word j of the guide the functions
+// get as SURFEL_GUIDE_PARAM: by default the SurfelGuide of surfelIndex in the surfelGuide buffer.
+
+#ifndef SURFEL_GUIDE_PARAM
+#define SURFEL_GUIDE_PARAM uint surfelIndex
+#define SURFEL_GUIDE_ARG surfelIndex
+#define SURFEL_GUIDE_WORD(j) surfelGuide[surfelIndex].cdf[j]
+#endif
+
+// Word j of the CDF, entries 2j and 2j + 1 in 1 / 0xffff from the running sums of the tile.
+// kSurfelGuideUniform of it is spread evenly and the last entry is 0xffff, the search always ends.
+uint packGuideCdf(float cumulativeLo, float cumulativeHi, float irradianceSum, uint j)
+{
+    uint i = j * 2u;
+    float lo = mix(cumulativeLo / irradianceSum, float(i + 1u) / float(kSurfelGuideEntries), kSurfelGuideUniform);
+    float hi = mix(cumulativeHi / irradianceSum, float(i + 2u) / float(kSurfelGuideEntries), kSurfelGuideUniform);
+    uint hiEntry = i + 2u == kSurfelGuideEntries ? 0xffffu : uint(round(hi * 65535.f));
+    return uint(round(lo * 65535.f)) | (hiEntry << 16);
+}
+
+// Entry i of the CDF, in 1 / 0xffff
+uint getGuideCdf(SURFEL_GUIDE_PARAM, uint i)
+{
+    return (SURFEL_GUIDE_WORD(i >> 1) >> ((i & 1u) * 16u)) & 0xffffu;
+}
+
+// Texel of the irradiance tile for a guided ray, u in [0, 1): the first entry of the CDF above
+// u * 0xffff, with the probability of picking it
+#ifdef CPP
+uint sampleGuideTexel(SURFEL_GUIDE_PARAM, float u, float& pdf)
+#else
+uint sampleGuideTexel(SURFEL_GUIDE_PARAM, float u, out float pdf)
+#endif
+{
+    uint x = uint(u * 65535.f);
+    uint lo = 0u;
+    uint hi = kSurfelGuideEntries - 1u;
+    while (lo < hi)
+    {
+        uint mid = (lo + hi) >> 1;
+        if (getGuideCdf(SURFEL_GUIDE_ARG, mid) > x)
+            hi = mid;
+        else
+            lo = mid + 1u;
+    }
+    uint below = lo > 0u ? getGuideCdf(SURFEL_GUIDE_ARG, lo - 1u) : 0u;
+    pdf = float(getGuideCdf(SURFEL_GUIDE_ARG, lo) - below) / 65535.f;
+    return lo;
+}
+
+// Octahedral uv covered by a tile texel along one axis: surfel_integrate.comp rounds uv * 3 to the
+// closest step, the last texel also takes the border step
+vec2 getGuideTexelRange(uint texel)
+{
+    return vec2(max(-1.f, (float(texel) - 3.5f) / 3.f), texel + 1u == kSurfelTileSize ? 1.f : (float(texel) - 2.5f) / 3.f);
+}
+
+// Direction in the hemisphere of the surfel for a texel picked with probability pdf, uniform over
+// the uv footprint of the texel for r in [0, 1)^2. The octahedron point p of uv spans
+// dw = dA_uv / (2 |p|^3), pdf comes back per solid angle.
+#ifdef CPP
+vec3 sampleGuideDirection(uint texel, vec2 r, float& pdf)
+#else
+vec3 sampleGuideDirection(uint texel, vec2 r, inout float pdf)
+#endif
+{
+    vec2 rangeX = getGuideTexelRange(texel % kSurfelTileSize);
+    vec2 rangeY = getGuideTexelRange(texel / kSurfelTileSize);
+    vec2 uv = vec2(mix(rangeX.x, rangeX.y, r.x), mix(rangeY.x, rangeY.y, r.y));
+    vec2 xy = vec2(uv.x + uv.y, uv.y - uv.x) * 0.5f;
+    vec3 p = vec3(xy, 1.f - abs(xy.x) - abs(xy.y));
+    float lengthP = length(p);
+    pdf *= 2.f * lengthP * lengthP * lengthP / ((rangeX.y - rangeX.x) * (rangeY.y - rangeY.x));
+    return p / lengthP;
+}
@@ -0,0 +1,34 @@
+// Ray budget of the surfels. The update pass writes a SurfelRayRequest per surfel and adds it to the
+// totals of SurfelCounter, surfel_ray_budget.comp then grants each request from those totals alone:
+// the count of a surfel does not depend on the order of the alive list, only its offset does.
+
+// Priority level of the rays of a surfel: new surfels first, then the visible ones with a high
+// variance, the other visible ones, and the sleeping or unseen ones last
+uint getRayPriority(bool young, bool visible, float variance)
+{
+    if (young)
+        return kRayPriorityLevels - 1u;
+    if (!visible)
+        return 0u;
+    return variance * 1.2 >= 0.5 ? 2u : 1u;
+}
+
+// Rays granted out of `budget`. Every request is served up to kSurfelMinRays first, scaled down
+// together when even those do not fit. The rest of the budget goes to the levels from the highest,
+// the level where it runs out gets the same share of each of its requests and the lower ones nothing.
+uint getRayAllocation(SurfelRayRequest request, SurfelCounter counter, uint budget)
+{
+    uint base = min(request.count, kSurfelMinRays);
+    if (counter.rayRequestBase > budget)
+        return uint(uint64_t(base) * uint64_t(budget) / uint64_t(counter.rayRequestBase));
+
+    uint remaining = budget - counter.rayRequestBase;
+    for (uint level = kRayPriorityLevels - 1u; level > request.priority; level--)
+        remaining -= min(counter.rayRequestExtra[level], remaining);
+
+    uint extra = request.count - base;
+    uint levelExtra = counter.rayRequestExtra[request.priority];
+    if (levelExtra > remaining)
+        extra = uint(uint64_t(extra) * uint64_t(remaining) / uint64_t(levelExtra));
+    return base + extra;
+}
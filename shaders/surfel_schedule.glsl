@@ -0,0 +1,51 @@
+// Amortized surfel updates. With rtxState.surfelUpdateFraction below 1 only that share of the alive
+// surfels asks for rays each frame, the others keep the radiance integrated last time. The update pass
+// ranks every kept surfel into one of kScheduleLevels levels and counts them in SurfelCounter,
+// surfel_prepare.comp then turns the counts into the threshold the next frame schedules from.
+
+// Frames a surfel goes at most between two updates, it is scheduled whatever its level once there
+uint getScheduleMaxStale(float fraction)
+{
+    return uint(ceil(2.f / max(fraction, 1.f / 64.f)));
+}
+
+// Level of a surfel: the visible ones, those with a high variance and those waiting for a while
+// rank first. The surfels at the end of their wait take the top level, so the updates forced there
+// come out of the quota.
+uint getScheduleLevel(bool visible, float variance, uint staleFrames, uint maxStale)
+{
+    if (staleFrames + 1u >= maxStale)
+        return kScheduleLevels - 1u;
+    float priority = 0.35f * float(visible)
+                   + 0.25f * clamp(variance * 1.2f, 0.f, 1.f)
+                   + 0.4f * min(float(staleFrames) / float(maxStale), 1.f);
+    return min(uint(priority * float(kScheduleLevels)), kScheduleLevels - 1u);
+}
+
+// Level from which the next frame schedules the surfels, and the share of that level out of 0x10000,
+// for `fraction` of the surfels counted in the histogram. The levels above the threshold are taken
+// whole, the threshold one only as far as the quota goes.
+uvec2 getScheduleThreshold(SurfelCounter counter, float fraction)
+{
+    uint total = 0u;
+    for (uint level = 0u; level < kScheduleLevels; level++)
+        total += counter.scheduleHistogram[level];
+    uint quota = uint(ceil(float(total) * fraction));
+
+    uint above = 0u;
+    for (uint level = kScheduleLevels; level > 0u; level--)
+    {
+        uint count = counter.scheduleHistogram[level - 1u];
+        if (count != 0u && above + count >= quota)
+            return uvec2(level - 1u, uint((uint64_t(quota - above) << 16) / uint64_t(count)));
+        above += count;
+    }
+    return uvec2(0u, 0x10000u);
+}
+
+// `hash` picks the surfels of the threshold level, it should change every frame
+bool isSurfelScheduled(uint level, uint hash, SurfelCounter counter)
+{
+    return level > counter.scheduleLevel
+        || (level == counter.scheduleLevel && (hash & 0xffffu) < counter.scheduleShare);
+}
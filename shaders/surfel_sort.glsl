@@ -0,0 +1,51 @@
+// Sort keys of the alive surfels, bins of the surfel rays and the network sorting the cell lists.
+
+// Sort key of the alive surfels: the position around the grid origin interleaved 10 bits per axis.
+// Each axis is warped like the grid, linear across a cube cell then logarithmic out to the last
+// frustum layer, so the keys stay fine near the camera where most surfels are.
+
+// Spreads the low 10 bits of v two bits apart
+uint expandMortonBits(uint v)
+{
+    v &= 0x3ffu;
+    v = (v | (v << 16)) & 0x030000ffu;
+    v = (v | (v << 8)) & 0x0300f00fu;
+    v = (v | (v << 4)) & 0x030c30c3u;
+    v = (v | (v << 2)) & 0x09249249u;
+    return v;
+}
+
+uint getSurfelSortKey(vec3 position, vec3 gridOrigin)
+{
+    float extent = getFrustumLayerBounds(m - 1, 1).y;
+    vec3 offset = position - gridOrigin;
+    vec3 warped = sign(offset) * log2(1.f + abs(offset) / kCellGridSnap) / log2(1.f + extent / kCellGridSnap);
+    uvec3 quantized = uvec3(clamp(warped * 0.5f + 0.5f, 0.f, 1.f) * 1023.f);
+    return (expandMortonBits(quantized.x) << 2) | (expandMortonBits(quantized.y) << 1) | expandMortonBits(quantized.z);
+}
+
+// Bin of a direction over the whole sphere, kRayBinDirSplits^2 cells of the folded octahedron
+uint getOctahedralBin(vec3 direction)
+{
+    vec2 uv = vec2(direction.x, direction.y) / (abs(direction.x) + abs(direction.y) + abs(direction.z));
+    if (direction.z < 0.f)
+        uv = (1.f - abs(vec2(uv.y, uv.x))) * vec2(uv.x >= 0.f ? 1.f : -1.f, uv.y >= 0.f ? 1.f : -1.f);
+    uvec2 bin = min(uvec2((uv * 0.5f + 0.5f) * float(kRayBinDirSplits)), uvec2(kRayBinDirSplits - 1u));
+    return bin.y * kRayBinDirSplits + bin.x;
+}
+
+// Rays of a bin leave about the same place in about the same direction and walk the same BVH nodes
+uint getSurfelRayBin(vec3 origin, vec3 direction, vec3 gridOrigin)
+{
+    uint cell = getSurfelSortKey(origin, gridOrigin) >> (kSortKeyBits - kRayBinCellBits);
+    return cell * kRayBinDirections + getOctahedralBin(direction);
+}
+
+// Cell lists are sorted by a workgroup with the flipped bitonic network, each step (k, j) compares
+// the pairs t of the list padded to a power of two. Every pair keeps the smaller value first, so the
+// positions past the end of the list act as +inf and are never touched.
+uvec2 getCellSortPair(uint t, uint k, uint j)
+{
+    uint a = (t / j) * 2u * j + (t % j);
+    return uvec2(a, j == k >> 1 ? a ^ (k - 1u) : a + j);
+}
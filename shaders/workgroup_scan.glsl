@@ -0,0 +1,28 @@
+// Exclusive scan of 4 x kGroupSize values by one workgroup of kGroupSize invocations, the blocks of
+// the multi-pass scans (cellInfo_update_pass.comp, surfel_ray_budget.comp).
+// Expects kGroupSize to be declared and to match local_size_x.
+
+shared uint sharedSums[kGroupSize];
+
+// Exclusive scan of the 4 x kGroupSize values of the workgroup, returns their total
+uint workgroupExclusiveScan(inout uvec4 values)
+{
+	uint tid = gl_LocalInvocationID.x;
+	uvec4 inclusive = uvec4(values.x, values.x + values.y, values.x + values.y + values.z, 0);
+	inclusive.w = inclusive.z + values.w;
+
+	// Hillis-Steele over the per-invocation sums
+	sharedSums[tid] = inclusive.w;
+	barrier();
+	for (uint offset = 1; offset < kGroupSize; offset <<= 1)
+	{
+		uint add = tid >= offset ? sharedSums[tid - offset] : 0;
+		barrier();
+		sharedSums[tid] += add;
+		barrier();
+	}
+
+	uint prefix = sharedSums[tid] - inclusive.w;
+	values = prefix + uvec4(0, inclusive.xyz);
+	return sharedSums[kGroupSize - 1];
+}
@@ -1,10 +1,20 @@
 #include "SurfelGI.h"
 
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <numeric>
+
+#include "nvh/nvprint.hpp"
 #include "nvvk/commands_vk.hpp"
 #include "nvvk/images_vk.hpp"
 #include "nvvk/pipeline_vk.hpp"
 #include "nvvk/renderpasses_vk.hpp"
+#include "nvvk/stagingmemorymanager_vk.hpp"
 #include "shaders/host_device.h"
+#include "surfel_cache.hpp"
+#include "surfel_config.hpp"
 
 void SurfelGI::setup(const VkDevice& device, const VkPhysicalDevice& physicalDevice, const std::vector<nvvk::Queue>& queues, nvvk::ResourceAllocator* allocator)
 {
@@ -20,49 +30,101 @@ void SurfelGI::createResources(const VkExtent2D& size)
 	VkCommandBuffer   cmdBuf = cmdBufGet.createCommandBuffer();
 
 	std::vector<VkDescriptorPoolSize> descriptorPoolSizes = {
-		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 10 },
+		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 24 },
 		{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 10 },
 		{ VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 10 },
 	};
 	m_descPool = nvvk::createDescriptorPool(m_device, descriptorPoolSizes, 20);
 
+	// Buffers sized by the SurfelConfig applied before, the shaders get the same values specialized
+	SurfelConfig config;
+	maxSurfelCnt = config.maxSurfelCount;
+	maxRayBudget = config.maxRayCount;
+
+	// The buffers of the surfel cache (saveCache / loadCache) are copied from and to the host
+	const VkBufferUsageFlags cacheUsage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+
 	std::vector<SurfelCounter> counters = { {0, maxSurfelCnt, 0, 0} };
-	m_surfelCounterBuffer = m_pAlloc->createBuffer(cmdBuf, counters, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	m_surfelCounterBuffer = m_pAlloc->createBuffer(cmdBuf, counters, cacheUsage);
 
 	std::vector<Surfel> surfels(maxSurfelCnt);
-	m_surfelBuffer = m_pAlloc->createBuffer(cmdBuf, surfels, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	m_surfelBuffer = m_pAlloc->createBuffer(cmdBuf, surfels, cacheUsage);
+
+	std::vector<SurfelCold> surfelCold(maxSurfelCnt);
+	m_surfelColdBuffer = m_pAlloc->createBuffer(cmdBuf, surfelCold, cacheUsage);
+
+	std::vector<SurfelGuide> surfelGuide(maxSurfelCnt);
+	m_surfelGuideBuffer = m_pAlloc->createBuffer(cmdBuf, surfelGuide, cacheUsage);
+
+	// Ray budget: requests of the update pass, block sums of the scan of the grants
+	std::vector<SurfelRayRequest> surfelRayRequest(maxSurfelCnt);
+	m_surfelRayRequestBuffer = m_pAlloc->createBuffer(cmdBuf, surfelRayRequest, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	std::vector<uint32_t> surfelRayScanBlock((maxSurfelCnt + kCellScanBlockSize - 1) / kCellScanBlockSize, 0);
+	m_surfelRayScanBlockBuffer = m_pAlloc->createBuffer(cmdBuf, surfelRayScanBlock, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
 
 	std::vector<uint32_t> surfelAliveBuffer(maxSurfelCnt, 0);
-	m_surfelAliveBuffer = m_pAlloc->createBuffer(cmdBuf, surfelAliveBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	m_surfelAliveBuffer = m_pAlloc->createBuffer(cmdBuf, surfelAliveBuffer, cacheUsage);
+
+	// Morton sort of the alive list: the list between two radix passes, digit counts of the blocks
+	m_surfelSortScratchBuffer = m_pAlloc->createBuffer(cmdBuf, surfelAliveBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	std::vector<uint32_t> surfelSortCounts(kSortDigits * ((maxSurfelCnt + kCellScanBlockSize - 1) / kCellScanBlockSize), 0);
+	m_surfelSortCountsBuffer = m_pAlloc->createBuffer(cmdBuf, surfelSortCounts, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
 
 	std::vector<uint32_t> surfelDeadBuffer(maxSurfelCnt, 0);
 	for (int i = 0; i < maxSurfelCnt; i++)
 		surfelDeadBuffer[i] = i;
 	
-	m_surfelDeadBuffer = m_pAlloc->createBuffer(cmdBuf, surfelDeadBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	m_surfelDeadBuffer = m_pAlloc->createBuffer(cmdBuf, surfelDeadBuffer, cacheUsage);
 	
-	std::vector<uint32_t> surfelDirtyBuffer(maxSurfelCnt, 0);
-	m_surfelDirtyBuffer = m_pAlloc->createBuffer(cmdBuf, surfelDirtyBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	// Cells each surfel overlaps (getSurfelCellMask), written by the update pass for the binning
+	std::vector<glm::uvec2> surfelCellMaskBuffer(maxSurfelCnt, glm::uvec2(0));
+	m_surfelCellMaskBuffer = m_pAlloc->createBuffer(cmdBuf, surfelCellMaskBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
 
 	std::vector<SurfelRecycleInfo> surfelRecycleBuffer(maxSurfelCnt);
-	m_surfelRecycleBuffer = m_pAlloc->createBuffer(cmdBuf, surfelRecycleBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	m_surfelRecycleBuffer = m_pAlloc->createBuffer(cmdBuf, surfelRecycleBuffer, cacheUsage);
 
 	std::vector<SurfelRay> surfelRayBuffer(maxRayBudget);
 	m_surfelRayBuffer = m_pAlloc->createBuffer(cmdBuf, surfelRayBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
 
+	// Coherence binning of the rays: their indices in bin order, the bin counts then offsets
+	std::vector<uint32_t> surfelRaySortIndex(maxRayBudget, 0);
+	m_surfelRaySortIndexBuffer = m_pAlloc->createBuffer(cmdBuf, surfelRaySortIndex, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	std::vector<uint32_t> surfelRayBins(2 * kRayBinCount, 0);
+	m_surfelRayBinsBuffer = m_pAlloc->createBuffer(cmdBuf, surfelRayBins, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+
+	std::vector<SurfelDispatch> surfelDispatch(1, SurfelDispatch{});
+	m_surfelDispatchBuffer = m_pAlloc->createBuffer(cmdBuf, surfelDispatch,
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
+
 	//totalCellCount = kCellDimension * kCellDimension * kCellDimension;
-	totalCellCount = n * n * n + 6 * n * n * m;
-	std::vector<CellInfo> cells(totalCellCount);
+	// A small grid still holds the kCellHashCapacity slots of the sparse hash
+	totalCellCount = config.getCellCount();
+	std::vector<CellInfo> cells(config.getCellBufferSize());
 	m_cellInfoBuffer = m_pAlloc->createBuffer(cmdBuf, cells, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
 
-	CellCounter cellCounter;
+	// Cell lists, grown by resizeCellToSurfel when the binning needs more entries
+	m_cellToSurfelCapacity = kCellToSurfelInitialSize;
+	std::vector<uint32_t> cellToSurfelBuffer(m_cellToSurfelCapacity, 0);
+	m_cellToSurfelBuffer = m_pAlloc->createBuffer(cmdBuf, cellToSurfelBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+
+	CellCounter cellCounter{};
 	cellCounter.totalCellCount = totalCellCount;
+	cellCounter.cellToSurfelCapacity = m_cellToSurfelCapacity;
 	std::vector<CellCounter> cellCounters = { cellCounter };
-	m_cellCounterBuffer = m_pAlloc->createBuffer(cmdBuf, cellCounters, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	m_cellCounterBuffer = m_pAlloc->createBuffer(cmdBuf, cellCounters,
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
 
-	//TODO: Size should be different! Currently is the 8 * maxSurfelCnt, should have something different?
-	std::vector<uint32_t> cellToSurfelBuffer(maxSurfelCnt * 8, 0);
-	m_cellToSurfelBuffer = m_pAlloc->createBuffer(cmdBuf, cellToSurfelBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	// Sums of the cell count blocks of the binning scan
+	assert(totalCellCount <= kCellScanBlockSize * kCellScanMaxBlocks);
+	std::vector<uint32_t> cellScanBlockBuffer(kCellScanMaxBlocks, 0);
+	m_cellScanBlockBuffer = m_pAlloc->createBuffer(cmdBuf, cellScanBlockBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+
+	// Sparse cell hash, its slots are the first entries of the cell buffer
+	assert(kCellHashCapacity <= cells.size());
+	std::vector<uint32_t> cellHashKeys(kCellHashCapacity, kCellHashEmpty);
+	m_cellHashKeysBuffer = m_pAlloc->createBuffer(cmdBuf, cellHashKeys, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	std::vector<uint32_t> cellHashOccupied(kCellHashCapacity, 0);
+	m_cellHashOccupiedBuffer = m_pAlloc->createBuffer(cmdBuf, cellHashOccupied, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
 
 	cmdBufGet.submitAndWait(cmdBuf);
 
@@ -81,20 +143,38 @@ void SurfelGI::createResources(const VkExtent2D& size)
 		bind.addBinding({ 4, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT });
 		bind.addBinding({ 5, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT });
 		bind.addBinding({ 6, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT });
+		bind.addBinding({ 7, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT });
+		bind.addBinding({ 8, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT });
+		bind.addBinding({ 9, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT });
+		bind.addBinding({ 10, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT });
+		bind.addBinding({ 11, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT });
+		bind.addBinding({ 12, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT });
+		bind.addBinding({ 13, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT });
+		bind.addBinding({ 14, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT });
+		bind.addBinding({ 15, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT });
 
 		m_surfelBuffersDescSetLayout = bind.createLayout(m_device);
 
 		// Create the edscriptor set
 		m_surfelBuffersDescSet = nvvk::allocateDescriptorSet(m_device, m_descPool, m_surfelBuffersDescSetLayout);
 
-		std::array<VkDescriptorBufferInfo, 7> dbi;
+		std::array<VkDescriptorBufferInfo, 16> dbi;
 		dbi[0] = VkDescriptorBufferInfo{ m_surfelCounterBuffer.buffer, 0, VK_WHOLE_SIZE };
 		dbi[1] = VkDescriptorBufferInfo{ m_surfelBuffer.buffer, 0, VK_WHOLE_SIZE };
 		dbi[2] = VkDescriptorBufferInfo{ m_surfelAliveBuffer.buffer, 0, VK_WHOLE_SIZE };
 		dbi[3] = VkDescriptorBufferInfo{ m_surfelDeadBuffer.buffer, 0, VK_WHOLE_SIZE };
-		dbi[4] = VkDescriptorBufferInfo{ m_surfelDirtyBuffer.buffer, 0, VK_WHOLE_SIZE };
+		dbi[4] = VkDescriptorBufferInfo{ m_surfelCellMaskBuffer.buffer, 0, VK_WHOLE_SIZE };
 		dbi[5] = VkDescriptorBufferInfo{ m_surfelRecycleBuffer.buffer, 0, VK_WHOLE_SIZE };
 		dbi[6] = VkDescriptorBufferInfo{ m_surfelRayBuffer.buffer, 0, VK_WHOLE_SIZE };
+		dbi[7] = VkDescriptorBufferInfo{ m_surfelDispatchBuffer.buffer, 0, VK_WHOLE_SIZE };
+		dbi[8] = VkDescriptorBufferInfo{ m_surfelColdBuffer.buffer, 0, VK_WHOLE_SIZE };
+		dbi[9] = VkDescriptorBufferInfo{ m_surfelGuideBuffer.buffer, 0, VK_WHOLE_SIZE };
+		dbi[10] = VkDescriptorBufferInfo{ m_surfelRayRequestBuffer.buffer, 0, VK_WHOLE_SIZE };
+		dbi[11] = VkDescriptorBufferInfo{ m_surfelRayScanBlockBuffer.buffer, 0, VK_WHOLE_SIZE };
+		dbi[12] = VkDescriptorBufferInfo{ m_surfelSortScratchBuffer.buffer, 0, VK_WHOLE_SIZE };
+		dbi[13] = VkDescriptorBufferInfo{ m_surfelSortCountsBuffer.buffer, 0, VK_WHOLE_SIZE };
+		dbi[14] = VkDescriptorBufferInfo{ m_surfelRaySortIndexBuffer.buffer, 0, VK_WHOLE_SIZE };
+		dbi[15] = VkDescriptorBufferInfo{ m_surfelRayBinsBuffer.buffer, 0, VK_WHOLE_SIZE };
 
 		std::vector<VkWriteDescriptorSet> writes;
 		writes.emplace_back(bind.makeWrite(m_surfelBuffersDescSet, 0, &dbi[0]));
@@ -104,6 +184,15 @@ void SurfelGI::createResources(const VkExtent2D& size)
 		writes.emplace_back(bind.makeWrite(m_surfelBuffersDescSet, 4, &dbi[4]));
 		writes.emplace_back(bind.makeWrite(m_surfelBuffersDescSet, 5, &dbi[5]));
 		writes.emplace_back(bind.makeWrite(m_surfelBuffersDescSet, 6, &dbi[6]));
+		writes.emplace_back(bind.makeWrite(m_surfelBuffersDescSet, 7, &dbi[7]));
+		writes.emplace_back(bind.makeWrite(m_surfelBuffersDescSet, 8, &dbi[8]));
+		writes.emplace_back(bind.makeWrite(m_surfelBuffersDescSet, 9, &dbi[9]));
+		writes.emplace_back(bind.makeWrite(m_surfelBuffersDescSet, 10, &dbi[10]));
+		writes.emplace_back(bind.makeWrite(m_surfelBuffersDescSet, 11, &dbi[11]));
+		writes.emplace_back(bind.makeWrite(m_surfelBuffersDescSet, 12, &dbi[12]));
+		writes.emplace_back(bind.makeWrite(m_surfelBuffersDescSet, 13, &dbi[13]));
+		writes.emplace_back(bind.makeWrite(m_surfelBuffersDescSet, 14, &dbi[14]));
+		writes.emplace_back(bind.makeWrite(m_surfelBuffersDescSet, 15, &dbi[15]));
 
 		// Writing the information
 		vkUpdateDescriptorSets(m_device, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
@@ -115,6 +204,9 @@ void SurfelGI::createResources(const VkExtent2D& size)
 		bind.addBinding({ 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT });
 		bind.addBinding({ 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT });
 		bind.addBinding({ 2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT });
+		bind.addBinding({ 3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT });
+		bind.addBinding({ 4, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT });
+		bind.addBinding({ 5, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT });
 
 		m_cellBufferDescSetLayout = bind.createLayout(m_device);
 
@@ -122,21 +214,206 @@ void SurfelGI::createResources(const VkExtent2D& size)
 		m_cellBufferDescSet = nvvk::allocateDescriptorSet(m_device, m_descPool, m_cellBufferDescSetLayout);
 
 		// Write descriptor set
-		std::array<VkDescriptorBufferInfo, 3> dbi;
+		std::array<VkDescriptorBufferInfo, 6> dbi;
 		dbi[0] = VkDescriptorBufferInfo{ m_cellInfoBuffer.buffer, 0, VK_WHOLE_SIZE };
 		dbi[1] = VkDescriptorBufferInfo{ m_cellCounterBuffer.buffer, 0, VK_WHOLE_SIZE };
 		dbi[2] = VkDescriptorBufferInfo{ m_cellToSurfelBuffer.buffer, 0, VK_WHOLE_SIZE };
+		dbi[3] = VkDescriptorBufferInfo{ m_cellScanBlockBuffer.buffer, 0, VK_WHOLE_SIZE };
+		dbi[4] = VkDescriptorBufferInfo{ m_cellHashKeysBuffer.buffer, 0, VK_WHOLE_SIZE };
+		dbi[5] = VkDescriptorBufferInfo{ m_cellHashOccupiedBuffer.buffer, 0, VK_WHOLE_SIZE };
 		
 		std::vector<VkWriteDescriptorSet> writes;
 		writes.emplace_back(bind.makeWrite(m_cellBufferDescSet, 0, &dbi[0]));
 		writes.emplace_back(bind.makeWrite(m_cellBufferDescSet, 1, &dbi[1]));
 		writes.emplace_back(bind.makeWrite(m_cellBufferDescSet, 2, &dbi[2]));
+		writes.emplace_back(bind.makeWrite(m_cellBufferDescSet, 3, &dbi[3]));
+		writes.emplace_back(bind.makeWrite(m_cellBufferDescSet, 4, &dbi[4]));
+		writes.emplace_back(bind.makeWrite(m_cellBufferDescSet, 5, &dbi[5]));
 
 		vkUpdateDescriptorSets(m_device, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
 	}
 
 }
 
+// The lists of the last frame are lost, the caller rebuilds the cells. The device must be idle: the
+// cell descriptor set is rewritten.
+void SurfelGI::resizeCellToSurfel(uint32_t capacity)
+{
+	m_pAlloc->destroy(m_cellToSurfelBuffer);
+	m_cellToSurfelCapacity = capacity;
+	m_cellToSurfelBuffer = m_pAlloc->createBuffer(VkDeviceSize(capacity) * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	m_debug.setObjectName(m_cellToSurfelBuffer.buffer, "Cell To Surfel");
+
+	nvvk::CommandPool cmdBufGet(m_device, m_queues[eGraphics].familyIndex, VK_COMMAND_POOL_CREATE_TRANSIENT_BIT, m_queues[eLoading].queue);
+	VkCommandBuffer   cmdBuf = cmdBufGet.createCommandBuffer();
+	vkCmdUpdateBuffer(cmdBuf, m_cellCounterBuffer.buffer, offsetof(CellCounter, cellToSurfelCapacity), sizeof(uint32_t), &capacity);
+	cmdBufGet.submitAndWait(cmdBuf);
+
+	VkDescriptorBufferInfo dbi{ m_cellToSurfelBuffer.buffer, 0, VK_WHOLE_SIZE };
+	VkWriteDescriptorSet   write{ VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
+	write.dstSet          = m_cellBufferDescSet;
+	write.dstBinding      = 2;
+	write.descriptorCount = 1;
+	write.descriptorType  = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	write.pBufferInfo     = &dbi;
+	vkUpdateDescriptorSets(m_device, 1, &write, 0, nullptr);
+}
+
+void SurfelGI::createStatsReadback(uint32_t framesInFlight)
+{
+	for (auto& buffer : m_statsReadback)
+		m_pAlloc->destroy(buffer);
+	m_statsReadback.resize(framesInFlight);
+	for (auto& buffer : m_statsReadback)
+	{
+		buffer = m_pAlloc->createBuffer(sizeof(ReadbackStats), VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+		m_debug.setObjectName(buffer.buffer, "Surfel Stats Readback");
+		memset(m_pAlloc->map(buffer), 0, sizeof(ReadbackStats));
+		m_pAlloc->unmap(buffer);
+	}
+}
+
+// The readback of this frame slot was copied when the slot was last used, its fence has been
+// waited on. The copy of this frame is recorded after the surfel passes.
+SurfelGI::ReadbackStats SurfelGI::readbackStats(const VkCommandBuffer& cmdBuf, uint32_t frameIndex)
+{
+	ReadbackStats result{};
+	if (m_statsReadback.empty())
+		return result;
+
+	const nvvk::Buffer& readback = m_statsReadback[frameIndex % m_statsReadback.size()];
+	memcpy(&result, m_pAlloc->map(readback), sizeof(ReadbackStats));
+	m_pAlloc->unmap(readback);
+
+	VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+		1, &barrier, 0, nullptr, 0, nullptr);
+	VkBufferCopy region{ 0, offsetof(ReadbackStats, dispatch), sizeof(SurfelDispatch) };
+	vkCmdCopyBuffer(cmdBuf, m_surfelDispatchBuffer.buffer, readback.buffer, 1, &region);
+	region = { 0, offsetof(ReadbackStats, cells), sizeof(CellCounter) };
+	vkCmdCopyBuffer(cmdBuf, m_cellCounterBuffer.buffer, readback.buffer, 1, &region);
+	region = { 0, offsetof(ReadbackStats, surfels), sizeof(SurfelCounter) };
+	vkCmdCopyBuffer(cmdBuf, m_surfelCounterBuffer.buffer, readback.buffer, 1, &region);
+	return result;
+}
+
+// The device must be idle. The surfel buffers and the atlases are read back whole, the records and
+// tiles of the alive surfels are gathered in the order of the list.
+void SurfelGI::saveCache(SurfelCache& cache)
+{
+	nvvk::CommandPool cmdBufGet(m_device, m_queues[eGraphics].familyIndex, VK_COMMAND_POOL_CREATE_TRANSIENT_BIT, m_queues[eLoading].queue);
+	VkCommandBuffer   cmdBuf = cmdBufGet.createCommandBuffer();
+	nvvk::StagingMemoryManager* staging = m_pAlloc->getStaging();
+
+	VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+		1, &barrier, 0, nullptr, 0, nullptr);
+
+	const glm::uvec2 atlasSize = SurfelConfig().getAtlasSize();
+	const VkDeviceSize atlasBytes = VkDeviceSize(atlasSize.x) * atlasSize.y * sizeof(uint16_t);  // R16F and RG8
+	const VkExtent3D atlasExtent{ atlasSize.x, atlasSize.y, 1 };
+	const VkImageSubresourceLayers subresource{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+
+	const auto* counter = staging->cmdFromBufferT<SurfelCounter>(cmdBuf, m_surfelCounterBuffer.buffer, 0, sizeof(SurfelCounter));
+	const auto* alive = staging->cmdFromBufferT<uint32_t>(cmdBuf, m_surfelAliveBuffer.buffer, 0, maxSurfelCnt * sizeof(uint32_t));
+	const auto* surfels = staging->cmdFromBufferT<Surfel>(cmdBuf, m_surfelBuffer.buffer, 0, maxSurfelCnt * sizeof(Surfel));
+	const auto* cold = staging->cmdFromBufferT<SurfelCold>(cmdBuf, m_surfelColdBuffer.buffer, 0, maxSurfelCnt * sizeof(SurfelCold));
+	const auto* recycle = staging->cmdFromBufferT<SurfelRecycleInfo>(cmdBuf, m_surfelRecycleBuffer.buffer, 0, maxSurfelCnt * sizeof(SurfelRecycleInfo));
+	const auto* guide = staging->cmdFromBufferT<SurfelGuide>(cmdBuf, m_surfelGuideBuffer.buffer, 0, maxSurfelCnt * sizeof(SurfelGuide));
+	const auto* irradiance = staging->cmdFromImageT<uint16_t>(cmdBuf, m_surfelIrradianceMap.image, {}, atlasExtent, subresource,
+		atlasBytes, VK_IMAGE_LAYOUT_GENERAL);
+	const auto* depth = staging->cmdFromImageT<uint16_t>(cmdBuf, m_surfelDepthMap.image, {}, atlasExtent, subresource,
+		atlasBytes, VK_IMAGE_LAYOUT_GENERAL);
+	cmdBufGet.submitAndWait(cmdBuf);
+
+	const uint32_t count = std::min(counter->aliveSurfelCnt, maxSurfelCnt);
+	cache.resize(count);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const uint32_t surfelIndex = alive[i];
+		cache.surfels[i] = surfels[surfelIndex];
+		cache.cold[i] = cold[surfelIndex];
+		cache.recycle[i] = recycle[surfelIndex];
+		cache.guide[i] = guide[surfelIndex];
+
+		const glm::uvec2 origin = SurfelCache::getTileOrigin(surfelIndex, atlasSize.x);
+		for (uint32_t t = 0; t < kSurfelGuideEntries; t++)
+		{
+			const size_t texel = size_t(origin.y + t / kSurfelTileSize) * atlasSize.x + origin.x + t % kSurfelTileSize;
+			cache.irradiance[size_t(i) * kSurfelGuideEntries + t] = irradiance[texel];
+			cache.depth[size_t(i) * kSurfelGuideEntries + t] = depth[texel];
+		}
+	}
+	m_pAlloc->finalizeAndReleaseStaging();
+}
+
+// The device must be idle. The cached surfels take the IDs [0, count) and the dead list the rest,
+// the records past them are left as they are: nothing reads a dead surfel. The caller rebuilds the
+// cells on the next frame.
+uint32_t SurfelGI::loadCache(const SurfelCache& cache)
+{
+	const uint32_t count = std::min(cache.getSurfelCount(), maxSurfelCnt);
+	if (count < cache.getSurfelCount())
+		LOGI("Surfel cache: %u surfels past the capacity of %u left out\n", cache.getSurfelCount() - count, maxSurfelCnt);
+
+	nvvk::CommandPool cmdBufGet(m_device, m_queues[eGraphics].familyIndex, VK_COMMAND_POOL_CREATE_TRANSIENT_BIT, m_queues[eLoading].queue);
+	VkCommandBuffer   cmdBuf = cmdBufGet.createCommandBuffer();
+	nvvk::StagingMemoryManager* staging = m_pAlloc->getStaging();
+
+	SurfelCounter counter{ count, maxSurfelCnt - count, 0, 0 };
+	staging->cmdToBuffer(cmdBuf, m_surfelCounterBuffer.buffer, 0, sizeof(SurfelCounter), &counter);
+
+	// Alive list [0, count), dead list [count, maxSurfelCnt)
+	std::vector<uint32_t> surfelIds(maxSurfelCnt);
+	std::iota(surfelIds.begin(), surfelIds.end(), 0u);
+	if (count > 0)
+	{
+		staging->cmdToBuffer(cmdBuf, m_surfelAliveBuffer.buffer, 0, count * sizeof(uint32_t), surfelIds.data());
+		staging->cmdToBuffer(cmdBuf, m_surfelBuffer.buffer, 0, count * sizeof(Surfel), cache.surfels.data());
+		staging->cmdToBuffer(cmdBuf, m_surfelColdBuffer.buffer, 0, count * sizeof(SurfelCold), cache.cold.data());
+		staging->cmdToBuffer(cmdBuf, m_surfelRecycleBuffer.buffer, 0, count * sizeof(SurfelRecycleInfo), cache.recycle.data());
+		staging->cmdToBuffer(cmdBuf, m_surfelGuideBuffer.buffer, 0, count * sizeof(SurfelGuide), cache.guide.data());
+	}
+	if (count < maxSurfelCnt)
+		staging->cmdToBuffer(cmdBuf, m_surfelDeadBuffer.buffer, 0, (maxSurfelCnt - count) * sizeof(uint32_t), surfelIds.data() + count);
+
+	// The tiles at their new IDs, the rest of the atlases cleared
+	const glm::uvec2 atlasSize = SurfelConfig().getAtlasSize();
+	std::vector<uint16_t> irradiance(size_t(atlasSize.x) * atlasSize.y, 0);
+	std::vector<uint16_t> depth(irradiance.size(), 0);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const glm::uvec2 origin = SurfelCache::getTileOrigin(i, atlasSize.x);
+		for (uint32_t t = 0; t < kSurfelGuideEntries; t++)
+		{
+			const size_t texel = size_t(origin.y + t / kSurfelTileSize) * atlasSize.x + origin.x + t % kSurfelTileSize;
+			irradiance[texel] = cache.irradiance[size_t(i) * kSurfelGuideEntries + t];
+			depth[texel] = cache.depth[size_t(i) * kSurfelGuideEntries + t];
+		}
+	}
+	const VkExtent3D atlasExtent{ atlasSize.x, atlasSize.y, 1 };
+	const VkImageSubresourceLayers subresource{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+	staging->cmdToImage(cmdBuf, m_surfelIrradianceMap.image, {}, atlasExtent, subresource, irradiance.size() * sizeof(uint16_t),
+		irradiance.data(), VK_IMAGE_LAYOUT_GENERAL);
+	staging->cmdToImage(cmdBuf, m_surfelDepthMap.image, {}, atlasExtent, subresource, depth.size() * sizeof(uint16_t),
+		depth.data(), VK_IMAGE_LAYOUT_GENERAL);
+
+	VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+		1, &barrier, 0, nullptr, 0, nullptr);
+	cmdBufGet.submitAndWait(cmdBuf);
+	m_pAlloc->finalizeAndReleaseStaging();
+	return count;
+}
+
 void SurfelGI::createIndirectLightingMap(const VkExtent2D& size)
 {
 	{
@@ -386,7 +663,26 @@ void SurfelGI::createGbuffers(const VkExtent2D& size, const size_t frameBufferCn
 
 void SurfelGI::createIrradianceDepthMap()
 {
-	const VkExtent2D size = { 3840, 2160 };
+	// One tile per surfel of the capacity. The shaders only texelFetch level 0: no mips.
+	const glm::uvec2 atlasSize = SurfelConfig().getAtlasSize();
+	const VkExtent2D size = { atlasSize.x, atlasSize.y };
+	assert(atlasSize.x / kSurfelTileSize * (atlasSize.y / kSurfelTileSize) >= maxSurfelCnt);
+
+	// R16F irradiance and RG8 depth, against the fixed 3840x2160 atlases with mip chains they replace
+	{
+		const VkDeviceSize texelBytes = 2 + 2;
+		VkDeviceSize       fixedTexels = 0;
+		for (VkExtent2D level = { 3840, 2160 }; ; level = { std::max(level.width / 2, 1u), std::max(level.height / 2, 1u) })
+		{
+			fixedTexels += VkDeviceSize(level.width) * level.height;
+			if (level.width == 1 && level.height == 1)
+				break;
+		}
+		const VkDeviceSize bytes = VkDeviceSize(size.width) * size.height * texelBytes;
+		const VkDeviceSize fixedBytes = fixedTexels * texelBytes;
+		LOGI("Surfel atlas: %ux%u for %u surfels, %.1f MB (%.1f MB saved over the fixed atlas)\n", size.width,
+			size.height, maxSurfelCnt, bytes / (1024.0 * 1024.0), (double(fixedBytes) - double(bytes)) / (1024.0 * 1024.0));
+	}
 
 	if (m_surfelIrradianceMap.image != VK_NULL_HANDLE)
 	{
@@ -402,7 +698,7 @@ void SurfelGI::createIrradianceDepthMap()
 	{
 		auto colorCreateInfo = nvvk::makeImage2DCreateInfo(
 			size, VK_FORMAT_R16_SFLOAT,
-			VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT, true);
+			VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, false);
 
 		nvvk::Image image = m_pAlloc->createImage(colorCreateInfo);
 		NAME_VK(image.image);
@@ -420,7 +716,7 @@ void SurfelGI::createIrradianceDepthMap()
 	{
 		auto colorCreateInfo = nvvk::makeImage2DCreateInfo(
 			size, VK_FORMAT_R8G8_UNORM,
-			VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT, true);
+			VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, false);
 
 		nvvk::Image image = m_pAlloc->createImage(colorCreateInfo);
 		NAME_VK(image.image);
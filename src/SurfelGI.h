@@ -11,6 +11,8 @@
 #include "nvh/fileoperations.hpp"
 #include "queue.hpp"
 
+struct SurfelCache;
+
 class GBufferResources
 {
 public:
@@ -46,6 +48,7 @@ public:
 	void createIndirectLightingMap(const VkExtent2D& size);
 	void createGbuffers(const VkExtent2D& size, const size_t frameBufferCnt, VkRenderPass renderPass);
 	void createIrradianceDepthMap();
+	void createStatsReadback(uint32_t framesInFlight);
 	VkFramebuffer			getGbufferFramebuffer(uint32_t currFrame) { return m_gbufferResources.m_frameBuffers[currFrame]; }
 	VkDescriptorSetLayout	getGbufferSamplerDescLayout() { return m_gbufferResources.m_samplerDescSetLayout; }
 	VkDescriptorSet			getGbufferSamplerDescSet() { return m_gbufferResources.m_samplerDescSet; }
@@ -55,16 +58,44 @@ public:
 	// Surfel Resources Getters
 	nvvk::Buffer getSurfelCounterBuffer() const {return m_surfelCounterBuffer;}
 	nvvk::Buffer getSurfelBuffer() const {return m_surfelBuffer;}
+	nvvk::Buffer getSurfelColdBuffer() const {return m_surfelColdBuffer;}
+	nvvk::Buffer getSurfelGuideBuffer() const {return m_surfelGuideBuffer;}
+	nvvk::Buffer getSurfelRayRequestBuffer() const {return m_surfelRayRequestBuffer;}
 	nvvk::Buffer getSurfelAliveBuffer() const {return m_surfelAliveBuffer;}
 	nvvk::Buffer getSurfelDeadBuffer() const {return m_surfelDeadBuffer;}
-	nvvk::Buffer getSurfelDirtyBuffer() const {return m_surfelDirtyBuffer;}
+	nvvk::Buffer getSurfelCellMaskBuffer() const {return m_surfelCellMaskBuffer;}
 	nvvk::Buffer getSurfelRecycleBuffer() const {return m_surfelRecycleBuffer;}
 	nvvk::Buffer getSurfelRayBuffer() const {return m_surfelRayBuffer;}
+	nvvk::Buffer getSurfelDispatchBuffer() const {return m_surfelDispatchBuffer;}
+
+	// Counters of a frame copied to the host
+	struct ReadbackStats
+	{
+		SurfelDispatch dispatch;  // Indirect dispatch arguments and live counts
+		CellCounter    cells;     // Cell hash, patching and cellToSurfel statistics
+		SurfelCounter  surfels;   // Ray requests against the rays granted
+	};
+	// One copy per frame in flight. Returns the values of the last frame that used the slot and
+	// records the copy of this one.
+	ReadbackStats readbackStats(const VkCommandBuffer& cmdBuf, uint32_t frameIndex);
+
+	// Surfel cache, between frames: the alive surfels and their atlas tiles copied to `cache`, and
+	// the surfels of `cache` in place of the current ones. loadCache returns the surfels loaded, the
+	// cells must be rebuilt after it.
+	void saveCache(SurfelCache& cache);
+	uint32_t loadCache(const SurfelCache& cache);
 
 	// Cell Resources Getters
 	nvvk::Buffer getCellInfoBuffer() const {return m_cellInfoBuffer;}
 	nvvk::Buffer getCellCounterBuffer() const {return m_cellCounterBuffer;}
 	nvvk::Buffer getCellToSurfelBuffer() const {return m_cellToSurfelBuffer;}
+	nvvk::Buffer getCellScanBlockBuffer() const {return m_cellScanBlockBuffer;}
+	nvvk::Buffer getCellHashKeysBuffer() const {return m_cellHashKeysBuffer;}
+	nvvk::Buffer getCellHashOccupiedBuffer() const {return m_cellHashOccupiedBuffer;}
+	uint32_t getCellToSurfelCapacity() const {return m_cellToSurfelCapacity;}
+
+	// Reallocates cellToSurfel with `capacity` entries, between frames
+	void resizeCellToSurfel(uint32_t capacity);
 	nvvk::Texture getIndirectLightingMap() const { return m_indirectLightingMap; }
 
 
@@ -81,9 +112,9 @@ public:
 
 	void gbufferLayoutTransition(VkCommandBuffer cmdBuf);
 
-	// Surfel Configuration
-	const uint32_t maxSurfelCnt = kMaxSurfelCount;
-	const uint32_t maxRayBudget = kMaxRayCount;
+	// Surfel Configuration, the applied SurfelConfig when the resources were created
+	uint32_t maxSurfelCnt = 0;
+	uint32_t maxRayBudget = 0;
 	uint32_t totalCellCount = 0;
 
 private:
@@ -113,16 +144,30 @@ private:
 	// Surfel Resources
 	nvvk::Buffer				m_surfelCounterBuffer{ VK_NULL_HANDLE };
 	nvvk::Buffer				m_surfelBuffer{ VK_NULL_HANDLE };
+	nvvk::Buffer				m_surfelColdBuffer{ VK_NULL_HANDLE };
+	nvvk::Buffer				m_surfelGuideBuffer{ VK_NULL_HANDLE };
+	nvvk::Buffer				m_surfelRayRequestBuffer{ VK_NULL_HANDLE };
+	nvvk::Buffer				m_surfelRayScanBlockBuffer{ VK_NULL_HANDLE };
 	nvvk::Buffer				m_surfelAliveBuffer{ VK_NULL_HANDLE };
+	nvvk::Buffer				m_surfelSortScratchBuffer{ VK_NULL_HANDLE };
+	nvvk::Buffer				m_surfelSortCountsBuffer{ VK_NULL_HANDLE };
 	nvvk::Buffer				m_surfelDeadBuffer{ VK_NULL_HANDLE };
-	nvvk::Buffer				m_surfelDirtyBuffer{ VK_NULL_HANDLE };
+	nvvk::Buffer				m_surfelCellMaskBuffer{ VK_NULL_HANDLE };
 	nvvk::Buffer				m_surfelRecycleBuffer{ VK_NULL_HANDLE };
 	nvvk::Buffer				m_surfelRayBuffer{ VK_NULL_HANDLE };
+	nvvk::Buffer				m_surfelRaySortIndexBuffer{ VK_NULL_HANDLE };
+	nvvk::Buffer				m_surfelRayBinsBuffer{ VK_NULL_HANDLE };
+	nvvk::Buffer				m_surfelDispatchBuffer{ VK_NULL_HANDLE };
+	std::vector<nvvk::Buffer>	m_statsReadback;
 	
 	// Cell Resources
 	nvvk::Buffer 				m_cellInfoBuffer{ VK_NULL_HANDLE };
 	nvvk::Buffer				m_cellCounterBuffer{ VK_NULL_HANDLE };
 	nvvk::Buffer 			    m_cellToSurfelBuffer{ VK_NULL_HANDLE };
+	nvvk::Buffer 			    m_cellScanBlockBuffer{ VK_NULL_HANDLE };
+	nvvk::Buffer 			    m_cellHashKeysBuffer{ VK_NULL_HANDLE };
+	nvvk::Buffer 			    m_cellHashOccupiedBuffer{ VK_NULL_HANDLE };
+	uint32_t					m_cellToSurfelCapacity{ 0 };
 
 	nvvk::Texture				m_indirectLightingMap;
 	nvvk::Texture				m_indirectLightingMapHalfRes;
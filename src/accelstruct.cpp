@@ -29,10 +29,15 @@
 
 
 #include "accelstruct.hpp"
+#include "scene.hpp"
+#include "nvh/container_utils.hpp"
 #include "nvvk/raytraceKHR_vk.hpp"
+#include "nvvk/acceleration_structures.hpp"
+#include "nvvk/commands_vk.hpp"
 #include "shaders/host_device.h"
 #include "tools.hpp"
 
+#include <algorithm>
 #include <sstream>
 #include <ios>
 
@@ -42,23 +47,49 @@ void AccelStructure::setup(const VkDevice& device, const VkPhysicalDevice& physi
   m_pAlloc     = allocator;
   m_queueIndex = familyIndex;
   m_debug.setup(device);
-  m_rtBuilder.setup(m_device, allocator, familyIndex);
+
+  VkPhysicalDeviceAccelerationStructurePropertiesKHR asProperties{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR};
+  VkPhysicalDeviceProperties2 properties{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2};
+  properties.pNext = &asProperties;
+  vkGetPhysicalDeviceProperties2(physicalDevice, &properties);
+  m_scratchAlignment = std::max<VkDeviceSize>(asProperties.minAccelerationStructureScratchOffsetAlignment, 1);
 }
 
 void AccelStructure::destroy()
 {
-  m_rtBuilder.destroy();
+  destroySceneResources();
+  for(auto& entry : m_blasCache)
+    m_pAlloc->destroy(entry.second.blas);
+  m_blasCache.clear();
+}
+
+// Everything but the BLAS cache
+void AccelStructure::destroySceneResources()
+{
+  m_pAlloc->destroy(m_tlas);
+  m_pAlloc->destroy(m_instanceBuffer);
+  m_pAlloc->destroy(m_tlasScratch);
+  m_instances.clear();
+  m_dirtyInstances.clear();
+  m_instanceDirty.clear();
+  m_blas.clear();
   vkDestroyDescriptorPool(m_device, m_rtDescPool, nullptr);
   vkDestroyDescriptorSetLayout(m_device, m_rtDescSetLayout, nullptr);
+  m_rtDescPool      = VK_NULL_HANDLE;
+  m_rtDescSetLayout = VK_NULL_HANDLE;
+  m_rtDescSet       = VK_NULL_HANDLE;
 }
 
-void AccelStructure::create(nvh::GltfScene& gltfScene, const std::vector<nvvk::Buffer>& vertex, const std::vector<nvvk::Buffer>& index)
+void AccelStructure::create(nvh::GltfScene&                  gltfScene,
+                            const std::vector<nvvk::Buffer>& vertex,
+                            const std::vector<nvvk::Buffer>& index,
+                            const std::vector<GeometryKey>&  geometryKeys)
 {
   MilliTimer timer;
   LOGI("Create acceleration structure \n");
-  destroy();  // reset
+  destroySceneResources();  // reset, the BLAS cache is kept
 
-  createBottomLevelAS(gltfScene, vertex, index);
+  createBottomLevelAS(gltfScene, vertex, index, geometryKeys);
   createTopLevelAS(gltfScene);
   createRtDescriptorSet();
   timer.print();
@@ -105,25 +136,315 @@ nvvk::RaytracingBuilderKHR::BlasInput AccelStructure::primitiveToGeometry(const
 }
 
 //--------------------------------------------------------------------------------------------------
-//
+// One BLAS per primitive mesh. BLAS are looked up in the cache by geometry hash and build flags
+// first, then by checksum and counts, only new or changed geometry is built. Cached BLAS the scene
+// does not use are evicted, least recently used first, once they take more than m_blasCacheBudget.
 //
 void AccelStructure::createBottomLevelAS(nvh::GltfScene&                  gltfScene,
                                          const std::vector<nvvk::Buffer>& vertex,
-                                         const std::vector<nvvk::Buffer>& index)
+                                         const std::vector<nvvk::Buffer>& index,
+                                         const std::vector<GeometryKey>&  geometryKeys)
 {
-  // BLAS - Storing each primitive in a geometry
-  uint32_t                                           prim_idx{0};
+  const VkBuildAccelerationStructureFlagsKHR flags =
+      VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR;
+  const auto numPrims = static_cast<uint32_t>(gltfScene.m_primMeshes.size());
+  assert(geometryKeys.size() == numPrims);
+
+  m_sceneGeneration++;
+  m_blas.assign(numPrims, {});
+
+  // BLAS - Storing each primitive in a geometry, identical primitives are built once
+  uint32_t                                           hits{0};
+  uint32_t                                           collisions{0};
   std::vector<nvvk::RaytracingBuilderKHR::BlasInput> allBlas;
-  allBlas.reserve(gltfScene.m_primMeshes.size());
-  for(nvh::GltfPrimMesh& primMesh : gltfScene.m_primMeshes)
+  std::vector<size_t>                                buildKeys;
+  std::vector<BlasGeometry>                          buildGeometry;
+  std::vector<std::vector<uint32_t>>                 buildPrims;  // Primitives waiting for each build
+  std::unordered_multimap<size_t, uint32_t>          pending;     // key -> build
+  for(uint32_t prim_idx = 0; prim_idx < numPrims; prim_idx++)
   {
+    const nvh::GltfPrimMesh& primMesh = gltfScene.m_primMeshes[prim_idx];
     auto geo = primitiveToGeometry(primMesh, vertex[prim_idx].buffer, index[prim_idx].buffer);
-    allBlas.push_back({geo});
-    prim_idx++;
+    const size_t       key = nvh::hashVal(geometryKeys[prim_idx].hash, geo.flags | flags);
+    const BlasGeometry geometry{geometryKeys[prim_idx].checksum, primMesh.vertexCount, primMesh.indexCount};
+
+    bool found    = false;
+    auto cacheHit = m_blasCache.equal_range(key);
+    for(auto it = cacheHit.first; it != cacheHit.second && !found; ++it)
+    {
+      if(it->second.geometry == geometry)
+      {
+        it->second.lastUse = m_sceneGeneration;
+        m_blas[prim_idx]   = it->second.blas;
+        found              = true;
+      }
+    }
+    if(found)
+    {
+      hits++;
+      continue;
+    }
+    auto pendingHit = pending.equal_range(key);
+    for(auto it = pendingHit.first; it != pendingHit.second && !found; ++it)
+    {
+      if(buildGeometry[it->second] == geometry)
+      {
+        buildPrims[it->second].push_back(prim_idx);
+        found = true;
+      }
+    }
+    if(found)
+      continue;
+
+    collisions += (cacheHit.first != cacheHit.second || pendingHit.first != pendingHit.second) ? 1 : 0;
+    pending.insert({key, uint32_t(allBlas.size())});
+    allBlas.push_back(geo);
+    buildKeys.push_back(key);
+    buildGeometry.push_back(geometry);
+    buildPrims.push_back({prim_idx});
   }
-  LOGI(" BLAS(%zu)", allBlas.size());
-  m_rtBuilder.buildBlas(allBlas, VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR
-                                     | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR);
+  if(collisions > 0)
+    LOGW(" BLAS cache: %u primitives share a hash with other geometry, built apart\n", collisions);
+
+  LOGI(" BLAS(%zu)\n", allBlas.size());
+  std::vector<nvvk::AccelKHR> built;
+  std::vector<VkDeviceSize>   builtSize;
+  if(!allBlas.empty())
+    buildBlasBatched(allBlas, flags, built, builtSize);
+
+  for(size_t i = 0; i < buildKeys.size(); i++)
+  {
+    m_blasCache.insert({buildKeys[i], {built[i], builtSize[i], m_sceneGeneration, buildGeometry[i]}});
+    for(uint32_t prim_idx : buildPrims[i])
+      m_blas[prim_idx] = built[i];
+  }
+
+  // LRU eviction of the BLAS the current scene does not reference
+  using CacheIterator = decltype(m_blasCache)::iterator;
+  std::vector<std::pair<uint64_t, CacheIterator>> unused;  // lastUse, entry
+  VkDeviceSize                                    unusedSize{0};
+  VkDeviceSize                                    cacheSize{0};
+  for(auto it = m_blasCache.begin(); it != m_blasCache.end(); ++it)
+  {
+    cacheSize += it->second.size;
+    if(it->second.lastUse != m_sceneGeneration)
+    {
+      unused.push_back({it->second.lastUse, it});
+      unusedSize += it->second.size;
+    }
+  }
+  std::sort(unused.begin(), unused.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+  uint32_t evicted{0};
+  for(auto& u : unused)
+  {
+    if(unusedSize <= m_blasCacheBudget)
+      break;
+    BlasCacheEntry& entry = u.second->second;
+    unusedSize -= entry.size;
+    cacheSize -= entry.size;
+    m_pAlloc->destroy(entry.blas);
+    m_blasCache.erase(u.second);
+    evicted++;
+  }
+
+  LOGI(" BLAS cache: %u hits, %u misses (%zu built), %u evicted, %zu cached (%.2f MB, %.2f MB unused)\n", hits,
+       numPrims - hits, allBlas.size(), evicted, m_blasCache.size(), cacheSize / 1048576.0, unusedSize / 1048576.0);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Building the BLAS in batches, so the scratch and uncompacted memory of a submission stays under
+// m_blasBudget. The compaction copies of a batch are recorded in the same command buffer as the
+// builds of the next batch, the GPU overlaps them and the uncompacted structures of a batch are
+// released one submission after they were built: they count in the budget of the next batch.
+//
+void AccelStructure::buildBlasBatched(const std::vector<nvvk::RaytracingBuilderKHR::BlasInput>& input,
+                                      VkBuildAccelerationStructureFlagsKHR                      flags,
+                                      std::vector<nvvk::AccelKHR>&                              blas,
+                                      std::vector<VkDeviceSize>&                                blasSize)
+{
+  const auto numBlas       = static_cast<uint32_t>(input.size());
+  const bool hasCompaction = (flags & VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR) != 0;
+
+  std::vector<nvvk::AccelerationStructureBuildData> buildData(numBlas);
+  for(uint32_t idx = 0; idx < numBlas; idx++)
+  {
+    buildData[idx].asType           = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+    buildData[idx].asGeometry       = input[idx].asGeometry;
+    buildData[idx].asBuildRangeInfo = input[idx].asBuildOffsetInfo;
+    buildData[idx].finalizeGeometry(m_device, input[idx].flags | flags);
+  }
+
+  // Greedy batching in scene order, a BLAS larger than the budget gets a batch of its own.
+  // With compaction the uncompacted structures of the previous batch are still alive while a batch
+  // builds, they are carried in its budget.
+  struct Batch
+  {
+    uint32_t     first{0};
+    uint32_t     count{0};
+    VkDeviceSize scratchSize{0};
+    VkDeviceSize buildSize{0};
+  };
+  std::vector<Batch> batches;
+  VkDeviceSize       maxScratch{0};
+  VkDeviceSize       carried{0};  // Uncompacted size of the previous batch
+  for(uint32_t idx = 0; idx < numBlas; idx++)
+  {
+    const VkDeviceSize scratch = alignScratch(buildData[idx].sizeInfo.buildScratchSize);
+    const VkDeviceSize asSize  = buildData[idx].sizeInfo.accelerationStructureSize;
+    if(batches.empty()
+       || (batches.back().count > 0
+           && carried + batches.back().scratchSize + batches.back().buildSize + scratch + asSize > m_blasBudget))
+    {
+      carried = (hasCompaction && !batches.empty()) ? batches.back().buildSize : 0;
+      batches.push_back({idx, 0, 0, 0});
+    }
+    Batch& batch = batches.back();
+    batch.count++;
+    batch.scratchSize += scratch;
+    batch.buildSize += asSize;
+    maxScratch = std::max(maxScratch, batch.scratchSize);
+  }
+  if(batches.empty())
+    return;
+
+  // The allocator does not take an alignment: the buffer is padded so its base address can be
+  // aligned up, the slices after it are aligned by their sizes
+  nvvk::Buffer scratchBuffer = m_pAlloc->createBuffer(maxScratch + m_scratchAlignment - 1,
+                                                      VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  NAME_VK(scratchBuffer.buffer);
+  const VkDeviceAddress scratchBase = alignScratch(scratchBuffer.address);
+
+  VkQueryPool queryPool{VK_NULL_HANDLE};
+  if(hasCompaction)
+  {
+    VkQueryPoolCreateInfo qpci{VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO};
+    qpci.queryCount = numBlas;
+    qpci.queryType  = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR;
+    vkCreateQueryPool(m_device, &qpci, nullptr, &queryPool);
+  }
+
+  // Memory alive on the device: scratch + built structures, including both versions of the
+  // batch being compacted
+  VkDeviceSize liveSize = maxScratch;
+  VkDeviceSize highWater{liveSize};
+  VkDeviceSize totalBuilt{0}, totalCompact{0};
+
+  blas.assign(numBlas, {});
+  blasSize.assign(numBlas, 0);
+  std::vector<nvvk::AccelKHR> uncompacted(numBlas);
+  std::vector<VkDeviceSize>   compactSizes(numBlas, 0);
+
+  nvvk::CommandPool cmdPool(m_device, m_queueIndex);
+  MilliTimer        timer;
+
+  // One more submission than batches, the last one only compacts
+  const auto numSubmits = static_cast<uint32_t>(batches.size()) + (hasCompaction ? 1 : 0);
+  for(uint32_t b = 0; b < numSubmits; b++)
+  {
+    const Batch* building   = b < batches.size() ? &batches[b] : nullptr;
+    const Batch* compacting = (hasCompaction && b > 0) ? &batches[b - 1] : nullptr;
+
+    VkCommandBuffer cmd = cmdPool.createCommandBuffer();
+
+    // Compaction of the previous batch, its builds and size queries completed with the last submit
+    VkDeviceSize batchCompact{0};
+    if(compacting)
+    {
+      for(uint32_t idx = compacting->first; idx < compacting->first + compacting->count; idx++)
+      {
+        VkAccelerationStructureCreateInfoKHR createInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR};
+        createInfo.size = compactSizes[idx];
+        createInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+        blas[idx]       = m_pAlloc->createAcceleration(createInfo);
+        blasSize[idx]   = compactSizes[idx];
+        NAME_IDX_VK(blas[idx].accel, idx);
+
+        VkCopyAccelerationStructureInfoKHR copyInfo{VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR};
+        copyInfo.src  = uncompacted[idx].accel;
+        copyInfo.dst  = blas[idx].accel;
+        copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR;
+        vkCmdCopyAccelerationStructureKHR(cmd, &copyInfo);
+        batchCompact += compactSizes[idx];
+      }
+      liveSize += batchCompact;
+    }
+
+    // Builds of this batch, each BLAS with its own slice of the scratch buffer and all in one call
+    // so they run concurrently (cmdBuildAccelerationStructure would add a barrier after each)
+    if(building)
+    {
+      std::vector<VkAccelerationStructureBuildGeometryInfoKHR> buildInfos;
+      std::vector<const VkAccelerationStructureBuildRangeInfoKHR*> rangeInfos;
+      VkDeviceAddress scratchAddress = scratchBase;
+      for(uint32_t idx = building->first; idx < building->first + building->count; idx++)
+      {
+        nvvk::AccelKHR& dst = hasCompaction ? uncompacted[idx] : blas[idx];
+        dst                 = m_pAlloc->createAcceleration(buildData[idx].makeCreateInfo());
+        blasSize[idx]       = buildData[idx].sizeInfo.accelerationStructureSize;
+
+        VkAccelerationStructureBuildGeometryInfoKHR info = buildData[idx].buildInfo;
+        info.dstAccelerationStructure                    = dst.accel;
+        info.scratchData.deviceAddress                   = scratchAddress;
+        info.pGeometries                                 = buildData[idx].asGeometry.data();
+        buildInfos.push_back(info);
+        rangeInfos.push_back(buildData[idx].asBuildRangeInfo.data());
+        scratchAddress += alignScratch(buildData[idx].sizeInfo.buildScratchSize);
+      }
+      vkCmdBuildAccelerationStructuresKHR(cmd, building->count, buildInfos.data(), rangeInfos.data());
+      liveSize += building->buildSize;
+
+      if(hasCompaction)
+      {
+        // The size query reads the finished structures
+        nvvk::accelerationStructureBarrier(cmd, VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+                                           VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR);
+        std::vector<VkAccelerationStructureKHR> handles;
+        for(uint32_t idx = building->first; idx < building->first + building->count; idx++)
+          handles.push_back(uncompacted[idx].accel);
+        vkCmdResetQueryPool(cmd, queryPool, building->first, building->count);
+        vkCmdWriteAccelerationStructuresPropertiesKHR(cmd, building->count, handles.data(),
+                                                      VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR,
+                                                      queryPool, building->first);
+      }
+    }
+    highWater = std::max(highWater, liveSize);
+
+    timer.reset();
+    cmdPool.submitAndWait(cmd);
+    const double elapsed = timer.elapsed();
+
+    if(building && hasCompaction)
+      vkGetQueryPoolResults(m_device, queryPool, building->first, building->count, building->count * sizeof(VkDeviceSize),
+                            &compactSizes[building->first], sizeof(VkDeviceSize), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+
+    if(compacting)
+    {
+      for(uint32_t idx = compacting->first; idx < compacting->first + compacting->count; idx++)
+        m_pAlloc->destroy(uncompacted[idx]);
+      liveSize -= compacting->buildSize;
+      totalCompact += batchCompact;
+    }
+    if(building)
+    {
+      totalBuilt += building->buildSize;
+      if(!hasCompaction)
+        totalCompact += building->buildSize;
+    }
+
+    // Per submission: what was built, what was compacted and the device memory alive
+    LOGI("  batch %u: build %u BLAS (%.2f MB), compact %u BLAS (%.2f MB), %.2f ms, live %.2f MB\n", b,
+         building ? building->count : 0, building ? building->buildSize / 1048576.0 : 0.0, compacting ? compacting->count : 0,
+         batchCompact / 1048576.0, elapsed, liveSize / 1048576.0);
+  }
+
+  LOGI("  BLAS budget %.2f MB, %zu batches, scratch %.2f MB, %.2f MB -> %.2f MB, high-water %.2f MB\n",
+       m_blasBudget / 1048576.0, batches.size(), maxScratch / 1048576.0, totalBuilt / 1048576.0,
+       totalCompact / 1048576.0, highWater / 1048576.0);
+
+  if(queryPool != VK_NULL_HANDLE)
+    vkDestroyQueryPool(m_device, queryPool, nullptr);
+  m_pAlloc->destroy(scratchBuffer);
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -131,7 +452,8 @@ void AccelStructure::createBottomLevelAS(nvh::GltfScene&                  gltfSc
 //
 void AccelStructure::createTopLevelAS(nvh::GltfScene& gltfScene)
 {
-  std::vector<VkAccelerationStructureInstanceKHR> tlas;
+  std::vector<VkAccelerationStructureInstanceKHR>& tlas = m_instances;
+  tlas.clear();
   tlas.reserve(gltfScene.m_nodes.size());
 
   for(auto& node : gltfScene.m_nodes)
@@ -151,16 +473,130 @@ void AccelStructure::createTopLevelAS(nvh::GltfScene& gltfScene)
     VkAccelerationStructureInstanceKHR rayInst{};
     rayInst.transform                      = nvvk::toTransformMatrixKHR(node.worldMatrix);
     rayInst.instanceCustomIndex            = node.primMesh;  // gl_InstanceCustomIndexEXT: to find which primitive
-    rayInst.accelerationStructureReference = m_rtBuilder.getBlasDeviceAddress(node.primMesh);
+    rayInst.accelerationStructureReference = m_blas[node.primMesh].address;
     rayInst.flags                          = flags;
     rayInst.instanceShaderBindingTableRecordOffset = 0;  // We will use the same hit group for all objects
     rayInst.mask                                   = 0xFF;
     tlas.emplace_back(rayInst);
   }
   LOGI(" TLAS(%zu)", tlas.size());
-  m_rtBuilder.buildTlas(tlas, VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR);
+
+  nvvk::CommandPool cmdPool(m_device, m_queueIndex);
+  VkCommandBuffer   cmd = cmdPool.createCommandBuffer();
+
+  m_instanceBuffer = m_pAlloc->createBuffer(cmd, tlas, VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
+                                                           | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR);
+  NAME_VK(m_instanceBuffer.buffer);
+
+  // Make sure the copy of the instance buffer are copied before triggering the acceleration structure build
+  VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1,
+                       &barrier, 0, nullptr, 0, nullptr);
+
+  m_tlasBuildData = {VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR};
+  m_tlasBuildData.addGeometry(m_tlasBuildData.makeInstanceGeometry(tlas.size(), m_instanceBuffer.address));
+  auto sizeInfo = m_tlasBuildData.finalizeGeometry(m_device, VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR
+                                                                 | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR);
+
+  m_tlas = m_pAlloc->createAcceleration(m_tlasBuildData.makeCreateInfo());
+  NAME_VK(m_tlas.accel);
+  m_tlasScratch = m_pAlloc->createBuffer(std::max(sizeInfo.buildScratchSize, sizeInfo.updateScratchSize) + m_scratchAlignment - 1,
+                                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+  NAME_VK(m_tlasScratch.buffer);
+  m_tlasScratchAddress = alignScratch(m_tlasScratch.address);
+
+  m_tlasBuildData.cmdBuildAccelerationStructure(cmd, m_tlas.accel, m_tlasScratchAddress);
+  cmdPool.submitAndWait(cmd);
+  m_pAlloc->finalizeAndReleaseStaging();
+
+  m_instanceDirty.assign(tlas.size(), false);
+  m_dirtyInstances.clear();
+  m_refitCount = 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Recording the new transform of an instance (glTF node), the TLAS is updated next frame
+//
+void AccelStructure::setInstanceTransform(uint32_t instance, const glm::mat4& transform)
+{
+  assert(instance < m_instances.size());
+  m_instances[instance].transform = nvvk::toTransformMatrixKHR(transform);
+  if(!m_instanceDirty[instance])
+  {
+    m_instanceDirty[instance] = true;
+    m_dirtyInstances.push_back(instance);
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+// Uploading the dirty instances and refitting the TLAS in the frame command buffer, or rebuilding
+// it once m_maxRefits refits have accumulated. Both are timed by the profiler ("TLAS Refit" and
+// "TLAS Rebuild") and their averages are logged at each rebuild.
+//
+bool AccelStructure::updateTopLevelAS(const VkCommandBuffer& cmdBuf, nvvk::ProfilerVK& profiler)
+{
+  if(m_dirtyInstances.empty() || m_tlas.accel == VK_NULL_HANDLE)
+    return false;
+
+  LABEL_SCOPE_VK(cmdBuf);
+  const bool rebuild = m_refitCount >= m_maxRefits;
+  if(rebuild)
+  {
+    double cpuTime, refitTime, rebuildTime;
+    profiler.getAveragedValues("TLAS Refit", cpuTime, refitTime);
+    profiler.getAveragedValues("TLAS Rebuild", cpuTime, rebuildTime);
+    LOGI("TLAS rebuild after %u refits, GPU average: refit %.3f ms, rebuild %.3f ms\n", m_refitCount,
+         refitTime / 1000.0, rebuildTime / 1000.0);
+  }
+
+  auto sec = profiler.timeRecurring(rebuild ? "TLAS Rebuild" : "TLAS Refit", cmdBuf);
+
+  // Previous frames may still trace the TLAS or build from the instances
+  const VkPipelineStageFlags readStages = VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT
+                                          | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+  VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+  barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+  vkCmdPipelineBarrier(cmdBuf, readStages | VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1,
+                       &barrier, 0, nullptr, 0, nullptr);
+
+  // Only the dirty instances are uploaded (64 bytes each)
+  for(uint32_t instance : m_dirtyInstances)
+  {
+    vkCmdUpdateBuffer(cmdBuf, m_instanceBuffer.buffer, instance * sizeof(VkAccelerationStructureInstanceKHR),
+                      sizeof(VkAccelerationStructureInstanceKHR), &m_instances[instance]);
+    m_instanceDirty[instance] = false;
+  }
+  m_dirtyInstances.clear();
+
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+  vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1,
+                       &barrier, 0, nullptr, 0, nullptr);
+
+  if(rebuild)
+  {
+    m_tlasBuildData.cmdBuildAccelerationStructure(cmdBuf, m_tlas.accel, m_tlasScratchAddress);
+    m_refitCount = 0;
+  }
+  else
+  {
+    m_tlasBuildData.cmdUpdateAccelerationStructure(cmdBuf, m_tlas.accel, m_tlasScratchAddress);
+    m_refitCount++;
+  }
+
+  // The TLAS is traced by the passes of this frame
+  barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+  barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+  vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, readStages, 0, 1, &barrier, 0,
+                       nullptr, 0, nullptr);
+  return true;
 }
 
+
 //--------------------------------------------------------------------------------------------------
 // Descriptor set holding the TLAS
 //
@@ -176,7 +612,7 @@ void AccelStructure::createRtDescriptorSet()
   CREATE_NAMED_VK(m_rtDescSet, nvvk::allocateDescriptorSet(m_device, m_rtDescPool, m_rtDescSetLayout));
 
 
-  VkAccelerationStructureKHR tlas = m_rtBuilder.getAccelerationStructure();
+  VkAccelerationStructureKHR tlas = m_tlas.accel;
 
   VkWriteDescriptorSetAccelerationStructureKHR descASInfo{VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_KHR};
   descASInfo.accelerationStructureCount = 1;
@@ -19,11 +19,15 @@
 
 
 #pragma once
+#include <unordered_map>
+
 #include "nvh/gltfscene.hpp"
 #include "nvvk/resourceallocator_vk.hpp"
 #include "nvvk/descriptorsets_vk.hpp"
 #include "nvvk/raytraceKHR_vk.hpp"
+#include "nvvk/profiler_vk.hpp"
 
+struct GeometryKey;  // scene.hpp
 
 /*
  
@@ -39,16 +43,44 @@ class AccelStructure
 public:
   void setup(const VkDevice& device, const VkPhysicalDevice& physicalDevice, uint32_t familyIndex, nvvk::ResourceAllocator* allocator);
   void destroy();
-  void create(nvh::GltfScene& gltfScene, const std::vector<nvvk::Buffer>& vertex, const std::vector<nvvk::Buffer>& index);
+  void create(nvh::GltfScene&                  gltfScene,
+              const std::vector<nvvk::Buffer>& vertex,
+              const std::vector<nvvk::Buffer>& index,
+              const std::vector<GeometryKey>&  geometryKeys);
 
-  VkAccelerationStructureKHR getTlas() { return m_rtBuilder.getAccelerationStructure(); }
+  VkAccelerationStructureKHR getTlas() { return m_tlas.accel; }
   VkDescriptorSetLayout      getDescLayout() { return m_rtDescSetLayout; }
   VkDescriptorSet            getDescSet() { return m_rtDescSet; }
 
+  // Upper bound for the scratch and uncompacted BLAS memory alive in one build batch
+  void setBlasMemoryBudget(VkDeviceSize budget) { m_blasBudget = budget; }
+  // Memory kept for cached BLAS the current scene does not use, least recently used go first
+  void setBlasCacheBudget(VkDeviceSize budget) { m_blasCacheBudget = budget; }
+
+  // Moving instances: the transform is recorded on the host and the TLAS is refitted with the
+  // dirty instances at the next updateTopLevelAS. After maxRefits refits in a row the TLAS is
+  // rebuilt instead, as refitting only grows the bounds of the original hierarchy.
+  void setInstanceTransform(uint32_t instance, const glm::mat4& transform);
+  bool updateTopLevelAS(const VkCommandBuffer& cmdBuf, nvvk::ProfilerVK& profiler);
+  void setMaxRefits(uint32_t maxRefits) { m_maxRefits = maxRefits; }
+
 private:
   nvvk::RaytracingBuilderKHR::BlasInput primitiveToGeometry(const nvh::GltfPrimMesh& prim, VkBuffer vertex, VkBuffer index);
-  void createBottomLevelAS(nvh::GltfScene& gltfScene, const std::vector<nvvk::Buffer>& vertex, const std::vector<nvvk::Buffer>& index);
+  void createBottomLevelAS(nvh::GltfScene&                  gltfScene,
+                           const std::vector<nvvk::Buffer>& vertex,
+                           const std::vector<nvvk::Buffer>& index,
+                           const std::vector<GeometryKey>&  geometryKeys);
   void createTopLevelAS(nvh::GltfScene& gltfScene);
+  void buildBlasBatched(const std::vector<nvvk::RaytracingBuilderKHR::BlasInput>& input,
+                        VkBuildAccelerationStructureFlagsKHR                      flags,
+                        std::vector<nvvk::AccelKHR>&                              blas,
+                        std::vector<VkDeviceSize>&                                blasSize);
+  // Scratch sizes and addresses rounded up to minAccelerationStructureScratchOffsetAlignment
+  VkDeviceSize alignScratch(VkDeviceSize size) const
+  {
+    return (size + m_scratchAlignment - 1) / m_scratchAlignment * m_scratchAlignment;
+  }
+  void destroySceneResources();
   void createRtDescriptorSet();
 
 
@@ -58,7 +90,42 @@ private:
   VkDevice                 m_device{nullptr};
   uint32_t                 m_queueIndex{0};
 
-  nvvk::RaytracingBuilderKHR m_rtBuilder;
+  std::vector<nvvk::AccelKHR> m_blas;  // Per primitive mesh, owned by m_blasCache
+  VkDeviceSize                m_blasBudget{256ull << 20};
+  VkDeviceSize                m_scratchAlignment{128};
+
+  // BLAS surviving scene reloads, keyed by geometry hash and build flags. A key only selects the
+  // candidates: the checksum and the counts of the geometry must match too, the entries of colliding
+  // keys live side by side.
+  struct BlasGeometry
+  {
+    uint64_t checksum{0};  // GeometryKey::checksum
+    uint32_t vertexCount{0};
+    uint32_t indexCount{0};
+    bool     operator==(const BlasGeometry&) const = default;
+  };
+  struct BlasCacheEntry
+  {
+    nvvk::AccelKHR blas;
+    VkDeviceSize   size{0};
+    uint64_t       lastUse{0};  // m_sceneGeneration of the last scene using it
+    BlasGeometry   geometry;
+  };
+  std::unordered_multimap<size_t, BlasCacheEntry> m_blasCache;
+  uint64_t                                        m_sceneGeneration{0};
+  VkDeviceSize                                    m_blasCacheBudget{512ull << 20};
+
+  // TLAS, built with ALLOW_UPDATE and refitted in place so the descriptor stays valid
+  nvvk::AccelKHR                                  m_tlas;
+  nvvk::Buffer                                    m_instanceBuffer;
+  nvvk::Buffer                                    m_tlasScratch;  // Large enough for a build or an update
+  VkDeviceAddress                                 m_tlasScratchAddress{0};  // Of m_tlasScratch, aligned
+  nvvk::AccelerationStructureBuildData            m_tlasBuildData{VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR};
+  std::vector<VkAccelerationStructureInstanceKHR> m_instances;
+  std::vector<uint32_t>                           m_dirtyInstances;
+  std::vector<bool>                               m_instanceDirty;
+  uint32_t                                        m_refitCount{0};
+  uint32_t                                        m_maxRefits{64};
 
   VkDescriptorPool      m_rtDescPool{VK_NULL_HANDLE};
   VkDescriptorSetLayout m_rtDescSetLayout{VK_NULL_HANDLE};
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <array>
+
 #include "nvvk/resourceallocator_vk.hpp"
 #include "nvvk/debug_util_vk.hpp"
 #include "nvvk/descriptorsets_vk.hpp"
@@ -35,7 +37,7 @@ private:
 
 
 	VkPipelineLayout m_pipelineLayout{ VK_NULL_HANDLE };
-	VkPipeline       m_pipeline{ VK_NULL_HANDLE };
+	std::array<VkPipeline, 3> m_pipelines{};  // Scan phases, see cellInfo_update_pass.comp
 	VkRenderPass     m_renderPass{ VK_NULL_HANDLE };
 };
 
@@ -4,11 +4,22 @@
 #include "nvh/fileoperations.hpp"
 #include "nvvk/shaders_vk.hpp"
 #include "scene.hpp"
+#include "surfel_specialization.hpp"
 #include "tools.hpp"
 
 #include "autogen/cellToSurfel_update_pass.comp.h"
 
 
+// Writes of a phase visible to the next one
+static void phaseBarrier(const VkCommandBuffer& cmdBuf)
+{
+	VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+		1, &barrier, 0, nullptr, 0, nullptr);
+}
+
 void CellToSurfelUpdatePass::setup(const VkDevice& device, const VkPhysicalDevice& physicalDevice, uint32_t familyIndex, nvvk::ResourceAllocator* allocator)
 {
 	m_device = device;
@@ -19,26 +30,35 @@ void CellToSurfelUpdatePass::setup(const VkDevice& device, const VkPhysicalDevic
 
 void CellToSurfelUpdatePass::destroy()
 {
-	vkDestroyPipeline(m_device, m_pipeline, nullptr);
+	for (auto& pipeline : m_pipelines)
+	{
+		vkDestroyPipeline(m_device, pipeline, nullptr);
+		pipeline = VK_NULL_HANDLE;
+	}
 	vkDestroyPipelineLayout(m_device, m_pipelineLayout, nullptr);
 
 	m_pipelineLayout = VK_NULL_HANDLE;
-	m_pipeline = VK_NULL_HANDLE;
 }
 
 void CellToSurfelUpdatePass::run(const VkCommandBuffer& cmdBuf, const VkExtent2D& size, nvvk::ProfilerVK& profiler, const std::vector<VkDescriptorSet>& descSets)
 {
+	// size.width: surfels to scatter, size.height: cells to sort
 	const int GROUP_SIZE = 32;
-	// Preparing for the compute shader
-	vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipeline);
 	vkCmdBindDescriptorSets(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelineLayout, 0,
 		static_cast<uint32_t>(descSets.size()), descSets.data(), 0, nullptr);
 
 	// Sending the push constant information
 	vkCmdPushConstants(cmdBuf, m_pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(RtxState), &m_state);
 
-	// Dispatching the shader
-	vkCmdDispatch(cmdBuf, (size.width + (GROUP_SIZE - 1)) / GROUP_SIZE, (size.height + (GROUP_SIZE - 1)) / GROUP_SIZE, 1);
+	vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelines[0]);
+	if (m_indirectBuffer != VK_NULL_HANDLE)
+		vkCmdDispatchIndirect(cmdBuf, m_indirectBuffer, m_indirectOffset);
+	else
+		vkCmdDispatch(cmdBuf, (size.width + (GROUP_SIZE - 1)) / GROUP_SIZE, 1, 1);
+	phaseBarrier(cmdBuf);
+
+	vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelines[1]);
+	vkCmdDispatch(cmdBuf, (size.height + (GROUP_SIZE - 1)) / GROUP_SIZE, 1, 1);
 }
 
 void CellToSurfelUpdatePass::create(const VkExtent2D& size, const std::vector<VkDescriptorSetLayout>& descSetsLayout, Scene* _scene)
@@ -53,16 +73,23 @@ void CellToSurfelUpdatePass::create(const VkExtent2D& size, const std::vector<Vk
 	layout_info.pSetLayouts = descSetsLayout.data();
 	vkCreatePipelineLayout(m_device, &layout_info, nullptr, &m_pipelineLayout);
 
+	// One pipeline per phase, selected by the specialization constant
+	SurfelSpecialization specialization;
+
 	VkComputePipelineCreateInfo computePipelineCreateInfo{ VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
 	computePipelineCreateInfo.layout = m_pipelineLayout;
 	computePipelineCreateInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
 	computePipelineCreateInfo.stage.module = nvvk::createShaderModule(m_device, cellToSurfel_update_pass_comp, sizeof(cellToSurfel_update_pass_comp));
 	computePipelineCreateInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
 	computePipelineCreateInfo.stage.pName = "main";
-
-	vkCreateComputePipelines(m_device, {}, 1, &computePipelineCreateInfo, nullptr, &m_pipeline);
-
-	m_debug.setObjectName(m_pipeline, "CellToSurfel Update Pass");
+	computePipelineCreateInfo.stage.pSpecializationInfo = specialization.getInfo();
+
+	for (uint32_t phase = 0; phase < m_pipelines.size(); phase++)
+	{
+		specialization.setPhase(phase);
+		vkCreateComputePipelines(m_device, {}, 1, &computePipelineCreateInfo, nullptr, &m_pipelines[phase]);
+		m_debug.setObjectName(m_pipelines[phase], "CellToSurfel Update Pass " + std::to_string(phase));
+	}
 	vkDestroyShaderModule(m_device, computePipelineCreateInfo.stage.module, nullptr);
 }
 
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <array>
+
 #include "nvvk/resourceallocator_vk.hpp"
 #include "nvvk/debug_util_vk.hpp"
 #include "nvvk/descriptorsets_vk.hpp"
@@ -25,6 +27,12 @@ public:
 	void          setPushContants(const RtxState& state) {
 		m_state = state;
 	}
+	// Dispatch sized on the GPU (SurfelDispatch) instead of by run()
+	void setIndirectDispatch(VkBuffer buffer, VkDeviceSize offset)
+	{
+		m_indirectBuffer = buffer;
+		m_indirectOffset = offset;
+	}
 
 private:
 	// Setup
@@ -34,8 +42,11 @@ private:
 	uint32_t                 m_queueIndex{ 0 };
 
 
+	VkBuffer     m_indirectBuffer{ VK_NULL_HANDLE };
+	VkDeviceSize m_indirectOffset{ 0 };
+
 	VkPipelineLayout m_pipelineLayout{ VK_NULL_HANDLE };
-	VkPipeline       m_pipeline{ VK_NULL_HANDLE };
+	std::array<VkPipeline, 2> m_pipelines{};  // Scatter and sort phases, see cellToSurfel_update_pass.comp
 	VkRenderPass     m_renderPass{ VK_NULL_HANDLE };
 };
 
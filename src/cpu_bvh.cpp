@@ -0,0 +1,690 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <future>
+#include <random>
+
+#include "cpu_bvh.hpp"
+#include "nvh/parallel_work.hpp"
+#include "tools.hpp"
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define CPU_BVH_SSE 1
+#endif
+
+namespace {
+constexpr uint32_t kBins           = 16;
+constexpr uint32_t kMaxLeafSize    = 8;
+constexpr uint32_t kParallelSize   = 8192;  // Smallest subtree built in its own task
+constexpr float    kTraversalCost  = 1.0f;  // Relative to one triangle test
+constexpr uint32_t kMaxSahDepth    = 48;   // Deeper ranges are split at the median, which bounds the depth
+constexpr uint32_t kMaxStackDepth  = 256;
+
+// Below kMaxSahDepth the median split halves the range, so the binary tree is at most 32 levels
+// deeper on 32-bit triangle counts. The wide tree is no deeper, and each popped node pushes at
+// most its other three children before descending: the stack cannot overflow.
+static_assert(3 * (kMaxSahDepth + 32) + 1 <= kMaxStackDepth, "CPU BVH traversal stack too small");
+
+float surfaceArea(const glm::vec3& bmin, const glm::vec3& bmax)
+{
+  const glm::vec3 d = glm::max(bmax - bmin, glm::vec3(0.f));
+  return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+}  // namespace
+
+
+struct CpuBvh::BinaryNode
+{
+  glm::vec3 bmin{0.f};
+  glm::vec3 bmax{0.f};
+  uint32_t  left{0};   // Inner node: children are left and left + 1
+  uint32_t  first{0};  // Leaf: triangles [first, first + count) of the build order
+  uint32_t  count{0};
+};
+
+struct CpuBvh::BuildContext
+{
+  std::vector<glm::vec3>  triMin, triMax, centroid;
+  std::vector<uint32_t>   order;
+  std::vector<BinaryNode> nodes;
+  std::atomic<uint32_t>   nodeCount{1};
+  uint32_t                parallelDepth{0};
+
+  void     split(uint32_t nodeIdx, uint32_t begin, uint32_t end, uint32_t depth);
+  uint32_t collapse(uint32_t nodeIdx, std::vector<Node4>& out) const;
+};
+
+
+//--------------------------------------------------------------------------------------------------
+// Binned SAH split of [begin, end), falls back to a median split when SAH finds nothing better
+// and the range is too large for a leaf, and always past kMaxSahDepth
+//
+void CpuBvh::BuildContext::split(uint32_t nodeIdx, uint32_t begin, uint32_t end, uint32_t depth)
+{
+  BinaryNode& node = nodes[nodeIdx];
+  glm::vec3   cmin(FLT_MAX), cmax(-FLT_MAX);
+  node.bmin = glm::vec3(FLT_MAX);
+  node.bmax = glm::vec3(-FLT_MAX);
+  for(uint32_t i = begin; i < end; i++)
+  {
+    const uint32_t tri = order[i];
+    node.bmin          = glm::min(node.bmin, triMin[tri]);
+    node.bmax          = glm::max(node.bmax, triMax[tri]);
+    cmin               = glm::min(cmin, centroid[tri]);
+    cmax               = glm::max(cmax, centroid[tri]);
+  }
+
+  const uint32_t count = end - begin;
+  node.first           = begin;
+  node.count           = count;
+  if(count <= 2)
+    return;
+
+  // Binning on the three axes
+  float    bestCost = FLT_MAX;
+  int      bestAxis = -1;
+  uint32_t bestBin  = 0;
+  for(int axis = 0; depth < kMaxSahDepth && axis < 3; axis++)
+  {
+    const float extent = cmax[axis] - cmin[axis];
+    if(extent <= 0.f)
+      continue;
+    const float scale = float(kBins) / extent;
+
+    glm::vec3 binMin[kBins], binMax[kBins];
+    uint32_t  binCount[kBins]{};
+    for(uint32_t b = 0; b < kBins; b++)
+    {
+      binMin[b] = glm::vec3(FLT_MAX);
+      binMax[b] = glm::vec3(-FLT_MAX);
+    }
+    for(uint32_t i = begin; i < end; i++)
+    {
+      const uint32_t tri = order[i];
+      const uint32_t b   = std::min(uint32_t((centroid[tri][axis] - cmin[axis]) * scale), kBins - 1);
+      binMin[b]          = glm::min(binMin[b], triMin[tri]);
+      binMax[b]          = glm::max(binMax[b], triMax[tri]);
+      binCount[b]++;
+    }
+
+    // Sweep from the right for the right-side areas, then from the left evaluating each plane
+    float     rightArea[kBins];
+    uint32_t  rightCount[kBins];
+    glm::vec3 accMin(FLT_MAX), accMax(-FLT_MAX);
+    uint32_t  accCount = 0;
+    for(uint32_t b = kBins - 1; b > 0; b--)
+    {
+      accMin = glm::min(accMin, binMin[b]);
+      accMax = glm::max(accMax, binMax[b]);
+      accCount += binCount[b];
+      rightArea[b]  = surfaceArea(accMin, accMax);
+      rightCount[b] = accCount;
+    }
+    accMin   = glm::vec3(FLT_MAX);
+    accMax   = glm::vec3(-FLT_MAX);
+    accCount = 0;
+    for(uint32_t b = 0; b < kBins - 1; b++)
+    {
+      accMin = glm::min(accMin, binMin[b]);
+      accMax = glm::max(accMax, binMax[b]);
+      accCount += binCount[b];
+      if(accCount == 0 || rightCount[b + 1] == 0)
+        continue;
+      const float cost = surfaceArea(accMin, accMax) * float(accCount) + rightArea[b + 1] * float(rightCount[b + 1]);
+      if(cost < bestCost)
+      {
+        bestCost = cost;
+        bestAxis = axis;
+        bestBin  = b;
+      }
+    }
+  }
+
+  const float nodeArea = std::max(surfaceArea(node.bmin, node.bmax), 1e-20f);
+  const float leafCost = float(count);
+  const bool  useSah   = bestAxis >= 0 && kTraversalCost + bestCost / nodeArea < leafCost;
+  if(!useSah && count <= kMaxLeafSize)
+    return;
+
+  uint32_t mid;
+  if(useSah)
+  {
+    const float scale = float(kBins) / (cmax[bestAxis] - cmin[bestAxis]);
+    auto it = std::partition(order.begin() + begin, order.begin() + end, [&](uint32_t tri) {
+      return std::min(uint32_t((centroid[tri][bestAxis] - cmin[bestAxis]) * scale), kBins - 1) <= bestBin;
+    });
+    mid = uint32_t(it - order.begin());
+  }
+  else
+  {
+    // Median on the largest centroid extent, also handles all centroids at the same point
+    const glm::vec3 extent = cmax - cmin;
+    const int       axis   = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    mid                    = begin + count / 2;
+    std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+                     [&](uint32_t a, uint32_t b) { return centroid[a][axis] < centroid[b][axis]; });
+  }
+
+  const uint32_t left = nodeCount.fetch_add(2);
+  node.left           = left;
+  node.count          = 0;
+
+  if(depth < parallelDepth && count > kParallelSize)
+  {
+    auto task = std::async(std::launch::async, [&] { split(left, begin, mid, depth + 1); });
+    split(left + 1, mid, end, depth + 1);
+    task.get();
+  }
+  else
+  {
+    split(left, begin, mid, depth + 1);
+    split(left + 1, mid, end, depth + 1);
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+// Collapsing the binary tree: the child with the largest surface area is opened until a node has
+// four children. Returns the index of the wide node.
+//
+uint32_t CpuBvh::BuildContext::collapse(uint32_t nodeIdx, std::vector<Node4>& out) const
+{
+  std::vector<uint32_t> children;
+  const BinaryNode&     root = nodes[nodeIdx];
+  if(root.count > 0)
+    children.push_back(nodeIdx);
+  else
+    children = {root.left, root.left + 1};
+
+  while(children.size() < 4)
+  {
+    int   open = -1;
+    float area = -1.f;
+    for(size_t i = 0; i < children.size(); i++)
+    {
+      const BinaryNode& c = nodes[children[i]];
+      if(c.count == 0 && surfaceArea(c.bmin, c.bmax) > area)
+      {
+        area = surfaceArea(c.bmin, c.bmax);
+        open = int(i);
+      }
+    }
+    if(open < 0)
+      break;
+    const uint32_t left = nodes[children[open]].left;
+    children[open]      = left;
+    children.push_back(left + 1);
+  }
+
+  const auto index = static_cast<uint32_t>(out.size());
+  out.emplace_back();
+
+  Node4 wide{};
+  for(uint32_t i = 0; i < 4; i++)
+  {
+    if(i >= children.size())
+    {
+      // Empty slot, a box at infinity is missed by every ray without producing NaN
+      for(int a = 0; a < 3; a++)
+        wide.bmin[a][i] = wide.bmax[a][i] = FLT_MAX;
+      wide.child[i] = -1;
+      wide.count[i] = 0;
+      continue;
+    }
+    const BinaryNode& c = nodes[children[i]];
+    for(int a = 0; a < 3; a++)
+    {
+      wide.bmin[a][i] = c.bmin[a];
+      wide.bmax[a][i] = c.bmax[a];
+    }
+    if(c.count > 0)
+    {
+      wide.child[i] = int32_t(c.first);
+      wide.count[i] = int32_t(c.count);
+    }
+    else
+    {
+      wide.child[i] = int32_t(collapse(children[i], out));
+      wide.count[i] = 0;
+    }
+  }
+  out[index] = wide;
+  return index;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// World space triangles of every node, then the binary SAH tree and its 4-wide version
+//
+void CpuBvh::build(const nvh::GltfScene& gltf, uint32_t numThreads)
+{
+  MilliTimer timer;
+  clear();
+  numThreads = std::max(numThreads, 1u);
+
+  // Triangle offset of each node
+  std::vector<uint32_t> nodeOffset(gltf.m_nodes.size() + 1, 0);
+  for(size_t n = 0; n < gltf.m_nodes.size(); n++)
+    nodeOffset[n + 1] = nodeOffset[n] + gltf.m_primMeshes[gltf.m_nodes[n].primMesh].indexCount / 3;
+  const uint32_t numTriangles = nodeOffset.back();
+  if(numTriangles == 0)
+    return;
+
+  BuildContext ctx;
+  ctx.triMin.resize(numTriangles);
+  ctx.triMax.resize(numTriangles);
+  ctx.centroid.resize(numTriangles);
+  ctx.order.resize(numTriangles);
+  ctx.nodes.resize(2 * size_t(numTriangles));
+  ctx.parallelDepth = uint32_t(std::ceil(std::log2(float(numThreads)))) + 1;
+
+  std::vector<Triangle>   triangles(numTriangles);
+  std::vector<TriangleId> ids(numTriangles);
+  nvh::parallel_batches<1>(
+      gltf.m_nodes.size(),
+      [&](uint64_t n) {
+        const nvh::GltfNode&     node = gltf.m_nodes[n];
+        const nvh::GltfPrimMesh& mesh = gltf.m_primMeshes[node.primMesh];
+        for(uint32_t t = 0; t < mesh.indexCount / 3; t++)
+        {
+          glm::vec3 p[3];
+          for(uint32_t k = 0; k < 3; k++)
+          {
+            const uint32_t idx = gltf.m_indices[mesh.firstIndex + t * 3 + k] + mesh.vertexOffset;
+            p[k]               = glm::vec3(node.worldMatrix * glm::vec4(gltf.m_positions[idx], 1.f));
+          }
+          const uint32_t tri = nodeOffset[n] + t;
+          triangles[tri]     = {p[0], p[1] - p[0], p[2] - p[0]};
+          ids[tri]           = {uint32_t(n), t};
+          ctx.triMin[tri]    = glm::min(p[0], glm::min(p[1], p[2]));
+          ctx.triMax[tri]    = glm::max(p[0], glm::max(p[1], p[2]));
+          ctx.centroid[tri]  = (ctx.triMin[tri] + ctx.triMax[tri]) * 0.5f;
+          ctx.order[tri]     = tri;
+        }
+      },
+      numThreads);
+
+  ctx.split(0, 0, numTriangles, 0);
+  m_boundsMin = ctx.nodes[0].bmin;
+  m_boundsMax = ctx.nodes[0].bmax;
+
+  m_nodes.reserve(ctx.nodeCount / 2 + 1);
+  ctx.collapse(0, m_nodes);
+
+  // Triangles in leaf order, so a leaf is a contiguous range
+  m_triangles.resize(numTriangles);
+  m_triangleIds.resize(numTriangles);
+  m_leafSlot.resize(numTriangles);
+  for(uint32_t i = 0; i < numTriangles; i++)
+  {
+    m_triangles[i]           = triangles[ctx.order[i]];
+    m_triangleIds[i]         = ids[ctx.order[i]];
+    m_leafSlot[ctx.order[i]] = i;
+  }
+  m_nodeOffset = std::move(nodeOffset);
+  hashGeometry();
+
+  m_buildTime = timer.elapsed();
+  LOGI("CPU BVH: %u triangles, %u binary -> %zu 4-wide nodes in %.2f ms (%u threads)\n", numTriangles,
+       ctx.nodeCount.load(), m_nodes.size(), m_buildTime, numThreads);
+}
+
+void CpuBvh::clear()
+{
+  m_nodes.clear();
+  m_triangles.clear();
+  m_triangleIds.clear();
+  m_nodeOffset.clear();
+  m_leafSlot.clear();
+  m_boundsMin = m_boundsMax = glm::vec3(0.f);
+  m_buildTime               = 0.0;
+  m_geometryHash            = 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+// The moved nodes have their triangles transformed again in place, then every box of the tree is
+// recomputed from its children. The split planes are not revisited.
+//
+void CpuBvh::refit(const nvh::GltfScene& gltf, const std::vector<uint32_t>& nodes)
+{
+  if(empty())
+    return;
+
+  for(uint32_t n : nodes)
+  {
+    const nvh::GltfNode&     node = gltf.m_nodes[n];
+    const nvh::GltfPrimMesh& mesh = gltf.m_primMeshes[node.primMesh];
+    for(uint32_t t = 0; t < mesh.indexCount / 3; t++)
+    {
+      glm::vec3 p[3];
+      for(uint32_t k = 0; k < 3; k++)
+      {
+        const uint32_t idx = gltf.m_indices[mesh.firstIndex + t * 3 + k] + mesh.vertexOffset;
+        p[k]               = glm::vec3(node.worldMatrix * glm::vec4(gltf.m_positions[idx], 1.f));
+      }
+      m_triangles[m_leafSlot[m_nodeOffset[n] + t]] = {p[0], p[1] - p[0], p[2] - p[0]};
+    }
+  }
+
+  refitNode(0, m_boundsMin, m_boundsMax);
+  hashGeometry();
+}
+
+// Bounds of the wide node `index` after refitting its subtree
+void CpuBvh::refitNode(uint32_t index, glm::vec3& bmin, glm::vec3& bmax)
+{
+  bmin = glm::vec3(FLT_MAX);
+  bmax = glm::vec3(-FLT_MAX);
+  for(uint32_t i = 0; i < 4; i++)
+  {
+    Node4& node = m_nodes[index];
+    if(node.child[i] < 0)
+      continue;
+
+    glm::vec3 cmin(FLT_MAX), cmax(-FLT_MAX);
+    if(node.count[i] > 0)
+    {
+      const uint32_t first = uint32_t(node.child[i]);
+      for(uint32_t tri = first; tri < first + uint32_t(node.count[i]); tri++)
+      {
+        const Triangle& t = m_triangles[tri];
+        cmin              = glm::min(cmin, glm::min(t.v0, glm::min(t.v0 + t.e1, t.v0 + t.e2)));
+        cmax              = glm::max(cmax, glm::max(t.v0, glm::max(t.v0 + t.e1, t.v0 + t.e2)));
+      }
+    }
+    else
+    {
+      refitNode(uint32_t(node.child[i]), cmin, cmax);
+    }
+    for(int a = 0; a < 3; a++)
+    {
+      node.bmin[a][i] = cmin[a];
+      node.bmax[a][i] = cmax[a];
+    }
+    bmin = glm::min(bmin, cmin);
+    bmax = glm::max(bmax, cmax);
+  }
+}
+
+// FNV-1a of the triangles in node order
+void CpuBvh::hashGeometry()
+{
+  m_geometryHash = 14695981039346656037ull;
+  for(uint32_t slot : m_leafSlot)
+  {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&m_triangles[slot]);
+    for(size_t i = 0; i < sizeof(Triangle); i++)
+      m_geometryHash = (m_geometryHash ^ bytes[i]) * 1099511628211ull;
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+// Moller-Trumbore, u and v are the barycentrics of the second and third vertices
+//
+bool CpuBvh::intersectTriangle(const Ray& ray, uint32_t index, float tMax, float& t, float& u, float& v) const
+{
+  const Triangle& tri  = m_triangles[index];
+  const glm::vec3 pvec = glm::cross(ray.direction, tri.e2);
+  const float     det  = glm::dot(tri.e1, pvec);
+  if(det == 0.f)
+    return false;
+  const float invDet = 1.f / det;
+
+  const glm::vec3 tvec = ray.origin - tri.v0;
+  u                    = glm::dot(tvec, pvec) * invDet;
+  if(u < 0.f || u > 1.f)
+    return false;
+  const glm::vec3 qvec = glm::cross(tvec, tri.e1);
+  v                    = glm::dot(ray.direction, qvec) * invDet;
+  if(v < 0.f || u + v > 1.f)
+    return false;
+  t = glm::dot(tri.e2, qvec) * invDet;
+  return t >= ray.tMin && t < tMax;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Stack traversal, the four children of a node are tested together and the inner ones visited
+// front to back
+//
+template <bool AnyHit>
+bool CpuBvh::traverse(const Ray& ray, Hit& hit, std::vector<uint32_t>* visited) const
+{
+  if(m_nodes.empty())
+    return false;
+
+  // Clamped reciprocal: no infinity, so no 0 * inf NaN in the slab test
+  glm::vec3 invDir;
+  for(int a = 0; a < 3; a++)
+  {
+    const float d = ray.direction[a];
+    invDir[a]     = 1.f / (std::abs(d) > 1e-20f ? d : std::copysign(1e-20f, d));
+  }
+
+  float    tMax    = ray.tMax;
+  bool     found   = false;
+  uint32_t closest = 0;
+  uint32_t stack[kMaxStackDepth];
+  uint32_t sp   = 0;
+  stack[sp++]   = 0;
+
+#ifdef CPU_BVH_SSE
+  const __m128 orgX = _mm_set1_ps(ray.origin.x), orgY = _mm_set1_ps(ray.origin.y), orgZ = _mm_set1_ps(ray.origin.z);
+  const __m128 invX = _mm_set1_ps(invDir.x), invY = _mm_set1_ps(invDir.y), invZ = _mm_set1_ps(invDir.z);
+  const __m128 rayMin = _mm_set1_ps(ray.tMin);
+#endif
+
+  while(sp > 0)
+  {
+    const uint32_t nodeIndex = stack[--sp];
+    const Node4&   node      = m_nodes[nodeIndex];
+    if(visited)
+      visited->push_back(nodeIndex);
+
+    alignas(16) float tNear[4];
+    int               mask = 0;
+#ifdef CPU_BVH_SSE
+    const __m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bmin[0]), orgX), invX);
+    const __m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bmax[0]), orgX), invX);
+    const __m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bmin[1]), orgY), invY);
+    const __m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bmax[1]), orgY), invY);
+    const __m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bmin[2]), orgZ), invZ);
+    const __m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bmax[2]), orgZ), invZ);
+    const __m128 enter = _mm_max_ps(_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)), _mm_max_ps(_mm_min_ps(t0z, t1z), rayMin));
+    const __m128 exit = _mm_min_ps(_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)),
+                                   _mm_min_ps(_mm_max_ps(t0z, t1z), _mm_set1_ps(tMax)));
+    mask = _mm_movemask_ps(_mm_cmple_ps(enter, exit));
+    _mm_store_ps(tNear, enter);
+#else
+    for(int i = 0; i < 4; i++)
+    {
+      float enter = ray.tMin, exit = tMax;
+      for(int a = 0; a < 3; a++)
+      {
+        const float t0 = (node.bmin[a][i] - ray.origin[a]) * invDir[a];
+        const float t1 = (node.bmax[a][i] - ray.origin[a]) * invDir[a];
+        enter          = std::max(enter, std::min(t0, t1));
+        exit           = std::min(exit, std::max(t0, t1));
+      }
+      tNear[i] = enter;
+      if(enter <= exit)
+        mask |= 1 << i;
+    }
+#endif
+
+    // Leaves right away, inner children sorted far to near so the nearest is popped first
+    uint32_t innerNode[4];
+    float    innerT[4];
+    uint32_t numInner = 0;
+    for(int i = 0; i < 4; i++)
+    {
+      if(!(mask & (1 << i)) || node.child[i] < 0)
+        continue;
+      if(node.count[i] > 0)
+      {
+        const uint32_t first = uint32_t(node.child[i]);
+        for(uint32_t tri = first; tri < first + uint32_t(node.count[i]); tri++)
+        {
+          float t, u, v;
+          if(intersectTriangle(ray, tri, tMax, t, u, v))
+          {
+            found = true;
+            if(AnyHit)
+              return true;
+            tMax         = t;
+            hit.t        = t;
+            hit.u        = u;
+            hit.v        = v;
+            hit.node     = m_triangleIds[tri].node;
+            hit.triangle = m_triangleIds[tri].triangle;
+            closest      = tri;
+          }
+        }
+      }
+      else
+      {
+        uint32_t k = numInner++;
+        while(k > 0 && innerT[k - 1] < tNear[i])
+        {
+          innerT[k]    = innerT[k - 1];
+          innerNode[k] = innerNode[k - 1];
+          k--;
+        }
+        innerT[k]    = tNear[i];
+        innerNode[k] = uint32_t(node.child[i]);
+      }
+    }
+    for(uint32_t k = 0; k < numInner; k++)
+    {
+      assert(sp < kMaxStackDepth);
+      stack[sp++] = innerNode[k];
+    }
+  }
+  if(found)
+    hit.normal = glm::normalize(glm::cross(m_triangles[closest].e1, m_triangles[closest].e2));
+  return found;
+}
+
+bool CpuBvh::intersect(const Ray& ray, Hit& hit) const
+{
+  return traverse<false>(ray, hit, nullptr);
+}
+
+bool CpuBvh::intersect(const Ray& ray, Hit& hit, std::vector<uint32_t>& visited) const
+{
+  return traverse<false>(ray, hit, &visited);
+}
+
+bool CpuBvh::occluded(const Ray& ray) const
+{
+  Hit hit;
+  return traverse<true>(ray, hit, nullptr);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// Uniform points over the scene surface
+//
+std::vector<glm::vec3> CpuBvh::sampleSurface(uint32_t numPoints, uint32_t seed) const
+{
+  std::vector<glm::vec3> points;
+  if(empty() || numPoints == 0)
+    return points;
+
+  // Triangle picked from the area CDF, then a uniform point on it
+  std::vector<double> cdf(m_triangles.size());
+  double              area = 0.0;
+  for(size_t i = 0; i < m_triangles.size(); i++)
+  {
+    area += 0.5 * glm::length(glm::cross(m_triangles[i].e1, m_triangles[i].e2));
+    cdf[i] = area;
+  }
+  if(area <= 0.0)
+    return points;
+
+  std::mt19937                          rng(seed);
+  std::uniform_real_distribution<float> uni(0.f, 1.f);
+  points.reserve(numPoints);
+  for(uint32_t i = 0; i < numPoints; i++)
+  {
+    const double    target = std::uniform_real_distribution<double>(0.0, area)(rng);
+    const size_t    index  = std::min(size_t(std::upper_bound(cdf.begin(), cdf.end(), target) - cdf.begin()), cdf.size() - 1);
+    const Triangle& tri    = m_triangles[index];
+    float           u = uni(rng), v = uni(rng);
+    if(u + v > 1.f)
+    {
+      u = 1.f - u;
+      v = 1.f - v;
+    }
+    points.push_back(tri.v0 + tri.e1 * u + tri.e2 * v);
+  }
+  return points;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Throughput on incoherent rays: origins uniform in the scene bounds, uniform directions. This is
+// the worst case for the tree, camera rays are faster.
+//
+void CpuBvh::benchmark(uint32_t numRays, uint32_t numThreads) const
+{
+  if(empty() || numRays == 0)
+    return;
+  numThreads = std::max(numThreads, 1u);
+
+  std::mt19937                          rng(4321);
+  std::uniform_real_distribution<float> uni(0.f, 1.f);
+  std::vector<Ray>                      rays(numRays);
+  for(auto& ray : rays)
+  {
+    ray.origin      = m_boundsMin + (m_boundsMax - m_boundsMin) * glm::vec3(uni(rng), uni(rng), uni(rng));
+    const float z   = 1.f - 2.f * uni(rng);
+    const float r   = std::sqrt(std::max(0.f, 1.f - z * z));
+    const float phi = 6.28318530718f * uni(rng);
+    ray.direction   = {r * std::cos(phi), r * std::sin(phi), z};
+  }
+
+  std::vector<Hit>     hits(numRays);
+  std::vector<uint8_t> closest(numRays), anyHit(numRays);
+
+  MilliTimer timer;
+  nvh::parallel_batches<256>(
+      numRays, [&](uint64_t i) { closest[i] = intersect(rays[i], hits[i]) ? 1 : 0; }, numThreads);
+  const double closestTime = timer.elapsed();
+
+  timer.reset();
+  nvh::parallel_batches<256>(
+      numRays, [&](uint64_t i) { anyHit[i] = occluded(rays[i]) ? 1 : 0; }, numThreads);
+  const double occludedTime = timer.elapsed();
+
+  uint32_t numHits = 0, anyMismatch = 0;
+  for(uint32_t i = 0; i < numRays; i++)
+  {
+    numHits += closest[i];
+    anyMismatch += closest[i] != anyHit[i] ? 1 : 0;
+  }
+
+  // Brute force on a subset, kept around 2e8 triangle tests
+  const auto numCheck = static_cast<uint32_t>(
+      std::min<size_t>(numRays, std::clamp<size_t>(size_t(2e8) / m_triangles.size(), 16, 256)));
+  uint32_t matches = 0;
+  for(uint32_t i = 0; i < numCheck; i++)
+  {
+    float    best = rays[i].tMax;
+    bool     any  = false;
+    for(uint32_t tri = 0; tri < m_triangles.size(); tri++)
+    {
+      float t, u, v;
+      if(intersectTriangle(rays[i], tri, best, t, u, v))
+      {
+        best = t;
+        any  = true;
+      }
+    }
+    if(any == bool(closest[i]) && (!any || std::abs(best - hits[i].t) <= 1e-4f * std::max(1.f, best)))
+      matches++;
+  }
+
+  LOGI("CPU BVH benchmark: %u rays, %u threads, %.1f%% hit\n", numRays, numThreads, 100.f * numHits / numRays);
+  LOGI("  closest hit: %.2f Mrays/s, occlusion: %.2f Mrays/s, %u any-hit mismatches\n",
+       numRays / (closestTime * 1000.0), numRays / (occludedTime * 1000.0), anyMismatch);
+  LOGI("  brute force: %u / %u rays match, build %.2f ms\n", matches, numCheck, m_buildTime);
+}
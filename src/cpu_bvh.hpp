@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include "nvh/gltfscene.hpp"
+
+//--------------------------------------------------------------------------------------------------
+// Bounding volume hierarchy of the scene triangles on the host, for queries that should not wait
+// on the GPU (picking, camera fitting, visibility tests, offline tools).
+// - Binned SAH build, subtrees are built in parallel
+// - The binary tree is collapsed into a 4-wide BVH, the four child boxes are tested at once with
+//   SSE (scalar fallback on other targets)
+// - Triangles are stored in world space, hits report the glTF node and the triangle in its mesh
+// - Moved nodes are refit: their triangles are transformed again and the boxes grown bottom-up,
+//   the topology is kept, so the tree gets slower after large moves until the next build
+//
+class CpuBvh
+{
+public:
+  struct Ray
+  {
+    glm::vec3 origin{0.f};
+    float     tMin{0.f};
+    glm::vec3 direction{0.f, 0.f, 1.f};
+    float     tMax{1e32f};
+  };
+
+  struct Hit
+  {
+    float    t{0.f};
+    float    u{0.f}, v{0.f};  // Barycentrics of v1 and v2
+    uint32_t node{0};         // Index in GltfScene::m_nodes, same as the TLAS instance
+    uint32_t triangle{0};     // Triangle in the primitive mesh of the node
+    glm::vec3 normal{0.f};    // Geometric normal in world space, winding order, not facing the ray
+  };
+
+  void build(const nvh::GltfScene& gltf, uint32_t numThreads = std::thread::hardware_concurrency());
+  void clear();
+  // Triangles of `nodes` from their current world matrix, then the boxes of the whole tree
+  void refit(const nvh::GltfScene& gltf, const std::vector<uint32_t>& nodes);
+
+  // Closest hit within [tMin, tMax]
+  bool intersect(const Ray& ray, Hit& hit) const;
+  // Same, with the index of every node popped appended to `visited`, for the coherence of ray batches
+  bool intersect(const Ray& ray, Hit& hit, std::vector<uint32_t>& visited) const;
+  // Any hit within [tMin, tMax], for shadow and visibility queries
+  bool occluded(const Ray& ray) const;
+
+  bool      empty() const { return m_nodes.empty(); }
+  size_t    getTriangleCount() const { return m_triangles.size(); }
+  size_t    getNodeCount() const { return m_nodes.size(); }
+  double    getBuildTime() const { return m_buildTime; }  // ms
+  // FNV-1a of the world space triangles in glTF node order: the same scene and node transforms give
+  // the same value from one launch to the next (SurfelCache)
+  uint64_t  getGeometryHash() const { return m_geometryHash; }
+  glm::vec3 getBoundsMin() const { return m_boundsMin; }
+  glm::vec3 getBoundsMax() const { return m_boundsMax; }
+
+  // Points spread uniformly over the triangle area, for statistics on where the geometry lies
+  std::vector<glm::vec3> sampleSurface(uint32_t numPoints, uint32_t seed = 1) const;
+
+  // Closest hit and occlusion throughput on random rays through the scene bounds, multithreaded,
+  // and a check of the first rays against brute force. Results go to the log.
+  void benchmark(uint32_t numRays = 1 << 20, uint32_t numThreads = std::thread::hardware_concurrency()) const;
+
+private:
+  // Triangle ready for Moller-Trumbore
+  struct Triangle
+  {
+    glm::vec3 v0, e1, e2;
+  };
+
+  struct TriangleId
+  {
+    uint32_t node;
+    uint32_t triangle;
+  };
+
+  // Four children, bounds in SoA for the SIMD test. A child with count > 0 is a leaf holding the
+  // triangles [child, child + count), count == 0 is an inner node, child < 0 is an empty slot.
+  struct alignas(16) Node4
+  {
+    float   bmin[3][4];
+    float   bmax[3][4];
+    int32_t child[4];
+    int32_t count[4];
+  };
+
+  struct BinaryNode;
+  struct BuildContext;
+
+  void refitNode(uint32_t index, glm::vec3& bmin, glm::vec3& bmax);
+  void hashGeometry();
+  bool intersectTriangle(const Ray& ray, uint32_t index, float tMax, float& t, float& u, float& v) const;
+  template <bool AnyHit>
+  bool traverse(const Ray& ray, Hit& hit, std::vector<uint32_t>* visited) const;
+
+  std::vector<Node4>      m_nodes;
+  std::vector<Triangle>   m_triangles;  // In leaf order
+  std::vector<TriangleId> m_triangleIds;
+  std::vector<uint32_t>   m_nodeOffset;  // First triangle of each glTF node, in node order
+  std::vector<uint32_t>   m_leafSlot;    // Node order -> leaf order, for the refit
+  glm::vec3               m_boundsMin{0.f};
+  glm::vec3               m_boundsMax{0.f};
+  double                  m_buildTime{0.0};
+  uint64_t                m_geometryHash{0};
+};
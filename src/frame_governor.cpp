@@ -0,0 +1,184 @@
+#include "frame_governor.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <sstream>
+
+#include <glm/glm.hpp>
+#include "nvh/nvprint.hpp"
+#include "shaders/host_device.h"
+
+
+void FrameGovernor::reset(uint32_t maxRayCount)
+{
+  m_maxRayCount = maxRayCount;
+  m_overFrames  = 0;
+  m_underFrames = 0;
+  m_holdFrames  = 0;
+  setScale(1.f);
+}
+
+void FrameGovernor::setScale(float scale)
+{
+  m_state.scale                = scale;
+  m_state.rayBudget            = std::max(uint32_t(double(m_maxRayCount) * scale), 1u);
+  m_state.reflectionCandidates = std::clamp(int(std::lround(kMaxReflectionCandidates * scale)), 1, kMaxReflectionCandidates);
+  m_state.spawnRate            = std::min(scale * 2.f, 1.f);
+}
+
+bool FrameGovernor::update(const Timings& timings)
+{
+  if(m_record.is_open())
+    m_record << timings.frame << ' ' << timings.surfels << ' ' << timings.reflection << ' ' << m_state.scale << '\n';
+
+  if(!m_settings.enabled)
+  {
+    const bool changed = m_state.scale != 1.f;
+    reset(m_maxRayCount);
+    return changed;
+  }
+  if(m_holdFrames > 0)
+  {
+    m_holdFrames--;
+    return false;
+  }
+
+  // Hysteresis: inside the band nothing moves, out of it only after settleFrames frames in a row
+  const float target = m_settings.targetMs;
+  const bool  over   = timings.frame > target * (1.f + m_settings.band);
+  const bool  under  = timings.frame < target * (1.f - m_settings.band);
+  m_overFrames       = over ? m_overFrames + 1 : 0;
+  m_underFrames      = under ? m_underFrames + 1 : 0;
+  if(std::max(m_overFrames, m_underFrames) < m_settings.settleFrames)
+    return false;
+  m_overFrames  = 0;
+  m_underFrames = 0;
+
+  // The rest of the frame does not scale, the two passes get what it leaves of the target. Their
+  // times are taken to follow the scale, the step is bounded for the times that do not.
+  const float scaled = timings.surfels + timings.reflection;
+  if(scaled <= 0.f)
+    return false;
+  const float factor = std::clamp((target - (timings.frame - scaled)) / scaled, m_settings.maxStepDown, m_settings.maxStepUp);
+  const float scale = std::clamp(m_state.scale * factor, m_settings.minScale, 1.f);
+  if(scale == m_state.scale)
+    return false;
+
+  setScale(scale);
+  m_holdFrames = m_settings.holdFrames;
+  return true;
+}
+
+bool FrameGovernor::record(const std::string& filename)
+{
+  m_record.open(filename);
+  if(!m_record)
+  {
+    LOGE("Frame governor: cannot write %s\n", filename.c_str());
+    return false;
+  }
+  m_record << "# frame_ms surfels_ms reflection_ms scale\n";
+  return true;
+}
+
+bool FrameGovernor::loadTrace(const std::string& filename, std::vector<TraceFrame>& trace)
+{
+  std::ifstream file(filename);
+  if(!file)
+  {
+    LOGE("Frame governor: cannot open %s\n", filename.c_str());
+    return false;
+  }
+
+  trace.clear();
+  std::string line;
+  for(uint32_t lineIndex = 1; std::getline(file, line); lineIndex++)
+  {
+    line = line.substr(0, line.find('#'));
+    std::istringstream stream(line);
+    TraceFrame         frame;
+    if(!(stream >> frame.timings.frame))
+      continue;
+    if(!(stream >> frame.timings.surfels >> frame.timings.reflection >> frame.scale) || frame.scale <= 0.f)
+    {
+      LOGE("Frame governor: %s:%u expects <frame ms> <surfels ms> <reflection ms> <scale>\n", filename.c_str(), lineIndex);
+      return false;
+    }
+    trace.push_back(frame);
+  }
+  return true;
+}
+
+bool FrameGovernor::replay(const std::vector<TraceFrame>& trace, uint32_t maxRayCount)
+{
+  const bool enabled = m_settings.enabled;
+  m_settings.enabled = true;
+  reset(maxRayCount);
+  if(trace.empty())
+    return true;
+
+  const float high = m_settings.targetMs * (1.f + m_settings.band);
+  const float low  = m_settings.targetMs * (1.f - m_settings.band);
+
+  std::deque<Timings> window;
+  Timings             sum;
+  uint32_t            steps = 0, reversals = 0, overFrames = 0, underFrames = 0;
+  int                 lastDirection = 0;
+  double              total = 0.0, tail = 0.0;
+  float               lowestScale = 1.f;
+  const size_t        tailStart   = trace.size() - trace.size() / 4;
+  for(size_t i = 0; i < trace.size(); i++)
+  {
+    // The frame at the current scale
+    const TraceFrame& recorded = trace[i];
+    const float       ratio    = m_state.scale / recorded.scale;
+    Timings           frame;
+    frame.surfels    = recorded.timings.surfels * ratio;
+    frame.reflection = recorded.timings.reflection * ratio;
+    frame.frame      = recorded.timings.frame - recorded.timings.surfels - recorded.timings.reflection + frame.surfels + frame.reflection;
+
+    total += frame.frame;
+    tail += i >= tailStart ? frame.frame : 0.0;
+    overFrames += frame.frame > high ? 1 : 0;
+    underFrames += frame.frame < low ? 1 : 0;
+
+    // What the profiler would report
+    window.push_back(frame);
+    sum.frame += frame.frame;
+    sum.surfels += frame.surfels;
+    sum.reflection += frame.reflection;
+    if(window.size() > kProfilerAveraging)
+    {
+      sum.frame -= window.front().frame;
+      sum.surfels -= window.front().surfels;
+      sum.reflection -= window.front().reflection;
+      window.pop_front();
+    }
+    const float n = float(window.size());
+
+    const float previous = m_state.scale;
+    if(update({sum.frame / n, sum.surfels / n, sum.reflection / n}))
+    {
+      const int direction = m_state.scale > previous ? 1 : -1;
+      reversals += lastDirection != 0 && direction != lastDirection ? 1 : 0;
+      lastDirection = direction;
+      steps++;
+    }
+    lowestScale = std::min(lowestScale, m_state.scale);
+  }
+
+  // Out of the band at the end is only fine with the scale against the side it would move to
+  const float tailMean = float(tail / double(trace.size() - tailStart));
+  const bool  pinned   = (tailMean > high && m_state.scale <= m_settings.minScale) || (tailMean < low && m_state.scale >= 1.f);
+  const bool  settled  = (tailMean >= low && tailMean <= high) || pinned;
+  const bool  stable   = reversals * 2 <= steps;
+  m_settings.enabled   = enabled;
+
+  LOGI("Frame governor replay: %zu frames, target %.2f ms (%.2f to %.2f)\n", trace.size(), m_settings.targetMs, low, high);
+  LOGI("  mean %.2f ms, last quarter %.2f ms%s, %u frames over and %u under the band\n", total / double(trace.size()),
+       tailMean, pinned ? " (scale at its bound)" : "", overFrames, underFrames);
+  LOGI("  %u steps, %u reversals, scale lowest %.3f last %.3f: %u rays, %d reflection candidates, spawn rate %.2f\n",
+       steps, reversals, lowestScale, m_state.scale, m_state.rayBudget, m_state.reflectionCandidates, m_state.spawnRate);
+  return settled && stable;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+//--------------------------------------------------------------------------------------------------
+// Holds a target GPU frame time by scaling the work of the surfel and reflection passes, once per
+// frame from the times of the profiler sections:
+// - the rays surfel_ray_budget.comp grants (RtxState::surfelRayBudget)
+// - the BSDF candidates of the reflection rays (RtxState::reflectionCandidates)
+// - the chance to spawn surfels (RtxState::surfelSpawnRate), cut once the rays are below half
+// All three follow one quality scale. It only moves after the frame time stayed out of the band
+// around the target for settleFrames frames, then waits holdFrames frames for the profiler
+// averages to catch up with the step before looking again.
+//
+class FrameGovernor
+{
+public:
+  // Frames the profiler averages its sections over, nvh::Profiler::setAveragingSize
+  static constexpr uint32_t kProfilerAveraging = 16;
+
+  struct Settings
+  {
+    bool     enabled{false};                    // Full quality when off, the trace is still recorded
+    float    targetMs{16.6f};
+    float    band{0.08f};                       // Fraction of the target the frame time drifts either way
+    uint32_t settleFrames{8};                   // Frames out of the band before a step
+    uint32_t holdFrames{kProfilerAveraging};    // Frames after a step before the next one
+    float    maxStepDown{0.5f};                 // Smallest factor of one step
+    float    maxStepUp{1.15f};                  // Largest factor of one step, slower than down
+    float    minScale{0.1f};
+  };
+
+  struct Timings  // GPU ms
+  {
+    float frame{0.f};       // Every section of the frame
+    float surfels{0.f};     // "Surfel Calculate"
+    float reflection{0.f};  // "Compute Reflection"
+  };
+
+  // One frame of a recorded trace, with the scale the timings were measured at
+  struct TraceFrame
+  {
+    Timings timings;
+    float   scale{1.f};
+  };
+
+  struct State
+  {
+    float    scale{1.f};
+    uint32_t rayBudget{0};
+    int      reflectionCandidates{0};
+    float    spawnRate{1.f};
+  };
+
+  // Full quality, the budget being all of maxRayCount
+  void reset(uint32_t maxRayCount);
+  // One step per frame, true when the state changed
+  bool update(const Timings& timings);
+  const State& getState() const { return m_state; }
+
+  // Appends every Timings given to update to a text trace, one frame per line
+  bool record(const std::string& filename);
+  static bool loadTrace(const std::string& filename, std::vector<TraceFrame>& trace);
+
+  // Runs the governor over a trace as if it had been in charge: the surfel and reflection times
+  // follow the scale linearly from the one they were recorded at, and the governor sees them
+  // through the kProfilerAveraging frame average. Steps, reversals of direction and frames out of
+  // the band go to the log. Returns false when the last quarter of the trace stays out of the
+  // band with room left to scale, or when more than half of the steps reverse the last one.
+  bool replay(const std::vector<TraceFrame>& trace, uint32_t maxRayCount);
+
+  Settings m_settings;
+
+private:
+  void setScale(float scale);
+
+  State         m_state;
+  uint32_t      m_maxRayCount{0};
+  uint32_t      m_overFrames{0};
+  uint32_t      m_underFrames{0};
+  uint32_t      m_holdFrames{0};
+  std::ofstream m_record;
+};
@@ -33,6 +33,7 @@
 #include "nvvk/commands_vk.hpp"
 #include "nvh/fileoperations.hpp"
 #include "hdr_sampling.hpp"
+#include "spherical_harmonics.hpp"
 
 
 void HdrSampling::setup(const VkDevice& device, const VkPhysicalDevice& physicalDevice, uint32_t familyIndex, nvvk::ResourceAllocator* allocator)
@@ -53,7 +54,7 @@ void HdrSampling::destroy()
 //--------------------------------------------------------------------------------------------------
 // Loading the HDR environment texture (HDR) and create the important accel structure
 //
-void HdrSampling::loadEnvironment(const std::string& hrdImage)
+void HdrSampling::loadEnvironment(const std::string& hrdImage, bool validateSH /*= false*/)
 {
   destroy();
 
@@ -88,12 +89,16 @@ void HdrSampling::loadEnvironment(const std::string& hrdImage)
     m_texHdr                        = m_alloc->createTexture(image, ivInfo, samplerCreateInfo);
     NAME_VK(m_texHdr.image);
 
-    auto envAccel  = createEnvironmentAccel(pixels, imgSize);
+    auto envAccel  = createEnvironmentAccel(pixels, imgSize, m_integral, m_average);
     m_accelImpSmpl = m_alloc->createBuffer(cmdBuf, envAccel, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
     NAME_VK(m_accelImpSmpl.buffer);
   }
   m_alloc->finalizeAndReleaseStaging();
 
+  // Irradiance SH of the environment, checked against a brute-force integration on request
+  m_envSH = EnvSHProjection::projectLatLong(pixels, imgSize.width, imgSize.height);
+  if(validateSH)
+    EnvSHProjection::validate(m_envSH, pixels, imgSize.width, imgSize.height);
 
   stbi_image_free(pixels);
 }
@@ -184,7 +189,7 @@ inline float luminance(const float* color)
 //--------------------------------------------------------------------------------------------------
 // Create acceleration data for importance sampling
 // See:  https://arxiv.org/pdf/1901.05423.pdf
-std::vector<EnvAccel> HdrSampling::createEnvironmentAccel(const float* pixels, VkExtent2D& size)
+std::vector<EnvAccel> HdrSampling::createEnvironmentAccel(const float* pixels, const VkExtent2D& size, float& integral, float& average)
 {
   const uint32_t rx = size.width;
   const uint32_t ry = size.height;
@@ -218,16 +223,16 @@ std::vector<EnvAccel> HdrSampling::createEnvironmentAccel(const float* pixels, V
     }
   }
 
-  m_average = static_cast<float>(total) / static_cast<float>(rx * ry);
+  average = static_cast<float>(total) / static_cast<float>(rx * ry);
 
   // Build the alias map, which aims at creating a set of texel couples
   // so that all couples emit roughly the same amount of energy. To this aim,
   // each smaller radiance texel will be assigned an "alias" with higher emitted radiance
   // As a byproduct this function also returns the integral of the radiance emitted by the environment
-  m_integral = buildAliasmap(importanceData, envAccel);
+  integral = buildAliasmap(importanceData, envAccel);
 
   // We deduce the PDF of each texel by normalizing its emitted radiance by the radiance integral
-  const float invEnvIntegral = 1.0f / m_integral;
+  const float invEnvIntegral = 1.0f / integral;
   for(uint32_t i = 0; i < rx * ry; ++i)
   {
     const uint32_t idx4 = i * 4;
@@ -39,17 +39,21 @@ public:
   HdrSampling() = default;
 
   void setup(const VkDevice& device, const VkPhysicalDevice& physicalDevice, uint32_t familyIndex, nvvk::ResourceAllocator* allocator);
-  void loadEnvironment(const std::string& hrdImage);
+  void loadEnvironment(const std::string& hrdImage, bool validateSH = false);
 
 
   void  destroy();
   float getIntegral() { return m_integral; }
   float getAverage() { return m_average; }
+  const EnvSH& getEnvSH() { return m_envSH; }
 
   // Resources
   nvvk::Texture m_texHdr;
   nvvk::Buffer  m_accelImpSmpl;
 
+  // Importance sampling data of any lat-long RGBA32F image, also used for the baked sky (SkyLut)
+  static std::vector<EnvAccel> createEnvironmentAccel(const float* pixels, const VkExtent2D& size, float& integral, float& average);
+
 private:
   VkDevice                 m_device{VK_NULL_HANDLE};
   uint32_t                 m_familyIndex{0};
@@ -58,8 +62,8 @@ private:
 
   float m_integral{1.f};
   float m_average{1.f};
+  EnvSH m_envSH{};  // Irradiance SH of the map, seeds new surfels
 
 
-  float                 buildAliasmap(const std::vector<float>& data, std::vector<EnvAccel>& accel);
-  std::vector<EnvAccel> createEnvironmentAccel(const float* pixels, VkExtent2D& size);
+  static float buildAliasmap(const std::vector<float>& data, std::vector<EnvAccel>& accel);
 };
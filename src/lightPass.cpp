@@ -7,6 +7,7 @@
 #include "nvvk/renderpasses_vk.hpp"
 
 #include "scene.hpp"
+#include "surfel_specialization.hpp"
 
 #include "autogen/passthrough.vert.h"
 #include "autogen/lightPass.frag.h"
@@ -65,7 +66,8 @@ void LightPass::create(const VkExtent2D& size, const std::vector<VkDescriptorSet
 	nvvk::GraphicsPipelineGeneratorCombined pipelineGenerator(m_device, m_pipelineLayout, m_renderPass);
 	pipelineGenerator.setPipelineRenderingCreateInfo(prend_info);
 	pipelineGenerator.addShader(vertexShader, VK_SHADER_STAGE_VERTEX_BIT);
-	pipelineGenerator.addShader(fragShader, VK_SHADER_STAGE_FRAGMENT_BIT);
+	SurfelSpecialization specialization;
+	pipelineGenerator.addShader(fragShader, VK_SHADER_STAGE_FRAGMENT_BIT).pSpecializationInfo = specialization.getInfo();
 
 	pipelineGenerator.setBlendAttachmentState(0, pipelineGenerator.makePipelineColorBlendAttachmentState(0xf, VK_FALSE));
 	pipelineGenerator.rasterizationState.cullMode = VK_CULL_MODE_FRONT_BIT;
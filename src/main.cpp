@@ -17,6 +17,7 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <algorithm>
 #include <thread>
 #include <iostream>
 
@@ -30,6 +31,8 @@
 #include "nvpsystem.hpp"
 #include "nvvk/context_vk.hpp"
 #include "sample_example.hpp"
+#include "frame_governor.hpp"
+#include "surfel_config.hpp"
 
 // Default search path for shaders
 std::vector<std::string> defaultSearchPaths;
@@ -66,6 +69,12 @@ int main(int argc, char **argv)
 
   std::string hdrFilename = parser.getString("-e", "std_env.hdr");
 
+  // Memory budget in MB of one submission of BLAS builds (scratch + uncompacted structures of the
+  // batch being built and of the previous batch being compacted)
+  int blasBudgetMB = std::max(parser.getInt("-blasbudget", 256), 1);
+  // Memory in MB kept for BLAS of previously loaded scenes, reused when the geometry matches
+  int blasCacheMB = std::max(parser.getInt("-blascache", 512), 0);
+
   // Setup GLFW window
   glfwSetErrorCallback(onErrorCallback);
   if (glfwInit() == GLFW_FALSE)
@@ -97,6 +106,28 @@ int main(int argc, char **argv)
       NVPSystem::exePath() + PROJECT_DOWNLOAD_RELDIRECTORY,
   };
 
+  // Surfel capacity and grid: config file, then the command line, applied before any surfel
+  // resource or pipeline exists
+  SurfelConfig surfelConfig;
+  if(parser.exist("-surfelconfig")
+     && !surfelConfig.load(nvh::findFile(parser.getString("-surfelconfig"), defaultSearchPaths, true)))
+    return 1;
+  if(!surfelConfig.parse(parser) || !surfelConfig.validate())
+    return 1;
+  surfelConfig.apply();
+  surfelConfig.print();
+
+  // Frame governor: replay of a recorded trace without opening a window, or a target frame time
+  // and a trace recorded while running
+  if(parser.exist("-governorreplay"))
+  {
+    std::vector<FrameGovernor::TraceFrame> trace;
+    FrameGovernor                          governor;
+    governor.m_settings.targetMs = parser.getFloat("-governor", governor.m_settings.targetMs);
+    const bool valid = FrameGovernor::loadTrace(parser.getString("-governorreplay"), trace);
+    return valid && governor.replay(trace, surfel_spec::kMaxRayCount) ? 0 : 1;
+  }
+
   // Vulkan required extensions
   assert(glfwVulkanSupported() == 1);
   uint32_t count{0};
@@ -184,6 +215,25 @@ int main(int argc, char **argv)
   ImGui::GetIO().MouseDoubleClickMaxDist = 2.0f; // Default: 6.0
 
   // Creation of the example - loading scene in separate thread
+  sample.m_accelStruct.setBlasMemoryBudget(VkDeviceSize(blasBudgetMB) << 20);
+  sample.m_accelStruct.setBlasCacheBudget(VkDeviceSize(blasCacheMB) << 20);
+  sample.m_cpuBvhBenchmark = parser.exist("-bvhbench");
+  sample.m_envValidation   = parser.exist("-envcheck");
+  sample.m_surfelReferenceFrames = std::max(parser.getInt("-surfelref", 0), 0);
+  sample.m_surfelCache = parser.exist("-surfelcache");
+  if(parser.exist("-governor"))
+  {
+    sample.m_governor.m_settings.enabled  = true;
+    sample.m_governor.m_settings.targetMs = std::max(parser.getFloat("-governor", 16.6f), 1.f);
+  }
+  if(parser.exist("-governorrecord") && !sample.m_governor.record(parser.getString("-governorrecord")))
+    return 1;
+  if(parser.exist("-gridocc"))
+  {
+    sample.m_gridOccupancy = true;
+    if(!sample.m_gridCandidate.load(nvh::findFile(parser.getString("-gridocc"), defaultSearchPaths, true)))
+      return 1;
+  }
   sample.loadEnvironmentHdr(nvh::findFile(hdrFilename, defaultSearchPaths, true));
   sample.m_busy = true;
   std::thread([&]
@@ -194,6 +244,8 @@ int main(int argc, char **argv)
     sample.createDescriptorSetLayout();
     sample.createRender(SampleExample::eRayQuery);
     sample.createSurfelResources();
+    if(sample.m_surfelCache)
+      sample.loadSurfelCache();
     sample.resetFrame();
 	//sample.createLightPass(); // this function is called in sample.createSurfelResources() to load gbuffer resources
     sample.m_busy = false; })
@@ -208,6 +260,7 @@ int main(int argc, char **argv)
   std::string profilerStats;
   profiler.init(vkctx.m_device, vkctx.m_physicalDevice, vkctx.m_queueGCT.familyIndex);
   profiler.setLabelUsage(true); // depends on VK_EXT_debug_utils
+  profiler.setAveragingSize(FrameGovernor::kProfilerAveraging); // the governor reacts to these averages
 
   // Used for Live Demo
   // Press any keys to continue the program
@@ -231,6 +284,7 @@ int main(int argc, char **argv)
     profiler.beginFrame(); // GPU performance timer
     sample.prepareFrame(); // Waits for a framebuffer to be available
     sample.updateFrame();  // Increment/update rendering frame count
+    sample.updateSurfelCapacity();  // Grows the surfel buffers the last frames overflowed
 
     // Start command buffer of this frame
     auto curFrame = sample.getCurFrame();
@@ -241,6 +295,7 @@ int main(int argc, char **argv)
     vkBeginCommandBuffer(cmdBuf, &beginInfo);
 
     sample.renderGui(profiler);         // UI
+    sample.updateGovernor(profiler);    // Ray budget of the frame
     sample.updateUniformBuffer(cmdBuf); // Updating UBOs
 
     // Rendering Scene (ray tracing)
@@ -248,6 +303,9 @@ int main(int argc, char **argv)
 
     if (!sample.m_busy)
     {
+      // Refit the TLAS with the instances moved since last frame
+      sample.m_accelStruct.updateTopLevelAS(cmdBuf, profiler);
+
       // Run gbuffer pass
       {
         auto sec = profiler.timeRecurring("Gbuffer", cmdBuf);
@@ -316,6 +374,8 @@ int main(int argc, char **argv)
 
   // Cleanup
   vkDeviceWaitIdle(sample.getDevice());
+  if(sample.m_surfelCache && !sample.isBusy())
+    sample.saveSurfelCache();
   glfwDestroyWindow(window);
   sample.destroyResources();
   sample.destroy();
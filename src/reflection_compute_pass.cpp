@@ -5,6 +5,7 @@
 #include "nvh/fileoperations.hpp"
 #include "nvvk/shaders_vk.hpp"
 #include "scene.hpp"
+#include "surfel_specialization.hpp"
 #include "tools.hpp"
 #include "nvvk/commands_vk.hpp"
 #include "shaders/host_device.h"
@@ -66,6 +67,9 @@ void ReflectionComputePass::create(const VkExtent2D& fullSize, const std::vector
 	computePipelineCreateInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
 	computePipelineCreateInfo.stage.pName = "main";
 
+	SurfelSpecialization specialization;
+	computePipelineCreateInfo.stage.pSpecializationInfo = specialization.getInfo();
+
 	vkCreateComputePipelines(m_device, {}, 1, &computePipelineCreateInfo, nullptr, &m_pipeline);
 
 	m_debug.setObjectName(m_pipeline, "Reflection Compute Pass");
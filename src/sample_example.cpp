@@ -23,6 +23,7 @@
  */
 
 #include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
 
 #include <filesystem>
 #include <thread>
@@ -35,6 +36,9 @@
 #include "sample_example.hpp"
 #include "sample_gui.hpp"
 #include "tools.hpp"
+#include "spherical_harmonics.hpp"
+#include "surfel_cache.hpp"
+#include "surfel_reference.hpp"
 
 #include "nvml_monitor.hpp"
 
@@ -62,7 +66,6 @@ void SampleExample::setup(const VkInstance&               instance,
   m_debug.setup(m_device);
 
   // Compute queues can be use for acceleration structures
-  m_picker.setup(m_device, physicalDevice, queues[eCompute].familyIndex, &m_alloc);
   m_accelStruct.setup(m_device, physicalDevice, queues[eCompute].familyIndex, &m_alloc);
 
   // Note: the GTC family queue is used because the nvvk::cmdGenerateMipmaps uses vkCmdBlitImage and this
@@ -72,12 +75,16 @@ void SampleExample::setup(const VkInstance&               instance,
   // Transfer queues can be use for the creation of the following assets
   m_offscreen.setup(m_device, physicalDevice, queues[eTransfer].familyIndex, &m_alloc);
   m_skydome.setup(device, physicalDevice, queues[eTransfer].familyIndex, &m_alloc);
+  m_skyLut.setup(device, queues[eTransfer].familyIndex, &m_alloc);
 
   m_surfel.setup(m_device, physicalDevice, queues, &m_alloc);
   m_gbufferPass.setup(m_device, physicalDevice, queues[eGCT0].familyIndex, &m_alloc);
   m_surfelPreparePass.setup(m_device, physicalDevice, queues[eGCT0].familyIndex, &m_alloc);
   m_surfelGenerationPass.setup(m_device, physicalDevice, queues[eGCT0].familyIndex, &m_alloc);
   m_surfelUpdatePass.setup(m_device, physicalDevice, queues[eGCT0].familyIndex, &m_alloc);
+  m_surfelRayBudgetPass.setup(m_device, physicalDevice, queues[eGCT0].familyIndex, &m_alloc);
+  m_surfelSortPass.setup(m_device, physicalDevice, queues[eGCT0].familyIndex, &m_alloc);
+  m_surfelDispatchArgsPass.setup(m_device);
   m_cellInfoUpdatePass.setup(m_device, physicalDevice, queues[eGCT0].familyIndex, &m_alloc);
   m_cellToSurfelUpdatePass.setup(m_device, physicalDevice, queues[eGCT0].familyIndex, &m_alloc);
   m_surfelRaytracePass.setup(m_device, physicalDevice, queues[eGCT0].familyIndex, &m_alloc);
@@ -98,6 +105,7 @@ void SampleExample::setup(const VkInstance&               instance,
     r->setup(m_device, physicalDevice, queues[eTransfer].familyIndex, &m_alloc);
   }
   m_rtxState.totalFrames = 0;
+  m_governor.reset(surfel_spec::kMaxRayCount);
 }
 
 
@@ -108,13 +116,124 @@ void SampleExample::setup(const VkInstance&               instance,
 void SampleExample::loadScene(const std::string& filename)
 {
   m_scene.load(filename);
-  m_accelStruct.create(m_scene.getScene(), m_scene.getBuffers(Scene::eVertex), m_scene.getBuffers(Scene::eIndex));
+  m_pickedNode      = -1;
+  m_surfelCacheFile = SurfelCache::getFilename(filename);
+  m_accelStruct.create(m_scene.getScene(), m_scene.getBuffers(Scene::eVertex), m_scene.getBuffers(Scene::eIndex),
+                       m_scene.getGeometryKeys());
+  if(m_cpuBvhBenchmark)
+    m_scene.getCpuBvh().benchmark();
+  if(m_gridOccupancy)
+  {
+    glm::vec3 eye, center, up;
+    CameraManip.getLookat(eye, center, up);
+    SurfelReference::evaluateGridOccupancy(m_scene.getCpuBvh(), SurfelConfig(), eye);
+    SurfelReference::evaluateGridOccupancy(m_scene.getCpuBvh(), m_gridCandidate, eye);
+  }
+  if(m_surfelReferenceFrames > 0)
+    runSurfelReference();
+  resetFrame();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Surfel GI frames on the CPU from the current camera (see SurfelReference), the timings and the
+// broken invariants go to the log. The tests of its units are in tests/, run by ctest.
+// Seeded with the sun & sky SH, the HDR one lives on the GPU.
+//
+void SampleExample::runSurfelReference()
+{
+  SurfelReference::Settings settings;
+  settings.width                 = m_size.width;
+  settings.height                = m_size.height;
+  settings.fireflyClampThreshold = m_rtxState.fireflyClampThreshold;
+  settings.hdrMultiplier         = m_rtxState.hdrMultiplier;
+  settings.cellHash              = m_rtxState.cellHash != 0;
+  settings.cellPatching          = m_cellPatching;
+  settings.updateFraction        = m_rtxState.surfelUpdateFraction;
+  settings.sortInterval          = uint32_t(std::max(m_surfelSortInterval, 0));
+  settings.rayBinning            = m_rtxState.surfelRayBinning != 0;
+
+  SurfelReference reference;
+  reference.setup(&m_scene.getCpuBvh(), settings);
+
+  float aspectRatio = m_size.width / static_cast<float>(m_size.height);
+  auto  camera      = SurfelReference::makeCamera(CameraManip.getMatrix(), CameraManip.getFov(), aspectRatio);
+  EnvSH envSH       = EnvSHProjection::projectSunAndSky(m_sunAndSky);
+  envSH.coeffs[0].w = m_surfelSHSeed ? 1.f : 0.f;
+  if(!reference.run(camera, m_sunAndSky, envSH, m_surfelReferenceFrames))
+    LOGE("Surfel reference: frames with broken invariants, see above\n");
+}
+
+//--------------------------------------------------------------------------------------------------
+// Surfels of the scene kept in m_surfelCacheFile (see SurfelCache), between frames. A file made for
+// other geometry or by another build is left as it is.
+//
+bool SampleExample::saveSurfelCache()
+{
+  if(m_surfelCacheFile.empty())
+    return false;
+
+  MilliTimer timer;
+  vkDeviceWaitIdle(m_device);
+  SurfelCache cache;
+  cache.sceneHash = m_scene.getCpuBvh().getGeometryHash();
+  m_surfel.saveCache(cache);
+  if(!cache.save(m_surfelCacheFile))
+    return false;
+  LOGI("Surfel cache: %u surfels, %.1f MB written to %s in %.1f ms\n", cache.getSurfelCount(),
+       cache.getByteSize() / (1024.0 * 1024.0), m_surfelCacheFile.c_str(), timer.elapsed());
+  return true;
+}
 
-  // The picker is the helper to return information from a ray hit under the mouse cursor
-  m_picker.setTlas(m_accelStruct.getTlas());
+bool SampleExample::loadSurfelCache()
+{
+  MilliTimer  timer;
+  SurfelCache cache;
+  if(m_surfelCacheFile.empty() || !cache.load(m_surfelCacheFile, m_scene.getCpuBvh().getGeometryHash()))
+    return false;
+  if(cache.source == SurfelCache::Source::eBake)
+  {
+    // The baked radiance ignores the materials and the scene lights: a seed the first rays replace
+    LOGI("Surfel cache: baked offline, loaded as a seed\n");
+    cache.seedConfidence();
+  }
+
+  vkDeviceWaitIdle(m_device);
+  const uint32_t loaded = m_surfel.loadCache(cache);
+  m_cellGridValid       = false;  // Binned again around the current camera
+  resetFrame();
+  LOGI("Surfel cache: %u surfels read from %s in %.1f ms\n", loaded, m_surfelCacheFile.c_str(), timer.elapsed());
+  return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Moving a glTF node: the raster and G-Buffer data follow immediately, the TLAS is refitted
+// when the frame updates it (AccelStructure::updateTopLevelAS)
+//
+void SampleExample::setNodeTransform(uint32_t node, const glm::mat4& transform)
+{
+  m_scene.setNodeTransform(node, transform);
+  m_accelStruct.setInstanceTransform(node, transform);
   resetFrame();
 }
 
+//--------------------------------------------------------------------------------------------------
+// Spinning the picked node about the vertical axis through its center: a TLAS refit every frame,
+// and a rebuild every maxRefits frames
+//
+void SampleExample::animateNodes()
+{
+  if(m_pickedNode < 0 || m_spinSpeed == 0.f)
+    return;
+
+  const nvh::GltfNode&     node  = m_scene.getScene().m_nodes[m_pickedNode];
+  const nvh::GltfPrimMesh& mesh  = m_scene.getScene().m_primMeshes[node.primMesh];
+  const glm::vec3          pivot = glm::vec3(node.worldMatrix * glm::vec4((mesh.posMin + mesh.posMax) * 0.5f, 1.f));
+  const float              angle = glm::radians(m_spinSpeed * ImGui::GetIO().DeltaTime);
+  const glm::mat4          spin  = glm::translate(glm::mat4(1), pivot) * glm::rotate(glm::mat4(1), angle, glm::vec3(0, 1, 0))
+                         * glm::translate(glm::mat4(1), -pivot);
+  setNodeTransform(uint32_t(m_pickedNode), spin * node.worldMatrix);
+}
+
 //--------------------------------------------------------------------------------------------------
 // Loading an HDR image and creating the importance sampling acceleration structure
 //
@@ -122,7 +241,7 @@ void SampleExample::loadEnvironmentHdr(const std::string& hdrFilename)
 {
   MilliTimer timer;
   LOGI("Loading HDR and converting %s\n", hdrFilename.c_str());
-  m_skydome.loadEnvironment(hdrFilename);
+  m_skydome.loadEnvironment(hdrFilename, m_envValidation);
   timer.print();
 
   m_rtxState.fireflyClampThreshold = m_skydome.getIntegral() * 4.f;  // magic
@@ -152,8 +271,14 @@ void SampleExample::loadAssets(const char* filename)
     {
       m_busyReasonText = "Loading scene ";
 
+      // The surfels of the scene being left go to its cache, the ones of the new scene come from its own
+      if(m_surfelCache)
+        saveSurfelCache();
+
       // Loading scene and creating acceleration structure
       loadScene(sfile);
+      if(m_surfelCache)
+        loadSurfelCache();
 
       // Loading the scene might have loaded new textures, which is changing the number of elements
       // in the DescriptorSetLayout. Therefore, the PipelineLayout will be out-of-date and need
@@ -193,7 +318,23 @@ void SampleExample::updateUniformBuffer(const VkCommandBuffer& cmdBuf)
 
   m_scene.updateCamera(cmdBuf, aspectRatio);
   if (m_scene.getDirty()) m_scene.updateLightBuffer(cmdBuf);
+  animateNodes();
+  m_scene.updateNodeBuffer(cmdBuf);
   vkCmdUpdateBuffer(cmdBuf, m_sunAndSkyBuffer.buffer, 0, sizeof(SunAndSky), &m_sunAndSky);
+  m_skyLut.update(cmdBuf, getCurFrame(), m_sunAndSky);
+
+  // Environment SH for the surfel seeding, the sky is re-projected when the LUT is re-baked so
+  // both share its debouncing
+  const SunAndSky& bakedSky = m_skyLut.getBakedSky();
+  if(memcmp(&m_envSHSunAndSky, &bakedSky, sizeof(SunAndSky)) != 0)
+  {
+    m_envSH[1]       = EnvSHProjection::projectSunAndSky(bakedSky);
+    m_envSHSunAndSky = bakedSky;
+  }
+  m_envSH[0] = m_skydome.getEnvSH();
+  for(auto& sh : m_envSH)
+    sh.coeffs[0].w = m_surfelSHSeed ? 1.f : 0.f;
+  vkCmdUpdateBuffer(cmdBuf, m_envSHBuffer.buffer, 0, sizeof(m_envSH), m_envSH.data());
 }
 
 VkRect2D SampleExample::getRenderRegion()
@@ -229,6 +370,69 @@ void SampleExample::updateFrame()
   m_scene.setSize(m_size);
 }
 
+//--------------------------------------------------------------------------------------------------
+// Grows cellToSurfel when the stats read back show the binning needed more entries than it has,
+// before the command buffer of the frame is recorded. Stats copied before the last growth report
+// the former capacity and are left out.
+//
+void SampleExample::updateSurfelCapacity()
+{
+  const CellCounter& cells = m_surfelStats.cells;
+  if(m_busy || cells.cellToSurfelCapacity != m_surfel.getCellToSurfelCapacity())
+    return;
+
+  m_cellToSurfelPeak = std::max(m_cellToSurfelPeak, cells.aliveSurfelInCell);
+  if(cells.aliveSurfelInCell <= cells.cellToSurfelCapacity && cells.cellToSurfelDropped == 0)
+    return;
+
+  // Half again what is needed, in steps of 64K entries
+  uint32_t capacity = cells.aliveSurfelInCell + cells.aliveSurfelInCell / 2;
+  capacity          = std::min((capacity + 0xffffu) & ~0xffffu, kCellToSurfelMaxSize);
+  if(capacity <= cells.cellToSurfelCapacity)
+  {
+    if(!m_cellToSurfelFull)
+      LOGW("cellToSurfel is at its largest size (%u entries): %u needed, %u dropped\n", capacity,
+           cells.aliveSurfelInCell, cells.cellToSurfelDropped);
+    m_cellToSurfelFull = true;
+    return;
+  }
+
+  vkDeviceWaitIdle(m_device);  // cannot destroy while in use
+  m_surfel.resizeCellToSurfel(capacity);
+  m_cellGridValid = false;
+  m_cellToSurfelGrows++;
+  LOGI("cellToSurfel grown to %u entries: %u needed, %u dropped, high-water mark %u\n", capacity,
+       cells.aliveSurfelInCell, cells.cellToSurfelDropped, m_cellToSurfelPeak);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Ray budget, reflection candidates and spawn rate of the frame from the GPU times of the last
+// frames (see FrameGovernor). The sections are the ones main records, at full quality while the
+// governor is off.
+//
+void SampleExample::updateGovernor(nvvk::ProfilerVK& profiler)
+{
+  if(!m_busy)
+  {
+    auto gpuTime = [&profiler](const char* section) {
+      nvh::Profiler::TimerInfo info;
+      return profiler.getTimerInfo(section, info) ? float(info.gpu.average / 1000.0) : 0.f;
+    };
+
+    FrameGovernor::Timings timings;
+    timings.surfels    = gpuTime("Surfel Calculate");
+    timings.reflection = gpuTime("Compute Reflection");
+    timings.frame      = gpuTime("Gbuffer") + timings.surfels + timings.reflection + gpuTime("Light") + gpuTime("TAA")
+                    + gpuTime("Tonemap");
+    m_governor.update(timings);
+  }
+
+  const FrameGovernor::State& state = m_governor.getState();
+  m_rtxState.surfelRayBudget        = state.rayBudget;
+  m_rtxState.reflectionCandidates   = state.reflectionCandidates;
+  m_rtxState.surfelSpawnRate        = state.spawnRate;
+}
+
 //--------------------------------------------------------------------------------------------------
 // Reset frame is re-starting the rendering
 //
@@ -249,6 +453,9 @@ void SampleExample::createDescriptorSetLayout()
   m_bind.addBinding({EnvBindings::eSunSky, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1, VK_SHADER_STAGE_MISS_BIT_KHR | flags});
   m_bind.addBinding({EnvBindings::eHdr, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, flags});  // HDR image
   m_bind.addBinding({EnvBindings::eImpSamples, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flags});   // importance sampling
+  m_bind.addBinding({EnvBindings::eEnvSH, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1, flags});        // SH irradiance
+  m_bind.addBinding({EnvBindings::eSkyLut, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, flags});  // Baked sun & sky
+  m_bind.addBinding({EnvBindings::eSkySamples, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flags});      // and its sampling
 
 
   m_descPool = m_bind.createPool(m_device, 1);
@@ -259,9 +466,14 @@ void SampleExample::createDescriptorSetLayout()
   std::vector<VkWriteDescriptorSet> writes;
   VkDescriptorBufferInfo            sunskyDesc{m_sunAndSkyBuffer.buffer, 0, VK_WHOLE_SIZE};
   VkDescriptorBufferInfo            accelImpSmpl{m_skydome.m_accelImpSmpl.buffer, 0, VK_WHOLE_SIZE};
+  VkDescriptorBufferInfo            envSHDesc{m_envSHBuffer.buffer, 0, VK_WHOLE_SIZE};
+  VkDescriptorBufferInfo            skyImpSmpl{m_skyLut.m_accelImpSmpl.buffer, 0, VK_WHOLE_SIZE};
   writes.emplace_back(m_bind.makeWrite(m_descSet, EnvBindings::eSunSky, &sunskyDesc));
   writes.emplace_back(m_bind.makeWrite(m_descSet, EnvBindings::eHdr, &m_skydome.m_texHdr.descriptor));
   writes.emplace_back(m_bind.makeWrite(m_descSet, EnvBindings::eImpSamples, &accelImpSmpl));
+  writes.emplace_back(m_bind.makeWrite(m_descSet, EnvBindings::eEnvSH, &envSHDesc));
+  writes.emplace_back(m_bind.makeWrite(m_descSet, EnvBindings::eSkyLut, &m_skyLut.m_texSky.descriptor));
+  writes.emplace_back(m_bind.makeWrite(m_descSet, EnvBindings::eSkySamples, &skyImpSmpl));
 
   vkUpdateDescriptorSets(m_device, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
 }
@@ -282,17 +494,25 @@ void SampleExample::updateHdrDescriptors()
 //--------------------------------------------------------------------------------------------------
 // Creating the uniform buffer holding the Sun&Sky structure
 // - Buffer is host visible and will be set each frame
+// - The sky LUT is baked here once, then only when the Sun&Sky parameters change
 //
 void SampleExample::createUniformBuffer()
 {
   m_sunAndSkyBuffer = m_alloc.createBuffer(sizeof(SunAndSky), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
                                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
   NAME_VK(m_sunAndSkyBuffer.buffer);
+
+  m_envSHBuffer = m_alloc.createBuffer(sizeof(m_envSH), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                       VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+  NAME_VK(m_envSHBuffer.buffer);
+
+  m_skyLut.create(m_sunAndSky, m_swapChain.getImageCount(), m_envValidation);
 }
 
 void SampleExample::createSurfelResources()
 {
     m_surfel.createResources(m_size);
+    m_cellGridValid = false;
 
     createGbufferPass();
     m_surfel.createGbuffers(m_size, m_swapChain.getImageCount(), m_gbufferPass.getRenderPass());
@@ -305,7 +525,9 @@ void SampleExample::createSurfelResources()
             m_surfel.getGbufferSamplerDescLayout(),
             m_scene.getDescLayout(),
             m_surfel.getIndirectLightDescLayout(),
-            m_surfel.getCellBufferDescLayout()}, & m_scene);
+            m_surfel.getCellBufferDescLayout(),
+            m_accelStruct.getDescLayout(),
+            m_descSetLayout}, & m_scene);
 
 	m_surfelUpdatePass.create({ m_surfel.maxSurfelCnt, 0 }, {
         m_surfel.getSurfelBuffersDescLayout(),
@@ -314,6 +536,10 @@ void SampleExample::createSurfelResources()
         m_surfel.getGbufferSamplerDescLayout(),
         }, &m_scene);
 
+    m_surfelRayBudgetPass.create({ m_surfel.maxSurfelCnt, 0 }, { m_surfel.getSurfelBuffersDescLayout() });
+
+    m_surfelSortPass.create({ m_surfel.maxSurfelCnt, 0 }, { m_surfel.getSurfelBuffersDescLayout() });
+
     m_cellInfoUpdatePass.create({ m_surfel.maxSurfelCnt, 0 }, { 
         m_surfel.getSurfelBuffersDescLayout(),
         m_surfel.getCellBufferDescLayout()
@@ -337,6 +563,15 @@ void SampleExample::createSurfelResources()
         m_scene.getDescLayout(),
 		}, & m_scene);
 
+    // Surfel and ray passes sized by the live counts
+    m_surfelDispatchArgsPass.create({ m_surfel.getSurfelBuffersDescLayout(), m_surfel.getCellBufferDescLayout() });
+    m_surfel.createStatsReadback(m_swapChain.getImageCount());
+    VkBuffer dispatchBuffer = m_surfel.getSurfelDispatchBuffer().buffer;
+    m_surfelUpdatePass.setIndirectDispatch(dispatchBuffer, offsetof(SurfelDispatch, update));
+    m_cellToSurfelUpdatePass.setIndirectDispatch(dispatchBuffer, offsetof(SurfelDispatch, aliveSurfels));
+    m_surfelRaytracePass.setIndirectDispatch(dispatchBuffer, offsetof(SurfelDispatch, rays));
+    m_surfelIntegratePass.setIndirectDispatch(dispatchBuffer, offsetof(SurfelDispatch, aliveSurfels));
+
     createReflectionPass();
 	createLightPass();
 
@@ -414,19 +649,23 @@ void SampleExample::createReflectionPass()
 //
 void SampleExample::destroyResources()
 {
+  LOGI("cellToSurfel high-water mark: %u of %u entries, grown %u times\n", m_cellToSurfelPeak,
+       m_surfel.getCellToSurfelCapacity(), m_cellToSurfelGrows);
+
   // Resources
   m_alloc.destroy(m_sunAndSkyBuffer);
+  m_alloc.destroy(m_envSHBuffer);
 
   // Descriptors
   vkDestroyDescriptorPool(m_device, m_descPool, nullptr);
   vkDestroyDescriptorSetLayout(m_device, m_descSetLayout, nullptr);
 
   // Other
-  m_picker.destroy();
   m_scene.destroy();
   m_accelStruct.destroy();
   m_offscreen.destroy();
   m_skydome.destroy();
+  m_skyLut.destroy();
   m_axis.deinit();
 
   // All renderers
@@ -657,25 +896,54 @@ void SampleExample::calculateSurfels(const VkCommandBuffer& cmdBuf, nvvk::Profil
 
     m_rtxState.size = { render_size.width, render_size.height };
 
+    // Surfel grid around the camera snapped to kCellGridSnap: while the snapped position holds, the
+    // cells of a surfel only change with its radius and the lists of the last frame are patched
+    glm::vec3 eye, center, up;
+    CameraManip.getLookat(eye, center, up);
+    const glm::vec3 gridOrigin = glm::round(eye / kCellGridSnap) * kCellGridSnap;
+    const bool      rebuild    = !m_cellPatching || !m_cellGridValid || gridOrigin != m_rtxState.cellGridOrigin
+                         || m_rtxState.cellHash != m_cellGridHash;
+    m_rtxState.cellGridOrigin = gridOrigin;
+    m_rtxState.cellRebuild    = rebuild ? 1 : 0;
+    m_cellGridValid           = true;
+    m_cellGridHash            = m_rtxState.cellHash;
+    (rebuild ? m_cellRebuildFrames : m_cellPatchFrames)++;
+
 	m_surfelPreparePass.setPushContants(m_rtxState);
 	m_surfelGenerationPass.setPushContants(m_rtxState);
 	m_surfelUpdatePass.setPushContants(m_rtxState);
+	m_surfelRayBudgetPass.setPushContants(m_rtxState);
+	m_surfelSortPass.setPushContants(m_rtxState);
 	m_surfelRaytracePass.setPushContants(m_rtxState);
 	m_surfelIntegratePass.setPushContants(m_rtxState);
+	m_cellInfoUpdatePass.setPushContants(m_rtxState);
+	m_cellToSurfelUpdatePass.setPushContants(m_rtxState);
 	m_indirectPostprocessPass.setPushContants(m_rtxState);
 
 
     VkBufferMemoryBarrier outbuffDependency = {};
     std::vector<VkBufferMemoryBarrier> outbuffDependencies = {};
 
+    // Entries of the cell buffer the scan and the sort go through, the sparse hash only uses its
+    // first slots. The prepare pass still covers the whole grid to clear it after a switch, and the
+    // cell mask of every surfel, a patched frame only resets the counters.
+    const uint32_t cellSlots    = m_rtxState.cellHash ? kCellHashCapacity : m_surfel.totalCellCount;
+    const uint32_t prepareCells = rebuild ? std::max(m_surfel.totalCellCount, m_surfel.maxSurfelCnt) : 1;
 
-    m_surfelPreparePass.run(cmdBuf, { m_surfel.totalCellCount, 1 }, profiler,
+    // Surfels close in space next to each other in the alive list, and so in the warps of the
+    // passes that go through it. The recycling swaps break the order up slowly.
+    if(m_surfelSortInterval > 0 && m_rtxState.totalFrames % uint32_t(m_surfelSortInterval) == 0)
+      m_surfelSortPass.run(cmdBuf, { m_surfel.maxSurfelCnt, 1 }, profiler, { m_surfel.getSurfelBuffersDescSet() });
+
+    m_surfelPreparePass.run(cmdBuf, { prepareCells, 1 }, profiler,
         { m_surfel.getSurfelBuffersDescSet(),
         m_surfel.getCellBufferDescSet()
         });
 
 	insertMemoryBarriers(cmdBuf, { m_surfel.getCellInfoBuffer().buffer, m_surfel.getCellCounterBuffer().buffer });
 
+	m_surfelDispatchArgsPass.run(cmdBuf, SurfelDispatchArgsPass::eAfterPrepare, { m_surfel.getSurfelBuffersDescSet(), m_surfel.getCellBufferDescSet() });
+
 	m_surfelUpdatePass.run(cmdBuf, { m_surfel.maxSurfelCnt, 1 }, profiler, { 
         m_surfel.getSurfelBuffersDescSet(),
 		m_surfel.getCellBufferDescSet(),
@@ -683,16 +951,25 @@ void SampleExample::calculateSurfels(const VkCommandBuffer& cmdBuf, nvvk::Profil
         m_surfel.getGbufferSamplerDescSet()
         });
 
-    insertMemoryBarriers(cmdBuf, { m_surfel.getCellInfoBuffer().buffer, m_surfel.getSurfelCounterBuffer().buffer });
+    insertMemoryBarriers(cmdBuf, { m_surfel.getCellInfoBuffer().buffer, m_surfel.getSurfelCounterBuffer().buffer,
+        m_surfel.getSurfelAliveBuffer().buffer, m_surfel.getSurfelColdBuffer().buffer, m_surfel.getSurfelRayRequestBuffer().buffer });
 
-    m_cellInfoUpdatePass.run(cmdBuf, { m_surfel.totalCellCount, 1 }, profiler, {
+    // Rays granted once every request is in, the raytrace dispatch follows their total
+    m_surfelRayBudgetPass.run(cmdBuf, { m_surfel.maxSurfelCnt, 1 }, profiler, { m_surfel.getSurfelBuffersDescSet() });
+
+    insertMemoryBarriers(cmdBuf, { m_surfel.getSurfelCounterBuffer().buffer, m_surfel.getSurfelColdBuffer().buffer,
+        m_surfel.getSurfelRayBuffer().buffer });
+
+	m_surfelDispatchArgsPass.run(cmdBuf, SurfelDispatchArgsPass::eAfterUpdate, { m_surfel.getSurfelBuffersDescSet(), m_surfel.getCellBufferDescSet() });
+
+    m_cellInfoUpdatePass.run(cmdBuf, { cellSlots, 1 }, profiler, {
         m_surfel.getSurfelBuffersDescSet(),
         m_surfel.getCellBufferDescSet()
         });
 
 	insertMemoryBarriers(cmdBuf, { m_surfel.getCellInfoBuffer().buffer, m_surfel.getCellCounterBuffer().buffer});
 
-    m_cellToSurfelUpdatePass.run(cmdBuf, { m_surfel.maxSurfelCnt, 1 }, profiler, {
+    m_cellToSurfelUpdatePass.run(cmdBuf, { m_surfel.maxSurfelCnt, cellSlots }, profiler, {
         m_surfel.getSurfelBuffersDescSet(),
         m_surfel.getCellBufferDescSet(),
         m_scene.getDescSet(),
@@ -719,7 +996,9 @@ void SampleExample::calculateSurfels(const VkCommandBuffer& cmdBuf, nvvk::Profil
         m_surfel.getGbufferSamplerDescSet(),
         m_scene.getDescSet(),
         m_surfel.getIndirectLightDescSet(),
-        m_surfel.getCellBufferDescSet() });
+        m_surfel.getCellBufferDescSet(),
+        m_accelStruct.getDescSet(),
+        m_descSet });
 
 	VkImageSubresourceRange subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
 	VkImageMemoryBarrier imageMemoryBarrier = {};
@@ -740,7 +1019,8 @@ void SampleExample::calculateSurfels(const VkCommandBuffer& cmdBuf, nvvk::Profil
 
 
     vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &imageMemoryBarrier);
-    
+
+    m_surfelStats = m_surfel.readbackStats(cmdBuf, getCurFrame());
 }
 
 
@@ -786,43 +1066,49 @@ void SampleExample::screenPicking()
   double x, y;
   glfwGetCursorPos(m_window, &x, &y);
 
-  // Set the camera as to see the model
-  nvvk::CommandPool sc(m_device, m_graphicsQueueIndex);
-  VkCommandBuffer   cmdBuf = sc.createCommandBuffer();
+  // Answered by the CPU BVH of the scene, no GPU submit to wait on
+  MilliTimer timer;
 
   const float aspectRatio = m_renderRegion.extent.width / static_cast<float>(m_renderRegion.extent.height);
   const auto& view        = CameraManip.getMatrix();
   auto        proj        = glm::perspectiveRH_ZO(glm::radians(CameraManip.getFov()), aspectRatio, 0.1f, 1000.0f);
   proj[1][1] *= -1;
 
-  nvvk::RayPickerKHR::PickInfo pickInfo;
-  pickInfo.pickX          = float(x - m_renderRegion.offset.x) / float(m_renderRegion.extent.width);
-  pickInfo.pickY          = float(y - m_renderRegion.offset.y) / float(m_renderRegion.extent.height);
-  pickInfo.modelViewInv   = glm::inverse(view);
-  pickInfo.perspectiveInv = glm::inverse(proj);
+  // Same ray as nvvk::RayPickerKHR
+  const glm::vec2 d = glm::vec2(float(x - m_renderRegion.offset.x) / float(m_renderRegion.extent.width),
+                                float(y - m_renderRegion.offset.y) / float(m_renderRegion.extent.height))
+                          * 2.0f
+                      - 1.0f;
+  const glm::mat4 modelViewInv = glm::inverse(view);
+  const glm::vec4 target       = glm::inverse(proj) * glm::vec4(d.x, d.y, 1, 1);
 
+  CpuBvh::Ray ray;
+  ray.origin    = glm::vec3(modelViewInv * glm::vec4(0, 0, 0, 1));
+  ray.direction = glm::vec3(modelViewInv * glm::vec4(glm::normalize(glm::vec3(target)), 0));
+  ray.tMin      = 0.00001f;
 
-  m_picker.run(cmdBuf, pickInfo);
-  sc.submitAndWait(cmdBuf);
+  CpuBvh::Hit hit;
+  const bool  found = m_scene.getCpuBvh().intersect(ray, hit);
+  m_pickLatency     = timer.elapsed();
 
-  nvvk::RayPickerKHR::PickResult pr = m_picker.getResult();
-
-  if(pr.instanceID == ~0)
+  if(!found)
   {
-    LOGI("Nothing Hit\n");
+    LOGI("Nothing Hit (%.3f ms)\n", m_pickLatency);
     return;
   }
 
-  glm::vec3 worldPos = glm::vec3(pr.worldRayOrigin + pr.worldRayDirection * pr.hitT);
+  glm::vec3 worldPos = ray.origin + ray.direction * hit.t;
   // Set the interest position
   glm::vec3 eye, center, up;
   CameraManip.getLookat(eye, center, up);
   CameraManip.setLookat(eye, worldPos, up, false);
 
 
-  auto& prim = m_scene.getScene().m_primMeshes[pr.instanceCustomIndex];
-  LOGI("Hit(%d): %s\n", pr.instanceCustomIndex, prim.name.c_str());
-  LOGI(" - PrimId(%d)\n", pr.primitiveID);
+  m_pickedNode       = int(hit.node);
+  const int primMesh = m_scene.getScene().m_nodes[hit.node].primMesh;
+  auto&     prim     = m_scene.getScene().m_primMeshes[primMesh];
+  LOGI("Hit(%d): %s (%.3f ms)\n", primMesh, prim.name.c_str(), m_pickLatency);
+  LOGI(" - PrimId(%d)\n", hit.triangle);
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -1030,7 +1316,7 @@ void SampleExample::runTAA(const VkCommandBuffer& cmdBuf, nvvk::ProfilerVK& prof
 
     LABEL_SCOPE_VK(cmdBuf);
 
-    auto sec = profiler.timeRecurring("Compute Reflection", cmdBuf);
+    auto sec = profiler.timeRecurring("TAA", cmdBuf);
 
     VkExtent2D render_size = m_renderRegion.extent;
     if (m_descaling)
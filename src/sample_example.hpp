@@ -59,17 +59,22 @@ typedef nvvk::ResourceAllocatorDedicated Allocator;
 #include "nvvk/debug_util_vk.hpp"
 #include "nvvk/profiler_vk.hpp"
 #include "nvvk/raytraceKHR_vk.hpp"
-#include "nvvk/raypicker_vk.hpp"
 
 #include "accelstruct.hpp"
 #include "render_output.hpp"
 #include "scene.hpp"
+#include "sky_model.hpp"
 #include "shaders/host_device.h"
 #include "SurfelGI.h"
+#include "surfel_config.hpp"
+#include "frame_governor.hpp"
 #include "gbuffer_pass.h"
 #include "surfel_prepare_pass.h"
 #include "surfel_generation_pass.h"
 #include "surfel_update_pass.h"
+#include "surfel_ray_budget_pass.h"
+#include "surfel_sort_pass.h"
+#include "surfel_dispatch_args_pass.h"
 #include "surfel_raytrace_pass.h"
 #include "cellInfo_update_pass.h"
 #include "cellToSurfel_update_pass.h"
@@ -131,7 +136,14 @@ public:
   void createRender(RndMethod method);
   void resetFrame();
   void screenPicking();
+  void setNodeTransform(uint32_t node, const glm::mat4& transform);
+  void animateNodes();
+  void runSurfelReference();
+  bool saveSurfelCache();
+  bool loadSurfelCache();
   void updateFrame();
+  void updateSurfelCapacity();
+  void updateGovernor(nvvk::ProfilerVK& profiler);
   void updateHdrDescriptors();
   void updateUniformBuffer(const VkCommandBuffer& cmdBuf);
   VkRect2D getRenderRegion();
@@ -147,18 +159,45 @@ public:
   AccelStructure     m_accelStruct;
   RenderOutput       m_offscreen;
   HdrSampling        m_skydome;
+  SkyLut             m_skyLut;
   nvvk::AxisVK       m_axis;
-  nvvk::RayPickerKHR m_picker;
 
   // surfel render passes
   GbufferPass m_gbufferPass;
   SurfelPreparePass m_surfelPreparePass;
   SurfelUpdatePass m_surfelUpdatePass;
+  SurfelRayBudgetPass m_surfelRayBudgetPass;
+  SurfelSortPass m_surfelSortPass;
   SurfelGenerationPass m_surfelGenerationPass;
   CellInfoUpdatePass m_cellInfoUpdatePass;
   CellToSurfelUpdatePass m_cellToSurfelUpdatePass;
   SurfelRaytracePass m_surfelRaytracePass;
   SurfelIntegratePass m_surfelIntegratePass;
+  SurfelDispatchArgsPass m_surfelDispatchArgsPass;
+  SurfelGI::ReadbackStats m_surfelStats{};  // Live counts and cell hash statistics of a recent frame
+
+  // Incremental binning: the surfel cells are rebuilt when the snapped grid origin moves, patched
+  // from the last frame otherwise
+  bool     m_cellPatching{true};
+  int      m_surfelSortInterval{32};  // Frames between two Morton sorts of the alive list, 0 never sorts
+  bool     m_cellGridValid{false};  // The GPU cells match m_rtxState.cellGridOrigin and m_cellGridHash
+  int      m_cellGridHash{0};
+  uint32_t m_cellRebuildFrames{0};
+  uint32_t m_cellPatchFrames{0};
+
+  // Scales the surfel rays, the reflection candidates and the surfel spawning to the target frame time
+  FrameGovernor m_governor;
+
+  // Surfels of the last run of the scene, next to its file (-surfelcache): loaded with the scene,
+  // written on exit
+  bool        m_surfelCache{false};
+  std::string m_surfelCacheFile;
+
+  // cellToSurfel sizing: entries the binning needed at most, from the stats read back, and the
+  // reallocations it caused, warned once when it cannot grow further
+  uint32_t m_cellToSurfelPeak{0};
+  uint32_t m_cellToSurfelGrows{0};
+  bool     m_cellToSurfelFull{false};
   IndirectPostprocessPass m_indirectPostprocessPass;
 
   // reflection compute passes
@@ -180,6 +219,12 @@ public:
   RndMethod                    m_rndMethod{eNone};
 
   nvvk::Buffer m_sunAndSkyBuffer;
+  nvvk::Buffer m_envSHBuffer;  // EnvSH[2]: HDR, sun & sky
+
+  // Environment SH used to seed new surfels, the sky part is re-projected when the sky LUT is re-baked
+  std::array<EnvSH, 2> m_envSH{};
+  SunAndSky            m_envSHSunAndSky{};
+  bool                 m_surfelSHSeed{true};
 
   // Graphic pipeline
   VkDescriptorPool            m_descPool{VK_NULL_HANDLE};
@@ -221,7 +266,15 @@ public:
       0,       // _pad0;
       {0, 0},  // size;
       0,       // minHeatmap;
-      65000    // maxHeatmap;
+      65000,   // maxHeatmap;
+      0,       // cellHash;
+      1,       // cellRebuild;
+      0,       // surfelRayBudget; set each frame by m_governor
+      1,       // surfelSpawnRate;
+      {0, 0, 0},  // cellGridOrigin;
+      kMaxReflectionCandidates,  // reflectionCandidates;
+      1,       // surfelUpdateFraction;
+      0,       // surfelRayBinning;
   };
 
   SunAndSky m_sunAndSky{
@@ -249,6 +302,14 @@ public:
   int         m_descalingLevel{1};
   bool        m_busy{false};
   std::string m_busyReasonText;
+  bool        m_cpuBvhBenchmark{false};  // Rays/s of the CPU BVH after each scene load (-bvhbench)
+  double      m_pickLatency{0.0};        // ms, last screenPicking
+  int         m_pickedNode{-1};          // glTF node of the last screenPicking hit, moved from the GUI
+  float       m_spinSpeed{0.f};          // Degrees per second about the world Y axis of m_pickedNode
+  bool        m_envValidation{false};    // Environment SH and sky LUT checked against brute force at each load (-envcheck)
+  uint32_t    m_surfelReferenceFrames{0};  // Frames of the CPU surfel reference after each scene load (-surfelref)
+  bool        m_gridOccupancy{false};  // Grid occupancy of m_gridCandidate and of the grid in use after each scene load (-gridocc)
+  SurfelConfig m_gridCandidate;
 
 
   std::shared_ptr<SampleGUI> m_gui;
@@ -80,6 +80,8 @@ void SampleGUI::render(nvvk::ProfilerVK& profiler)
     }
 	if (ImGui::CollapsingHeader("Additional Lights"))
 		changed |= guiAdditionalLights();
+    if(ImGui::CollapsingHeader("Nodes"))
+      changed |= guiNodes();
 
 
     ImGui::TextWrapped("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate,
@@ -144,6 +146,37 @@ bool SampleGUI::guiRayTracing()
   // add slider to change scene camera parameter
   changed |= GuiH::Slider("Jitter Scale", "", & _se->m_scene.getCamera().jitter.z, nullptr, Normal, 0.0f, 2.0f);
   changed |= GuiH::Slider("Sharpness", "", &_se->m_scene.getCamera().jitter.w, nullptr, Normal, 0.1f, 3.0f);
+  changed |= GuiH::Checkbox("Sparse Cell Hash", "Store only the grid cells holding surfels, in a hash table",
+                            (bool*)&rtxState.cellHash);
+  GuiH::Checkbox("Patch Surfel Cells", "Keep the cell lists of the last frame while the snapped camera cell holds",
+                 &_se->m_cellPatching);
+  GuiH::Slider("Surfel Update Fraction",
+               "Share of the surfels that trace rays each frame, the others keep their radiance.\n"
+               "The visible, noisy and longest waiting ones go first.",
+               &rtxState.surfelUpdateFraction, nullptr, Normal, 0.05f, 1.0f);
+  GuiH::Checkbox("Surfel Ray Binning", "Trace the surfel rays sorted by origin cell and direction, same results",
+                 (bool*)&rtxState.surfelRayBinning);
+  GuiH::Slider("Surfel Sort Interval", "Frames between two Morton sorts of the alive surfel list, 0 never sorts",
+               &_se->m_surfelSortInterval, nullptr, Normal, 0, 256);
+  GuiH::Checkbox("Surfel Cache", "Load the surfels of the last run with the scene and save them on exit",
+                 &_se->m_surfelCache);
+  if(ImGui::Button("Save Surfels"))
+    _se->saveSurfelCache();
+  ImGui::SameLine();
+  if(ImGui::Button("Load Surfels"))
+    changed |= _se->loadSurfelCache();
+
+  // Scales the surfel rays, the reflection candidates and the spawning of surfels to the target
+  FrameGovernor& governor = _se->m_governor;
+  GuiH::Checkbox("Frame Governor", "Lower the surfel and reflection work to hold the target GPU frame time",
+                 &governor.m_settings.enabled);
+  if(governor.m_settings.enabled)
+  {
+    GuiH::Slider("Target Frame [ms]", "", &governor.m_settings.targetMs, nullptr, Normal, 4.0f, 50.0f);
+    const FrameGovernor::State& state = governor.getState();
+    ImGui::Text("Scale %.2f: %u rays, %d reflection candidates, spawn %.2f", state.scale, state.rayBudget,
+                state.reflectionCandidates, state.spawnRate);
+  }
   static bool bAnyHit = true;
   if(_se->m_rndMethod == SampleExample::RndMethod::eRtxPipeline)
   {
@@ -281,6 +314,8 @@ bool SampleGUI::guiEnvironment()
   changed |= ImGui::Checkbox("Use Sun & Sky", (bool*)&sunAndSky.in_use);
   changed |= GuiH::Slider("Exposure", "Intensity of the environment", &_se->m_rtxState.hdrMultiplier, nullptr,
                           GuiH::Flags::Normal, 0.f, 5.f);
+  changed |= GuiH::Checkbox("Surfel SH Seed", "Seed new surfels with the sky-visible environment irradiance",
+                            &_se->m_surfelSHSeed);
 
   // Adjusting the up with the camera
   glm::vec3 eye, center, up;
@@ -394,6 +429,30 @@ bool SampleGUI::guiAdditionalLights()
     return false;  // no need to restart the renderer
 }
 
+//--------------------------------------------------------------------------------------------------
+// Moving the node picked with Space: the TLAS is refit, the CPU BVH too
+//
+bool SampleGUI::guiNodes()
+{
+  auto& gltf = _se->m_scene.getScene();
+  if(_se->m_pickedNode < 0 || _se->m_pickedNode >= int(gltf.m_nodes.size()))
+  {
+    ImGui::TextWrapped("Press Space over an object to pick its node");
+    return false;
+  }
+
+  const nvh::GltfNode& node = gltf.m_nodes[_se->m_pickedNode];
+  GuiH::Info("Node", "", std::to_string(_se->m_pickedNode) + " (" + gltf.m_primMeshes[node.primMesh].name + ")");
+
+  glm::mat4 transform = node.worldMatrix;
+  if(GuiH::Custom("Position", "World translation of the node",
+                  [&] { return ImGui::DragFloat3("##Position", &transform[3].x, 0.01f); }))
+    _se->setNodeTransform(uint32_t(_se->m_pickedNode), transform);
+  GuiH::Slider("Spin", "Degrees per second about the vertical axis", &_se->m_spinSpeed, nullptr, GuiH::Flags::Normal, -180.f, 180.f);
+
+  return false;  // setNodeTransform restarts the frames
+}
+
 //--------------------------------------------------------------------------------------------------
 //
 //
@@ -488,6 +547,56 @@ bool SampleGUI::guiProfiler(nvvk::ProfilerVK& profiler)
     ImGui::Text("Mipmap Gen: %2.3fms", mipmapGen);
   ImGui::ProgressBar(display.statRender.x / display.frameTime);
 
+  ImGui::Text("Pick CPU [ms]: %2.3f", _se->m_pickLatency);
+
+  // Threads launched by the indirect dispatches against the live counts, the fixed sizes were
+  // maxSurfelCnt for the surfel passes and maxRayBudget for the ray tracing
+  const SurfelDispatch& dispatch = _se->m_surfelStats.dispatch;
+  ImGui::Text("Surfels live/threads: %u / %u (was %u)", dispatch.aliveSurfels.w,
+              dispatch.aliveSurfels.x * kSurfelGroupSize, _se->m_surfel.maxSurfelCnt);
+  ImGui::Text("Rays live/threads: %u / %u (was %u)", dispatch.rays.w, dispatch.rays.x * kSurfelGroupSize,
+              _se->m_surfel.maxRayBudget);
+
+  // Rays the update pass asked for against the ones granted, past the budget the lowest priority
+  // levels are scaled down first
+  const SurfelCounter& surfels   = _se->m_surfelStats.surfels;
+  uint32_t             requested = surfels.rayRequestBase;
+  for(uint32_t level = 0; level < kRayPriorityLevels; level++)
+    requested += surfels.rayRequestExtra[level];
+  ImGui::Text("Rays requested/granted: %u / %u%s", requested, surfels.surfelRayCnt,
+              requested > _se->m_governor.getState().rayBudget ? " (over budget)" : "");
+  if(_se->m_rtxState.surfelUpdateFraction < 1.f)
+    ImGui::Text("Surfels updated: %u / %u", surfels.scheduledSurfels, dispatch.aliveSurfels.w);
+
+  // Frames that cleared and binned all surfels again against frames that only moved the changed ones
+  const CellCounter& cells = _se->m_surfelStats.cells;
+  ImGui::Text("Cells rebuilt/patched: %u / %u frames", _se->m_cellRebuildFrames, _se->m_cellPatchFrames);
+  ImGui::Text("Surfels re-binned: %u / %u%s", cells.changedSurfels, dispatch.aliveSurfels.w,
+              cells.rebuiltFrame ? " (rebuild)" : "");
+
+  // Entries of the cell lists against cellToSurfel, the lists are cut short when it overflows
+  ImGui::Text("Cell lists: %u / %u entries, peak %u", cells.aliveSurfelInCell, cells.cellToSurfelCapacity,
+              _se->m_cellToSurfelPeak);
+  if(cells.cellToSurfelDropped != 0)
+    ImGui::Text("Cell lists dropped: %u (growing)", cells.cellToSurfelDropped);
+
+  // Load of the sparse cell hash and length of the probe sequences of the insertions
+  if(cells.hashedFrame != 0)
+  {
+    ImGui::Text("Cell hash load: %u / %u (%.1f%%)", cells.hashOccupied, kCellHashCapacity,
+                100.f * cells.hashOccupied / kCellHashCapacity);
+    ImGui::Text("Cell hash probes mean/max: %.2f / %u, overflow %u",
+                cells.hashInsertions ? float(cells.hashProbes) / cells.hashInsertions : 0.f, cells.hashMaxProbe,
+                cells.hashOverflow);
+  }
+
+  // Only present once an instance has moved
+  nvh::Profiler::TimerInfo tlasInfo;
+  if(profiler.getTimerInfo("TLAS Refit", tlasInfo))
+    ImGui::Text("TLAS Refit GPU [ms]: %2.3f", tlasInfo.gpu.average / 1000.0f);
+  if(profiler.getTimerInfo("TLAS Rebuild", tlasInfo))
+    ImGui::Text("TLAS Rebuild GPU [ms]: %2.3f", tlasInfo.gpu.average / 1000.0f);
+
 
   return false;
 }
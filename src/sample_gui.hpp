@@ -49,6 +49,7 @@ private:
   bool guiProfiler(nvvk::ProfilerVK& profiler);
   bool guiGpuMeasures();
   bool guiAdditionalLights();
+  bool guiNodes();
 
   SampleExample* _se{nullptr};
 };
@@ -22,6 +22,7 @@
  * - Creates the buffers and descriptor set for the scene
  */
 
+#include <algorithm>
 #include <filesystem>
 #include <sstream>
 
@@ -105,6 +106,9 @@ bool Scene::load(const std::string &filename)
   // Descriptor set for all elements
   createDescriptorSet(gltf);
 
+  // Host side copy of the geometry for picking and other queries
+  m_cpuBvh.build(gltf);
+
   // Keeping minimal resources
   m_gltf.m_nodes = gltf.m_nodes;
   m_gltf.m_primMeshes = gltf.m_primMeshes;
@@ -172,6 +176,33 @@ void Scene::createInstanceDataBuffer(VkCommandBuffer cmdBuf, nvh::GltfScene &glt
   NAME_VK(m_buffer[eInstData].buffer);
 }
 
+//--------------------------------------------------------------------------------------------------
+// FNV-1a 64 of the geometry the BLAS is built from (positions and indices), so the acceleration
+// structure can recognize a primitive it has already built, see AccelStructure::createBottomLevelAS.
+// The checksum runs over the same data word by word with an unrelated mix, a collision would need
+// both to match.
+//
+static GeometryKey hashGeometry(const std::vector<glm::vec3> &positions, uint32_t vertexOffset, uint32_t vertexCount,
+                                const std::vector<uint32_t> &indices)
+{
+  GeometryKey key{14695981039346656037ull, 0x9e3779b97f4a7c15ull};
+  auto hashWords = [&](const void *data, size_t size) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    for (size_t i = 0; i < size; i++)
+      key.hash = (key.hash ^ bytes[i]) * 1099511628211ull;
+    const uint32_t *words = static_cast<const uint32_t *>(data);
+    for (size_t i = 0; i < size / sizeof(uint32_t); i++)
+    {
+      key.checksum = (key.checksum ^ words[i]) * 0xbf58476d1ce4e5b9ull;
+      key.checksum = (key.checksum << 31) | (key.checksum >> 33);
+    }
+  };
+  hashWords(&vertexCount, sizeof(vertexCount));
+  hashWords(positions.data() + vertexOffset, vertexCount * sizeof(glm::vec3));
+  hashWords(indices.data(), indices.size() * sizeof(uint32_t));
+  return key;
+}
+
 //--------------------------------------------------------------------------------------------------
 // Creating a buffer per primitive mesh (BLAS) containing all Vertex (pos, nrm, .. )
 // and a buffer of index.
@@ -264,6 +295,7 @@ void Scene::createVertexBuffer(VkCommandBuffer cmdBuf, const nvh::GltfScene &glt
     NAME_IDX_VK(i_buffer.buffer, prim_idx);
 
     m_indicesCount.push_back(primMesh.indexCount);
+    m_geometryKeys.push_back(hashGeometry(gltf.m_positions, primMesh.vertexOffset, primMesh.vertexCount, indices));
 
     prim_idx++;
   }
@@ -388,6 +420,48 @@ void Scene::updateLightBuffer(VkCommandBuffer cmdBuf)
   setDirty(false);
 }
 
+//--------------------------------------------------------------------------------------------------
+// Moving a node: the raster passes read m_gltf.m_nodes directly, the shaders reconstructing
+// positions from the G-Buffer read the node buffer, which is patched by updateNodeBuffer along
+// with a refit of the CPU BVH
+//
+void Scene::setNodeTransform(uint32_t node, const glm::mat4 &transform)
+{
+  assert(node < m_gltf.m_nodes.size());
+  m_gltf.m_nodes[node].worldMatrix = transform;
+  if (std::find(m_dirtyNodes.begin(), m_dirtyNodes.end(), node) == m_dirtyNodes.end())
+    m_dirtyNodes.push_back(node);
+}
+
+void Scene::updateNodeBuffer(VkCommandBuffer cmdBuf)
+{
+  if (m_dirtyNodes.empty())
+    return;
+
+  VkBuffer nodeBuffer = m_buffer[eNodes].buffer;
+  const VkPipelineStageFlags readStages = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR;
+
+  VkBufferMemoryBarrier barrier{VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER};
+  barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.buffer = nodeBuffer;
+  barrier.size = VK_WHOLE_SIZE;
+  vkCmdPipelineBarrier(cmdBuf, readStages, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+
+  for (uint32_t node : m_dirtyNodes)
+  {
+    const nvh::GltfNode &gltfNode = m_gltf.m_nodes[node];
+    SceneNodeData data = {gltfNode.worldMatrix, gltfNode.primMesh};
+    vkCmdUpdateBuffer(cmdBuf, nodeBuffer, node * sizeof(SceneNodeData), sizeof(SceneNodeData), &data);
+  }
+  m_cpuBvh.refit(m_gltf, m_dirtyNodes);
+  m_dirtyNodes.clear();
+
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_TRANSFER_BIT, readStages, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+}
+
 //--------------------------------------------------------------------------------------------------
 // Create a buffer of all materials
 // Most parameters are supported, and GltfShadeMaterial is GLSL packed compliant
@@ -463,6 +537,8 @@ void Scene::destroy()
     m_pAlloc->destroy(buffers);
   }
   m_buffers[eIndex].clear();
+  m_geometryKeys.clear();
+  m_dirtyNodes.clear();
 
   for (auto &i : m_images)
   {
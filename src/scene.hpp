@@ -32,6 +32,7 @@
 #include "nvvk/debug_util_vk.hpp"
 #include "nvvk/descriptorsets_vk.hpp"
 #include "queue.hpp"
+#include "cpu_bvh.hpp"
 
 #define MAX_ADDITONAL_LIGHTS 10
 struct AdditionalLights
@@ -45,6 +46,15 @@ struct AdditionalLights
     bool dirty{ false };
 };
 
+// Identity of the geometry a BLAS is built from (positions and indices) of a primitive mesh. The
+// hash keys the BLAS cache of AccelStructure, the checksum is compared on a hit so a hash collision
+// builds a BLAS instead of reusing the one of other geometry.
+struct GeometryKey
+{
+  uint64_t hash{0};      // FNV-1a 64
+  uint64_t checksum{0};  // Independent multiply-rotate hash of the same data
+};
+
 class Scene
 {
 public:
@@ -76,6 +86,8 @@ public:
   void createLightBuffer(VkCommandBuffer cmdBuf, const nvh::GltfScene& gltf);
   void updateLightBuffer(VkCommandBuffer cmdBuf, const std::vector<Light>& lights, int lightCount);
   void updateLightBuffer(VkCommandBuffer cmdBuf);
+  void setNodeTransform(uint32_t node, const glm::mat4& transform);
+  void updateNodeBuffer(VkCommandBuffer cmdBuf);
   void createMaterialBuffer(VkCommandBuffer cmdBuf, const nvh::GltfScene& gltf);
   void destroy();
   void updateCamera(const VkCommandBuffer& cmdBuf, float aspectRatio);
@@ -88,6 +100,8 @@ public:
   const std::string&               getSceneName() const { return m_sceneName; }
   SceneCamera&                     getCamera() { return m_camera; }
   const std::vector<uint32_t>&     getIndicesCount() { return m_indicesCount; }
+  const std::vector<GeometryKey>&  getGeometryKeys() { return m_geometryKeys; }
+  const CpuBvh&                    getCpuBvh() const { return m_cpuBvh; }
 
   AdditionalLights& getAdditionalLights() { return m_lights; }
   std::vector<Light>& getLights() { return m_lights.lights; }
@@ -106,6 +120,7 @@ private:
 
   nvh::GltfScene m_gltf;
   nvh::GltfStats m_stats;
+  CpuBvh         m_cpuBvh;  // World space triangles for host queries, the glTF geometry is not kept
 
   std::string m_sceneName;
   SceneCamera m_camera{};
@@ -123,6 +138,8 @@ private:
   std::vector<std::pair<nvvk::Image, VkImageCreateInfo>> m_images;           // vector of all images of the scene
   std::vector<size_t>                                    m_defaultTextures;  // for cleanup
   std::vector<uint32_t>								     m_indicesCount;
+  std::vector<GeometryKey>                               m_geometryKeys;     // Per primitive, positions + indices
+  std::vector<uint32_t>                                  m_dirtyNodes;       // Moved since the last updateNodeBuffer
 
 
   // Lights
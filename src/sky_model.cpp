@@ -0,0 +1,258 @@
+#define _USE_MATH_DEFINES
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <thread>
+
+#include <glm/glm.hpp>
+
+#include "sky_model.hpp"
+#include "hdr_sampling.hpp"
+#include "tools.hpp"
+
+#include "nvh/parallel_work.hpp"
+#include "nvvk/commands_vk.hpp"
+#include "nvvk/images_vk.hpp"
+
+// Inverse of GetSphericalUv (common.glsl)
+static glm::vec3 latLongDirection(float u, float v)
+{
+  const float theta = (u - 0.5f) * float(2.0 * M_PI);
+  const float gamma = (v - 0.5f) * float(M_PI);
+  return {std::cos(gamma) * std::cos(theta), -std::sin(gamma), std::cos(gamma) * std::sin(theta)};
+}
+
+// The LUT does not depend on whether the sky is in use
+static bool sameSky(SunAndSky a, SunAndSky b)
+{
+  a.in_use = b.in_use = 0;
+  return memcmp(&a, &b, sizeof(SunAndSky)) == 0;
+}
+
+
+void SkyLut::setup(const VkDevice& device, uint32_t familyIndex, nvvk::ResourceAllocator* allocator)
+{
+  m_device      = device;
+  m_alloc       = allocator;
+  m_familyIndex = familyIndex;
+  m_debug.setup(device);
+}
+
+void SkyLut::destroy()
+{
+  m_alloc->destroy(m_texSky);
+  m_alloc->destroy(m_accelImpSmpl);
+  for(auto& b : m_staging)
+    m_alloc->destroy(b);
+  m_staging.clear();
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// Evaluating the analytic model at each texel center and building the alias map of the result
+//
+void SkyLut::bake(const SunAndSky& ss)
+{
+  m_pixels.resize(kWidth * kHeight * 4);
+
+  nvh::parallel_batches<kWidth>(
+      kWidth * kHeight,
+      [&](uint64_t idx) {
+        const uint32_t x   = uint32_t(idx % kWidth);
+        const uint32_t y   = uint32_t(idx / kWidth);
+        glm::vec3      dir = latLongDirection((float(x) + 0.5f) / float(kWidth), (float(y) + 0.5f) / float(kHeight));
+        glm::vec3      c   = evalSunAndSky(ss, dir);
+        float*         p   = &m_pixels[idx * 4];
+        p[0]               = c.x;
+        p[1]               = c.y;
+        p[2]               = c.z;
+        p[3]               = 1.f;
+      },
+      std::thread::hardware_concurrency());
+
+  float integral, average;
+  m_envAccel = HdrSampling::createEnvironmentAccel(m_pixels.data(), VkExtent2D{kWidth, kHeight}, integral, average);
+  m_bakedSky = ss;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// Creating the texture, the importance sampling buffer and the staging buffers
+//
+void SkyLut::create(const SunAndSky& ss, uint32_t framesInFlight, bool validateLut /*= false*/)
+{
+  destroy();
+
+  MilliTimer timer;
+  LOGI("Baking sun & sky LUT (%ux%u)", kWidth, kHeight);
+  bake(ss);
+  timer.print();
+
+  VkSamplerCreateInfo samplerCreateInfo{VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO};
+  samplerCreateInfo.minFilter    = VK_FILTER_LINEAR;
+  samplerCreateInfo.magFilter    = VK_FILTER_LINEAR;
+  samplerCreateInfo.mipmapMode   = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+  samplerCreateInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;  // Same as the HDR, no leaking between poles
+  VkFormat          format       = VK_FORMAT_R32G32B32A32_SFLOAT;
+  VkImageCreateInfo icInfo       = nvvk::makeImage2DCreateInfo({kWidth, kHeight}, format);
+
+  {
+    VkQueue queue;
+    vkGetDeviceQueue(m_device, m_familyIndex, 0, &queue);
+
+    nvvk::ScopeCommandBuffer cmdBuf(m_device, m_familyIndex, queue);
+    nvvk::Image image  = m_alloc->createImage(cmdBuf, m_pixels.size() * sizeof(float), m_pixels.data(), icInfo);
+    VkImageViewCreateInfo ivInfo = nvvk::makeImageViewCreateInfo(image.image, icInfo);
+    m_texSky                     = m_alloc->createTexture(image, ivInfo, samplerCreateInfo);
+    NAME_VK(m_texSky.image);
+
+    m_accelImpSmpl = m_alloc->createBuffer(cmdBuf, m_envAccel, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+    NAME_VK(m_accelImpSmpl.buffer);
+  }
+  m_alloc->finalizeAndReleaseStaging();
+
+  const VkDeviceSize stagingSize = m_pixels.size() * sizeof(float) + m_envAccel.size() * sizeof(EnvAccel);
+  m_staging.resize(framesInFlight);
+  for(auto& b : m_staging)
+  {
+    b = m_alloc->createBuffer(stagingSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                              VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    NAME_VK(b.buffer);
+  }
+
+  if(validateLut)
+    validate(ss);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// Re-baking on parameter change, once the parameters stopped moving. The staging buffer of this frame is free since the frame fence
+// was waited on, the copies are ordered after all previous reads of the LUT on this queue.
+//
+bool SkyLut::update(const VkCommandBuffer& cmdBuf, uint32_t frameIndex, const SunAndSky& ss)
+{
+  if(ss.in_use == 0 || m_staging.empty() || sameSky(ss, m_bakedSky))
+  {
+    m_pendingFrames = 0;
+    return false;
+  }
+
+  m_settleFrames = m_pendingFrames > 0 && sameSky(ss, m_pendingSky) ? m_settleFrames + 1 : 0;
+  m_pendingSky   = ss;
+  if(++m_pendingFrames < kMaxPendingFrames && m_settleFrames < kSettleFrames)
+    return false;
+  m_pendingFrames = 0;
+
+  bake(ss);
+
+  const VkDeviceSize pixelBytes = m_pixels.size() * sizeof(float);
+  const VkDeviceSize accelBytes = m_envAccel.size() * sizeof(EnvAccel);
+  const nvvk::Buffer& staging   = m_staging[frameIndex % m_staging.size()];
+
+  auto* dst = static_cast<uint8_t*>(m_alloc->map(staging));
+  memcpy(dst, m_pixels.data(), pixelBytes);
+  memcpy(dst + pixelBytes, m_envAccel.data(), accelBytes);
+  m_alloc->unmap(staging);
+
+  // Previous readers of the importance table must be done before overwriting it
+  VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+  barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0,
+                       nullptr, 0, nullptr);
+  nvvk::cmdBarrierImageLayout(cmdBuf, m_texSky.image, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+
+  VkBufferImageCopy region{};
+  region.bufferOffset     = 0;
+  region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+  region.imageExtent      = {kWidth, kHeight, 1};
+  vkCmdCopyBufferToImage(cmdBuf, staging.buffer, m_texSky.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+  VkBufferCopy copy{pixelBytes, 0, accelBytes};
+  vkCmdCopyBuffer(cmdBuf, staging.buffer, m_accelImpSmpl.buffer, 1, &copy);
+
+  nvvk::cmdBarrierImageLayout(cmdBuf, m_texSky.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 1, &barrier, 0,
+                       nullptr, 0, nullptr);
+  return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// Bilinear fetch with the sampler of the texture: repeat in U, clamp in V
+//
+glm::vec3 SkyLut::lookup(const glm::vec3& direction) const
+{
+  const float u = std::atan2(direction.z, direction.x) * float(0.5 / M_PI) + 0.5f;
+  const float v = std::asin(glm::clamp(-direction.y, -1.f, 1.f)) * float(1.0 / M_PI) + 0.5f;
+
+  const float fx = u * kWidth - 0.5f;
+  const float fy = glm::clamp(v * kHeight - 0.5f, 0.f, float(kHeight - 1));
+  const int   x0 = int(std::floor(fx));
+  const int   y0 = int(std::floor(fy));
+  const float tx = fx - float(x0);
+  const float ty = fy - float(y0);
+
+  auto texel = [&](int x, int y) {
+    x              = (x % int(kWidth) + int(kWidth)) % int(kWidth);
+    y              = glm::clamp(y, 0, int(kHeight) - 1);
+    const float* p = &m_pixels[(y * kWidth + x) * 4];
+    return glm::vec3(p[0], p[1], p[2]);
+  };
+  return glm::mix(glm::mix(texel(x0, y0), texel(x0 + 1, y0), tx), glm::mix(texel(x0, y0 + 1), texel(x0 + 1, y0 + 1), tx), ty);
+}
+
+
+void SkyLut::validate(const SunAndSky& ss)
+{
+  const uint32_t numDirs = 4096;
+
+  std::mt19937                          rng(4321);
+  std::uniform_real_distribution<float> uni(0.f, 1.f);
+  std::vector<glm::vec3>                dirs;
+  dirs.reserve(numDirs);
+
+  // The sun disk is a few texels wide at most, it is left out of the error but not of the timing
+  const glm::vec3 sunDir    = glm::normalize(ss.sun_direction);
+  const float     sunRadius = 0.00465f * ss.sun_disk_scale * 10.f;
+  const float     sunCos    = std::cos(std::min(3.f * sunRadius + float(2.0 * M_PI) / kWidth, float(M_PI)));
+
+  while(dirs.size() < numDirs)
+  {
+    const float z   = 1.f - 2.f * uni(rng);
+    const float phi = uni(rng) * float(2.0 * M_PI);
+    const float r   = std::sqrt(std::max(0.f, 1.f - z * z));
+    dirs.emplace_back(r * std::cos(phi), z, r * std::sin(phi));
+  }
+
+  std::vector<glm::vec3> reference(numDirs), baked(numDirs);
+  MilliTimer             timer;
+  for(uint32_t i = 0; i < numDirs; i++)
+    reference[i] = evalSunAndSky(ss, dirs[i]);
+  const double evalMs = timer.elapsed();
+  timer.reset();
+  for(uint32_t i = 0; i < numDirs; i++)
+    baked[i] = lookup(dirs[i]);
+  const double lookupMs = timer.elapsed();
+
+  auto  lum         = [](const glm::vec3& c) { return glm::dot(c, glm::vec3(0.2126f, 0.7152f, 0.0722f)); };
+  float avgRelError = 0.f, maxRelError = 0.f;
+  int   count       = 0;
+  for(uint32_t i = 0; i < numDirs; i++)
+  {
+    if(glm::dot(dirs[i], sunDir) > sunCos)
+      continue;
+    const float ref = lum(reference[i]);
+    const float err = std::abs(lum(baked[i]) - ref) / std::max(ref, 1e-6f);
+    avgRelError += err;
+    maxRelError = std::max(maxRelError, err);
+    count++;
+  }
+  avgRelError /= float(std::max(count, 1));
+
+  LOGI("Sky LUT vs analytic model (%d dirs): avg %.2f%%, max %.2f%% relative error\n", count, avgRelError * 100.f,
+       maxRelError * 100.f);
+  LOGI("Sky LUT CPU cost per miss: analytic %.1f ns, bilinear fetch %.1f ns\n", evalMs * 1e6 / numDirs, lookupMs * 1e6 / numDirs);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+#include "shaders/host_device.h"
+#include "sun_and_sky.hpp"
+
+#include "nvvk/debug_util_vk.hpp"
+#include "nvvk/resourceallocator_vk.hpp"
+
+//--------------------------------------------------------------------------------------------------
+// Sun & sky baked in a lat-long texture (same mapping as the HDR, see GetSphericalUv) with its
+// importance sampling table, so a miss costs one texture fetch instead of the analytic model.
+// The bake runs on the CPU when the SunAndSky parameters change, debounced so dragging a slider
+// does not re-bake every frame. The upload is recorded in the frame command buffer through one
+// staging buffer per frame in flight.
+//
+class SkyLut
+{
+public:
+  static constexpr uint32_t kWidth  = 256;
+  static constexpr uint32_t kHeight = 128;
+  // Re-bake once the parameters hold for kSettleFrames frames, at the latest kMaxPendingFrames
+  // after the first change
+  static constexpr uint32_t kSettleFrames     = 3;
+  static constexpr uint32_t kMaxPendingFrames = 16;
+
+  void setup(const VkDevice& device, uint32_t familyIndex, nvvk::ResourceAllocator* allocator);
+  void create(const SunAndSky& ss, uint32_t framesInFlight, bool validateLut = false);
+  void destroy();
+
+  // Returns true when the sky was re-baked and the upload recorded
+  bool update(const VkCommandBuffer& cmdBuf, uint32_t frameIndex, const SunAndSky& ss);
+  // Parameters of the sky currently in the LUT
+  const SunAndSky& getBakedSky() const { return m_bakedSky; }
+
+  // LUT lookups against the analytic model at random directions, logs the error and the cost
+  void validate(const SunAndSky& ss);
+
+  // Resources
+  nvvk::Texture m_texSky;
+  nvvk::Buffer  m_accelImpSmpl;
+
+private:
+  VkDevice                 m_device{VK_NULL_HANDLE};
+  uint32_t                 m_familyIndex{0};
+  nvvk::ResourceAllocator* m_alloc{nullptr};
+  nvvk::DebugUtil          m_debug;
+
+  std::vector<nvvk::Buffer> m_staging;  // One per frame in flight: pixels followed by the EnvAccel table
+  std::vector<float>        m_pixels;
+  std::vector<EnvAccel>     m_envAccel;
+  SunAndSky                 m_bakedSky{};
+  SunAndSky                 m_pendingSky{};  // Last parameters seen while a re-bake is pending
+  uint32_t                  m_pendingFrames{0};
+  uint32_t                  m_settleFrames{0};
+
+  void      bake(const SunAndSky& ss);
+  glm::vec3 lookup(const glm::vec3& direction) const;
+};
@@ -0,0 +1,261 @@
+#define _USE_MATH_DEFINES
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "spherical_harmonics.hpp"
+#include "sun_and_sky.hpp"
+#include "tools.hpp"
+
+#ifndef CPP
+#define CPP
+#endif
+
+// Same code as the shaders, so the validation checks what the GPU evaluates
+namespace glsl_sh {
+using namespace glm;
+#include "shaders/spherical_harmonics.glsl"
+#include "shaders/msme.glsl"
+}  // namespace glsl_sh
+
+
+namespace EnvSHProjection {
+
+// Real SH basis up to band 2, same ordering and constants as spherical_harmonics.glsl
+static void shBasis(const glm::vec3& n, float b[9])
+{
+  b[0] = 0.282095f;
+  b[1] = 0.488603f * n.y;
+  b[2] = 0.488603f * n.z;
+  b[3] = 0.488603f * n.x;
+  b[4] = 1.092548f * n.x * n.y;
+  b[5] = 1.092548f * n.y * n.z;
+  b[6] = 0.315392f * (3.0f * n.z * n.z - 1.0f);
+  b[7] = 1.092548f * n.x * n.z;
+  b[8] = 0.546274f * (n.x * n.x - n.y * n.y);
+}
+
+// Inverse of GetSphericalUv (common.glsl)
+static glm::vec3 latLongDirection(float u, float v)
+{
+  const float theta = (u - 0.5f) * float(2.0 * M_PI);
+  const float gamma = (v - 0.5f) * float(M_PI);
+  return {std::cos(gamma) * std::cos(theta), -std::sin(gamma), std::cos(gamma) * std::sin(theta)};
+}
+
+static glm::vec3 latLongFetch(const float* pixels, uint32_t width, uint32_t height, const glm::vec3& dir)
+{
+  const float u = std::atan2(dir.z, dir.x) * float(0.5 / M_PI) + 0.5f;
+  const float v = std::asin(glm::clamp(-dir.y, -1.f, 1.f)) * float(1.0 / M_PI) + 0.5f;
+  const uint32_t x = std::min(uint32_t(u * width), width - 1);
+  const uint32_t y = std::min(uint32_t(v * height), height - 1);
+  const float*   p = &pixels[(y * width + x) * 4];
+  return {p[0], p[1], p[2]};
+}
+
+// Solid angle of a texel row of a lat-long map
+static float rowSolidAngle(uint32_t y, uint32_t width, uint32_t height)
+{
+  const float gamma0 = (float(y) / float(height) - 0.5f) * float(M_PI);
+  const float gamma1 = (float(y + 1) / float(height) - 0.5f) * float(M_PI);
+  return (std::sin(gamma1) - std::sin(gamma0)) * float(2.0 * M_PI) / float(width);
+}
+
+static void accumulate(glm::dvec3 acc[9], const glm::vec3& dir, const glm::vec3& radiance, float dOmega)
+{
+  float b[9];
+  shBasis(dir, b);
+  for(int i = 0; i < 9; i++)
+    acc[i] += glm::dvec3(radiance) * double(b[i] * dOmega);
+}
+
+// Radiance to irradiance: convolution with the clamped cosine, band factors pi, 2pi/3, pi/4
+static EnvSH finalize(const glm::dvec3 acc[9])
+{
+  const double band[9] = {M_PI, 2.0 * M_PI / 3.0, 2.0 * M_PI / 3.0, 2.0 * M_PI / 3.0, M_PI / 4.0,
+                          M_PI / 4.0, M_PI / 4.0, M_PI / 4.0, M_PI / 4.0};
+  EnvSH sh{};
+  for(int i = 0; i < 9; i++)
+    sh.coeffs[i] = glm::vec4(glm::vec3(acc[i] * band[i]), 0.f);
+  sh.coeffs[0].w = 1.f;
+  return sh;
+}
+
+static float luminance(const glm::vec3& c)
+{
+  return glm::dot(c, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+
+EnvSH projectLatLong(const float* pixels, uint32_t width, uint32_t height)
+{
+  glm::dvec3 acc[9]{};
+  for(uint32_t y = 0; y < height; y++)
+  {
+    const float dOmega = rowSolidAngle(y, width, height);
+    const float v      = (float(y) + 0.5f) / float(height);
+    for(uint32_t x = 0; x < width; x++)
+    {
+      const float* p = &pixels[(y * width + x) * 4];
+      accumulate(acc, latLongDirection((float(x) + 0.5f) / float(width), v), {p[0], p[1], p[2]}, dOmega);
+    }
+  }
+  return finalize(acc);
+}
+
+
+EnvSH projectSunAndSky(const SunAndSky& ss)
+{
+  // The sky is smooth, a coarse grid is enough. The sun disk is a few texels wide at most and is
+  // integrated on its own cap, grid texels falling in that cap are skipped.
+  const uint32_t width = 128, height = 64;
+
+  const bool      hasSun    = ss.sun_disk_intensity > 0.f && ss.sun_disk_scale > 0.f;
+  const glm::vec3 sunDir    = glm::normalize(ss.sun_direction);
+  const float     capRadius = 2.f * 0.00465f * ss.sun_disk_scale * 10.f;  // sun_radius in sun_and_sky.glsl, with margin
+  const float     capCos    = std::cos(std::min(capRadius, float(M_PI)));
+
+  glm::dvec3 acc[9]{};
+  for(uint32_t y = 0; y < height; y++)
+  {
+    const float dOmega = rowSolidAngle(y, width, height);
+    const float v      = (float(y) + 0.5f) / float(height);
+    for(uint32_t x = 0; x < width; x++)
+    {
+      glm::vec3 dir = latLongDirection((float(x) + 0.5f) / float(width), v);
+      if(hasSun && glm::dot(dir, sunDir) > capCos)
+        continue;
+      accumulate(acc, dir, evalSunAndSky(ss, dir), dOmega);
+    }
+  }
+
+  if(hasSun)
+  {
+    // Stratified samples over the cap, uniform in solid angle
+    const uint32_t  n = 32;
+    const float     capOmega = float(2.0 * M_PI) * (1.f - capCos);
+    const glm::vec3 t = glm::normalize(std::abs(sunDir.x) > 0.9f ? glm::cross(sunDir, glm::vec3(0, 1, 0)) :
+                                                                  glm::cross(sunDir, glm::vec3(1, 0, 0)));
+    const glm::vec3 b = glm::cross(sunDir, t);
+    for(uint32_t i = 0; i < n; i++)
+    {
+      for(uint32_t j = 0; j < n; j++)
+      {
+        const float cosT = 1.f - (float(i) + 0.5f) / float(n) * (1.f - capCos);
+        const float sinT = std::sqrt(std::max(0.f, 1.f - cosT * cosT));
+        const float phi  = (float(j) + 0.5f) / float(n) * float(2.0 * M_PI);
+        glm::vec3   dir  = sunDir * cosT + (t * std::cos(phi) + b * std::sin(phi)) * sinT;
+        accumulate(acc, dir, evalSunAndSky(ss, dir), capOmega / float(n * n));
+      }
+    }
+  }
+  return finalize(acc);
+}
+
+
+void validate(const EnvSH& sh, const float* pixels, uint32_t width, uint32_t height)
+{
+  MilliTimer timer;
+
+  // Axes and cube diagonals
+  std::vector<glm::vec3> normals;
+  for(int a = 0; a < 3; a++)
+  {
+    glm::vec3 n(0.f);
+    n[a] = 1.f;
+    normals.push_back(n);
+    normals.push_back(-n);
+  }
+  for(int i = 0; i < 8; i++)
+    normals.push_back(glm::normalize(glm::vec3(i & 1 ? 1 : -1, i & 2 ? 1 : -1, i & 4 ? 1 : -1)));
+
+  // Brute force: E(n) = sum L(w) max(0, n.w) dw over every texel
+  std::vector<glm::dvec3> reference(normals.size(), glm::dvec3(0.0));
+  for(uint32_t y = 0; y < height; y++)
+  {
+    const float dOmega = rowSolidAngle(y, width, height);
+    const float v      = (float(y) + 0.5f) / float(height);
+    for(uint32_t x = 0; x < width; x++)
+    {
+      const glm::vec3 dir = latLongDirection((float(x) + 0.5f) / float(width), v);
+      const float*    p   = &pixels[(y * width + x) * 4];
+      for(size_t k = 0; k < normals.size(); k++)
+      {
+        const float cosine = glm::dot(normals[k], dir);
+        if(cosine > 0.f)
+          reference[k] += glm::dvec3(p[0], p[1], p[2]) * double(cosine * dOmega);
+      }
+    }
+  }
+
+  float maxRelError = 0.f;
+  float avgRelError = 0.f;
+  for(size_t k = 0; k < normals.size(); k++)
+  {
+    const float ref = luminance(glm::vec3(reference[k]));
+    const float est = luminance(glsl_sh::shIrradiance(sh, normals[k]));
+    const float err = std::abs(est - ref) / std::max(ref, 1e-6f);
+    maxRelError     = std::max(maxRelError, err);
+    avgRelError += err / float(normals.size());
+  }
+  LOGI("SH irradiance vs brute force (%zu normals): avg %.2f%%, max %.2f%% relative error\n", normals.size(),
+       avgRelError * 100.f, maxRelError * 100.f);
+
+  // Convergence replay: what surfel_integrate.comp feeds MSME for a fresh surfel (64 rays the first
+  // frames, 4 packs of 16 cosine-weighted samples) until the mean stays within 10% of the reference.
+  // Unoccluded sky, so it is the best case for the seed.
+  const int   maxFrames = 600;
+  const int   packs = 4, packSize = 16;
+  const float tolerance = 0.1f;
+
+  std::mt19937                          rng(1234);
+  std::uniform_real_distribution<float> uni(0.f, 1.f);
+
+  auto framesToConverge = [&](const glm::vec3& n, const glm::vec3& seed, float ref) {
+    MSMEData data{};
+    data.mean          = seed;
+    data.shortMean     = seed;
+    data.vbbr          = 0.f;
+    data.variance      = glm::vec3(1.f);
+    data.inconsistency = 1.f;
+
+    const glm::vec3 t = glm::normalize(std::abs(n.x) > 0.9f ? glm::cross(n, glm::vec3(0, 1, 0)) : glm::cross(n, glm::vec3(1, 0, 0)));
+    const glm::vec3 b = glm::cross(n, t);
+
+    int lastOutside = 0;
+    for(int frame = 1; frame <= maxFrames; frame++)
+    {
+      for(int p = 0; p < packs; p++)
+      {
+        glm::vec3 y(0.f);
+        for(int s = 0; s < packSize; s++)
+        {
+          // Cosine sampling: L * cos / pdf = pi * L
+          const float r   = std::sqrt(uni(rng));
+          const float phi = uni(rng) * float(2.0 * M_PI);
+          glm::vec3   dir = t * (r * std::cos(phi)) + b * (r * std::sin(phi)) + n * std::sqrt(std::max(0.f, 1.f - r * r));
+          y += latLongFetch(pixels, width, height, dir) * float(M_PI);
+        }
+        glsl_sh::MSME(y / float(packSize), data, 0.01f);
+      }
+      if(std::abs(luminance(data.mean) - ref) > tolerance * ref)
+        lastOutside = frame;
+    }
+    return lastOutside;
+  };
+
+  float coldFrames = 0.f, seededFrames = 0.f;
+  for(size_t k = 0; k < normals.size(); k++)
+  {
+    const float ref = luminance(glm::vec3(reference[k]));
+    coldFrames += float(framesToConverge(normals[k], glm::vec3(0.f), ref)) / float(normals.size());
+    seededFrames += float(framesToConverge(normals[k], glsl_sh::shIrradiance(sh, normals[k]), ref)) / float(normals.size());
+  }
+  LOGI("Surfel convergence (within %.0f%%): black seed %.1f frames, SH seed %.1f frames, %.1f saved", tolerance * 100.f,
+       coldFrames, seededFrames, coldFrames - seededFrames);
+  timer.print();
+}
+
+}  // namespace EnvSHProjection
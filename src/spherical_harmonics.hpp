@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+#include <glm/glm.hpp>
+#include "shaders/host_device.h"
+
+//--------------------------------------------------------------------------------------------------
+// L2 spherical harmonics projection of the environment, used to give freshly spawned surfels a
+// plausible starting irradiance instead of black (see surfel_generation_pass.comp).
+// All results are EnvSH, convolved with the cosine lobe and ready for shIrradiance().
+//
+namespace EnvSHProjection {
+
+// Lat-long RGBA32F radiance as mapped by GetSphericalUv (the layout stbi_loadf returns)
+EnvSH projectLatLong(const float* pixels, uint32_t width, uint32_t height);
+
+// Analytic sun & sky, the sun disk is integrated separately so it is not missed by the grid
+EnvSH projectSunAndSky(const SunAndSky& ss);
+
+// Compares the SH irradiance against a brute-force cosine integral of the map over a set of
+// normals, then replays the surfel MSME on the CPU from a black and from an SH seed to report
+// how many frames the seed saves. Results go to the log.
+void validate(const EnvSH& sh, const float* pixels, uint32_t width, uint32_t height);
+
+}  // namespace EnvSHProjection
@@ -0,0 +1,20 @@
+#define _USE_MATH_DEFINES
+#include <cmath>
+
+#include "sun_and_sky.hpp"
+
+#ifndef CPP
+#define CPP
+#endif
+
+// The shader code is written against the GLSL built-ins, glm provides all of them.
+namespace glsl_sky {
+using namespace glm;
+#include "shaders/sun_and_sky.glsl"
+}  // namespace glsl_sky
+
+
+glm::vec3 evalSunAndSky(const SunAndSky& ss, const glm::vec3& direction)
+{
+  return glsl_sky::sun_and_sky(ss, direction);
+}
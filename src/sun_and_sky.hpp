@@ -0,0 +1,11 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include "shaders/host_device.h"
+
+//--------------------------------------------------------------------------------------------------
+// CPU evaluation of the analytic sun & sky model, compiled from shaders/sun_and_sky.glsl,
+// so the host sees exactly what a miss returns on the GPU (without hdrMultiplier).
+// Kept apart from SkyLut so the CPU-only tools do not pull in Vulkan.
+//
+glm::vec3 evalSunAndSky(const SunAndSky& ss, const glm::vec3& direction);
@@ -0,0 +1,150 @@
+#include "surfel_cache.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <istream>
+#include <iterator>
+#include <ostream>
+
+#include "nvh/nvprint.hpp"
+
+namespace {
+constexpr uint32_t kCacheMagic   = 0x4c465253;  // "SRFL"
+constexpr uint32_t kCacheVersion = 2;  // 2: source
+
+// Fixed part of the file, the arrays of SurfelCache follow in the order of its members
+struct CacheHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t sceneHash;
+  uint32_t surfelCount;
+  uint32_t tileSize;        // kSurfelTileSize
+  uint32_t source;          // SurfelCache::Source
+  uint32_t recordSizes[4];  // Surfel, SurfelCold, SurfelRecycleInfo, SurfelGuide
+};
+
+CacheHeader makeHeader(uint64_t sceneHash, uint32_t surfelCount, SurfelCache::Source source)
+{
+  return {kCacheMagic,
+          kCacheVersion,
+          sceneHash,
+          surfelCount,
+          kSurfelTileSize,
+          uint32_t(source),
+          {sizeof(Surfel), sizeof(SurfelCold), sizeof(SurfelRecycleInfo), sizeof(SurfelGuide)}};
+}
+
+template <typename T>
+void writeArray(std::ostream& out, const std::vector<T>& values)
+{
+  out.write(reinterpret_cast<const char*>(values.data()), std::streamsize(values.size() * sizeof(T)));
+}
+
+template <typename T>
+bool readArray(std::istream& in, std::vector<T>& values)
+{
+  return bool(in.read(reinterpret_cast<char*>(values.data()), std::streamsize(values.size() * sizeof(T))));
+}
+}  // namespace
+
+
+void SurfelCache::resize(uint32_t count)
+{
+  surfels.resize(count);
+  cold.resize(count);
+  recycle.resize(count);
+  guide.resize(count);
+  irradiance.resize(size_t(count) * kSurfelGuideEntries);
+  depth.resize(size_t(count) * kSurfelGuideEntries);
+}
+
+size_t SurfelCache::getByteSize() const
+{
+  return sizeof(CacheHeader) + surfels.size() * sizeof(Surfel) + cold.size() * sizeof(SurfelCold)
+         + recycle.size() * sizeof(SurfelRecycleInfo) + guide.size() * sizeof(SurfelGuide)
+         + (irradiance.size() + depth.size()) * sizeof(uint16_t);
+}
+
+bool SurfelCache::write(std::ostream& out) const
+{
+  const CacheHeader header = makeHeader(sceneHash, getSurfelCount(), source);
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  writeArray(out, surfels);
+  writeArray(out, cold);
+  writeArray(out, recycle);
+  writeArray(out, guide);
+  writeArray(out, irradiance);
+  writeArray(out, depth);
+  return bool(out);
+}
+
+bool SurfelCache::read(std::istream& in, uint64_t expectedSceneHash)
+{
+  CacheHeader header{};
+  if(!in.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != kCacheMagic)
+  {
+    LOGE("Surfel cache: not a surfel cache\n");
+    return false;
+  }
+  const CacheHeader expected = makeHeader(expectedSceneHash, header.surfelCount, Source::eRuntime);
+  if(header.version != expected.version || header.tileSize != expected.tileSize
+     || !std::equal(std::begin(header.recordSizes), std::end(header.recordSizes), std::begin(expected.recordSizes)))
+  {
+    LOGE("Surfel cache: version %u with %u texel tiles, made by another build\n", header.version, header.tileSize);
+    return false;
+  }
+  if(header.source > uint32_t(Source::eBake))
+  {
+    LOGE("Surfel cache: unknown source %u\n", header.source);
+    return false;
+  }
+  if(header.sceneHash != expectedSceneHash)
+  {
+    LOGI("Surfel cache: made for another scene (hash %016llx, scene %016llx)\n",
+         (unsigned long long)header.sceneHash, (unsigned long long)expectedSceneHash);
+    return false;
+  }
+
+  resize(header.surfelCount);
+  sceneHash = header.sceneHash;
+  source    = Source(header.source);
+  if(!readArray(in, surfels) || !readArray(in, cold) || !readArray(in, recycle) || !readArray(in, guide)
+     || !readArray(in, irradiance) || !readArray(in, depth))
+  {
+    LOGE("Surfel cache: truncated, %u surfels expected\n", header.surfelCount);
+    resize(0);
+    return false;
+  }
+  return true;
+}
+
+void SurfelCache::seedConfidence()
+{
+  // As surfel_generation_pass.comp spawns a surfel
+  for(SurfelCold& c : cold)
+  {
+    c.msmeData.vbbr          = 0.f;
+    c.msmeData.variance      = glm::vec3(1.f);
+    c.msmeData.inconsistency = 1.f;
+  }
+}
+
+bool SurfelCache::save(const std::string& filename) const
+{
+  std::ofstream file(filename, std::ios::binary);
+  if(!file || !write(file))
+  {
+    LOGE("Surfel cache: cannot write %s\n", filename.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool SurfelCache::load(const std::string& filename, uint64_t expectedSceneHash)
+{
+  std::ifstream file(filename, std::ios::binary);
+  if(!file)
+    return false;  // No cache yet
+  return read(file, expectedSceneHash);
+}
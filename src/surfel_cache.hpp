@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include "shaders/host_device.h"
+
+//--------------------------------------------------------------------------------------------------
+// Alive surfels of a scene kept on disk, so a launch starts from the surfels of the last one instead
+// of an empty pool that the generation pass fills one surfel per tile and frame.
+// - The records are compacted in the order of the alive list. A load gives them the IDs [0, count)
+//   with their atlas tiles, the dead list holds the IDs after them (SurfelGI::loadCache,
+//   SurfelReference::loadCache).
+// - Positions are in world space: the cache does not depend on the camera nor on the grid origin.
+//   The cells are not kept, the first frame after a load bins the surfels again.
+// - The atlas texels are in the formats of the images, R16F irradiance and RG8 depth.
+// - The source tells the radiance of the application from the CPU approximation of surfel_bake,
+//   loaded as a seed only: see seedConfidence.
+// A file is refused when its scene hash (CpuBvh::getGeometryHash) or the record layout differ.
+//
+struct SurfelCache
+{
+  enum class Source : uint32_t
+  {
+    eRuntime,  // Saved by the application
+    eBake,     // surfel_bake: constant albedo lit by the sun & sky only
+  };
+
+  uint64_t                       sceneHash{0};
+  Source                         source{Source::eRuntime};
+  std::vector<Surfel>            surfels;
+  std::vector<SurfelCold>        cold;
+  std::vector<SurfelRecycleInfo> recycle;
+  std::vector<SurfelGuide>       guide;
+  std::vector<uint16_t>          irradiance;  // kSurfelGuideEntries texels per surfel, row major in the tile
+  std::vector<uint16_t>          depth;       // Same, the two unorm8 of a texel
+
+  uint32_t getSurfelCount() const { return uint32_t(surfels.size()); }
+  void     resize(uint32_t count);
+  size_t   getByteSize() const;  // Of the file
+
+  bool write(std::ostream& out) const;
+  // Returns false and logs the reason on a bad file, another record layout or another scene
+  bool read(std::istream& in, uint64_t expectedSceneHash);
+  bool save(const std::string& filename) const;
+  bool load(const std::string& filename, uint64_t expectedSceneHash);
+
+  // Resets the MSME variance and inconsistency as a new surfel has them, keeping the mean: the first
+  // rays of the loaded surfels weigh as much as on a spawn instead of being filtered against a
+  // converged estimate. For the baked caches, whose radiance ignores the materials and the lights.
+  void seedConfidence();
+
+  // Texel of the atlases where the tile of a surfel starts, as surfel_integrate.comp places it
+  static glm::uvec2 getTileOrigin(uint32_t surfelIndex, uint32_t atlasWidth)
+  {
+    const uint32_t tilesPerRow = atlasWidth / kSurfelTileSize;
+    return glm::uvec2(surfelIndex % tilesPerRow, surfelIndex / tilesPerRow) * kSurfelTileSize;
+  }
+
+  // The cache file next to the scene
+  static std::string getFilename(const std::string& sceneFile) { return sceneFile + ".surfels"; }
+};
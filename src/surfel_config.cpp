@@ -0,0 +1,180 @@
+#include "surfel_config.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <fstream>
+#include <sstream>
+
+#include "nvh/inputparser.h"
+#include "nvh/nvprint.hpp"
+
+namespace {
+// Side of the irradiance / depth atlas every device supports (maxImageDimension2D of current GPUs)
+constexpr uint32_t kAtlasMaxDimension = 16384;
+
+template <typename T>
+bool parseValue(const std::string& text, T& value)
+{
+  std::istringstream stream(text);
+  T                  parsed{};
+  if(!(stream >> parsed) || !(stream >> std::ws).eof())
+    return false;
+  value = parsed;
+  return true;
+}
+}  // namespace
+
+
+bool SurfelConfig::set(const std::string& name, const std::string& value)
+{
+  bool valid = false;
+  if(name == "maxSurfelCount")
+  {
+    valid = parseValue(value, maxSurfelCount);
+    if(valid)
+      maxRayCount = maxSurfelCount * kRaysPerSurfel;
+  }
+  else if(name == "maxRayCount")
+    valid = parseValue(value, maxRayCount);
+  else if(name == "maxLife")
+    valid = parseValue(value, maxLife);
+  else if(name == "gridSize")
+    valid = parseValue(value, gridSize);
+  else if(name == "gridSplits")
+    valid = parseValue(value, gridSplits);
+  else if(name == "gridRatio")
+    valid = parseValue(value, gridRatio);
+  else if(name == "gridLayers")
+    valid = parseValue(value, gridLayers);
+  else
+  {
+    LOGE("Surfel config: unknown setting %s\n", name.c_str());
+    return false;
+  }
+
+  if(!valid)
+    LOGE("Surfel config: bad value '%s' for %s\n", value.c_str(), name.c_str());
+  return valid;
+}
+
+bool SurfelConfig::load(const std::string& filename)
+{
+  std::ifstream file(filename);
+  if(!file)
+  {
+    LOGE("Surfel config: cannot open %s\n", filename.c_str());
+    return false;
+  }
+
+  // maxRayCount follows maxSurfelCount unless the file sets it, wherever it comes in the file
+  bool        valid = true;
+  std::string rayCount;
+  std::string line;
+  while(std::getline(file, line))
+  {
+    line = line.substr(0, line.find('#'));
+    std::istringstream stream(line);
+    std::string        name, value;
+    if(!(stream >> name))
+      continue;
+    std::getline(stream >> std::ws, value);
+    if(name == "maxRayCount")
+      rayCount = value;
+    else
+      valid &= set(name, value);
+  }
+  if(!rayCount.empty())
+    valid &= set("maxRayCount", rayCount);
+  return valid;
+}
+
+bool SurfelConfig::parse(const InputParser& parser)
+{
+  bool valid = true;
+  if(parser.exist("-maxsurfels"))
+    valid &= set("maxSurfelCount", parser.getString("-maxsurfels"));
+  if(parser.exist("-maxrays"))
+    valid &= set("maxRayCount", parser.getString("-maxrays"));
+  if(parser.exist("-surfellife"))
+    valid &= set("maxLife", parser.getString("-surfellife"));
+  if(parser.exist("-grid"))
+  {
+    auto items = parser.getString("-grid", 4);
+    if(items.size() != 4)
+    {
+      LOGE("Surfel config: -grid expects <size> <splits> <ratio> <layers>\n");
+      return false;
+    }
+    valid &= set("gridSize", items[0]) && set("gridSplits", items[1]) && set("gridRatio", items[2])
+             && set("gridLayers", items[3]);
+  }
+  return valid;
+}
+
+bool SurfelConfig::validate() const
+{
+  bool valid = true;
+  auto check = [&valid](bool condition, const char* message) {
+    if(!condition)
+      LOGE("Surfel config: %s\n", message);
+    valid &= condition;
+  };
+
+  check(maxSurfelCount >= kSurfelGroupSize, "maxSurfelCount must be at least one workgroup (32)");
+  check(maxSurfelCount <= kCellScanBlockSize * kCellScanMaxBlocks, "maxSurfelCount must be at most 1M (ray budget scan)");
+  check(glm::all(glm::lessThanEqual(getAtlasSize(), glm::uvec2(kAtlasMaxDimension))),
+        "maxSurfelCount must fit in a 16384 x 16384 irradiance atlas");
+  check(maxRayCount >= maxSurfelCount && uint64_t(maxRayCount) <= uint64_t(maxSurfelCount) * 1024,
+        "maxRayCount must be 1 to 1024 rays per surfel");
+  check(maxLife >= 2, "maxLife must be at least 2 frames");
+  check(gridSize > 0.f && std::isfinite(gridSize), "gridSize must be positive");
+  check(gridSplits >= 2 && gridSplits % 2 == 0 && gridSplits <= 256, "gridSplits must be even, 2 to 256");
+  check(gridRatio > 1.f && gridRatio <= 4.f, "gridRatio must be in (1, 4]");
+  check(gridLayers >= 1 && gridLayers <= 256, "gridLayers must be 1 to 256");
+  if(valid)
+    check(getCellCount() <= kCellScanBlockSize * kCellScanMaxBlocks, "the grid has more cells than the binning scan handles (1M)");
+  return valid;
+}
+
+void SurfelConfig::apply() const
+{
+  surfel_spec::kMaxSurfelCount = maxSurfelCount;
+  surfel_spec::kMaxRayCount    = maxRayCount;
+  surfel_spec::kMaxLife        = maxLife;
+  surfel_spec::d               = gridSize;
+  surfel_spec::n               = gridSplits;
+  surfel_spec::p               = gridRatio;
+  surfel_spec::m               = gridLayers;
+}
+
+void SurfelConfig::print() const
+{
+  LOGI("Surfel config: %u surfels, %u rays, life %u frames\n", maxSurfelCount, maxRayCount, maxLife);
+  LOGI("  grid: cube %.2f split %d (cells of %.3f), %d frustum layers of ratio %.3f, extent %.1f, %u cells\n",
+       gridSize, gridSplits, getCubeCellSize(), gridLayers, gridRatio, getGridExtent(), getCellCount());
+}
+
+uint32_t SurfelConfig::getCellCount() const
+{
+  return uint32_t(gridSplits * gridSplits * gridSplits + 6 * gridSplits * gridSplits * gridLayers);
+}
+
+uint32_t SurfelConfig::getCellBufferSize() const
+{
+  return std::max(getCellCount(), kCellHashCapacity);
+}
+
+float SurfelConfig::getGridExtent() const
+{
+  // Layer k of the frustums starts at half_d + delta * (1 - p^k) / (1 - p), see getFrustumLayerBounds
+  const float delta = getCubeCellSize();
+  return gridSize * 0.5f + delta * (1.f - std::pow(gridRatio, float(gridLayers))) / (1.f - gridRatio);
+}
+
+glm::uvec2 SurfelConfig::getAtlasSize() const
+{
+  const uint32_t tilesPerRow = uint32_t(std::ceil(std::sqrt(double(maxSurfelCount))));
+  const uint32_t rows        = (maxSurfelCount + tilesPerRow - 1) / tilesPerRow;
+  return glm::uvec2(tilesPerRow, rows) * kSurfelTileSize;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include <glm/glm.hpp>
+#include "shaders/host_device.h"
+
+class InputParser;
+
+//--------------------------------------------------------------------------------------------------
+// Surfel capacity and grid parameters, the SURFEL_CONSTANT values of host_device.h (surfel_spec).
+// They come from a config file and the command line and are applied before SurfelGI::createResources
+// sizes the buffers; the surfel passes specialize their shaders with them (SurfelSpecialization).
+// Config file: one "name value" per line, '#' starts a comment, the names are the members below.
+//
+struct SurfelConfig  // Defaults to the values in use
+{
+  uint32_t maxSurfelCount{surfel_spec::kMaxSurfelCount};
+  uint32_t maxRayCount{surfel_spec::kMaxRayCount};
+  uint32_t maxLife{surfel_spec::kMaxLife};
+  float    gridSize{surfel_spec::d};    // Size of the uniform cube
+  int      gridSplits{surfel_spec::n};  // Split count of the cube and of the frustums, even
+  float    gridRatio{surfel_spec::p};   // Growth of the frustum layers
+  int      gridLayers{surfel_spec::m};  // Layers of each frustum
+
+  static constexpr uint32_t kRaysPerSurfel = 64;  // maxRayCount when only maxSurfelCount is given
+
+  // Both return false and log the reason on an unknown name or a malformed value
+  bool load(const std::string& filename);
+  // -maxsurfels <count> -maxrays <count> -surfellife <frames> -grid <d> <n> <p> <m>
+  bool parse(const InputParser& parser);
+
+  bool validate() const;  // Logs what is out of range
+  void apply() const;     // Sets the host_device.h values, the surfel resources must be created after
+  void print() const;
+
+  uint32_t getCellCount() const;        // Cube and frustum cells, SurfelGI::totalCellCount
+  uint32_t getCellBufferSize() const;   // Entries of the cell buffer, the hash slots come first
+  float    getGridExtent() const;       // Distance from the grid origin to the far side of the frustums
+  float    getCubeCellSize() const { return gridSize / float(gridSplits); }
+  // Texels of the irradiance / depth atlas: a near square of kSurfelTileSize tiles, one per surfel
+  glm::uvec2 getAtlasSize() const;
+
+private:
+  bool set(const std::string& name, const std::string& value);
+};
@@ -0,0 +1,78 @@
+#include "surfel_dispatch_args_pass.h"
+
+#include "nvvk/shaders_vk.hpp"
+#include "surfel_specialization.hpp"
+
+#include "autogen/surfel_dispatch_args.comp.h"
+
+
+void SurfelDispatchArgsPass::setup(const VkDevice& device)
+{
+	m_device = device;
+	m_debug.setup(device);
+}
+
+void SurfelDispatchArgsPass::destroy()
+{
+	for (auto& pipeline : m_pipelines)
+	{
+		vkDestroyPipeline(m_device, pipeline, nullptr);
+		pipeline = VK_NULL_HANDLE;
+	}
+	vkDestroyPipelineLayout(m_device, m_pipelineLayout, nullptr);
+
+	m_pipelineLayout = VK_NULL_HANDLE;
+}
+
+void SurfelDispatchArgsPass::run(const VkCommandBuffer& cmdBuf, Stage stage, const std::vector<VkDescriptorSet>& descSets)
+{
+	// The counters are written by the previous pass
+	VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+		1, &barrier, 0, nullptr, 0, nullptr);
+
+	vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelines[stage]);
+	vkCmdBindDescriptorSets(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelineLayout, 0,
+		static_cast<uint32_t>(descSets.size()), descSets.data(), 0, nullptr);
+	vkCmdDispatch(cmdBuf, 1, 1, 1);
+
+	// Arguments read by vkCmdDispatchIndirect, counters reset for the next pass
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void SurfelDispatchArgsPass::create(const std::vector<VkDescriptorSetLayout>& descSetsLayout)
+{
+	VkPipelineLayoutCreateInfo layout_info{ VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
+	layout_info.setLayoutCount = static_cast<uint32_t>(descSetsLayout.size());
+	layout_info.pSetLayouts = descSetsLayout.data();
+	vkCreatePipelineLayout(m_device, &layout_info, nullptr, &m_pipelineLayout);
+
+	// One pipeline per stage, selected by the specialization constant
+	SurfelSpecialization specialization;
+
+	VkComputePipelineCreateInfo computePipelineCreateInfo{ VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+	computePipelineCreateInfo.layout = m_pipelineLayout;
+	computePipelineCreateInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	computePipelineCreateInfo.stage.module = nvvk::createShaderModule(m_device, surfel_dispatch_args_comp, sizeof(surfel_dispatch_args_comp));
+	computePipelineCreateInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	computePipelineCreateInfo.stage.pName = "main";
+	computePipelineCreateInfo.stage.pSpecializationInfo = specialization.getInfo();
+
+	for (uint32_t stage = 0; stage < m_pipelines.size(); stage++)
+	{
+		specialization.setPhase(stage);
+		vkCreateComputePipelines(m_device, {}, 1, &computePipelineCreateInfo, nullptr, &m_pipelines[stage]);
+		m_debug.setObjectName(m_pipelines[stage], "Surfel Dispatch Args " + std::to_string(stage));
+	}
+	vkDestroyShaderModule(m_device, computePipelineCreateInfo.stage.module, nullptr);
+}
+
+const std::string SurfelDispatchArgsPass::name()
+{
+	return "Surfel Dispatch Args";
+}
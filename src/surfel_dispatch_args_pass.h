@@ -0,0 +1,33 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <vector>
+
+#include "nvvk/debug_util_vk.hpp"
+#include "shaders/host_device.h"
+
+// Writes SurfelDispatch from the surfel counters, for the passes dispatched indirectly.
+// The first stage also resets the per-frame counters of the cell hash.
+class SurfelDispatchArgsPass
+{
+public:
+	enum Stage
+	{
+		eAfterPrepare,  // update
+		eAfterUpdate,   // cellToSurfel, raytrace, integrate
+	};
+
+	void setup(const VkDevice& device);
+	void destroy();
+	void run(const VkCommandBuffer& cmdBuf, Stage stage, const std::vector<VkDescriptorSet>& descSets);
+	void create(const std::vector<VkDescriptorSetLayout>& descSetsLayout);
+	const std::string name();
+
+private:
+	nvvk::DebugUtil m_debug;
+	VkDevice        m_device{ VK_NULL_HANDLE };
+
+	VkPipelineLayout          m_pipelineLayout{ VK_NULL_HANDLE };
+	std::array<VkPipeline, 2> m_pipelines{};  // One per stage
+};
@@ -4,6 +4,7 @@
 #include "nvh/fileoperations.hpp"
 #include "nvvk/shaders_vk.hpp"
 #include "scene.hpp"
+#include "surfel_specialization.hpp"
 #include "tools.hpp"
 
 #include "autogen/surfel_generation_pass.comp.h"
@@ -61,6 +62,9 @@ void SurfelGenerationPass::create(const VkExtent2D& size, const std::vector<VkDe
 	computePipelineCreateInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
 	computePipelineCreateInfo.stage.pName = "main";
 
+	SurfelSpecialization specialization;
+	computePipelineCreateInfo.stage.pSpecializationInfo = specialization.getInfo();
+
 	vkCreateComputePipelines(m_device, {}, 1, &computePipelineCreateInfo, nullptr, &m_pipeline);
 
 	m_debug.setObjectName(m_pipeline, "Surfel Generation Pass");
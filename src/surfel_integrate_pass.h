@@ -23,6 +23,12 @@ public:
     void create(const VkExtent2D& size, const std::vector<VkDescriptorSetLayout>& descSetsLayout, Scene* _scene = nullptr);
     const std::string name();
     void          setPushContants(const RtxState& state) { m_state = state; }
+    // Dispatch sized on the GPU (SurfelDispatch) instead of by run()
+    void setIndirectDispatch(VkBuffer buffer, VkDeviceSize offset)
+    {
+        m_indirectBuffer = buffer;
+        m_indirectOffset = offset;
+    }
 
 private:
     // Setup
@@ -32,6 +38,9 @@ private:
     uint32_t                 m_queueIndex{ 0 };
 
 
+    VkBuffer     m_indirectBuffer{ VK_NULL_HANDLE };
+    VkDeviceSize m_indirectOffset{ 0 };
+
     VkPipelineLayout m_pipelineLayout{ VK_NULL_HANDLE };
     VkPipeline       m_pipeline{ VK_NULL_HANDLE };
     VkRenderPass     m_renderPass{ VK_NULL_HANDLE };
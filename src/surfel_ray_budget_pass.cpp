@@ -0,0 +1,106 @@
+#include "surfel_ray_budget_pass.h"
+
+#include <cassert>
+
+#include "nvh/alignment.hpp"
+#include "nvh/fileoperations.hpp"
+#include "nvvk/shaders_vk.hpp"
+#include "scene.hpp"
+#include "surfel_specialization.hpp"
+#include "tools.hpp"
+
+#include "autogen/surfel_ray_budget.comp.h"
+
+
+// Writes of a phase visible to the next one
+static void phaseBarrier(const VkCommandBuffer& cmdBuf)
+{
+	VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+		1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void SurfelRayBudgetPass::setup(const VkDevice& device, const VkPhysicalDevice& physicalDevice, uint32_t familyIndex, nvvk::ResourceAllocator* allocator)
+{
+	m_device = device;
+	m_pAlloc = allocator;
+	m_queueIndex = familyIndex;
+	m_debug.setup(device);
+}
+
+void SurfelRayBudgetPass::destroy()
+{
+	for (auto& pipeline : m_pipelines)
+	{
+		vkDestroyPipeline(m_device, pipeline, nullptr);
+		pipeline = VK_NULL_HANDLE;
+	}
+	vkDestroyPipelineLayout(m_device, m_pipelineLayout, nullptr);
+
+	m_pipelineLayout = VK_NULL_HANDLE;
+}
+
+void SurfelRayBudgetPass::run(const VkCommandBuffer& cmdBuf, const VkExtent2D& size, nvvk::ProfilerVK& profiler, const std::vector<VkDescriptorSet>& descSets)
+{
+	// size.width: surfel capacity, one workgroup of 256 per scan block then per 256 surfels
+	const uint32_t GROUP_SIZE = 256;
+	const uint32_t blockCount = (size.width + (kCellScanBlockSize - 1)) / kCellScanBlockSize;
+	assert(blockCount <= kCellScanMaxBlocks);
+
+	vkCmdBindDescriptorSets(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelineLayout, 0,
+		static_cast<uint32_t>(descSets.size()), descSets.data(), 0, nullptr);
+
+	// Sending the push constant information, the ray budget of the frame
+	vkCmdPushConstants(cmdBuf, m_pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(RtxState), &m_state);
+
+	// Block grants and scans, scan of the block sums, block offsets and rays
+	vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelines[0]);
+	vkCmdDispatch(cmdBuf, blockCount, 1, 1);
+	phaseBarrier(cmdBuf);
+
+	vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelines[1]);
+	vkCmdDispatch(cmdBuf, 1, 1, 1);
+	phaseBarrier(cmdBuf);
+
+	vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelines[2]);
+	vkCmdDispatch(cmdBuf, (size.width + (GROUP_SIZE - 1)) / GROUP_SIZE, 1, 1);
+}
+
+void SurfelRayBudgetPass::create(const VkExtent2D& size, const std::vector<VkDescriptorSetLayout>& descSetsLayout, Scene* _scene)
+{
+	std::vector<VkPushConstantRange> push_constants;
+	push_constants.push_back({ VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(RtxState) });
+
+	VkPipelineLayoutCreateInfo layout_info{ VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
+	layout_info.pushConstantRangeCount = static_cast<uint32_t>(push_constants.size());
+	layout_info.pPushConstantRanges = push_constants.data();
+	layout_info.setLayoutCount = static_cast<uint32_t>(descSetsLayout.size());
+	layout_info.pSetLayouts = descSetsLayout.data();
+	vkCreatePipelineLayout(m_device, &layout_info, nullptr, &m_pipelineLayout);
+
+	// One pipeline per phase, selected by the specialization constant
+	SurfelSpecialization specialization;
+
+	VkComputePipelineCreateInfo computePipelineCreateInfo{ VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+	computePipelineCreateInfo.layout = m_pipelineLayout;
+	computePipelineCreateInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	computePipelineCreateInfo.stage.module = nvvk::createShaderModule(m_device, surfel_ray_budget_comp, sizeof(surfel_ray_budget_comp));
+	computePipelineCreateInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	computePipelineCreateInfo.stage.pName = "main";
+	computePipelineCreateInfo.stage.pSpecializationInfo = specialization.getInfo();
+
+	for (uint32_t phase = 0; phase < m_pipelines.size(); phase++)
+	{
+		specialization.setPhase(phase);
+		vkCreateComputePipelines(m_device, {}, 1, &computePipelineCreateInfo, nullptr, &m_pipelines[phase]);
+		m_debug.setObjectName(m_pipelines[phase], "Surfel Ray Budget Pass " + std::to_string(phase));
+	}
+	vkDestroyShaderModule(m_device, computePipelineCreateInfo.stage.module, nullptr);
+}
+
+const std::string SurfelRayBudgetPass::name()
+{
+	return "Surfel Ray Budget Pass";
+}
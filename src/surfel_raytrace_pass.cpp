@@ -5,9 +5,22 @@
 #include "nvh/fileoperations.hpp"
 #include "nvvk/shaders_vk.hpp"
 #include "scene.hpp"
+#include "surfel_specialization.hpp"
 #include "tools.hpp"
 
 #include "autogen/surfel_raytrace.comp.h"
+#include "autogen/surfel_ray_bin.comp.h"
+
+
+// Writes of a binning phase visible to the next one
+static void phaseBarrier(const VkCommandBuffer& cmdBuf)
+{
+	VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+		1, &barrier, 0, nullptr, 0, nullptr);
+}
 
 void SurfelRaytracePass::setup(const VkDevice& device, const VkPhysicalDevice& physicalDevice, uint32_t familyIndex, nvvk::ResourceAllocator* allocator)
 {
@@ -19,27 +32,56 @@ void SurfelRaytracePass::setup(const VkDevice& device, const VkPhysicalDevice& p
 
 void SurfelRaytracePass::destroy()
 {
-	vkDestroyPipeline(m_device, m_pipeline, nullptr);
+	for (auto& pipeline : m_pipelines)
+	{
+		vkDestroyPipeline(m_device, pipeline, nullptr);
+		pipeline = VK_NULL_HANDLE;
+	}
+	vkDestroyPipeline(m_device, m_binPipeline, nullptr);
 	vkDestroyPipelineLayout(m_device, m_pipelineLayout, nullptr);
 
 	m_pipelineLayout = VK_NULL_HANDLE;
-	m_pipeline = VK_NULL_HANDLE;
+	m_binPipeline = VK_NULL_HANDLE;
+}
+
+void SurfelRaytracePass::dispatch(const VkCommandBuffer& cmdBuf, const VkExtent2D& size, VkPipeline pipeline)
+{
+	const int GROUP_SIZE = 32;
+	vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+
+	// Dispatching the shader, sized by the live count when the arguments are on the GPU
+	if (m_indirectBuffer != VK_NULL_HANDLE)
+		vkCmdDispatchIndirect(cmdBuf, m_indirectBuffer, m_indirectOffset);
+	else
+		vkCmdDispatch(cmdBuf, (size.width + (GROUP_SIZE - 1)) / GROUP_SIZE, (size.height + (GROUP_SIZE - 1)) / GROUP_SIZE, 1);
 }
 
 void SurfelRaytracePass::run(const VkCommandBuffer& cmdBuf, const VkExtent2D& size, nvvk::ProfilerVK& profiler, const std::vector<VkDescriptorSet>& descSets)
 {
 	LABEL_SCOPE_VK(cmdBuf);
-	const int GROUP_SIZE = 32;
 	// Preparing for the compute shader
-	vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipeline);
 	vkCmdBindDescriptorSets(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelineLayout, 0,
 		static_cast<uint32_t>(descSets.size()), descSets.data(), 0, nullptr);
 
 	// Sending the push constant information
 	vkCmdPushConstants(cmdBuf, m_pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(RtxState), &m_state);
 
-	// Dispatching the shader
-	vkCmdDispatch(cmdBuf, (size.width + (GROUP_SIZE - 1)) / GROUP_SIZE, (size.height + (GROUP_SIZE - 1)) / GROUP_SIZE, 1);
+	// Rays binned, bins scanned, rays scattered to their bin
+	if (m_state.surfelRayBinning != 0)
+	{
+		auto sec = profiler.timeRecurring("Surfel Ray Binning", cmdBuf);
+		dispatch(cmdBuf, size, m_pipelines[0]);
+		phaseBarrier(cmdBuf);
+
+		vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_binPipeline);
+		vkCmdDispatch(cmdBuf, 1, 1, 1);
+		phaseBarrier(cmdBuf);
+
+		dispatch(cmdBuf, size, m_pipelines[1]);
+		phaseBarrier(cmdBuf);
+	}
+
+	dispatch(cmdBuf, size, m_pipelines[2]);
 }
 
 void SurfelRaytracePass::create(const VkExtent2D& size, const std::vector<VkDescriptorSetLayout>& extraDescSetsLayout, Scene* _scene)
@@ -61,9 +103,22 @@ void SurfelRaytracePass::create(const VkExtent2D& size, const std::vector<VkDesc
 	computePipelineCreateInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
 	computePipelineCreateInfo.stage.pName = "main";
 
-	vkCreateComputePipelines(m_device, {}, 1, &computePipelineCreateInfo, nullptr, &m_pipeline);
+	// One pipeline per phase, selected by the specialization constant
+	SurfelSpecialization specialization;
+	computePipelineCreateInfo.stage.pSpecializationInfo = specialization.getInfo();
+
+	for (uint32_t phase = 0; phase < m_pipelines.size(); phase++)
+	{
+		specialization.setPhase(phase);
+		vkCreateComputePipelines(m_device, {}, 1, &computePipelineCreateInfo, nullptr, &m_pipelines[phase]);
+		m_debug.setObjectName(m_pipelines[phase], "Surfel Raytrace Pass " + std::to_string(phase));
+	}
+	vkDestroyShaderModule(m_device, computePipelineCreateInfo.stage.module, nullptr);
 
-	m_debug.setObjectName(m_pipeline, "Surfel Raytrace Pass");
+	// Scan of the ray bins, same layout
+	computePipelineCreateInfo.stage.module = nvvk::createShaderModule(m_device, surfel_ray_bin_comp, sizeof(surfel_ray_bin_comp));
+	vkCreateComputePipelines(m_device, {}, 1, &computePipelineCreateInfo, nullptr, &m_binPipeline);
+	m_debug.setObjectName(m_binPipeline, "Surfel Ray Bin Pass");
 	vkDestroyShaderModule(m_device, computePipelineCreateInfo.stage.module, nullptr);
 }
 
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <array>
+
 #include "nvvk/resourceallocator_vk.hpp"
 #include "nvvk/debug_util_vk.hpp"
 #include "nvvk/descriptorsets_vk.hpp"
@@ -23,8 +25,16 @@ public:
     void create(const VkExtent2D& size, const std::vector<VkDescriptorSetLayout>& descSetsLayout, Scene* _scene = nullptr);
     const std::string name();
     void          setPushContants(const RtxState& state) { m_state = state; }
+    // Dispatch sized on the GPU (SurfelDispatch) instead of by run()
+    void setIndirectDispatch(VkBuffer buffer, VkDeviceSize offset)
+    {
+        m_indirectBuffer = buffer;
+        m_indirectOffset = offset;
+    }
 
 private:
+    void dispatch(const VkCommandBuffer& cmdBuf, const VkExtent2D& size, VkPipeline pipeline);
+
     // Setup
     nvvk::ResourceAllocator* m_pAlloc{ nullptr };  // Allocator for buffer, images, acceleration structures
     nvvk::DebugUtil          m_debug;            // Utility to name objects
@@ -32,8 +42,12 @@ private:
     uint32_t                 m_queueIndex{ 0 };
 
 
+    VkBuffer     m_indirectBuffer{ VK_NULL_HANDLE };
+    VkDeviceSize m_indirectOffset{ 0 };
+
     VkPipelineLayout m_pipelineLayout{ VK_NULL_HANDLE };
-    VkPipeline       m_pipeline{ VK_NULL_HANDLE };
+    std::array<VkPipeline, 3> m_pipelines{};  // Binning, scatter and trace, see surfel_raytrace.comp
+    VkPipeline       m_binPipeline{ VK_NULL_HANDLE };  // surfel_ray_bin.comp
     VkRenderPass     m_renderPass{ VK_NULL_HANDLE };
 };
 
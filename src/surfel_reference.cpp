@@ -0,0 +1,1107 @@
+#include "surfel_reference_common.hpp"
+#include "sun_and_sky.hpp"
+
+
+void SurfelReference::setup(const CpuBvh* bvh, const Settings& settings)
+{
+  m_bvh      = bvh;
+  m_settings = settings;
+  m_settings.numThreads = std::max(m_settings.numThreads, 1u);
+  m_totalCellCount      = n * n * n + 6 * n * n * m;  // SurfelGI::createResources
+  reset();
+}
+
+
+void SurfelReference::reset()
+{
+  m_totalFrames   = 0;
+  m_cellGridValid = false;
+  m_counter               = {};
+  m_counter.deadSurfelCnt = kMaxSurfelCount;
+  m_surfels.assign(kMaxSurfelCount, Surfel{});
+  m_surfelCold.assign(kMaxSurfelCount, SurfelCold{});
+  m_surfelGuide.assign(kMaxSurfelCount, SurfelGuide{});
+  m_alive.assign(kMaxSurfelCount, 0);
+  m_dead.resize(kMaxSurfelCount);
+  for(uint32_t i = 0; i < kMaxSurfelCount; i++)
+    m_dead[i] = i;
+  m_recycle.assign(kMaxSurfelCount, SurfelRecycleInfo{});
+  m_rays.assign(kMaxRayCount, SurfelRay{});
+  m_rayRequest.assign(kMaxSurfelCount, SurfelRayRequest{});
+  m_rayScanBlockSums.assign((kMaxSurfelCount + kCellScanBlockSize - 1) / kCellScanBlockSize, 0);
+  m_sortScratch.assign(kMaxSurfelCount, 0);
+  m_sortCounts.assign(kSortDigits * m_rayScanBlockSums.size(), 0);
+  m_sortKeys.assign(kMaxSurfelCount, 0);
+  m_raySortIndex.assign(kMaxRayCount, 0);
+  m_rayBins.assign(2 * kRayBinCount, 0);
+
+  const uint32_t cellBufferSize = std::max(m_totalCellCount, kCellHashCapacity);  // The hash slots come first
+  m_cells.assign(cellBufferSize, CellInfo{});
+  m_cellCounter = {};
+  m_cellCounter.totalCellCount = m_totalCellCount;
+  m_cellToSurfel.assign(m_settings.cellToSurfelCapacity, 0);
+  m_cellCounter.cellToSurfelCapacity = m_settings.cellToSurfelCapacity;
+  m_cellToSurfelPeak                 = 0;
+  m_cellToSurfelGrows                = 0;
+  m_cellMask.assign(kMaxSurfelCount, uvec2(0u));
+  m_scanBlockSums.assign((cellBufferSize + kCellScanBlockSize - 1) / kCellScanBlockSize, 0);
+  m_cellHashKeys.assign(kCellHashCapacity, kCellHashEmpty);
+  m_cellHashOccupied.assign(kCellHashCapacity, 0);
+
+  m_atlasSize = SurfelConfig().getAtlasSize();  // SurfelGI::createIrradianceDepthMap
+  m_irradianceMap.assign(size_t(m_atlasSize.x) * m_atlasSize.y, 0.f);
+  m_depthMap.assign(size_t(m_atlasSize.x) * m_atlasSize.y, glm::vec2(0.f));
+
+  m_cellReserved.assign(cellBufferSize, 0);
+  m_updateFrame.assign(kMaxSurfelCount, ~0u);
+}
+
+
+SceneCamera SurfelReference::makeCamera(const glm::mat4& view, float fovDeg, float aspectRatio)
+{
+  SceneCamera camera{};
+  camera.view = view;
+  camera.proj = glm::perspectiveRH_ZO(glm::radians(fovDeg), aspectRatio, 1.f, 1000.0f);
+  camera.proj[1][1] *= -1;
+  camera.viewInverse = glm::inverse(camera.view);
+  camera.projInverse = glm::inverse(camera.proj);
+  camera.fov         = fovDeg;
+  return camera;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// Primary rays through the half resolution pixel centers, the closest hit gives what gbuffer.frag
+// writes: depth, normal facing the camera and the node as object ID
+//
+void SurfelReference::renderGBuffer(const SceneCamera& camera)
+{
+  const uint32_t w = m_settings.width / 2, h = m_settings.height / 2;
+  m_gbuffer.depth.resize(size_t(w) * h);
+  m_gbuffer.position.resize(size_t(w) * h);
+  m_gbuffer.normal.resize(size_t(w) * h);
+  m_gbuffer.objID.resize(size_t(w) * h);
+  m_indirect.assign(size_t(w) * h, glm::vec4(0.f));
+
+  const glm::vec3 origin   = camera.viewInverse * glm::vec4(0, 0, 0, 1);
+  const glm::mat4 viewProj = camera.proj * camera.view;
+  nvh::parallel_batches<64>(
+      uint64_t(w) * h,
+      [&](uint64_t i) {
+        const glm::vec2 uv     = (glm::vec2(float(i % w), float(i / w)) + 0.5f) / glm::vec2(w, h);
+        const glm::vec4 target = camera.projInverse * glm::vec4(uv * 2.f - 1.f, 1.f, 1.f);
+        CpuBvh::Ray     ray;
+        ray.origin    = origin;
+        ray.direction = glm::normalize(glm::vec3(camera.viewInverse * glm::vec4(glm::normalize(glm::vec3(target)), 0.f)));
+
+        CpuBvh::Hit hit;
+        if(!m_bvh->intersect(ray, hit))
+        {
+          m_gbuffer.depth[i] = 1.f;
+          return;
+        }
+        const glm::vec3 pos  = ray.origin + ray.direction * hit.t;
+        const glm::vec4 clip = viewProj * glm::vec4(pos, 1.f);
+        const glm::vec3 nrm  = glm::dot(hit.normal, ray.direction) <= 0.f ? hit.normal : -hit.normal;
+        m_gbuffer.depth[i]    = std::min(clip.z / clip.w, std::nextafter(1.f, 0.f));
+        m_gbuffer.position[i] = pos;
+        m_gbuffer.normal[i]   = compress_unit_vec(nrm);
+        m_gbuffer.objID[i]    = hit.node;
+      },
+      m_settings.numThreads);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// surfel_prepare.comp
+//
+void SurfelReference::passPrepare()
+{
+  m_counter.surfelRayCnt     = 0;
+  m_counter.rayRequestBase   = 0;
+  std::fill(std::begin(m_counter.rayRequestExtra), std::end(m_counter.rayRequestExtra), 0u);
+  const uvec2 threshold        = getScheduleThreshold(m_counter, m_settings.updateFraction);
+  m_counter.scheduleLevel      = threshold.x;
+  m_counter.scheduleShare      = threshold.y;
+  m_counter.scheduledSurfels   = 0;
+  std::fill(std::begin(m_counter.scheduleHistogram), std::end(m_counter.scheduleHistogram), 0u);
+  m_cellCounter.rebuiltFrame = m_cellRebuild ? 1 : 0;
+  if(m_cellRebuild)
+  {
+    clearCells();
+    std::fill(m_cellMask.begin(), m_cellMask.end(), uvec2(0u));
+    std::fill(m_cellReserved.begin(), m_cellReserved.end(), 0u);
+  }
+
+  // Stage 0 of surfel_dispatch_args.comp, the slots of a patched frame stay claimed
+  m_cellCounter.hashInsertions = 0;
+  m_cellCounter.hashProbes     = 0;
+  m_cellCounter.hashMaxProbe   = 0;
+  m_cellCounter.hashOverflow   = 0;
+  m_cellCounter.changedSurfels = 0;
+  m_cellCounter.cellToSurfelDropped = 0;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// surfel_update.comp: life, radius, cell counts and ray request of each alive surfel, recycling
+//
+void SurfelReference::passUpdate(const SceneCamera& camera, FrameStats& stats)
+{
+  const vec3            camPos = vec3(camera.viewInverse[3]);
+  const SurfelCounter   schedule = m_counter;  // Threshold of passPrepare, the histogram fills meanwhile
+  std::atomic<uint32_t> outOfGrid{0};
+
+  // Swaps the last alive surfel in, as in the shader the swapped one is not processed this frame
+  // when its own invocation already returned on the lowered alive count
+  auto recycleSurfelInAlive = [&](uint aliveArrayIndex) {
+    uint surfelIndexToRecycle = atomicLoad(m_alive[aliveArrayIndex]);
+    uint newAliveCnt          = atomicSub(m_counter.aliveSurfelCnt, 1u) - 1;
+    uint endSurfelIndex       = atomicLoad(m_alive[newAliveCnt]);
+    atomicStore(m_alive[aliveArrayIndex], endSurfelIndex);
+    atomicStore(m_dead[kMaxSurfelCount - newAliveCnt - 1], surfelIndexToRecycle);
+  };
+
+  // Counts binned in an earlier frame, patched frames only touch the cells a surfel left or entered
+  auto removeSurfelFromCells = [&](ivec4 cellPosIndex, uvec2 mask, uvec2 keptMask) {
+    const uint slots = getCellMaskSlotCount(mask);
+    for(uint i = 0; i < slots; i++)
+    {
+      const ivec4 cellPos = getCellMaskCellPos(cellPosIndex, mask, i);
+      if(cellPos.w < 0 || isCellInMask(keptMask, ivec3(cellPos) - ivec3(cellPosIndex)))
+        continue;
+      const uint cellIndex = findCellIndex(getFlattenCellIndexNonUniform(cellPos));
+      if(cellIndex != kInvalidCell)
+        atomicSub(m_cells[cellIndex].surfelCount, 1u);
+    }
+  };
+
+  auto shouldRecycleSurfel = [&](const Surfel& surfel, const SurfelRecycleInfo& recycleInfo, bool lastSeen,
+                                 float surfelToCameraDistance, uint& randSeed) {
+    if(surfel.radius < 0.001f || recycleInfo.life == 0)
+      return true;
+    if(lastSeen)
+      return false;
+
+    float distanceFactor = smoothstep(50.0f, 100.0f, surfelToCameraDistance);
+    float lifeFactor     = (float(kMaxLife) - float(recycleInfo.life)) / float(kMaxLife);
+    lifeFactor           = pow(lifeFactor, 2.0f);
+    float recycleProb    = 0.1f * distanceFactor + 0.4f * lifeFactor;
+
+    float surfelCountFactor = float(atomicLoad(m_counter.aliveSurfelCnt)) / float(kMaxSurfelCount);
+    surfelCountFactor *= step(0.8f, surfelCountFactor);
+    recycleProb *= surfelCountFactor;
+    return rand(randSeed) < recycleProb;
+  };
+
+  nvh::parallel_batches<32>(
+      kMaxSurfelCount,
+      [&](uint64_t i) {
+        const uint idx = uint(i);
+        if(idx >= atomicLoad(m_counter.aliveSurfelCnt))
+          return;
+
+        uint randSeed    = tea(idx, m_totalFrames);
+        uint surfelIndex = atomicLoad(m_alive[idx]);
+        m_updateFrame[surfelIndex] = m_totalFrames;
+
+        Surfel     surfel = m_surfels[surfelIndex];
+        SurfelCold cold   = m_surfelCold[surfelIndex];
+        surfel.radiance   = cold.msmeData.mean;
+
+        SurfelRecycleInfo recycleInfo = m_recycle[surfelIndex];
+        bool              isSleeping  = (recycleInfo.status & 0x0001u) != 0u;
+        bool              lastSeen    = (recycleInfo.status & 0x0002u) != 0u;
+        bool              lastRefed   = (recycleInfo.status & 0x0004u) != 0u;
+
+        if(m_settings.ageUnseen)
+          recycleInfo.life = std::max(recycleInfo.life - 1u, 0u);  // uint, as in the shader
+        recycleInfo.frame = uint(clamp(int(recycleInfo.frame) + 1, 0, 65535));
+
+        if(isSleeping && lastRefed)
+          recycleInfo.life = kMaxLife / 2;
+        if(lastSeen)
+        {
+          recycleInfo.life = kMaxLife;
+          isSleeping       = false;
+        }
+
+        float surfelToCameraDistance = distance(surfel.position, camPos);
+        if(!shouldRecycleSurfel(surfel, recycleInfo, lastSeen || lastRefed, surfelToCameraDistance, randSeed))
+        {
+          vec2  resolution    = vec2(m_settings.width, m_settings.height);
+          float newRadius     = calcSurfelRadius(surfelToCameraDistance, camera.fov, resolution);
+          float surfelMaxSize = getSurfelMaxSize(surfelToCameraDistance);
+          newRadius           = min(newRadius, isSleeping ? surfelMaxSize * 2.f : surfelMaxSize);
+          if(lastSeen)
+            newRadius = mix(surfel.radius, newRadius, 0.1f);
+          newRadius     = max(newRadius, surfelMaxSize * surfelMinSizeRatio);
+          float radDiff = abs(surfel.radius - newRadius);
+          cold.msmeData.variance *= 1.0f + radDiff * 10.0f;
+          surfel.radius = newRadius;
+
+          ivec4 cellPosIndex      = getCellPosNonUniform(surfel.position, m_gridOrigin);
+          uvec2 cellMask          = getSurfelCellMask(surfel, cellPosIndex, m_gridOrigin);
+          uvec2 lastMask          = m_cellMask[surfelIndex];
+          m_cellMask[surfelIndex] = cellMask;
+          if(cellMask != lastMask)
+            atomicAdd(m_cellCounter.changedSurfels, 1u);
+          removeSurfelFromCells(cellPosIndex, lastMask, cellMask);
+
+          uint added = 0, probes = 0, maxProbe = 0;
+          const uint slots = getCellMaskSlotCount(cellMask);
+          for(uint slot = 0; slot < slots; slot++)
+          {
+            const ivec4 cellPos = getCellMaskCellPos(cellPosIndex, cellMask, slot);
+            if(cellPos.w < 0 || isCellInMask(lastMask, ivec3(cellPos) - ivec3(cellPosIndex)))
+              continue;
+            added++;
+            uint flattenIndex = getFlattenCellIndexNonUniform(cellPos);
+            if(flattenIndex >= m_totalCellCount)
+            {
+              outOfGrid++;
+              continue;
+            }
+            uint cellIndex = insertCellIndex(flattenIndex, probes, maxProbe);
+            if(cellIndex != kInvalidCell)
+              atomicAdd(m_cells[cellIndex].surfelCount, 1u);
+          }
+          if(m_settings.cellHash && added != 0)
+          {
+            atomicAdd(m_cellCounter.hashInsertions, added);
+            atomicAdd(m_cellCounter.hashProbes, probes);
+            atomicMax(m_cellCounter.hashMaxProbe, maxProbe);
+          }
+
+          float variance      = length(cold.msmeData.variance);
+          uint  rayRequestCnt = uint(mix(4.0f, 64.0f, clamp(variance * 1.2f, 0.f, 1.f)));
+          bool visible = lastSeen && !isSleeping;
+          bool young   = recycleInfo.frame < 20;
+          if(!visible)
+            rayRequestCnt = rayRequestCnt / 4;
+          if(young)
+            rayRequestCnt = 64;
+
+          bool scheduled = true;
+          if(m_settings.updateFraction < 1.f)
+          {
+            uint maxStale = getScheduleMaxStale(m_settings.updateFraction);
+            uint level    = getScheduleLevel(visible, variance, recycleInfo.staleFrames, maxStale);
+            uint hash     = lowbias32(surfelIndex ^ lowbias32(m_totalFrames));
+            scheduled = young || recycleInfo.staleFrames + 1u >= maxStale || isSurfelScheduled(level, hash, schedule);
+            uint nextLevel = getScheduleLevel(visible, variance, scheduled ? 0u : recycleInfo.staleFrames + 1u, maxStale);
+            atomicAdd(m_counter.scheduleHistogram[nextLevel], 1u);
+          }
+          recycleInfo.staleFrames = scheduled ? 0u : recycleInfo.staleFrames + 1u;
+          if(scheduled)
+            atomicAdd(m_counter.scheduledSurfels, 1u);
+          else
+            rayRequestCnt = 0;
+
+          uint priority             = getRayPriority(young, visible, variance);
+          m_rayRequest[surfelIndex] = {rayRequestCnt, priority};
+          uint base                 = min(rayRequestCnt, kSurfelMinRays);
+          atomicAdd(m_counter.rayRequestBase, base);
+          if(rayRequestCnt > base)
+            atomicAdd(m_counter.rayRequestExtra[priority], rayRequestCnt - base);
+          m_surfels[surfelIndex]    = surfel;
+          m_surfelCold[surfelIndex] = cold;
+        }
+        else
+        {
+          const uvec2 lastMask = m_cellMask[surfelIndex];
+          if(lastMask.x != 0)
+          {
+            removeSurfelFromCells(getCellPosNonUniform(surfel.position, m_gridOrigin), lastMask, uvec2(0u));
+            m_cellMask[surfelIndex] = uvec2(0u);
+            atomicAdd(m_cellCounter.changedSurfels, 1u);
+          }
+          recycleSurfelInAlive(idx);
+        }
+
+        recycleInfo.status     = isSleeping ? 0x0001 : 0x0000;
+        m_recycle[surfelIndex] = recycleInfo;
+      },
+      m_settings.numThreads);
+
+  for(uint32_t idx = 0; idx < m_counter.aliveSurfelCnt; idx++)
+    if(m_updateFrame[m_alive[idx]] != m_totalFrames)
+      stats.skippedSurfels++;
+  stats.outOfGrid += outOfGrid;
+  stats.cellHashSlots = m_settings.cellHash ? m_cellCounter.hashOccupied : 0;
+  stats.hashOverflow += m_cellCounter.hashOverflow;
+  stats.changedSurfels = m_cellCounter.changedSurfels;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// finalizePathWithSurfel of shaderUtils_surfel_cell.glsl
+//
+bool SurfelReference::finalizePathWithSurfel(const glm::vec3& worldPos, const glm::vec3& worldNor,
+                                             uint32_t randSeed, glm::vec4& irradiance)
+{
+  irradiance         = vec4(0.0f);
+  ivec4 cellPosIndex = getCellPosNonUniform(worldPos, m_gridOrigin);
+  if(!isCellValid(cellPosIndex))
+    return false;
+
+  const CellInfo cellInfo   = getCellInfo(cellPosIndex);
+  const uint     targetCnt  = min(64u, cellInfo.surfelCount);
+  const float    surfelCntF = float(cellInfo.surfelCount);
+  for(uint i = 0; i < targetCnt; i++)
+  {
+    uint currIndex = targetCnt == cellInfo.surfelCount ? i : uint(rand(randSeed) * surfelCntF);
+    if(cellInfo.surfelOffset + currIndex >= m_cellToSurfel.size())
+      continue;
+    uint          surfelIndex = atomicLoad(m_cellToSurfel[cellInfo.surfelOffset + currIndex]);
+    const Surfel& surfel      = m_surfels[surfelIndex];
+    vec3          neiNor      = decompress_unit_vec(surfel.normal);
+    vec3          bias        = surfel.position - worldPos;
+    float         dist        = length(bias);
+    float         cosineTheta = dot(bias, worldNor) / dist;
+    if(cosineTheta < -0.2f || dot(-bias, neiNor) / dist < -0.2f)
+      continue;
+
+    if(dist < surfel.radius)
+    {
+      float dotN         = dot(worldNor, neiNor);
+      float contribution = 1.f;
+      if(dotN > 0.f)
+      {
+        contribution *= clamp(dotN, 0.f, 1.f);
+        contribution *= clamp(1.f - dist / surfel.radius, 0.f, 1.f);
+        contribution = smoothstep(0.f, 1.f, contribution);
+      }
+      else
+      {
+        contribution *= max(cosineTheta, 0.f);
+        contribution *= pow(1.f - dist / surfel.radius, 2.0f);
+      }
+      irradiance += vec4(surfel.radiance, 1.f) * contribution;
+      atomicOr(m_recycle[surfelIndex].status, 0x0004u);
+    }
+  }
+
+  if(irradiance.w > 0.1f)
+  {
+    irradiance /= irradiance.w;
+    return true;
+  }
+  return false;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// surfelPathTrace with a diffuse material of constant albedo and no light sampling
+//
+glm::vec3 SurfelReference::pathTrace(const CpuBvh::Ray& ray, int maxDepth, uint32_t surfelIndex, const SunAndSky& sky,
+                                     uint32_t& seed, float& firstDepth)
+{
+  CpuBvh::Ray r            = ray;
+  vec3        radiance     = vec3(0.0f);
+  vec3        throughput   = vec3(1.0f);
+  vec3        nextThroughput = vec3(1.0f);
+  vec3        diffuseRatio = vec3(1.f);
+  vec3        position{0.f}, normal{0.f};
+  int         depth;
+
+  for(depth = 0; depth < maxDepth; depth++)
+  {
+    throughput = nextThroughput;
+    CpuBvh::Hit hit;
+    const bool  found = m_bvh->intersect(r, hit);
+    if(depth == 0)
+      firstDepth = found ? hit.t : INFINITY;
+
+    if(!found)
+      return radiance + evalSunAndSky(sky, r.direction) * m_settings.hdrMultiplier * throughput;
+
+    position             = r.origin + r.direction * hit.t;
+    normal               = hit.normal;
+    const vec3 ffnormal  = dot(normal, r.direction) <= 0.0f ? normal : -normal;
+    diffuseRatio         = m_settings.albedo;
+
+    // Lambert: f * cos / pdf is the albedo
+    vec3 T, B;
+    CreateCoordinateSystem(ffnormal, T, B);
+    const vec2 uv  = rand2(seed);
+    const vec3 dir = CosineSampleHemisphere(uv.x, uv.y);
+    nextThroughput *= m_settings.albedo;
+
+    r.direction = normalize(dir.x * T + dir.y * B + dir.z * ffnormal);
+    r.origin    = OffsetRay(position, ffnormal);
+    r.tMin      = 0.f;
+    r.tMax      = 1e32f;
+  }
+
+  // Surfel indirect at the end of the path, same test on the positions as the shader
+  const vec3  surfelPos = m_surfels[surfelIndex].position;
+  const float radius    = m_surfels[surfelIndex].radius;
+  if(dot(position, surfelPos) < radius * radius)
+  {
+    vec4 irradiance = vec4(0.0f);
+    if(finalizePathWithSurfel(position, normal, tea(surfelIndex, m_totalFrames), irradiance))
+      radiance += vec3(irradiance) * diffuseRatio * throughput;
+  }
+  return radiance;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// surfel_raytrace.comp: one invocation per allocated ray
+//
+void SurfelReference::passRaytrace(const SunAndSky& sky, FrameStats& stats)
+{
+  std::atomic<uint32_t> guided{0}, belowSurface{0};
+  const uint32_t        rayCount = std::min(m_counter.surfelRayCnt, kMaxRayCount);
+  const uint            frameHash = lowbias32(m_totalFrames);
+
+  nvh::parallel_batches<64>(
+      rayCount,
+      [&](uint64_t i) {
+        // The binned trace takes the rays in bin order, each result goes back to the slot of its ray
+        const uint index       = m_settings.rayBinning ? m_raySortIndex[i] : uint(i);
+        SurfelRay  surfelRay   = m_rays[index];
+        uint       randSeed    = tea(lowbias32(index), frameHash);
+        uint       surfelIndex = surfelRay.surfelID;
+        bool       isSleeping  = (atomicLoad(m_recycle[surfelIndex].status) & 0x0001u) != 0u;
+
+        vec3        dirL;
+        float       pdf;
+        bool        isGuided;
+        CpuBvh::Ray ray = getSurfelRay(surfelIndex, randSeed, dirL, pdf, isGuided);
+        if(isGuided)
+          guided++;
+        if(dirL.z < 0.f)
+          belowSurface++;
+
+        int maxDepth       = isSleeping ? 5 : 3;
+        surfelRay.radiance = pathTrace(ray, maxDepth, surfelIndex, sky, randSeed, surfelRay.t);
+        float lum          = dot(surfelRay.radiance, vec3(0.212671f, 0.715160f, 0.072169f));
+        if(lum > m_settings.fireflyClampThreshold)
+          surfelRay.radiance *= m_settings.fireflyClampThreshold / lum;
+        surfelRay.dir_o = compress_unit_vec(dirL);
+        surfelRay.pdf   = pdf;
+        m_rays[index]   = surfelRay;
+      },
+      m_settings.numThreads);
+
+  stats.rays             = rayCount;
+  stats.guidedRays       = guided;
+  stats.raysBelowSurface = belowSurface;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// surfel_integrate.comp: MSME over the rays, atlases, radiance shared with the cell neighbours
+//
+void SurfelReference::passIntegrate()
+{
+
+  // imageStore / texelFetch, out of the image is dropped / zero
+  auto texel = [this](ivec2 c) -> int64_t {
+    if(c.x < 0 || c.y < 0 || c.x >= int(m_atlasSize.x) || c.y >= int(m_atlasSize.y))
+      return -1;
+    return int64_t(c.y) * m_atlasSize.x + c.x;
+  };
+  const uint tilesPerRow = m_atlasSize.x / kSurfelTileSize;
+
+  nvh::parallel_batches<32>(
+      m_counter.aliveSurfelCnt,
+      [&](uint64_t i) {
+        uint       surfelIndex = m_alive[i];
+        SurfelCold cold        = m_surfelCold[surfelIndex];
+        if(cold.rayCount == 0)
+          return;
+        const Surfel surfel = m_surfels[surfelIndex];
+
+        ivec2 irrMapBase = ivec2(surfelIndex % tilesPerRow, surfelIndex / tilesPerRow) * int(kSurfelTileSize);
+        bool  newSurfel  = m_recycle[surfelIndex].frame == 0;
+        if(newSurfel)
+        {
+          for(uint y = 0; y < kSurfelTileSize; ++y)
+            for(uint x = 0; x < kSurfelTileSize; ++x)
+              atomicStore(m_irradianceMap[texel(irrMapBase + ivec2(x, y))], 0.f);
+        }
+
+        vec3 totalRadiance = vec3(0.0f);
+        uint samplePack    = max(4u, cold.rayCount / 4);
+        uint packCounter   = 0;
+        for(uint r = 0; r < cold.rayCount; r++)
+        {
+          const SurfelRay& rayResult = m_rays[cold.rayOffset + r];
+          float            depth     = clamp(rayResult.t, 0.f, surfel.radius) / surfel.radius;
+
+          vec3  norL       = decompress_unit_vec(rayResult.dir_o);
+          vec3  inRadiance = rayResult.radiance * norL.z / max(1e-12f, rayResult.pdf);
+          float lum        = dot(inRadiance, vec3(0.212671f, 0.715160f, 0.072169f));
+          if(lum > m_settings.fireflyClampThreshold)
+            inRadiance *= m_settings.fireflyClampThreshold / lum;
+          totalRadiance += inRadiance;
+
+          packCounter++;
+          if(packCounter == samplePack || r == cold.rayCount - 1)
+          {
+            totalRadiance /= float(packCounter);
+            packCounter = 0;
+            MSME(totalRadiance, cold.msmeData, 0.01f);
+            totalRadiance = vec3(0.0f);
+          }
+
+          vec2  mapUV     = DirToOctUV(norL);
+          ivec2 mapOffset = 3 + ivec2(sign(mapUV.x) * round(abs(mapUV.x * 3.0f)), sign(mapUV.y) * round(abs(mapUV.y * 3.0f)));
+          mapOffset       = clamp(mapOffset, ivec2(0), ivec2(kSurfelTileSize - 1));
+
+          const int64_t irrTexel = texel(irrMapBase + mapOffset);
+          if(irrTexel >= 0)
+          {
+            float lumn  = max(1e-12f, dot(rayResult.radiance, vec3(0.2126f, 0.7152f, 0.0722f)));
+            float old   = newSurfel ? 0.0f : atomicLoad(m_irradianceMap[irrTexel]);
+            float delta = newSurfel ? lumn : 0.2f * (lumn - old);
+            atomicStore(m_irradianceMap[irrTexel], toR16F(old + delta));
+
+            // Same tiling for the depth atlas
+            vec2 depth2   = vec2(depth, pow(depth, 2.0f));
+            vec2 oldDepth = newSurfel ? vec2(0) : m_depthMap[irrTexel];
+            vec2 delta2   = newSurfel ? depth2 : 0.2f * (depth2 - oldDepth);
+            m_depthMap[irrTexel] = toRG8(oldDepth + delta2);
+          }
+        }
+        // Sum of the tile, with the low bit set once every texel has been hit, and its CDF for the
+        // guided rays of the next frame
+        float irradianceSum = 0.f;
+        bool  isFull        = true;
+        float cumulative[kSurfelGuideEntries];
+        for(uint t = 0; t < kSurfelGuideEntries; t++)
+        {
+          const float irr = atomicLoad(m_irradianceMap[texel(irrMapBase + ivec2(t % kSurfelTileSize, t / kSurfelTileSize))]);
+          irradianceSum += irr;
+          cumulative[t] = irradianceSum;
+          isFull        = isFull && irr != 0.f;
+        }
+        cold.irradiance = glsl_surfel::floatBitsToUint(irradianceSum) | uint(isFull);
+        if(irradianceSum > 1e-12f)
+          m_surfelGuide[surfelIndex] = makeSurfelGuide(cumulative, irradianceSum);
+
+        ivec4 cellPosIndex = getCellPosNonUniform(surfel.position, m_gridOrigin);
+        if(isCellValid(cellPosIndex))
+        {
+          vec3     normal   = decompress_unit_vec(surfel.normal);
+          CellInfo cellInfo = getCellInfo(cellPosIndex);
+          vec4     sharedRadiance = vec4(0.0f);
+          for(uint c = 0; c < cellInfo.surfelCount; c++)
+          {
+            if(cellInfo.surfelOffset + c >= m_cellToSurfel.size())
+              break;
+            uint          neiIndex  = atomicLoad(m_cellToSurfel[cellInfo.surfelOffset + c]);
+            const Surfel& neiSurfel = m_surfels[neiIndex];
+            vec3          neiNor    = decompress_unit_vec(neiSurfel.normal);
+            vec3          distV     = neiSurfel.position - surfel.position;
+            float         dist      = length(distV);
+            float         cosineTheta = dot(distV, normal) / dist;
+            if(cosineTheta < -0.2f || dot(-distV, neiNor) / dist < -0.2f)
+              continue;
+
+            float surfelRad = 2.0f * surfel.radius;
+            if(dist < surfelRad)
+            {
+              float dotN         = dot(normal, neiNor);
+              float contribution = 1.f;
+              if(dotN > 0.f)
+              {
+                contribution *= min(dotN, 1.f);
+                contribution *= clamp(1.f - dist / surfelRad, 0.f, 1.f);
+                contribution = smoothstep(0.f, 1.f, contribution);
+              }
+              else
+              {
+                contribution *= max(cosineTheta, 0.f);
+                contribution *= pow(1.f - dist / surfelRad, 2.0f);
+              }
+              contribution *= smoothstep(0.f, 10.f, float(m_recycle[neiIndex].frame));
+              sharedRadiance += vec4(neiSurfel.radiance, 1.f) * contribution;
+            }
+          }
+          if(sharedRadiance.w > 0.1f)
+          {
+            vec3 shared = vec3(sharedRadiance) / sharedRadiance.w;
+            MSME(shared, cold.msmeData, 0.04f);
+          }
+        }
+
+        m_surfelCold[surfelIndex].msmeData   = cold.msmeData;
+        m_surfelCold[surfelIndex].irradiance = cold.irradiance;
+      },
+      m_settings.numThreads);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// surfel_generation_pass.comp: indirect lighting of the half resolution pixels, spawning where the
+// coverage is lowest in each 16x16 group and shrinking the strongest surfel where it is highest.
+// The two halves around the group barrier run one after the other for each group.
+//
+void SurfelReference::passGeneration(const SceneCamera& camera, const EnvSH& envSH)
+{
+  const ivec2    imageRes = ivec2(m_settings.width / 2, m_settings.height / 2);
+  const uvec2    groups   = (uvec2(imageRes) + 15u) / 16u;
+  const vec3     camPos   = vec3(camera.viewInverse[3]);
+  const uint     frameHash = lowbias32(m_totalFrames);
+  const uint32_t numThreads = m_settings.numThreads;
+
+  // Shrinking is applied after the pass, so all the groups see the same radii
+  std::vector<std::vector<uint32_t>> shrink(numThreads);
+
+  auto estimateSkyVisibility = [&](vec3 worldPos, vec3 normal, uint& randSeed) {
+    const uint kSkyVisibilityRays = 4;
+    vec3       tangent = normalize(abs(normal.z) > 0.99999f ? vec3(-normal.x * normal.y, 1.0f - normal.y * normal.y, -normal.y * normal.z) :
+                                                              vec3(-normal.x * normal.z, -normal.y * normal.z, 1.0f - normal.z * normal.z));
+    vec3       bitangent = cross(tangent, normal);
+    uint       visible   = 0;
+    for(uint i = 0; i < kSkyVisibilityRays; i++)
+    {
+      vec2        uv  = rand2(randSeed);
+      float       r   = sqrt(uv.x);
+      float       phi = 6.28318530718f * uv.y;
+      CpuBvh::Ray ray;
+      ray.origin    = worldPos + normal * 1e-3f;
+      ray.direction = tangent * (r * cos(phi)) + bitangent * (r * sin(phi)) + normal * sqrt(max(0.f, 1.f - uv.x));
+      if(!m_bvh->occluded(ray))
+        visible++;
+    }
+    return float(visible) / float(kSkyVisibilityRays);
+  };
+
+  nvh::parallel_batches<1>(
+      uint64_t(groups.x) * groups.y,
+      [&](uint64_t g, uint32_t threadIdx) {
+        struct Invocation
+        {
+          ivec2 coords;
+          uint  index;
+          uint  randSeed;
+          float coverage;
+          float maxContribution;
+          uint  maxContributionSurfelIndex;
+          float neighborWeight;
+          vec3  indirectLighting;
+        };
+        Invocation inv[256];
+        uint       numInv                    = 0;
+        uint       groupShareMinCoverage     = glsl_surfel::floatBitsToUint(10.f);
+        uint       groupShareMaxContribution = 0;
+
+        const ivec2 groupBase = ivec2(uint(g) % groups.x, uint(g) / groups.x) * 16;
+        for(int ly = 0; ly < 16; ly++)
+        {
+          for(int lx = 0; lx < 16; lx++)
+          {
+            const ivec2 imageCoords = groupBase + ivec2(lx, ly);
+            if(imageCoords.x >= imageRes.x || imageCoords.y >= imageRes.y)
+              continue;
+            const uint pixel = uint(imageCoords.y * imageRes.x + imageCoords.x);
+            if(m_gbuffer.depth[pixel] == 1.f)
+            {
+              m_indirect[pixel] = vec4(0.f, 0.f, 0.f, 1.f);
+              continue;
+            }
+
+            Invocation& it = inv[numInv++];
+            it.coords      = imageCoords;
+            it.index       = pixel;
+            it.randSeed    = initRandom(uvec2(imageRes), uvec2(imageCoords), frameHash);
+
+            const vec3 normal   = decompress_unit_vec(m_gbuffer.normal[pixel]);
+            const vec3 worldPos = m_gbuffer.position[pixel];
+
+            vec4  indirectContrib = vec4(0.f);
+            float coverage        = 0.f;
+            float maxContribution = 0.f;
+            uint  maxContributionSurfelIndex = 0xffffffff;
+
+            ivec4          cellPosIndex = getCellPosNonUniform(worldPos, m_gridOrigin);
+            const CellInfo cellInfo     = getCellInfo(cellPosIndex);
+            for(uint i = 0; i < cellInfo.surfelCount; i++)
+            {
+              if(cellInfo.surfelOffset + i >= m_cellToSurfel.size())
+                break;
+              uint          surfelIndex = atomicLoad(m_cellToSurfel[cellInfo.surfelOffset + i]);
+              const Surfel& surfel      = m_surfels[surfelIndex];
+              vec3          bias        = surfel.position - worldPos;
+              float         dist        = length(bias);
+              float         cosineTheta = dot(bias, normal) / dist;
+              if(dist < surfel.radius)
+              {
+                vec3  surfelNor    = decompress_unit_vec(surfel.normal);
+                float dotN         = dot(normal, surfelNor);
+                float contribution = 1.f;
+                float age          = smoothstep(0.f, 10.f, float(m_recycle[surfelIndex].frame));
+                if(dotN > 0.f)
+                {
+                  contribution *= clamp(dotN, 0.f, 1.f);
+                  contribution *= clamp(1.f - dist / surfel.radius, 0.f, 1.f);
+                  contribution = smoothstep(0.f, 1.f, contribution);
+                  coverage += contribution;
+                  indirectContrib += vec4(surfel.radiance, 1.f) * contribution * age;
+                  if(maxContribution < contribution)
+                  {
+                    maxContribution            = contribution;
+                    maxContributionSurfelIndex = surfelIndex;
+                  }
+                  atomicOr(m_recycle[surfelIndex].status, 0x0002u);
+                }
+                else
+                {
+                  contribution *= max(cosineTheta, 0.f);
+                  contribution *= pow(1.f - dist / surfel.radius, 2.0f);
+                  indirectContrib += vec4(surfel.radiance, 1.f) * contribution * age;
+                }
+              }
+            }
+
+            it.neighborWeight   = indirectContrib.w;
+            it.indirectLighting = indirectContrib.w > 0 ? vec3(indirectContrib) / indirectContrib.w : vec3(0.f);
+            m_indirect[pixel]   = vec4(it.indirectLighting, 1.f);
+
+            coverage += rand(it.randSeed) * 1e-10f;
+            groupShareMinCoverage = min(groupShareMinCoverage, glsl_surfel::floatBitsToUint(coverage));
+            maxContribution += rand(it.randSeed) * 1e-10f;
+            groupShareMaxContribution = max(groupShareMaxContribution, glsl_surfel::floatBitsToUint(maxContribution));
+
+            it.coverage                   = coverage;
+            it.maxContribution            = maxContribution;
+            it.maxContributionSurfelIndex = maxContributionSurfelIndex;
+          }
+        }
+
+        // barrier()
+        const float groupMinCoverage     = glsl_surfel::uintBitsToFloat(groupShareMinCoverage);
+        const float groupMaxContribution = glsl_surfel::uintBitsToFloat(groupShareMaxContribution);
+        for(uint k = 0; k < numInv; k++)
+        {
+          Invocation& it    = inv[k];
+          const float depth = m_gbuffer.depth[it.index];
+          if(atomicLoad(m_counter.aliveSurfelCnt) < kMaxSurfelCount && it.coverage == groupMinCoverage
+             && it.coverage < 2.0f && rand(it.randSeed) < depth * 0.3f * max(0.0f, 2.0f - it.coverage) * m_settings.spawnRate)
+          {
+            uint surfelAliveIndex = atomicAdd(m_counter.aliveSurfelCnt, 1u);
+            if(surfelAliveIndex < kMaxSurfelCount)
+            {
+              uint surfelID = atomicLoad(m_dead[kMaxSurfelCount - surfelAliveIndex - 1]);
+              atomicStore(m_alive[surfelAliveIndex], surfelID);
+
+              const vec3 worldPos = m_gbuffer.position[it.index];
+              const vec3 normal   = decompress_unit_vec(m_gbuffer.normal[it.index]);
+
+              Surfel     newSurfel{};
+              SurfelCold newCold{};
+              newCold.objID      = m_gbuffer.objID[it.index];
+              newSurfel.position = worldPos;
+              newSurfel.normal   = m_gbuffer.normal[it.index];
+
+              vec3 seedLighting = it.indirectLighting;
+              if(envSH.coeffs[0].w > 0.f && it.neighborWeight < 1.f)
+              {
+                vec3 envIrradiance = shIrradiance(envSH, normal) * m_settings.hdrMultiplier;
+                seedLighting += envIrradiance * estimateSkyVisibility(worldPos, normal, it.randSeed) * (1.f - it.neighborWeight);
+              }
+
+              newSurfel.radiance             = seedLighting;
+              newCold.msmeData.mean          = seedLighting;
+              newCold.msmeData.shortMean     = seedLighting;
+              newCold.msmeData.vbbr          = 0.f;
+              newCold.msmeData.variance      = vec3(1.f);
+              newCold.msmeData.inconsistency = 1.f;
+              float surfelToCameraDistance   = distance(worldPos, camPos);
+              float surfelMaxSize            = getSurfelMaxSize(surfelToCameraDistance);
+              newSurfel.radius = min(calcSurfelRadius(surfelToCameraDistance, camera.fov, vec2(m_settings.width, m_settings.height)),
+                                     surfelMaxSize);
+              newSurfel.radius = max(newSurfel.radius, surfelMaxSize * surfelMinSizeRatio);
+              m_surfels[surfelID]    = newSurfel;
+              m_surfelCold[surfelID] = newCold;
+
+              SurfelRecycleInfo newSurfelRecycleInfo{};
+              newSurfelRecycleInfo.life   = kMaxLife;
+              newSurfelRecycleInfo.frame  = 0;
+              newSurfelRecycleInfo.status = 0;
+              m_recycle[surfelID].life    = newSurfelRecycleInfo.life;
+              m_recycle[surfelID].frame   = newSurfelRecycleInfo.frame;
+              m_recycle[surfelID].staleFrames = 0;
+              atomicStore(m_recycle[surfelID].status, newSurfelRecycleInfo.status);
+            }
+            else
+            {
+              atomicSub(m_counter.aliveSurfelCnt, 1u);
+            }
+          }
+
+          if(atomicLoad(m_counter.aliveSurfelCnt) > 0 && it.maxContribution == groupMaxContribution && it.coverage > 4.0f
+             && rand(it.randSeed) < depth * 0.2f)
+            shrink[threadIdx].push_back(it.maxContributionSurfelIndex);
+        }
+      },
+      numThreads);
+
+  for(const auto& list : shrink)
+    for(uint32_t surfelIndex : list)
+      m_surfels[surfelIndex].radius = 0.f;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// End of frame: surfelAlive and surfelDead share out the IDs, the rays of the surfels updated this
+// frame are disjoint and point back to them, radiance is finite
+//
+void SurfelReference::checkSurfels(FrameStats& stats) const
+{
+  const uint32_t alive = std::min(m_counter.aliveSurfelCnt, kMaxSurfelCount);
+  if(m_counter.aliveSurfelCnt > kMaxSurfelCount)
+    stats.listErrors++;
+  stats.aliveSurfels = alive;
+
+  std::vector<uint8_t> owners(kMaxSurfelCount, 0);
+  for(uint32_t i = 0; i < alive; i++)
+    if(m_alive[i] >= kMaxSurfelCount || owners[m_alive[i]]++ > 0)
+      stats.listErrors++;
+  for(uint32_t i = 0; i < kMaxSurfelCount - alive; i++)
+    if(m_dead[i] >= kMaxSurfelCount || owners[m_dead[i]]++ > 0)
+      stats.listErrors++;
+  stats.listErrors += uint32_t(std::count(owners.begin(), owners.end(), uint8_t(0)));
+
+  std::vector<std::pair<uint32_t, uint32_t>> ranges;
+  for(uint32_t i = 0; i < alive; i++)
+  {
+    const uint32_t    s    = m_alive[i];
+    const SurfelCold& cold = m_surfelCold[s];
+    if(!isFinite(m_surfels[s].radiance) || !isFinite(cold.msmeData.mean))
+      stats.nonFinite++;
+    if(m_updateFrame[s] != m_totalFrames || cold.rayCount == 0)
+      continue;
+    if(cold.rayOffset + cold.rayCount > m_counter.surfelRayCnt || cold.rayOffset + cold.rayCount > m_rays.size())
+    {
+      stats.rayErrors++;
+      continue;
+    }
+    for(uint32_t r = 0; r < cold.rayCount; r++)
+      if(m_rays[cold.rayOffset + r].surfelID != s)
+      {
+        stats.rayErrors++;
+        break;
+      }
+    ranges.push_back({cold.rayOffset, cold.rayOffset + cold.rayCount});
+  }
+  std::sort(ranges.begin(), ranges.end());
+  for(size_t i = 1; i < ranges.size(); i++)
+    if(ranges[i].first < ranges[i - 1].second)
+      stats.rayErrors++;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// One frame of calculateSurfels
+//
+SurfelReference::FrameStats SurfelReference::runFrame(const SceneCamera& camera, const SunAndSky& sky, const EnvSH& envSH)
+{
+  assert(m_bvh != nullptr);
+  FrameStats stats;
+  MilliTimer timer;
+
+  stats.cellToSurfelGrown = growCellToSurfel();
+  renderGBuffer(camera);
+
+  // SampleExample::calculateSurfels: the cells are rebuilt when the snapped grid origin moves
+  const vec3 gridOrigin = glm::round(vec3(camera.viewInverse[3]) / kCellGridSnap) * kCellGridSnap;
+  m_cellRebuild         = !m_settings.cellPatching || !m_cellGridValid || gridOrigin != m_gridOrigin;
+  m_gridOrigin          = gridOrigin;
+  m_cellGridValid       = true;
+  stats.cellRebuild     = m_cellRebuild;
+
+  // The sort works on the list of the last frame with the grid origin of this one
+  if(m_settings.sortInterval > 0 && m_totalFrames % m_settings.sortInterval == 0)
+  {
+    timer.reset();
+    passSort(stats);
+    stats.times.sort = timer.elapsed();
+    stats.sorted     = true;
+  }
+
+  timer.reset();
+  passPrepare();
+  stats.times.prepare = timer.elapsed();
+
+  timer.reset();
+  passUpdate(camera, stats);
+  stats.times.update = timer.elapsed();
+
+  timer.reset();
+  passRayBudget(stats);
+  stats.times.rayBudget = timer.elapsed();
+  checkRayBudget(stats);
+
+  // The early return of cellInfo and cellToSurfel when no surfel entered or left a cell
+  stats.cellsReused = !m_cellRebuild && m_cellCounter.changedSurfels == 0;
+  if(stats.cellsReused)
+    m_binnedCount = m_counter.aliveSurfelCnt;
+  else
+  {
+    timer.reset();
+    passCellInfo();
+    stats.times.cellInfo = timer.elapsed();
+
+    timer.reset();
+    passCellToSurfel();
+    stats.times.cellToSurfel = timer.elapsed();
+  }
+  stats.cellToSurfelDropped = m_cellCounter.cellToSurfelDropped;
+  m_cellToSurfelPeak        = std::max(m_cellToSurfelPeak, m_cellCounter.aliveSurfelInCell);
+  checkBinning(stats);
+
+  if(m_settings.rayBinning)
+  {
+    timer.reset();
+    passRayBinning(stats);
+    stats.times.rayBinning = timer.elapsed();
+  }
+
+  timer.reset();
+  passRaytrace(sky, stats);
+  stats.times.raytrace = timer.elapsed();
+
+  timer.reset();
+  passIntegrate();
+  stats.times.integrate = timer.elapsed();
+
+  timer.reset();
+  passGeneration(camera, envSH);
+  stats.times.generation = timer.elapsed();
+
+  checkSurfels(stats);
+  m_totalFrames++;
+  return stats;
+}
+
+
+bool SurfelReference::run(const SceneCamera& camera, const SunAndSky& sky, const EnvSH& envSH, uint32_t frames)
+{
+  if(m_bvh == nullptr || m_bvh->empty() || frames == 0)
+    return false;
+
+  LOGI("Surfel reference: %u frames at %ux%u, %u threads\n", frames, m_settings.width, m_settings.height, m_settings.numThreads);
+  PassTimes  sum;
+  FrameStats total;
+  uint32_t   firstError = ~0u;
+  uint32_t   rebuilt = 0, reused = 0, sorts = 0;
+  uint64_t   changedSurfels = 0, scheduledSurfels = 0;
+  for(uint32_t f = 0; f < frames; f++)
+  {
+    const FrameStats s = runFrame(camera, sky, envSH);
+    sum.sort += s.times.sort;
+    sum.prepare += s.times.prepare;
+    sum.update += s.times.update;
+    sum.rayBudget += s.times.rayBudget;
+    sum.cellInfo += s.times.cellInfo;
+    sum.cellToSurfel += s.times.cellToSurfel;
+    sum.rayBinning += s.times.rayBinning;
+    sum.raytrace += s.times.raytrace;
+    sum.integrate += s.times.integrate;
+    sum.generation += s.times.generation;
+
+    const uint32_t errors = s.getErrorCount();
+    if(errors > 0 && firstError == ~0u)
+      firstError = f;
+    total.guidedRays += s.guidedRays;
+    total.raysBelowSurface += s.raysBelowSurface;
+    total.skippedSurfels += s.skippedSurfels;
+    total.mismatchedCells += s.mismatchedCells;
+    total.scanErrors += s.scanErrors;
+    total.missingBinning += s.missingBinning;
+    total.staleBinning += s.staleBinning;
+    total.outOfGrid += s.outOfGrid;
+    total.droppedWrites += s.droppedWrites;
+    total.hashOverflow += s.hashOverflow;
+    total.cellToSurfelDropped += s.cellToSurfelDropped;
+    total.cellHashSlots = std::max(total.cellHashSlots, s.cellHashSlots);
+    total.listErrors += s.listErrors;
+    total.rayErrors += s.rayErrors;
+    total.nonFinite += s.nonFinite;
+    total.budgetErrors += s.budgetErrors;
+    total.sortErrors += s.sortErrors;
+    total.aliveSurfels = s.aliveSurfels;
+    total.scheduledSurfels = s.scheduledSurfels;
+    rebuilt += s.cellRebuild ? 1 : 0;
+    sorts += s.sorted ? 1 : 0;
+    reused += s.cellsReused ? 1 : 0;
+    changedSurfels += s.changedSurfels;
+    total.rays          = s.rays;
+    total.raysRequested = s.raysRequested;
+    scheduledSurfels += s.scheduledSurfels;
+
+    if((f & 15) == 0 || f == frames - 1)
+      LOGI("  frame %3u: %6u surfels, %8u rays, %u errors\n", f, s.aliveSurfels, s.rays, errors);
+  }
+
+  const double n = double(frames);
+  LOGI("  avg ms: prepare %.2f, update %.2f, rayBudget %.2f, cellInfo %.2f, cellToSurfel %.2f, raytrace %.2f, integrate %.2f, "
+       "generation %.2f\n",
+       sum.prepare / n, sum.update / n, sum.rayBudget / n, sum.cellInfo / n, sum.cellToSurfel / n, sum.raytrace / n,
+       sum.integrate / n, sum.generation / n);
+  LOGI("  rays: %u guided, %u below the surface, last frame %u granted of %u requested (budget %u)\n", total.guidedRays,
+       total.raysBelowSurface, total.rays, total.raysRequested, std::min(m_settings.rayBudget, kMaxRayCount));
+  LOGI("  schedule: update fraction %.2f, %.0f surfels asked for rays per frame, %u of %u last frame\n",
+       m_settings.updateFraction, double(scheduledSurfels) / n, total.scheduledSurfels, total.aliveSurfels);
+  if(m_settings.rayBinning)
+    LOGI("  ray binning: %.2f ms per frame before the trace\n", sum.rayBinning / n);
+  if(sorts > 0)
+    LOGI("  sort: alive list sorted %u times, %.2f ms each\n", sorts, sum.sort / double(sorts));
+  LOGI("  cells: %u rebuilt, %u patched (%u reused) frames, %.0f surfels re-binned per frame\n", rebuilt,
+       frames - rebuilt, reused, double(changedSurfels) / n);
+  LOGI("  cellToSurfel: high-water mark %u of %u entries, grown %u times, %u entries dropped while full\n",
+       m_cellToSurfelPeak, m_cellCounter.cellToSurfelCapacity, m_cellToSurfelGrows, total.cellToSurfelDropped);
+  if(m_settings.cellHash)
+    LOGI("  cell hash: %u of %u slots at most, %u overflow\n", total.cellHashSlots, kCellHashCapacity, total.hashOverflow);
+  LOGI("  errors: %u skipped surfels, %u mismatched cells, %u scan, %u missing bins, %u stale bins, %u out of grid\n",
+       total.skippedSurfels, total.mismatchedCells, total.scanErrors, total.missingBinning, total.staleBinning,
+       total.outOfGrid);
+  LOGI("          %u dropped writes, %u alive/dead list, %u ray ranges, %u non-finite, %u ray budget, %u sort\n",
+       total.droppedWrites, total.listErrors, total.rayErrors, total.nonFinite, total.budgetErrors, total.sortErrors);
+  if(firstError != ~0u)
+    LOGI("  first error at frame %u\n", firstError);
+  return firstError == ~0u;
+}
+
+
+SurfelReference::Convergence SurfelReference::runUntilConverged(const SceneCamera& camera, const SunAndSky& sky,
+                                                                const EnvSH& envSH, uint32_t maxFrames, float tolerance,
+                                                                uint32_t window)
+{
+  Convergence result;
+  if(m_bvh == nullptr || m_bvh->empty() || window == 0)
+    return result;
+
+  // Mean luminance of the last `window` frames against the one of the window before
+  std::vector<float> previous, current;
+  while(result.frames < maxFrames && !result.converged)
+  {
+    const FrameStats s = runFrame(camera, sky, envSH);
+    result.frames++;
+    result.aliveSurfels = s.aliveSurfels;
+    result.errors += s.getErrorCount();
+
+    const std::vector<float> image = getLuminance(m_indirect);
+    current.resize(image.size(), 0.f);
+    for(size_t i = 0; i < image.size(); i++)
+      current[i] += image[i] / float(window);
+    if(result.frames % window != 0)
+      continue;
+
+    if(!previous.empty())
+    {
+      const bool black = std::all_of(current.begin(), current.end(), [](float v) { return v <= 0.f; });
+      result.change    = black ? 1.f : getRelativeError(previous, current);
+      result.converged = result.change <= tolerance;
+    }
+    previous.swap(current);
+    current.assign(previous.size(), 0.f);
+  }
+  return result;
+}
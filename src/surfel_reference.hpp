@@ -0,0 +1,248 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include "shaders/host_device.h"
+#include "cpu_bvh.hpp"
+#include "surfel_cache.hpp"
+#include "surfel_config.hpp"
+
+//--------------------------------------------------------------------------------------------------
+// Host implementation of the surfel GI frame (SampleExample::calculateSurfels) working on the
+// host_device.h structures, with the grid, compression and MSME code compiled from the shaders.
+// It is driven by a G-buffer traced through the CPU BVH, so the whole pipeline runs without a ray
+// tracing GPU:
+// - regression oracle: the passes are ported line by line, the buffers can be compared against a
+//   readback of the GPU ones and every frame is checked for broken invariants
+// - testbed: each pass is timed, new surfel and cell layouts can be profiled on the CPU first
+// Passes run multithreaded with the same atomics as the shaders, a run with one thread is
+// deterministic. What differs from the GPU:
+// - surfelPathTrace is reduced to diffuse bounces with a constant albedo, the sun & sky is only
+//   reached by misses (no light sampling, no material textures, no HDR environment)
+// - indirect_postprocess.comp (screen-space AO) is left out, it does not touch the surfels
+// The frame is in surfel_reference.cpp, the other passes are split by unit in
+// surfel_reference_<unit>.cpp. The tests of the units derive from it (tests/surfel_reference_test.hpp).
+//
+class SurfelReference
+{
+public:
+  struct Settings
+  {
+    uint32_t  width{1280};  // rtxState.size, the G-buffer and the generation pass are at half
+    uint32_t  height{720};
+    float     fireflyClampThreshold{10.f};
+    float     hdrMultiplier{1.f};
+    glm::vec3 albedo{0.6f};
+    uint32_t  numThreads{std::thread::hardware_concurrency()};
+    bool      cellHash{false};     // rtxState.cellHash, cells in the sparse hash
+    bool      cellPatching{true};  // Patch the cells of the last frame while the snapped grid origin holds
+    uint32_t  cellToSurfelCapacity{kCellToSurfelInitialSize};  // Entries of cellToSurfel before it grows
+    uint32_t  rayBudget{~0u};      // rtxState.surfelRayBudget, capped to kMaxRayCount
+    float     spawnRate{1.f};      // rtxState.surfelSpawnRate
+    float     updateFraction{1.f}; // rtxState.surfelUpdateFraction
+    uint32_t  sortInterval{0};     // SampleExample::m_surfelSortInterval, frames between two sorts of the alive list
+    bool      rayBinning{false};   // rtxState.surfelRayBinning, rays traced in the order of their bins
+    bool      ageUnseen{true};     // Surfels out of view lose life each frame, off for a bake over several viewpoints
+  };
+
+  struct PassTimes  // ms
+  {
+    double sort{0.0};
+    double prepare{0.0};
+    double update{0.0};
+    double rayBudget{0.0};
+    double cellInfo{0.0};
+    double cellToSurfel{0.0};
+    double rayBinning{0.0};
+    double raytrace{0.0};
+    double integrate{0.0};
+    double generation{0.0};
+  };
+
+  // Counters of one frame, the error ones should all stay at zero
+  struct FrameStats
+  {
+    PassTimes times;
+    uint32_t  aliveSurfels{0};
+    uint32_t  rays{0};
+    uint32_t  raysRequested{0};     // Rays the update pass asked for, more than `rays` past the budget
+    uint32_t  scheduledSurfels{0};  // Surfels the amortized schedule let ask for rays
+    uint32_t  guidedRays{0};        // Rays sampled from the irradiance atlas
+    uint32_t  raysBelowSurface{0};  // Ray directions with dirL.z < 0
+    uint32_t  cellHashSlots{0};     // Slots of the sparse hash claimed by the update pass
+    bool      cellRebuild{false};   // rtxState.cellRebuild, the cells were cleared and binned again
+    bool      cellsReused{false};   // No surfel changed its cells, cellInfo and cellToSurfel were skipped
+    uint32_t  changedSurfels{0};    // Surfels the update pass moved in or out of cells
+    uint32_t  cellToSurfelDropped{0};  // Entries past the capacity of cellToSurfel, left out of the lists
+    bool      cellToSurfelGrown{false};  // cellToSurfel was reallocated before the frame
+    bool      sorted{false};             // The alive list was sorted before the prepare pass
+    // Errors
+    uint32_t skippedSurfels{0};   // Alive surfels the update pass did not process
+    uint32_t mismatchedCells{0};  // Cells with more or less surfels written than reserved
+    uint32_t scanErrors{0};       // Cell offsets other than the exclusive scan of the counts, unsorted lists
+    uint32_t missingBinning{0};   // Surfel / cell overlaps not found in cellToSurfel
+    uint32_t staleBinning{0};     // cellToSurfel entries of surfels that left the cell or died
+    uint32_t outOfGrid{0};        // Neighbour cells flattened outside of the cell buffer
+    uint32_t droppedWrites{0};    // Writes past the end of the ray buffer
+    uint32_t hashOverflow{0};     // Cell insertions that found no free slot of the sparse hash
+    uint32_t listErrors{0};       // IDs lost or duplicated between surfelAlive and surfelDead
+    uint32_t rayErrors{0};        // Ray ranges overlapping or not pointing back to their surfel
+    uint32_t nonFinite{0};        // Alive surfels with NaN or infinite radiance
+    uint32_t budgetErrors{0};     // Ray grants other than the ones of the budget model, rays past the budget,
+                                  // requests of unscheduled surfels, waits past the schedule bound
+    uint32_t sortErrors{0};       // Alive surfels out of key order after a sort, rays binned twice or out of bin order
+
+    uint32_t getErrorCount() const
+    {
+      return skippedSurfels + mismatchedCells + scanErrors + missingBinning + staleBinning + outOfGrid + droppedWrites
+             + listErrors + rayErrors + nonFinite + budgetErrors + sortErrors;
+    }
+  };
+
+  // Result of runUntilConverged
+  struct Convergence
+  {
+    uint32_t frames{0};
+    bool     converged{false};
+    float    change{1.f};  // Between the last two windows
+    uint32_t aliveSurfels{0};
+    uint32_t errors{0};  // Summed over the frames
+  };
+
+  void setup(const CpuBvh* bvh, const Settings& settings);
+  void reset();  // All surfels dead, as after SurfelGI::createResources
+
+  // Camera matrices the way Scene::updateCamera makes them, without the TAA jitter
+  static SceneCamera makeCamera(const glm::mat4& view, float fovDeg, float aspectRatio);
+
+  // One frame in the order of calculateSurfels, the G-buffer is traced first
+  FrameStats runFrame(const SceneCamera& camera, const SunAndSky& sky, const EnvSH& envSH);
+
+  // Runs `frames` frames from a fixed camera and logs the timings and the errors.
+  // Returns true when no frame reported an error.
+  bool run(const SceneCamera& camera, const SunAndSky& sky, const EnvSH& envSH, uint32_t frames);
+
+  // Frames from a fixed camera until the indirect lighting settles: the mean luminance of a window
+  // of frames is within `tolerance` (relative L1) of the window before, or `maxFrames` were run.
+  // A black image never counts as settled.
+  Convergence runUntilConverged(const SceneCamera& camera, const SunAndSky& sky, const EnvSH& envSH,
+                                uint32_t maxFrames, float tolerance = 0.02f, uint32_t window = 8);
+
+  // Cells of a candidate grid centered on `eye` that hold scene geometry, from points spread over the
+  // triangles: share of the geometry in the cube, the frustums and past the grid, occupied cells of
+  // each region and the load they would put on the sparse hash. Results go to the log. The candidate
+  // is applied while the grid code runs, the configuration in use is restored after.
+  static void evaluateGridOccupancy(const CpuBvh& bvh, const SurfelConfig& candidate, const glm::vec3& eye,
+                                    uint32_t numPoints = 1 << 20);
+
+  // Alive surfels and their atlas tiles the way SurfelGI::saveCache gathers them, and the state
+  // SurfelGI::loadCache makes from them, returning the surfels loaded. The cells are rebuilt on the
+  // next frame.
+  void     saveCache(SurfelCache& cache) const;
+  uint32_t loadCache(const SurfelCache& cache);
+
+  // Buffers, same layout as the GPU ones
+  const SurfelCounter&                  getSurfelCounter() const { return m_counter; }
+  const std::vector<Surfel>&            getSurfels() const { return m_surfels; }
+  const std::vector<SurfelCold>&        getSurfelCold() const { return m_surfelCold; }
+  const std::vector<uint32_t>&          getSurfelAlive() const { return m_alive; }
+  const std::vector<SurfelRecycleInfo>& getSurfelRecycleInfo() const { return m_recycle; }
+  const std::vector<CellInfo>&          getCells() const { return m_cells; }
+  const std::vector<uint32_t>&          getCellToSurfel() const { return m_cellToSurfel; }
+  const std::vector<glm::vec4>&         getIndirectLighting() const { return m_indirect; }
+
+protected:
+  // Half resolution, what the passes fetch at imageCoords * 2
+  struct GBuffer
+  {
+    std::vector<float>     depth;  // NDC, 1 on the background
+    std::vector<glm::vec3> position;
+    std::vector<uint32_t>  normal;  // compress_unit_vec
+    std::vector<uint32_t>  objID;
+  };
+
+  void renderGBuffer(const SceneCamera& camera);
+  void passSort(FrameStats& stats);
+  void passPrepare();
+  void clearCells();
+  void passUpdate(const SceneCamera& camera, FrameStats& stats);
+  void passRayBudget(FrameStats& stats);
+  void passCellInfo();
+  void passCellToSurfel();
+  CpuBvh::Ray getSurfelRay(uint32_t surfelIndex, uint32_t& randSeed, glm::vec3& dirL, float& pdf, bool& guided) const;
+  void        passRayBinning(FrameStats& stats);
+  void passRaytrace(const SunAndSky& sky, FrameStats& stats);
+  void passIntegrate();
+  void passGeneration(const SceneCamera& camera, const EnvSH& envSH);
+
+  // cell_hash.glsl, the key is the dense flatten index
+  uint32_t getCellSlotCount() const;
+  uint32_t findCellIndex(uint32_t key) const;
+  uint32_t insertCellIndex(uint32_t key, uint32_t& probes, uint32_t& maxProbe);
+  CellInfo getCellInfo(const glm::ivec4& cellPos) const;  // Empty outside of the grid
+  uint32_t getCellListCount(const CellInfo& cell) const;
+
+  // SampleExample::updateSurfelCapacity, from the counters of the last frame
+  bool growCellToSurfel();
+
+  void checkBinning(FrameStats& stats) const;
+  void checkRayBudget(FrameStats& stats) const;
+  void checkSurfels(FrameStats& stats) const;
+
+  glm::vec3 pathTrace(const CpuBvh::Ray& ray, int maxDepth, uint32_t surfelIndex, const SunAndSky& sky, uint32_t& seed,
+                      float& firstDepth);
+  bool      finalizePathWithSurfel(const glm::vec3& worldPos, const glm::vec3& worldNor, uint32_t randSeed,
+                                   glm::vec4& irradiance);
+
+  const CpuBvh* m_bvh{nullptr};
+  Settings      m_settings;
+  uint32_t      m_totalFrames{0};
+  uint32_t      m_totalCellCount{0};
+  glm::vec3     m_gridOrigin{0.f};  // rtxState.cellGridOrigin
+  bool          m_cellRebuild{true};
+  bool          m_cellGridValid{false};
+  GBuffer       m_gbuffer;
+
+  // Surfel buffers
+  SurfelCounter                  m_counter{};
+  std::vector<Surfel>            m_surfels;
+  std::vector<SurfelCold>        m_surfelCold;
+  std::vector<SurfelGuide>       m_surfelGuide;
+  std::vector<uint32_t>          m_alive;
+  std::vector<uint32_t>          m_dead;
+  std::vector<SurfelRecycleInfo> m_recycle;
+  std::vector<SurfelRay>         m_rays;
+  std::vector<SurfelRayRequest>  m_rayRequest;
+  std::vector<uint32_t>          m_rayScanBlockSums;  // surfelRayScanBlockSum
+  std::vector<uint32_t>          m_sortScratch;       // surfelSortScratch
+  std::vector<uint32_t>          m_sortCounts;        // surfelSortCounts
+  std::vector<uint32_t>          m_sortKeys;          // getSurfelSortKey by surfel, the shader computes them each pass
+  std::vector<uint32_t>          m_raySortIndex;      // surfelRaySortIndex, ray indices in bin order
+  std::vector<uint32_t>          m_rayBins;           // surfelRayBins, counts then offsets
+
+  // Cell buffers
+  std::vector<CellInfo>   m_cells;
+  CellCounter             m_cellCounter{};
+  std::vector<uint32_t>   m_cellToSurfel;
+  std::vector<glm::uvec2> m_cellMask;       // surfelCellMask, overlapped cells of each surfel
+  std::vector<uint32_t>   m_scanBlockSums;  // cellScanBlockSum
+  std::vector<uint32_t>   m_cellHashKeys;
+  std::vector<uint32_t>   m_cellHashOccupied;
+
+  // Irradiance (R16F) and depth (RG8) atlases, kSurfelTileSize^2 texels per surfel
+  glm::uvec2             m_atlasSize{0};
+  std::vector<float>     m_irradianceMap;
+  std::vector<glm::vec2> m_depthMap;
+  std::vector<glm::vec4> m_indirect;  // resultImage of the generation pass
+
+  // Bookkeeping of the checks, not part of the GPU state
+  std::vector<uint32_t> m_cellReserved;  // surfelCount of each cell before cellInfo resets it
+  std::vector<uint32_t> m_updateFrame;   // Last frame the update pass processed the surfel
+  uint32_t              m_binnedCount{0};
+  uint32_t              m_cellToSurfelPeak{0};
+  uint32_t              m_cellToSurfelGrows{0};
+};
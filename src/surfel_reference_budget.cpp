@@ -0,0 +1,126 @@
+// Ray budget: the scan of the requests by priority level and the grants it gives.
+
+#include "surfel_reference_common.hpp"
+
+
+//--------------------------------------------------------------------------------------------------
+// surfel_ray_budget.comp: grants of the requests scanned into ray offsets in the three phases of the
+// cell scan, over the alive list
+//
+void SurfelReference::passRayBudget(FrameStats& stats)
+{
+  const uint32_t      aliveCount = std::min(m_counter.aliveSurfelCnt, kMaxSurfelCount);
+  const uint32_t      blockCount = (aliveCount + kCellScanBlockSize - 1) / kCellScanBlockSize;
+  const SurfelCounter counter    = m_counter;
+  const uint32_t      budget     = std::min(m_settings.rayBudget, kMaxRayCount);
+  nvh::parallel_batches<1>(
+      blockCount,
+      [&](uint64_t b) {
+        const uint32_t first = uint32_t(b) * kCellScanBlockSize;
+        const uint32_t last  = std::min(first + kCellScanBlockSize, aliveCount);
+        uint32_t       sum   = 0;
+        for(uint32_t i = first; i < last; i++)
+        {
+          SurfelCold& cold = m_surfelCold[m_alive[i]];
+          cold.rayCount    = getRayAllocation(m_rayRequest[m_alive[i]], counter, budget);
+          cold.rayOffset   = sum;
+          sum += cold.rayCount;
+        }
+        m_rayScanBlockSums[b] = sum;
+      },
+      m_settings.numThreads);
+
+  uint32_t total = 0;
+  for(uint32_t b = 0; b < blockCount; b++)
+    total += std::exchange(m_rayScanBlockSums[b], total);
+  m_counter.surfelRayCnt = total;
+
+  std::atomic<uint32_t> droppedRays{0};
+  nvh::parallel_batches<256>(
+      aliveCount,
+      [&](uint64_t i) {
+        const uint  surfelIndex = m_alive[i];
+        SurfelCold& cold        = m_surfelCold[surfelIndex];
+        cold.rayOffset += m_rayScanBlockSums[i / kCellScanBlockSize];
+        for(uint rayIndex = 0; rayIndex < cold.rayCount; ++rayIndex)
+        {
+          if(cold.rayOffset + rayIndex >= m_rays.size())
+          {
+            droppedRays++;
+            continue;
+          }
+          m_rays[cold.rayOffset + rayIndex]          = SurfelRay{};
+          m_rays[cold.rayOffset + rayIndex].surfelID = surfelIndex;
+        }
+      },
+      m_settings.numThreads);
+  stats.droppedWrites += droppedRays;
+}
+
+
+
+//--------------------------------------------------------------------------------------------------
+// After the ray budget: the request totals are the sums over the alive list, each surfel got what
+// filling the budget level by level gives it, and all the rays fit in the budget. The surfels the
+// schedule left out ask for nothing and none waits past getScheduleMaxStale.
+//
+void SurfelReference::checkRayBudget(FrameStats& stats) const
+{
+  const uint32_t                           alive = std::min(m_counter.aliveSurfelCnt, kMaxSurfelCount);
+  uint64_t                                 base  = 0;
+  std::array<uint64_t, kRayPriorityLevels> extra{};
+  for(uint32_t i = 0; i < alive; i++)
+  {
+    const SurfelRayRequest& request = m_rayRequest[m_alive[i]];
+    const uint32_t          minRays = std::min(request.count, kSurfelMinRays);
+    base += minRays;
+    extra[std::min(request.priority, kRayPriorityLevels - 1)] += request.count - minRays;
+  }
+
+  uint32_t       errors    = 0;
+  uint32_t       scheduled = 0;
+  const uint32_t maxStale  = getScheduleMaxStale(m_settings.updateFraction);
+  for(uint32_t i = 0; i < alive; i++)
+  {
+    const uint32_t staleFrames = m_recycle[m_alive[i]].staleFrames;
+    errors += (staleFrames != 0 && m_rayRequest[m_alive[i]].count != 0) || staleFrames >= maxStale ? 1 : 0;
+    scheduled += staleFrames == 0 ? 1 : 0;
+  }
+  errors += scheduled != m_counter.scheduledSurfels ? 1 : 0;
+  uint64_t requested = base;
+  for(uint32_t level = 0; level < kRayPriorityLevels; level++)
+  {
+    errors += extra[level] != m_counter.rayRequestExtra[level] ? 1 : 0;
+    requested += extra[level];
+  }
+  errors += base != m_counter.rayRequestBase ? 1 : 0;
+
+  // Rays above the minimums each level gets, the highest first
+  const uint64_t                           budget = std::min(m_settings.rayBudget, kMaxRayCount);
+  const bool                               scaled = base > budget;
+  std::array<uint64_t, kRayPriorityLevels> served{};
+  uint64_t                                 left = scaled ? 0 : budget - base;
+  for(uint32_t level = kRayPriorityLevels; level-- > 0;)
+  {
+    served[level] = std::min(extra[level], left);
+    left -= served[level];
+  }
+
+  uint64_t granted = 0;
+  for(uint32_t i = 0; i < alive; i++)
+  {
+    const SurfelRayRequest& request  = m_rayRequest[m_alive[i]];
+    const uint32_t          level    = std::min(request.priority, kRayPriorityLevels - 1);
+    const uint64_t          minRays  = std::min(request.count, kSurfelMinRays);
+    const uint64_t          expected = scaled ? minRays * budget / base :
+                                                minRays + (extra[level] ? (request.count - minRays) * served[level] / extra[level] : 0);
+    const uint32_t          count    = m_surfelCold[m_alive[i]].rayCount;
+    errors += count != expected ? 1 : 0;
+    granted += count;
+  }
+  errors += granted != m_counter.surfelRayCnt || granted > budget ? 1 : 0;
+
+  stats.raysRequested    = uint32_t(requested);
+  stats.scheduledSurfels = scheduled;
+  stats.budgetErrors += errors;
+}
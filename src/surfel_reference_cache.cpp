@@ -0,0 +1,59 @@
+// Surfel cache: saving and loading the alive surfels.
+
+#include "surfel_reference_common.hpp"
+
+
+//--------------------------------------------------------------------------------------------------
+// Same gathering and ID assignment as SurfelGI::saveCache and loadCache, with the atlas texels
+// converted to and from the image formats
+//
+void SurfelReference::saveCache(SurfelCache& cache) const
+{
+  const uint32_t count = std::min(m_counter.aliveSurfelCnt, kMaxSurfelCount);
+  cache.sceneHash      = m_bvh != nullptr ? m_bvh->getGeometryHash() : 0;
+  cache.resize(count);
+  for(uint32_t i = 0; i < count; i++)
+  {
+    const uint32_t surfelIndex = m_alive[i];
+    cache.surfels[i]           = m_surfels[surfelIndex];
+    cache.cold[i]              = m_surfelCold[surfelIndex];
+    cache.recycle[i]           = m_recycle[surfelIndex];
+    cache.guide[i]             = m_surfelGuide[surfelIndex];
+
+    const uvec2 origin = SurfelCache::getTileOrigin(surfelIndex, m_atlasSize.x);
+    for(uint32_t t = 0; t < kSurfelGuideEntries; t++)
+    {
+      const size_t texel = size_t(origin.y + t / kSurfelTileSize) * m_atlasSize.x + origin.x + t % kSurfelTileSize;
+      cache.irradiance[size_t(i) * kSurfelGuideEntries + t] = glm::packHalf1x16(m_irradianceMap[texel]);
+      cache.depth[size_t(i) * kSurfelGuideEntries + t]      = packRG8(m_depthMap[texel]);
+    }
+  }
+}
+
+
+uint32_t SurfelReference::loadCache(const SurfelCache& cache)
+{
+  reset();
+  const uint32_t count     = std::min(cache.getSurfelCount(), kMaxSurfelCount);
+  m_counter.aliveSurfelCnt = count;
+  m_counter.deadSurfelCnt  = kMaxSurfelCount - count;
+  for(uint32_t i = 0; i < count; i++)
+  {
+    m_alive[i]       = i;
+    m_surfels[i]     = cache.surfels[i];
+    m_surfelCold[i]  = cache.cold[i];
+    m_recycle[i]     = cache.recycle[i];
+    m_surfelGuide[i] = cache.guide[i];
+
+    const uvec2 origin = SurfelCache::getTileOrigin(i, m_atlasSize.x);
+    for(uint32_t t = 0; t < kSurfelGuideEntries; t++)
+    {
+      const size_t texel = size_t(origin.y + t / kSurfelTileSize) * m_atlasSize.x + origin.x + t % kSurfelTileSize;
+      m_irradianceMap[texel] = glm::unpackHalf1x16(cache.irradiance[size_t(i) * kSurfelGuideEntries + t]);
+      m_depthMap[texel]      = unpackRG8(cache.depth[size_t(i) * kSurfelGuideEntries + t]);
+    }
+  }
+  for(uint32_t i = 0; i < m_counter.deadSurfelCnt; i++)
+    m_dead[i] = count + i;
+  return count;
+}
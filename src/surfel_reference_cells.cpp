@@ -0,0 +1,190 @@
+// Cells of the surfel grid: the sparse hash, the growth of cellToSurfel, the overlap masks of the
+// surfels, patching the cells of the last frame and the occupancy of candidate grids.
+
+#include "surfel_reference_common.hpp"
+
+
+// The dense grid, or the slots the hash claimed last frame
+void SurfelReference::clearCells()
+{
+  m_cellCounter.aliveSurfelInCell = 0;
+  if(m_cellCounter.hashedFrame != 0)
+  {
+    for(uint32_t i = 0; i < m_cellCounter.hashOccupied; i++)
+    {
+      const uint32_t slot  = m_cellHashOccupied[i];
+      m_cellHashKeys[slot] = kCellHashEmpty;
+      m_cells[slot]        = CellInfo{0, 0};
+    }
+  }
+  else
+    std::fill(m_cells.begin(), m_cells.end(), CellInfo{0, 0});
+  m_cellCounter.hashOccupied = 0;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// cell_hash.glsl
+//
+uint32_t SurfelReference::getCellSlotCount() const
+{
+  return m_settings.cellHash ? kCellHashCapacity : m_totalCellCount;
+}
+
+
+uint32_t SurfelReference::findCellIndex(uint32_t key) const
+{
+  if(!m_settings.cellHash)
+    return key;
+
+  const uint home = getCellHashHome(key);
+  for(uint i = 0; i < kCellHashMaxProbes; i++)
+  {
+    const uint slot    = (home + i) & (kCellHashCapacity - 1u);
+    const uint slotKey = atomicLoad(m_cellHashKeys[slot]);
+    if(slotKey == key)
+      return slot;
+    if(slotKey == kCellHashEmpty)
+      break;
+  }
+  return kInvalidCell;
+}
+
+
+uint32_t SurfelReference::insertCellIndex(uint32_t key, uint32_t& probes, uint32_t& maxProbe)
+{
+  if(!m_settings.cellHash)
+    return key;
+
+  const uint home = getCellHashHome(key);
+  for(uint i = 0; i < kCellHashMaxProbes; i++)
+  {
+    const uint slot    = (home + i) & (kCellHashCapacity - 1u);
+    const uint slotKey = atomicCompSwap(m_cellHashKeys[slot], kCellHashEmpty, key);
+    if(slotKey == kCellHashEmpty)
+      atomicStore(m_cellHashOccupied[atomicAdd(m_cellCounter.hashOccupied, 1u)], slot);
+    if(slotKey == kCellHashEmpty || slotKey == key)
+    {
+      probes += i + 1;
+      maxProbe = max(maxProbe, i + 1);
+      return slot;
+    }
+  }
+  probes += kCellHashMaxProbes;
+  maxProbe = kCellHashMaxProbes;
+  atomicAdd(m_cellCounter.hashOverflow, 1u);
+  return kInvalidCell;
+}
+
+
+CellInfo SurfelReference::getCellInfo(const glm::ivec4& cellPos) const
+{
+  const uint cellIndex = findCellIndex(getFlattenCellIndexNonUniform(cellPos));
+  if(cellIndex >= m_cells.size())
+    return CellInfo{0, 0};
+  return CellInfo{m_cells[cellIndex].surfelOffset, getCellListCount(m_cells[cellIndex])};
+}
+
+
+uint32_t SurfelReference::getCellListCount(const CellInfo& cell) const
+{
+  const uint capacity = m_cellCounter.cellToSurfelCapacity;
+  return cell.surfelOffset < capacity ? std::min(cell.surfelCount, capacity - cell.surfelOffset) : 0u;
+}
+
+
+// Same sizing as the host, the growth happens between frames and the cells are rebuilt
+bool SurfelReference::growCellToSurfel()
+{
+  const CellCounter& cells = m_cellCounter;
+  if(cells.aliveSurfelInCell <= cells.cellToSurfelCapacity && cells.cellToSurfelDropped == 0)
+    return false;
+
+  uint32_t capacity = cells.aliveSurfelInCell + cells.aliveSurfelInCell / 2;
+  capacity          = std::min((capacity + 0xffffu) & ~0xffffu, kCellToSurfelMaxSize);
+  if(capacity <= cells.cellToSurfelCapacity)
+    return false;
+
+  m_cellToSurfel.assign(capacity, 0);
+  m_cellCounter.cellToSurfelCapacity = capacity;
+  m_cellGridValid                    = false;
+  m_cellToSurfelGrows++;
+  return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// Grid occupancy of a candidate configuration
+//
+void SurfelReference::evaluateGridOccupancy(const CpuBvh& bvh, const SurfelConfig& candidate, const glm::vec3& eye,
+                                            uint32_t numPoints)
+{
+  const std::vector<glm::vec3> points = bvh.sampleSurface(numPoints);
+  if(points.empty() || !candidate.validate())
+    return;
+
+  // The grid code reads the host_device.h values
+  const SurfelConfig inUse;
+  candidate.apply();
+
+  MilliTimer            timer;
+  const glm::vec3       origin = glm::round(eye / kCellGridSnap) * kCellGridSnap;  // SampleExample::calculateSurfels
+  std::vector<uint32_t> cellPoints(candidate.getCellCount(), 0);
+  std::array<uint32_t, 7> regionPoints{};
+  uint32_t                outside = 0;
+  for(const glm::vec3& point : points)
+  {
+    const ivec4 cellPos = getCellPosNonUniform(point, origin);
+    if(!isCellValid(cellPos))
+    {
+      outside++;
+      continue;
+    }
+    regionPoints[cellPos.w]++;
+    cellPoints[getFlattenCellIndexNonUniform(cellPos)]++;
+  }
+  const double time = timer.elapsed();
+  inUse.apply();
+
+  // Cube cells first, then m * n * n per frustum (getFlattenCellIndexNonUniform)
+  const uint32_t          cubeCells    = uint32_t(candidate.gridSplits * candidate.gridSplits * candidate.gridSplits);
+  const uint32_t          frustumCells = uint32_t(candidate.gridLayers * candidate.gridSplits * candidate.gridSplits);
+  std::array<uint32_t, 7> regionCells{};
+  uint32_t                occupied = 0, maxPoints = 0;
+  for(uint32_t c = 0; c < cellPoints.size(); c++)
+  {
+    if(cellPoints[c] == 0)
+      continue;
+    regionCells[c < cubeCells ? 0 : 1 + (c - cubeCells) / frustumCells]++;
+    occupied++;
+    maxPoints = std::max(maxPoints, cellPoints[c]);
+  }
+  uint32_t frustumOccupied = 0;
+  for(uint32_t r = 1; r < 7; r++)
+    frustumOccupied += regionCells[r];
+
+  const glm::vec3 bmin = bvh.getBoundsMin(), bmax = bvh.getBoundsMax();
+  float           reach = 0.f;  // Farthest corner of the scene bounds
+  for(uint32_t corner = 0; corner < 8; corner++)
+  {
+    const glm::vec3 pos{corner & 1 ? bmax.x : bmin.x, corner & 2 ? bmax.y : bmin.y, corner & 4 ? bmax.z : bmin.z};
+    reach = std::max(reach, glm::length(pos - origin));
+  }
+
+  const float inGrid   = float(points.size() - outside);
+  const float hashLoad = occupied / float(kCellHashCapacity);
+  const auto  percent  = [&](uint32_t count) { return 100.f * count / float(points.size()); };
+  LOGI("Grid occupancy: %zu points over the scene around (%.2f, %.2f, %.2f), %.1f ms\n", points.size(), origin.x,
+       origin.y, origin.z, time);
+  candidate.print();
+  LOGI("  geometry: %.1f%% in the cube, %.1f%% in the frustums, %.1f%% past the grid (scene reaches %.1f)\n",
+       percent(regionPoints[0]), percent(uint32_t(inGrid) - regionPoints[0]), percent(outside), reach);
+  LOGI("  occupied cells: %u of %u (%.2f%%), cube %u of %u, frustums %u of %u\n", occupied, candidate.getCellCount(),
+       100.f * occupied / candidate.getCellCount(), regionCells[0], cubeCells, frustumOccupied, 6 * frustumCells);
+  LOGI("  frustums +X %u, -X %u, +Y %u, -Y %u, +Z %u, -Z %u occupied\n", regionCells[1], regionCells[2],
+       regionCells[3], regionCells[4], regionCells[5], regionCells[6]);
+  LOGI("  points per occupied cell: mean %.1f, max %u\n", occupied ? inGrid / occupied : 0.f, maxPoints);
+  LOGI("  sparse hash: load %.2f of %u slots%s, dense cell buffer %.1f MB\n", hashLoad, kCellHashCapacity,
+       hashLoad > 0.75f ? " (past 3/4, long probes and overflows)" : "",
+       candidate.getCellBufferSize() * sizeof(CellInfo) / (1024.0 * 1024.0));
+}
@@ -0,0 +1,272 @@
+#pragma once
+
+// Shared by the units of SurfelReference (surfel_reference*.cpp), not part of its interface: the
+// shader code compiled for the host and the host side of the GLSL built-ins. Everything has internal
+// linkage, each unit uses a part of it.
+
+#define _USE_MATH_DEFINES
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <iterator>
+#include <sstream>
+#include <utility>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "surfel_reference.hpp"
+#include "tools.hpp"
+
+#include "nvh/parallel_work.hpp"
+
+#ifndef CPP
+#define CPP
+#endif
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#elif defined(_MSC_VER)
+#pragma warning(push)
+#pragma warning(disable : 4505)  // Unreferenced function with internal linkage
+#endif
+
+namespace {
+
+// Same code as the shaders for everything that compiles as C++, the rest is ported below
+namespace glsl_surfel {
+using namespace glm;
+using namespace surfel_spec;
+#include "shaders/compress.glsl"
+#include "shaders/shaderUtil_grid.glsl"
+#include "shaders/msme.glsl"
+#include "shaders/spherical_harmonics.glsl"
+#include "shaders/surfel_ray_budget.glsl"
+#include "shaders/surfel_schedule.glsl"
+#include "shaders/surfel_sort.glsl"
+
+// surfel_guide.glsl on a SurfelGuide of the host, `fetches` after it counts the entries read
+#define SURFEL_GUIDE_PARAM const SurfelGuide &guide, uint &fetches
+#define SURFEL_GUIDE_ARG guide, fetches
+#define SURFEL_GUIDE_WORD(j) (fetches++, guide.cdf[j])
+#include "shaders/surfel_guide.glsl"
+
+// random.glsl (inout parameters)
+uint tea(uint val0, uint val1)
+{
+  uint v0 = val0;
+  uint v1 = val1;
+  uint s0 = 0;
+  for(uint i = 0; i < 16; i++)
+  {
+    s0 += 0x9e3779b9;
+    v0 += ((v1 << 4) + 0xa341316c) ^ (v1 + s0) ^ ((v1 >> 5) + 0xc8013ea4);
+    v1 += ((v0 << 4) + 0xad90777d) ^ (v0 + s0) ^ ((v0 >> 5) + 0x7e95761e);
+  }
+  return v0;
+}
+
+uint initRandom(uvec2 resolution, uvec2 screenCoord, uint frame)
+{
+  return tea(screenCoord.y * resolution.x + screenCoord.x, frame);
+}
+
+uint lowbias32(uint x)
+{
+  x ^= x >> 17;
+  x *= 0xed5ad4bbU;
+  x ^= x >> 11;
+  x *= 0xac4c1b51U;
+  x ^= x >> 15;
+  x *= 0x31848babU;
+  x ^= x >> 14;
+  return x;
+}
+
+uint pcg(uint& state)
+{
+  uint prev = state * 747796405u + 2891336453u;
+  uint word = ((prev >> ((prev >> 28u) + 4u)) ^ prev) * 277803737u;
+  state     = prev;
+  return (word >> 22u) ^ word;
+}
+
+float rand(uint& seed)
+{
+  uint r = pcg(seed);
+  return uintBitsToFloat(0x3f800000 | (r >> 9)) - 1.0f;
+}
+
+vec2 rand2(uint& prev)
+{
+  float x = rand(prev);
+  return vec2(x, rand(prev));
+}
+
+// compress.glsl (device only)
+vec2 DirToOctUV(vec3 v)
+{
+  float norm   = abs(v.x) + abs(v.y) + abs(v.z);
+  vec2  result = vec2(v.x, v.y) * (1.0f / norm);
+  return vec2(result.x - result.y, result.x + result.y);
+}
+
+vec3 OctUVToDir(vec2 uv)
+{
+  vec2 result = vec2((uv.x + uv.y) / 2.f, (uv.y - uv.x) / 2.f);
+  vec3 v      = vec3(result.x, result.y, 1.f - abs(result.x) - abs(result.y));
+  return normalize(v);
+}
+
+// pbr_disney.glsl
+vec3 CosineSampleHemisphere(float r1, float r2)
+{
+  vec3  dir;
+  float r   = sqrt(r1);
+  float phi = float(2.0 * M_PI) * r2;
+  dir.x     = r * cos(phi);
+  dir.y     = r * sin(phi);
+  dir.z     = sqrt(max(0.0f, 1.0f - dir.x * dir.x - dir.y * dir.y));
+  return dir;
+}
+
+// common.glsl
+void CreateCoordinateSystem(vec3 N, vec3& Nt, vec3& Nb)
+{
+  Nt = normalize(((abs(N.z) > 0.99999f) ? vec3(-N.x * N.y, 1.0f - N.y * N.y, -N.y * N.z) :
+                                          vec3(-N.x * N.z, -N.y * N.z, 1.0f - N.z * N.z)));
+  Nb = cross(Nt, N);
+}
+
+vec3 OffsetRay(vec3 p, vec3 n)
+{
+  const float intScale   = 4096.0f;
+  const float floatScale = 1.0f / 65536.0f;
+  const float origin     = 1.0f / 32.0f;
+
+  ivec3 of_i = ivec3(intScale * n.x, intScale * n.y, intScale * n.z);
+  vec3  p_i;
+  for(int a = 0; a < 3; a++)
+  {
+    int bits = int(floatBitsToUint(p[a])) + ((p[a] < 0) ? -of_i[a] : of_i[a]);
+    p_i[a]   = uintBitsToFloat(uint(bits));
+  }
+  return vec3(abs(p.x) < origin ? p.x + floatScale * n.x : p_i.x,  //
+              abs(p.y) < origin ? p.y + floatScale * n.y : p_i.y,  //
+              abs(p.z) < origin ? p.z + floatScale * n.z : p_i.z);
+}
+
+// shaderUtils_surfel_cell.glsl
+float calcSurfelRadius(float distance, float fovy, vec2 resolution)
+{
+  float angle = sqrt(surfelSize / 3.14159265359f) * fovy * 2.0f / max(resolution.x, resolution.y);
+  return distance * tan(angle);
+}
+}  // namespace glsl_surfel
+
+using namespace glsl_surfel;
+
+// GLSL atomics on plain buffer elements
+template <typename T>
+T atomicAdd(T& value, T add)
+{
+  return std::atomic_ref<T>(value).fetch_add(add, std::memory_order_relaxed);
+}
+template <typename T>
+T atomicSub(T& value, T sub)
+{
+  return std::atomic_ref<T>(value).fetch_sub(sub, std::memory_order_relaxed);
+}
+uint32_t atomicOr(uint32_t& value, uint32_t bits)
+{
+  return std::atomic_ref<uint32_t>(value).fetch_or(bits, std::memory_order_relaxed);
+}
+uint32_t atomicMax(uint32_t& value, uint32_t x)
+{
+  std::atomic_ref<uint32_t> ref(value);
+  uint32_t                  prev = ref.load(std::memory_order_relaxed);
+  while(prev < x && !ref.compare_exchange_weak(prev, x, std::memory_order_relaxed))
+    ;
+  return prev;
+}
+uint32_t atomicCompSwap(uint32_t& value, uint32_t compare, uint32_t data)
+{
+  std::atomic_ref<uint32_t>(value).compare_exchange_strong(compare, data, std::memory_order_relaxed);
+  return compare;
+}
+template <typename T>
+T atomicLoad(const T& value)
+{
+  return std::atomic_ref<T>(const_cast<T&>(value)).load(std::memory_order_relaxed);
+}
+template <typename T>
+void atomicStore(T& value, T x)
+{
+  std::atomic_ref<T>(value).store(x, std::memory_order_relaxed);
+}
+
+// Storage formats of the atlases
+float toR16F(float v)
+{
+  return glm::unpackHalf1x16(glm::packHalf1x16(v));
+}
+glm::vec2 toRG8(glm::vec2 v)
+{
+  return glm::round(glm::clamp(v, 0.f, 1.f) * 255.f) / 255.f;
+}
+// RG8 texel as the image holds it, for the surfel cache. Values from toRG8 come back unchanged.
+uint16_t packRG8(glm::vec2 v)
+{
+  const glm::uvec2 bytes = glm::uvec2(glm::round(glm::clamp(v, 0.f, 1.f) * 255.f));
+  return uint16_t(bytes.x | (bytes.y << 8));
+}
+glm::vec2 unpackRG8(uint16_t texel)
+{
+  return glm::vec2(float(texel & 0xffu), float(texel >> 8)) / 255.f;
+}
+
+bool isFinite(const glm::vec3& v)
+{
+  return std::isfinite(v.x) && std::isfinite(v.y) && std::isfinite(v.z);
+}
+
+// surfel_integrate.comp: CDF of a tile from its running sums
+SurfelGuide makeSurfelGuide(const float* cumulative, float irradianceSum)
+{
+  SurfelGuide guide{};
+  for(uint32_t j = 0; j < kSurfelGuideEntries / 2; j++)
+    guide.cdf[j] = packGuideCdf(cumulative[2 * j], cumulative[2 * j + 1], irradianceSum, j);
+  return guide;
+}
+
+// Convergence of the indirect lighting, compared on its luminance
+std::vector<float> getLuminance(const std::vector<glm::vec4>& image)
+{
+  std::vector<float> result(image.size());
+  for(size_t i = 0; i < image.size(); i++)
+    result[i] = dot(vec3(image[i]), vec3(0.2126f, 0.7152f, 0.0722f));
+  return result;
+}
+
+// Relative L1 distance, 0 against a black target
+float getRelativeError(const std::vector<float>& image, const std::vector<float>& target)
+{
+  double diff = 0.0, sum = 0.0;
+  for(size_t i = 0; i < target.size(); i++)
+  {
+    diff += std::abs(double(image[i]) - double(target[i]));
+    sum += std::abs(double(target[i]));
+  }
+  return sum > 0.0 ? float(diff / sum) : 0.f;
+}
+}  // namespace
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#elif defined(_MSC_VER)
+#pragma warning(pop)
+#endif
@@ -0,0 +1,41 @@
+// Surfel ray directions, cosine or guided by the tile CDF of the irradiance atlas.
+
+#include "surfel_reference_common.hpp"
+
+
+//--------------------------------------------------------------------------------------------------
+// Ray of surfel_raytrace.comp: guided by the CDF of the irradiance tile once it is full, cosine
+// weighted before. The binning and the trace draw it from the same seed. pdf is per solid angle.
+//
+CpuBvh::Ray SurfelReference::getSurfelRay(uint surfelIndex, uint& randSeed, vec3& dirL, float& pdf, bool& guided) const
+{
+  const SurfelCold& cold             = m_surfelCold[surfelIndex];
+  uint              irradianceUint   = cold.irradiance;
+  float             surfelIrradiance = glsl_surfel::uintBitsToFloat(irradianceUint);
+  bool              isFull           = (irradianceUint & 0x01) > 0 && surfelIrradiance > 1e-12f;
+
+  guided = isFull && cold.rayCount > 16;
+  if(guided)
+  {
+    uint32_t fetches = 0;
+    uint     texel   = sampleGuideTexel(m_surfelGuide[surfelIndex], fetches, rand(randSeed), pdf);
+    vec2     r       = rand2(randSeed);
+    dirL             = sampleGuideDirection(texel, r, pdf);
+  }
+  else
+  {
+    vec2 uv = rand2(randSeed);
+    dirL    = CosineSampleHemisphere(uv.x, uv.y);
+    pdf     = dirL.z * float(M_1_PI);
+  }
+
+  const Surfel& surfel = m_surfels[surfelIndex];
+  vec3          N      = decompress_unit_vec(surfel.normal);
+  vec3          T, B;
+  CreateCoordinateSystem(N, T, B);
+
+  CpuBvh::Ray ray;
+  ray.direction = normalize(dirL.x * T + dirL.y * B + dirL.z * N);
+  ray.origin    = surfel.position + 0.05f * N;
+  return ray;
+}
@@ -0,0 +1,171 @@
+// Binning of the surfels in their cells: the counts scanned into list offsets, then the scatter.
+
+#include "surfel_reference_common.hpp"
+
+
+//--------------------------------------------------------------------------------------------------
+// cellInfo_update_pass.comp: exclusive scan of the cell counts in the same three phases, a block
+// scanned serially gives the same offsets as the workgroup scan
+//
+void SurfelReference::passCellInfo()
+{
+  const uint32_t cellCount  = getCellSlotCount();
+  const uint32_t blockCount = (cellCount + kCellScanBlockSize - 1) / kCellScanBlockSize;
+  nvh::parallel_batches<1>(
+      blockCount,
+      [&](uint64_t b) {
+        const uint32_t first = uint32_t(b) * kCellScanBlockSize;
+        const uint32_t last  = std::min(first + kCellScanBlockSize, cellCount);
+        uint32_t       sum   = 0;
+        for(uint32_t c = first; c < last; c++)
+        {
+          m_cellReserved[c]       = m_cells[c].surfelCount;
+          m_cells[c].surfelOffset = sum;
+          sum += m_cells[c].surfelCount;
+        }
+        m_scanBlockSums[b] = sum;
+      },
+      m_settings.numThreads);
+
+  uint32_t total = 0;
+  for(uint32_t b = 0; b < blockCount; b++)
+    total += std::exchange(m_scanBlockSums[b], total);
+  m_cellCounter.aliveSurfelInCell = total;
+  m_cellCounter.hashedFrame       = m_settings.cellHash ? 1 : 0;
+
+  nvh::parallel_batches<256>(
+      cellCount,
+      [&](uint64_t i) {
+        m_cells[i].surfelOffset += m_scanBlockSums[i / kCellScanBlockSize];
+        m_cells[i].surfelCount = 0;
+      },
+      m_settings.numThreads);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// cellToSurfel_update_pass.comp: each surfel written in the ranges of the cells of its mask, then
+// each range sorted by surfel index
+//
+void SurfelReference::passCellToSurfel()
+{
+  m_binnedCount = m_counter.aliveSurfelCnt;
+
+  nvh::parallel_batches<32>(
+      m_binnedCount,
+      [&](uint64_t i) {
+        const uint  surfelIndex = m_alive[i];
+        const uvec2 cellMask    = m_cellMask[surfelIndex];
+        if(cellMask.x == 0)
+          return;
+
+        ivec4      cellPosIndex = getCellPosNonUniform(m_surfels[surfelIndex].position, m_gridOrigin);
+        const uint slots        = getCellMaskSlotCount(cellMask);
+        for(uint j = 0; j < slots; j++)
+        {
+          const ivec4 cellPos = getCellMaskCellPos(cellPosIndex, cellMask, j);
+          if(cellPos.w < 0)
+            continue;
+          uint cellIndex = findCellIndex(getFlattenCellIndexNonUniform(cellPos));
+          if(cellIndex == kInvalidCell)
+            continue;
+          uint prevCount = atomicAdd(m_cells[cellIndex].surfelCount, 1u);
+          uint dst       = m_cells[cellIndex].surfelOffset + prevCount;
+          if(dst < m_cellCounter.cellToSurfelCapacity)
+            atomicStore(m_cellToSurfel[dst], surfelIndex);
+          else
+            atomicAdd(m_cellCounter.cellToSurfelDropped, 1u);
+        }
+      },
+      m_settings.numThreads);
+
+  nvh::parallel_batches<256>(
+      getCellSlotCount(),
+      [&](uint64_t i) {
+        // The network of the workgroup, its invocations one after the other within a step
+        const CellInfo cell  = m_cells[i];
+        const uint32_t count = getCellListCount(cell);
+        if(count < 2)
+          return;
+        uint32_t*      list  = &m_cellToSurfel[cell.surfelOffset];
+        const uint32_t pairs = 1u << (31 - std::countl_zero(count - 1));
+        for(uint k = 2; k <= pairs * 2; k <<= 1)
+        {
+          for(uint j = k >> 1; j > 0; j >>= 1)
+          {
+            for(uint t = 0; t < pairs; t++)
+            {
+              const uvec2 pair = getCellSortPair(t, k, j);
+              if(pair.y < count && list[pair.x] > list[pair.y])
+                std::swap(list[pair.x], list[pair.y]);
+            }
+          }
+        }
+      },
+      m_settings.numThreads);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// Right after cellToSurfel: the offsets are the exclusive scan of the counts, every cell got what it
+// reserved in surfel index order, the lists hold exactly the cells of the surfel masks (patched
+// frames must not leave a surfel in a cell it left), and the mask of each surfel updated this frame
+// is its overlap with the grid
+//
+void SurfelReference::checkBinning(FrameStats& stats) const
+{
+  std::vector<uint64_t> pairs;
+  pairs.reserve(m_cellCounter.aliveSurfelInCell);
+  uint32_t offset = 0;
+  for(uint32_t c = 0; c < getCellSlotCount(); c++)
+  {
+    const CellInfo& cell = m_cells[c];
+    if(cell.surfelOffset != offset)
+      stats.scanErrors++;
+    offset += m_cellReserved[c];
+    if(cell.surfelCount != m_cellReserved[c])
+      stats.mismatchedCells++;
+
+    // Lists cut short by an overflow of cellToSurfel are left out, the next frame grows it
+    const uint32_t count = std::min(cell.surfelCount, m_cellReserved[c]);
+    if(getCellListCount(cell) < count)
+      continue;
+    const auto first = m_cellToSurfel.begin() + cell.surfelOffset;
+    if(!std::is_sorted(first, first + count))
+      stats.scanErrors++;
+    for(uint32_t i = 0; i < count; i++)
+      pairs.push_back(uint64_t(c) << 32 | first[i]);
+  }
+  if(offset != m_cellCounter.aliveSurfelInCell)
+    stats.scanErrors++;
+  std::sort(pairs.begin(), pairs.end());
+
+  std::vector<uint64_t> expected;
+  expected.reserve(pairs.size());
+  for(uint32_t idx = 0; idx < m_binnedCount; idx++)
+  {
+    const uint32_t s            = m_alive[idx];
+    const Surfel&  surfel       = m_surfels[s];
+    const ivec4    cellPosIndex = getCellPosNonUniform(surfel.position, m_gridOrigin);
+    if(m_updateFrame[s] == m_totalFrames && m_cellMask[s] != getSurfelCellMask(surfel, cellPosIndex, m_gridOrigin))
+      stats.missingBinning++;
+    const uint slots = getCellMaskSlotCount(m_cellMask[s]);
+    for(uint j = 0; j < slots; j++)
+    {
+      const ivec4 cellPos = getCellMaskCellPos(cellPosIndex, m_cellMask[s], j);
+      if(cellPos.w < 0)
+        continue;
+      const uint cellIndex = findCellIndex(getFlattenCellIndexNonUniform(cellPos));
+      if(cellIndex != kInvalidCell && getCellListCount(m_cells[cellIndex]) == m_cells[cellIndex].surfelCount)
+        expected.push_back(uint64_t(cellIndex) << 32 | s);
+    }
+  }
+  std::sort(expected.begin(), expected.end());
+
+  std::vector<uint64_t> difference;
+  std::set_difference(expected.begin(), expected.end(), pairs.begin(), pairs.end(), std::back_inserter(difference));
+  stats.missingBinning += uint32_t(difference.size());
+  difference.clear();
+  std::set_difference(pairs.begin(), pairs.end(), expected.begin(), expected.end(), std::back_inserter(difference));
+  stats.staleBinning += uint32_t(difference.size());
+}
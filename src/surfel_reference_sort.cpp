@@ -0,0 +1,115 @@
+// Order of the work: the radix sort of the alive list and the binning of the rays.
+
+#include "surfel_reference_common.hpp"
+
+
+//--------------------------------------------------------------------------------------------------
+// surfel_sort.comp: each radix pass counts the digits of the blocks, scans the counts digit major
+// and scatters the blocks in list order, serially here as the shader ranks within a digit
+//
+void SurfelReference::passSort(FrameStats& stats)
+{
+  const uint32_t aliveCount = std::min(m_counter.aliveSurfelCnt, kMaxSurfelCount);
+  const uint32_t blockCount = (aliveCount + kCellScanBlockSize - 1) / kCellScanBlockSize;
+  nvh::parallel_batches<256>(
+      aliveCount,
+      [&](uint64_t i) {
+        const uint surfelIndex = m_alive[i];
+        m_sortKeys[surfelIndex] = getSurfelSortKey(m_surfels[surfelIndex].position, m_gridOrigin);
+      },
+      m_settings.numThreads);
+
+  for(uint32_t radixPass = 0; radixPass < kSortPasses; radixPass++)
+  {
+    const uint32_t               shift = radixPass * kSortDigitBits;
+    const std::vector<uint32_t>& src   = radixPass % 2 ? m_sortScratch : m_alive;
+    std::vector<uint32_t>&       dst   = radixPass % 2 ? m_alive : m_sortScratch;
+    auto getDigit = [&](uint32_t surfelIndex) { return (m_sortKeys[surfelIndex] >> shift) & (kSortDigits - 1u); };
+
+    nvh::parallel_batches<1>(
+        blockCount,
+        [&](uint64_t b) {
+          const uint32_t first = uint32_t(b) * kCellScanBlockSize;
+          const uint32_t last  = std::min(first + kCellScanBlockSize, aliveCount);
+          uint32_t       counts[kSortDigits]{};
+          for(uint32_t i = first; i < last; i++)
+            counts[getDigit(src[i])]++;
+          for(uint32_t digit = 0; digit < kSortDigits; digit++)
+            m_sortCounts[digit * blockCount + b] = counts[digit];
+        },
+        m_settings.numThreads);
+
+    uint32_t total = 0;
+    for(uint32_t i = 0; i < kSortDigits * blockCount; i++)
+      total += std::exchange(m_sortCounts[i], total);
+
+    nvh::parallel_batches<1>(
+        blockCount,
+        [&](uint64_t b) {
+          const uint32_t first = uint32_t(b) * kCellScanBlockSize;
+          const uint32_t last  = std::min(first + kCellScanBlockSize, aliveCount);
+          uint32_t       offsets[kSortDigits];
+          for(uint32_t digit = 0; digit < kSortDigits; digit++)
+            offsets[digit] = m_sortCounts[digit * blockCount + b];
+          for(uint32_t i = first; i < last; i++)
+            dst[offsets[getDigit(src[i])]++] = src[i];
+        },
+        m_settings.numThreads);
+  }
+
+  for(uint32_t i = 1; i < aliveCount; i++)
+    stats.sortErrors += m_sortKeys[m_alive[i - 1]] > m_sortKeys[m_alive[i]] ? 1 : 0;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// Coherence binning of surfel_raytrace.comp: the bin of each ray from the direction the trace will
+// sample, the exclusive scan of the bins by surfel_ray_bin.comp and the scatter of the ray indices
+// to their bin. The order within a bin follows the atomics, the results do not depend on it.
+//
+void SurfelReference::passRayBinning(FrameStats& stats)
+{
+  const uint32_t rayCount  = std::min(m_counter.surfelRayCnt, kMaxRayCount);
+  const uint     frameHash = lowbias32(m_totalFrames);
+
+  nvh::parallel_batches<64>(
+      rayCount,
+      [&](uint64_t i) {
+        const uint  index    = uint(i);
+        uint        randSeed = tea(lowbias32(index), frameHash);
+        vec3        dirL;
+        float       pdf;
+        bool        guided;
+        CpuBvh::Ray ray      = getSurfelRay(m_rays[index].surfelID, randSeed, dirL, pdf, guided);
+        const uint  bin      = getSurfelRayBin(ray.origin, ray.direction, m_gridOrigin);
+        m_rays[index].pad    = glsl_surfel::uintBitsToFloat(bin);
+        atomicAdd(m_rayBins[bin], 1u);
+      },
+      m_settings.numThreads);
+
+  uint32_t total = 0;
+  for(uint32_t bin = 0; bin < kRayBinCount; bin++)
+  {
+    m_rayBins[kRayBinCount + bin] = total;
+    total += std::exchange(m_rayBins[bin], 0u);
+  }
+
+  nvh::parallel_batches<64>(
+      rayCount,
+      [&](uint64_t i) {
+        const uint bin = glsl_surfel::floatBitsToUint(m_rays[i].pad);
+        m_raySortIndex[atomicAdd(m_rayBins[kRayBinCount + bin], 1u)] = uint32_t(i);
+      },
+      m_settings.numThreads);
+
+  // Every ray once, in bin order
+  std::vector<uint8_t> seen(rayCount, 0);
+  uint                 lastBin = 0;
+  for(uint32_t i = 0; i < rayCount; i++)
+  {
+    const uint32_t index = m_raySortIndex[i];
+    const uint     bin   = glsl_surfel::floatBitsToUint(m_rays[index].pad);
+    stats.sortErrors += seen[index]++ != 0 || bin < lastBin ? 1 : 0;
+    lastBin = bin;
+  }
+}
@@ -0,0 +1,118 @@
+#include "surfel_sort_pass.h"
+
+#include <cassert>
+
+#include "nvh/alignment.hpp"
+#include "nvh/fileoperations.hpp"
+#include "nvvk/shaders_vk.hpp"
+#include "scene.hpp"
+#include "surfel_specialization.hpp"
+#include "tools.hpp"
+
+#include "autogen/surfel_sort.comp.h"
+
+
+// Writes of a phase visible to the next one, the last one to the passes reading surfelAlive
+static void phaseBarrier(const VkCommandBuffer& cmdBuf)
+{
+	VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+		1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void SurfelSortPass::setup(const VkDevice& device, const VkPhysicalDevice& physicalDevice, uint32_t familyIndex, nvvk::ResourceAllocator* allocator)
+{
+	m_device = device;
+	m_pAlloc = allocator;
+	m_queueIndex = familyIndex;
+	m_debug.setup(device);
+}
+
+void SurfelSortPass::destroy()
+{
+	for (auto& pipeline : m_pipelines)
+	{
+		vkDestroyPipeline(m_device, pipeline, nullptr);
+		pipeline = VK_NULL_HANDLE;
+	}
+	vkDestroyPipelineLayout(m_device, m_pipelineLayout, nullptr);
+
+	m_pipelineLayout = VK_NULL_HANDLE;
+}
+
+void SurfelSortPass::run(const VkCommandBuffer& cmdBuf, const VkExtent2D& size, nvvk::ProfilerVK& profiler, const std::vector<VkDescriptorSet>& descSets)
+{
+	// size.width: surfel capacity, one workgroup of 256 per block of kCellScanBlockSize
+	static_assert(kSortPasses % 2 == 0, "the last radix pass must write surfelAlive");
+	const uint32_t blockCount = (size.width + (kCellScanBlockSize - 1)) / kCellScanBlockSize;
+	assert(blockCount <= kCellScanMaxBlocks);
+
+	auto sec = profiler.timeRecurring("Surfel Sort", cmdBuf);
+
+	// Alive list of the last frame
+	phaseBarrier(cmdBuf);
+
+	vkCmdBindDescriptorSets(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelineLayout, 0,
+		static_cast<uint32_t>(descSets.size()), descSets.data(), 0, nullptr);
+
+	SurfelSortConstants pass{};
+	pass.gridOrigin = m_state.cellGridOrigin;
+	for (uint32_t radixPass = 0; radixPass < kSortPasses; radixPass++)
+	{
+		pass.shift = radixPass * kSortDigitBits;
+		pass.flip = radixPass % 2;
+		vkCmdPushConstants(cmdBuf, m_pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(SurfelSortConstants), &pass);
+
+		// Block digit counts, their scan, the scatter
+		vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelines[0]);
+		vkCmdDispatch(cmdBuf, blockCount, 1, 1);
+		phaseBarrier(cmdBuf);
+
+		vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelines[1]);
+		vkCmdDispatch(cmdBuf, 1, 1, 1);
+		phaseBarrier(cmdBuf);
+
+		vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelines[2]);
+		vkCmdDispatch(cmdBuf, blockCount, 1, 1);
+		phaseBarrier(cmdBuf);
+	}
+}
+
+void SurfelSortPass::create(const VkExtent2D& size, const std::vector<VkDescriptorSetLayout>& descSetsLayout, Scene* _scene)
+{
+	std::vector<VkPushConstantRange> push_constants;
+	push_constants.push_back({ VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(SurfelSortConstants) });
+
+	VkPipelineLayoutCreateInfo layout_info{ VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
+	layout_info.pushConstantRangeCount = static_cast<uint32_t>(push_constants.size());
+	layout_info.pPushConstantRanges = push_constants.data();
+	layout_info.setLayoutCount = static_cast<uint32_t>(descSetsLayout.size());
+	layout_info.pSetLayouts = descSetsLayout.data();
+	vkCreatePipelineLayout(m_device, &layout_info, nullptr, &m_pipelineLayout);
+
+	// One pipeline per phase, selected by the specialization constant
+	SurfelSpecialization specialization;
+
+	VkComputePipelineCreateInfo computePipelineCreateInfo{ VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+	computePipelineCreateInfo.layout = m_pipelineLayout;
+	computePipelineCreateInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	computePipelineCreateInfo.stage.module = nvvk::createShaderModule(m_device, surfel_sort_comp, sizeof(surfel_sort_comp));
+	computePipelineCreateInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	computePipelineCreateInfo.stage.pName = "main";
+	computePipelineCreateInfo.stage.pSpecializationInfo = specialization.getInfo();
+
+	for (uint32_t phase = 0; phase < m_pipelines.size(); phase++)
+	{
+		specialization.setPhase(phase);
+		vkCreateComputePipelines(m_device, {}, 1, &computePipelineCreateInfo, nullptr, &m_pipelines[phase]);
+		m_debug.setObjectName(m_pipelines[phase], "Surfel Sort Pass " + std::to_string(phase));
+	}
+	vkDestroyShaderModule(m_device, computePipelineCreateInfo.stage.module, nullptr);
+}
+
+const std::string SurfelSortPass::name()
+{
+	return "Surfel Sort Pass";
+}
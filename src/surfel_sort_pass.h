@@ -0,0 +1,43 @@
+#pragma once
+
+#include <array>
+
+#include "nvvk/resourceallocator_vk.hpp"
+#include "nvvk/debug_util_vk.hpp"
+#include "nvvk/descriptorsets_vk.hpp"
+
+#include "nvvk/profiler_vk.hpp"
+#include "renderer.h"
+#include "shaders/host_device.h"
+
+// Sorts surfelAlive in Morton order of the surfel positions around rtxState.cellGridOrigin, so the
+// surfels of a workgroup of the later passes are close to each other, see surfel_sort.comp
+class SurfelSortPass : Renderer
+{
+public:
+	void setup(const VkDevice& device,
+		const VkPhysicalDevice& physicalDevice,
+		uint32_t                 familyIndex,
+		nvvk::ResourceAllocator* allocator);
+	void destroy();
+	void run(const VkCommandBuffer& cmdBuf,
+		const VkExtent2D& size,
+		nvvk::ProfilerVK& profiler,
+		const std::vector<VkDescriptorSet>& descSets);
+	void create(const VkExtent2D& size, const std::vector<VkDescriptorSetLayout>& descSetsLayout, Scene* _scene = nullptr);
+	const std::string name();
+	void          setPushContants(const RtxState& state) {
+		m_state = state;
+	}
+
+private:
+	// Setup
+	nvvk::ResourceAllocator* m_pAlloc{ nullptr };  // Allocator for buffer, images, acceleration structures
+	nvvk::DebugUtil          m_debug;            // Utility to name objects
+	VkDevice                 m_device{ VK_NULL_HANDLE };
+	uint32_t                 m_queueIndex{ 0 };
+
+
+	VkPipelineLayout m_pipelineLayout{ VK_NULL_HANDLE };
+	std::array<VkPipeline, 3> m_pipelines{};  // Phases of a radix pass, see surfel_sort.comp
+};
@@ -0,0 +1,26 @@
+#include "surfel_specialization.hpp"
+
+#include <cstddef>
+
+//--------------------------------------------------------------------------------------------------
+// One map entry per SurfelSpecConstants id, with the values applied when the pass creates its pipeline
+//
+SurfelSpecialization::SurfelSpecialization(uint32_t phase)
+{
+  m_data = {phase,          surfel_spec::kMaxSurfelCount, surfel_spec::kMaxRayCount, surfel_spec::kMaxLife,
+            surfel_spec::d, surfel_spec::n,               surfel_spec::p,            surfel_spec::m};
+
+  m_entries[eSpecPhase]          = {eSpecPhase, offsetof(Data, phase), sizeof(uint32_t)};
+  m_entries[eSpecMaxSurfelCount] = {eSpecMaxSurfelCount, offsetof(Data, maxSurfelCount), sizeof(uint32_t)};
+  m_entries[eSpecMaxRayCount]    = {eSpecMaxRayCount, offsetof(Data, maxRayCount), sizeof(uint32_t)};
+  m_entries[eSpecMaxLife]        = {eSpecMaxLife, offsetof(Data, maxLife), sizeof(uint32_t)};
+  m_entries[eSpecGridSize]       = {eSpecGridSize, offsetof(Data, gridSize), sizeof(float)};
+  m_entries[eSpecGridSplits]     = {eSpecGridSplits, offsetof(Data, gridSplits), sizeof(int32_t)};
+  m_entries[eSpecGridRatio]      = {eSpecGridRatio, offsetof(Data, gridRatio), sizeof(float)};
+  m_entries[eSpecGridLayers]     = {eSpecGridLayers, offsetof(Data, gridLayers), sizeof(int32_t)};
+
+  m_info.mapEntryCount = static_cast<uint32_t>(m_entries.size());
+  m_info.pMapEntries   = m_entries.data();
+  m_info.dataSize      = sizeof(Data);
+  m_info.pData         = &m_data;
+}
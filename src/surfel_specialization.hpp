@@ -0,0 +1,40 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include <vulkan/vulkan_core.h>
+#include <glm/glm.hpp>
+#include "shaders/host_device.h"
+
+//--------------------------------------------------------------------------------------------------
+// Specialization info of a surfel pipeline with the applied SurfelConfig (surfel_config.hpp). eSpecPhase selects the
+// phase of the passes building several pipelines from one shader, the other shaders ignore it.
+//
+class SurfelSpecialization
+{
+public:
+  explicit SurfelSpecialization(uint32_t phase = 0);
+  SurfelSpecialization(const SurfelSpecialization&)            = delete;
+  SurfelSpecialization& operator=(const SurfelSpecialization&) = delete;
+
+  void                        setPhase(uint32_t phase) { m_data.phase = phase; }
+  const VkSpecializationInfo* getInfo() const { return &m_info; }
+
+private:
+  struct Data
+  {
+    uint32_t phase;
+    uint32_t maxSurfelCount;
+    uint32_t maxRayCount;
+    uint32_t maxLife;
+    float    gridSize;
+    int32_t  gridSplits;
+    float    gridRatio;
+    int32_t  gridLayers;
+  };
+
+  Data                                              m_data{};
+  std::array<VkSpecializationMapEntry, eSpecCount> m_entries{};
+  VkSpecializationInfo                              m_info{};
+};
@@ -4,6 +4,7 @@
 #include "nvh/fileoperations.hpp"
 #include "nvvk/shaders_vk.hpp"
 #include "scene.hpp"
+#include "surfel_specialization.hpp"
 #include "tools.hpp"
 
 #include "autogen/surfel_update.comp.h"
@@ -37,8 +38,11 @@ void SurfelUpdatePass::run(const VkCommandBuffer& cmdBuf, const VkExtent2D& size
 	// Sending the push constant information
 	vkCmdPushConstants(cmdBuf, m_pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(RtxState), &m_state);
 
-	// Dispatching the shader
-	vkCmdDispatch(cmdBuf, (size.width + (GROUP_SIZE - 1)) / GROUP_SIZE, (size.height + (GROUP_SIZE - 1)) / GROUP_SIZE, 1);
+	// Dispatching the shader, sized by the live count when the arguments are on the GPU
+	if (m_indirectBuffer != VK_NULL_HANDLE)
+		vkCmdDispatchIndirect(cmdBuf, m_indirectBuffer, m_indirectOffset);
+	else
+		vkCmdDispatch(cmdBuf, (size.width + (GROUP_SIZE - 1)) / GROUP_SIZE, (size.height + (GROUP_SIZE - 1)) / GROUP_SIZE, 1);
 }
 
 void SurfelUpdatePass::create(const VkExtent2D& size, const std::vector<VkDescriptorSetLayout>& descSetsLayout, Scene* _scene)
@@ -60,6 +64,9 @@ void SurfelUpdatePass::create(const VkExtent2D& size, const std::vector<VkDescri
 	computePipelineCreateInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
 	computePipelineCreateInfo.stage.pName = "main";
 
+	SurfelSpecialization specialization;
+	computePipelineCreateInfo.stage.pSpecializationInfo = specialization.getInfo();
+
 	vkCreateComputePipelines(m_device, {}, 1, &computePipelineCreateInfo, nullptr, &m_pipeline);
 
 	m_debug.setObjectName(m_pipeline, "Surfel Update Pass");
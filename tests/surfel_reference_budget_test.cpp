@@ -0,0 +1,148 @@
+// Tests of the ray budget: the scan of the requests by priority level and the grants it gives.
+
+#include "src/surfel_reference_common.hpp"
+#include "surfel_reference_test.hpp"
+
+
+//--------------------------------------------------------------------------------------------------
+// The grants are the ones surfel_ray_budget.comp gives with the totals of the requests in
+// SurfelCounter, the offsets the scan of the order given. The atomic allocation serves the requests
+// in that order until the budget runs out, its last grant may run past it.
+//
+void SurfelReferenceTest::testRayBudget(uint32_t iterations)
+{
+  const uint32_t alive = std::min(m_counter.aliveSurfelCnt, kMaxSurfelCount);
+  if(!SURFEL_EXPECT(alive > 0))
+    return;
+
+  std::vector<SurfelRayRequest> requests(alive);
+  SurfelCounter                 counter{};
+  uint64_t                      requested = 0;
+  for(uint32_t i = 0; i < alive; i++)
+  {
+    requests[i]            = m_rayRequest[m_alive[i]];
+    requests[i].priority   = std::min(requests[i].priority, kRayPriorityLevels - 1);
+    const uint32_t minRays = std::min(requests[i].count, kSurfelMinRays);
+    counter.rayRequestBase += minRays;
+    counter.rayRequestExtra[requests[i].priority] += requests[i].count - minRays;
+    requested += requests[i].count;
+  }
+
+  // The alive list, reversed and shuffled
+  std::array<std::vector<uint32_t>, 3> orders;
+  for(auto& order : orders)
+    order.resize(alive);
+  uint seed = 0x510e527fu;
+  for(uint32_t i = 0; i < alive; i++)
+  {
+    orders[0][i] = i;
+    orders[1][i] = alive - 1 - i;
+    orders[2][i] = i;
+  }
+  for(uint32_t i = alive - 1; i > 0; i--)
+    std::swap(orders[2][i], orders[2][pcg(seed) % (i + 1)]);
+
+  // Grants by request, the offsets follow the order
+  std::vector<uint32_t> offsets(alive), blockSums((alive + kCellScanBlockSize - 1) / kCellScanBlockSize);
+  auto scanGrants = [&](const std::vector<uint32_t>& order, uint32_t budget, std::vector<uint32_t>& counts) {
+    nvh::parallel_batches<1>(
+        blockSums.size(),
+        [&](uint64_t b) {
+          const uint32_t first = uint32_t(b) * kCellScanBlockSize;
+          const uint32_t last  = std::min(first + kCellScanBlockSize, alive);
+          uint32_t       sum   = 0;
+          for(uint32_t i = first; i < last; i++)
+          {
+            counts[order[i]] = getRayAllocation(requests[order[i]], counter, budget);
+            offsets[i]       = sum;
+            sum += counts[order[i]];
+          }
+          blockSums[b] = sum;
+        },
+        m_settings.numThreads);
+    uint32_t total = 0;
+    for(uint32_t& blockSum : blockSums)
+      total += std::exchange(blockSum, total);
+    nvh::parallel_batches<256>(
+        alive, [&](uint64_t i) { offsets[i] += blockSums[i / kCellScanBlockSize]; }, m_settings.numThreads);
+    return total;
+  };
+  auto atomicGrants = [&](const std::vector<uint32_t>& order, uint32_t budget, std::vector<uint32_t>& counts) {
+    uint32_t used = 0, end = 0;
+    nvh::parallel_batches<32>(
+        alive,
+        [&](uint64_t i) {
+          const SurfelRayRequest& request = requests[order[i]];
+          const uint32_t          offset  = atomicAdd(used, request.count);
+          if(offset < budget)
+          {
+            counts[order[i]] = request.count;
+            atomicMax(end, offset + request.count);
+          }
+          else
+          {
+            counts[order[i]] = 0;
+            atomicSub(used, request.count);
+          }
+        },
+        m_settings.numThreads);
+    return end;
+  };
+
+  LOGI("Surfel ray budget: %u surfels, %llu rays requested, %u threads\n", alive, (unsigned long long)requested,
+       m_settings.numThreads);
+  for(const double share : {1.0, 0.5, 0.25, 0.1})
+  {
+    const uint32_t budget = std::max(uint32_t(double(requested) * share), alive);
+
+    std::array<std::vector<uint32_t>, 3> scanCounts;
+    uint32_t                             scanTotal = 0, orderChanges = 0;
+    for(size_t o = 0; o < orders.size(); o++)
+    {
+      scanCounts[o].resize(alive);
+      const uint32_t total = scanGrants(orders[o], budget, scanCounts[o]);
+      scanTotal            = o == 0 ? total : scanTotal;
+      SURFEL_EXPECT(total <= budget);
+      SURFEL_EXPECT(total == scanTotal);
+      for(uint32_t i = 0; i < alive; i++)
+        orderChanges += scanCounts[o][i] != scanCounts[0][i] ? 1 : 0;
+    }
+    SURFEL_EXPECT(orderChanges == 0);
+
+    // Twice in the shuffled order, the threads race for the budget
+    std::vector<uint32_t> atomicCounts(alive), atomicRerun(alive);
+    const uint32_t        atomicEnd = atomicGrants(orders[2], budget, atomicCounts);
+    atomicGrants(orders[2], budget, atomicRerun);
+    uint32_t atomicTotal = 0, runChanges = 0;
+    for(uint32_t i = 0; i < alive; i++)
+    {
+      atomicTotal += atomicCounts[i];
+      runChanges += atomicCounts[i] != atomicRerun[i] ? 1 : 0;
+    }
+
+    std::array<uint64_t, kRayPriorityLevels> levelRequested{}, levelScan{}, levelAtomic{};
+    std::array<uint32_t, kRayPriorityLevels> scanStarved{}, atomicStarved{};
+    for(uint32_t i = 0; i < alive; i++)
+    {
+      const uint32_t level = requests[i].priority;
+      levelRequested[level] += requests[i].count;
+      levelScan[level] += scanCounts[0][i];
+      levelAtomic[level] += atomicCounts[i];
+      scanStarved[level] += scanCounts[0][i] == 0 ? 1 : 0;
+      atomicStarved[level] += atomicCounts[i] == 0 ? 1 : 0;
+    }
+
+    const double scanTime   = surfel_test::timeAverage(iterations, [&] { scanGrants(orders[0], budget, scanCounts[0]); });
+    const double atomicTime = surfel_test::timeAverage(iterations, [&] { atomicGrants(orders[0], budget, atomicRerun); });
+
+    LOGI("  budget %3.0f%% (%u rays)\n", share * 100.0, budget);
+    LOGI("    scan  : %7.3f ms, %u rays, %u grants differ across orders of the alive list\n", scanTime, scanTotal,
+         orderChanges);
+    LOGI("    atomic: %7.3f ms, %u rays (%u past the budget), %u grants differ between two runs\n", atomicTime,
+         atomicTotal, atomicEnd > budget ? atomicEnd - budget : 0, runChanges);
+    for(uint32_t level = kRayPriorityLevels; level-- > 0;)
+      LOGI("    level %u: %8llu rays requested, scan %8llu (%u surfels without), atomic %8llu (%u surfels without)\n",
+           level, (unsigned long long)levelRequested[level], (unsigned long long)levelScan[level], scanStarved[level],
+           (unsigned long long)levelAtomic[level], atomicStarved[level]);
+  }
+}
@@ -0,0 +1,108 @@
+// Tests of the surfel cache: the warm start it gives.
+
+#include <sstream>
+
+#include "src/surfel_reference_common.hpp"
+#include "surfel_reference_test.hpp"
+
+
+//--------------------------------------------------------------------------------------------------
+// Launch with a surfel cache against a launch from an empty pool. The target is the mean indirect
+// lighting of the current surfels over a few more frames; a run has converged from the frame its
+// error stays within the tolerance, raised to twice the frame to frame noise of the target frames.
+//
+void SurfelReferenceTest::testWarmStart(const Frame& frame, uint32_t frames, float tolerance)
+{
+  if(!SURFEL_EXPECT(m_counter.aliveSurfelCnt > 0) || frames == 0)
+    return;
+
+  // The current surfels through the file format
+  MilliTimer  timer;
+  SurfelCache saved;
+  saveCache(saved);
+  std::stringstream file;
+  saved.write(file);
+  const double saveTime = timer.elapsed();
+
+  SurfelReferenceTest warm = *this;
+  timer.reset();
+  SurfelCache cache;
+  SURFEL_EXPECT(cache.read(file, m_bvh->getGeometryHash()));
+  warm.loadCache(cache);
+  const double loadTime = timer.elapsed();
+
+  // A load keeps every record and texel: saved again, the file is the same
+  SurfelCache resaved;
+  warm.saveCache(resaved);
+  std::stringstream refile;
+  resaved.write(refile);
+  const bool same = refile.str() == file.str();
+  SURFEL_EXPECT(same);
+
+  constexpr uint32_t              kTargetFrames = 8;
+  std::vector<std::vector<float>> targetFrames;
+  {
+    SurfelReferenceTest reference = *this;
+    for(uint32_t f = 0; f < kTargetFrames; f++)
+    {
+      reference.runFrame(frame.camera, frame.sky, frame.envSH);
+      targetFrames.push_back(getLuminance(reference.m_indirect));
+    }
+  }
+  std::vector<float> target(targetFrames[0].size(), 0.f);
+  for(const auto& image : targetFrames)
+    for(size_t i = 0; i < target.size(); i++)
+      target[i] += image[i] / float(kTargetFrames);
+  float noise = 0.f;
+  for(const auto& image : targetFrames)
+    noise += getRelativeError(image, target) / float(kTargetFrames);
+  const float threshold = std::max(tolerance, 2.f * noise);
+
+  struct Result
+  {
+    uint32_t              converged{~0u};  // Frames until the error stays within the threshold
+    std::vector<float>    error;
+    std::vector<uint32_t> alive;
+    uint32_t              errors{0};
+  };
+  auto measure = [&](SurfelReferenceTest& reference) {
+    Result result;
+    for(uint32_t f = 0; f < frames; f++)
+    {
+      const FrameStats s = reference.runFrame(frame.camera, frame.sky, frame.envSH);
+      result.error.push_back(getRelativeError(getLuminance(reference.m_indirect), target));
+      result.alive.push_back(s.aliveSurfels);
+      if(result.error.back() > threshold)
+        result.converged = ~0u;
+      else if(result.converged == ~0u)
+        result.converged = f + 1;
+      result.errors += s.getErrorCount();
+    }
+    return result;
+  };
+
+  SurfelReferenceTest cold = *this;
+  cold.reset();
+  const Result coldResult = measure(cold);
+  const Result warmResult = measure(warm);
+
+  LOGI("Surfel warm start: %u surfels, %.2f MB cache, save %.2f ms, load %.2f ms, %s after a load\n",
+       cache.getSurfelCount(), cache.getByteSize() / (1024.0 * 1024.0), saveTime, loadTime,
+       same ? "same cache" : "cache CHANGED");
+  LOGI("  target: %u frames of the current surfels, frame noise %.3f, threshold %.3f\n", kTargetFrames, noise, threshold);
+  for(const auto& [name, r] : {std::pair{"empty", &coldResult}, std::pair{"cache", &warmResult}})
+  {
+    if(r->converged != ~0u)
+    {
+      LOGI("  %s: converged after %u frames, %u errors\n", name, r->converged, r->errors);
+    }
+    else
+    {
+      LOGI("  %s: not converged within %u frames, %u errors\n", name, frames, r->errors);
+    }
+    for(uint32_t f = 1; f <= frames; f *= 2)
+      LOGI("    frame %4u: error %.3f, %6u surfels\n", f, r->error[f - 1], r->alive[f - 1]);
+  }
+  SURFEL_EXPECT(coldResult.errors == 0);
+  SURFEL_EXPECT(warmResult.errors == 0);
+}
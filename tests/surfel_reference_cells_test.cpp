@@ -0,0 +1,354 @@
+// Tests of the cells of the surfel grid: the sparse hash, the overlap masks of the surfels and
+// patching the cells of the last frame.
+
+#include "src/surfel_reference_common.hpp"
+#include "surfel_reference_test.hpp"
+
+
+//--------------------------------------------------------------------------------------------------
+// The binning of a frame (clear of the last cells, counts through the masks of the update pass,
+// scan and scatter) in the dense grid and in the sparse hash, on the surfels of the last frame.
+// Cells are compared by their dense index, the hash slots are checked for duplicate and lost keys.
+//
+void SurfelReferenceTest::testCellHash(uint32_t iterations)
+{
+  const uint32_t alive = std::min(m_counter.aliveSurfelCnt, kMaxSurfelCount);
+  if(!SURFEL_EXPECT(alive > 0))
+    return;
+
+  auto bin = [&](double& clearTime) {
+    MilliTimer timer;
+    clearCells();
+    clearTime += timer.elapsed();
+    m_cellCounter.hashInsertions = 0;
+    m_cellCounter.hashProbes     = 0;
+    m_cellCounter.hashMaxProbe   = 0;
+    m_cellCounter.hashOverflow   = 0;
+    nvh::parallel_batches<32>(
+        alive,
+        [&](uint64_t i) {
+          const uint  surfelIndex = m_alive[i];
+          const uvec2 cellMask    = m_cellMask[surfelIndex];
+          if(cellMask.x == 0)
+            return;
+          const ivec4 cellPosIndex = getCellPosNonUniform(m_surfels[surfelIndex].position, m_gridOrigin);
+          const uint  slots  = getCellMaskSlotCount(cellMask);
+          uint        inserted = 0, probes = 0, maxProbe = 0;
+          for(uint j = 0; j < slots; j++)
+          {
+            const ivec4 cellPos = getCellMaskCellPos(cellPosIndex, cellMask, j);
+            if(cellPos.w < 0)
+              continue;
+            inserted++;
+            const uint flattenIndex = getFlattenCellIndexNonUniform(cellPos);
+            if(flattenIndex >= m_totalCellCount)
+              continue;
+            const uint cellIndex = insertCellIndex(flattenIndex, probes, maxProbe);
+            if(cellIndex != kInvalidCell)
+              atomicAdd(m_cells[cellIndex].surfelCount, 1u);
+          }
+          if(m_settings.cellHash)
+          {
+            atomicAdd(m_cellCounter.hashInsertions, inserted);
+            atomicAdd(m_cellCounter.hashProbes, probes);
+            atomicMax(m_cellCounter.hashMaxProbe, maxProbe);
+          }
+        },
+        m_settings.numThreads);
+    passCellInfo();
+    passCellToSurfel();
+  };
+
+  // Cell lists by dense index
+  using CellLists = std::vector<std::pair<uint32_t, std::vector<uint32_t>>>;
+  auto snapshot   = [&]() {
+    CellLists lists;
+    for(uint32_t c = 0; c < getCellSlotCount(); c++)
+    {
+      const CellInfo cell = m_cells[c];
+      const uint32_t key  = m_settings.cellHash ? m_cellHashKeys[c] : c;
+      if(key == kCellHashEmpty || (!m_settings.cellHash && cell.surfelCount == 0))
+        continue;
+      auto first = m_cellToSurfel.begin() + std::min<size_t>(cell.surfelOffset, m_cellToSurfel.size());
+      auto last  = m_cellToSurfel.begin() + std::min<size_t>(size_t(cell.surfelOffset) + cell.surfelCount, m_cellToSurfel.size());
+      lists.emplace_back(key, std::vector<uint32_t>(first, last));
+    }
+    std::sort(lists.begin(), lists.end());
+    return lists;
+  };
+
+  struct Result
+  {
+    double    time{0.0};
+    double    clearTime{0.0};
+    size_t    clearBytes{0};
+    CellLists lists;
+  };
+  auto measure = [&](bool hash) {
+    Result result;
+    double warmup       = 0.0;
+    m_settings.cellHash = hash;
+    bin(warmup);  // The cells of the other mode are cleared here
+    result.clearBytes = m_cellCounter.hashedFrame != 0 ?
+                            size_t(m_cellCounter.hashOccupied) * (sizeof(CellInfo) + 2 * sizeof(uint32_t)) :
+                            size_t(m_totalCellCount) * sizeof(CellInfo);
+    result.time = surfel_test::timeAverage(iterations, [&] { bin(result.clearTime); });
+    result.clearTime /= double(std::max(iterations, 1u));
+    result.lists = snapshot();
+    return result;
+  };
+
+  const Result dense = measure(false);
+  const Result hash  = measure(true);
+
+  // Every claimed slot holds a distinct key found again from its home slot
+  uint32_t keyErrors = 0;
+  std::vector<uint32_t> keys;
+  for(uint32_t i = 0; i < m_cellCounter.hashOccupied; i++)
+  {
+    const uint32_t slot = m_cellHashOccupied[i];
+    keys.push_back(m_cellHashKeys[slot]);
+    if(findCellIndex(m_cellHashKeys[slot]) != slot)
+      keyErrors++;
+  }
+  std::sort(keys.begin(), keys.end());
+  keyErrors += uint32_t(keys.end() - std::unique(keys.begin(), keys.end()));
+  keyErrors += uint32_t(std::count_if(m_cellHashKeys.begin(), m_cellHashKeys.end(), [](uint32_t k) { return k != kCellHashEmpty; }))
+               - m_cellCounter.hashOccupied;
+
+  const CellCounter stats = m_cellCounter;
+  LOGI("Surfel cell hash: %u surfels, %zu cells, %u threads\n", alive, dense.lists.size(), m_settings.numThreads);
+  LOGI("  dense: %8.3f ms (clear %.3f ms, %zu bytes), %u cells scanned\n", dense.time, dense.clearTime,
+       dense.clearBytes, m_totalCellCount);
+  LOGI("  hash : %8.3f ms (clear %.3f ms, %zu bytes), %u slots scanned\n", hash.time, hash.clearTime, hash.clearBytes,
+       kCellHashCapacity);
+  LOGI("  load %.1f%%, probes mean %.2f max %u, %u overflow, %u key errors, cell lists %s\n",
+       100.0 * stats.hashOccupied / kCellHashCapacity,
+       stats.hashInsertions ? double(stats.hashProbes) / stats.hashInsertions : 0.0, stats.hashMaxProbe,
+       stats.hashOverflow, keyErrors, dense.lists == hash.lists ? "match" : "differ");
+  SURFEL_EXPECT(dense.lists == hash.lists);
+  SURFEL_EXPECT(stats.hashOverflow == 0);
+  SURFEL_EXPECT(keyErrors == 0);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// getSurfelCellMask (overlapped range of each component) against the 27 neighbour tests it
+// replaced, on the surfels of the last frame and on random surfels over the cube and the six
+// frustums, an eighth of them on cell boundaries, with radii up to the sleeping maximum.
+// Surfels reaching past the 3x3x3 neighbourhood take the range encoding: every cell the tests find
+// around the bounding box of the sphere must be in its range, the corner cells it adds are counted.
+// Fails as well when a range is clipped by the encoding, or when the cells of the alive surfels
+// would not fit in cellToSurfel grown to kCellToSurfelMaxSize.
+//
+void SurfelReferenceTest::testCellOverlap(uint32_t iterations)
+{
+  const uint32_t      alive = std::min(m_counter.aliveSurfelCnt, kMaxSurfelCount);
+  std::vector<Surfel> surfels(alive);
+  for(uint32_t i = 0; i < alive; i++)
+    surfels[i] = m_surfels[m_alive[i]];
+
+  const float delta    = d / float(n);
+  const float frustumD = delta * (1.f - std::pow(p, float(m))) / (1.f - p);  // Depth of the frustums
+  uint        seed     = 0x2d1f5a3u;
+  for(uint32_t i = 0; i < (1u << 18); i++)
+  {
+    const int region = int(rand(seed) * 7.f) % 7;
+    vec3      posC;
+    for(int axis = 0; axis < 3; axis++)
+      posC[axis] = (rand(seed) - 0.5f) * d;
+    if(region != 0)
+    {
+      const ivec3 axes = getCellAxes(region);
+      const float main = d / 2.f + rand(seed) * frustumD;
+      posC[axes.x]     = region % 2 == 0 ? -main : main;
+      posC[axes.y]     = (rand(seed) * 2.f - 1.f) * main;
+      posC[axes.z]     = (rand(seed) * 2.f - 1.f) * main;
+    }
+    if(i % 8 == 0)
+      posC = glm::round(posC / delta) * delta;
+
+    Surfel surfel{};
+    surfel.position = m_gridOrigin + posC;
+    surfel.radius   = getSurfelMaxSize(length(posC)) * glm::mix(surfelMinSizeRatio, 2.f, rand(seed));
+    surfels.push_back(surfel);
+  }
+
+  auto neighbourTests = [&](const Surfel& surfel, const ivec4& cellPos) {
+    uint mask = 0;
+    for(uint i = 0; i < 27; i++)
+    {
+      const ivec4 neighbourPos = getNeighbourCellPos(cellPos, i);
+      if(isCellValid(neighbourPos) && isSurfelIntersectCellNonUniform(surfel, neighbourPos, m_gridOrigin))
+        mask |= 1u << i;
+    }
+    return mask;
+  };
+
+  const uint32_t        count = uint32_t(surfels.size());
+  std::vector<ivec4>    cellPos(count);
+  std::vector<uint32_t> expected(count);
+  std::vector<uvec2>    masks(count);
+  for(uint32_t i = 0; i < count; i++)
+    cellPos[i] = getCellPosNonUniform(surfels[i].position, m_gridOrigin);
+
+  // Both at least once, the masks are compared below
+  iterations             = std::max(iterations, 1u);
+  const double bruteTime = surfel_test::timeAverage(iterations, [&] {
+    nvh::parallel_batches<256>(
+        count, [&](uint64_t i) { expected[i] = neighbourTests(surfels[i], cellPos[i]); }, m_settings.numThreads);
+  });
+  const double rangeTime = surfel_test::timeAverage(iterations, [&] {
+    nvh::parallel_batches<256>(
+        count, [&](uint64_t i) { masks[i] = getSurfelCellMask(surfels[i], cellPos[i], m_gridOrigin); }, m_settings.numThreads);
+  });
+
+  // Every cell of the home region around the bounding box of the sphere the test uses (radius^1.5),
+  // one cell wider on each side, the whole region when the box leaves it. A cell found further than
+  // kCellRangeMax from home is clipped. All the alive surfels, one random surfel in 16.
+  const uint32_t        sampling = 16;
+  std::vector<uint32_t> missing(count), cells(count), extra(count), clippedFlags(count);
+  nvh::parallel_batches<32>(
+      count,
+      [&](uint64_t i) {
+        if(i >= alive && (i - alive) % sampling != 0)
+          return;
+        const Surfel& surfel = surfels[i];
+        const ivec4   home   = cellPos[i];
+        const float   reach  = std::sqrt(surfel.radius * surfel.radius * surfel.radius);
+        const ivec3   size   = ivec3(home.w == 0 ? n : m, n, n);
+        ivec3         extent(0);
+        for(int corner = 0; corner < 8; corner++)
+        {
+          const vec3  offset(corner & 1 ? reach : -reach, corner & 2 ? reach : -reach, corner & 4 ? reach : -reach);
+          const ivec4 cornerPos = getCellPosNonUniform(surfel.position + offset, m_gridOrigin);
+          const ivec3 distance  = cornerPos.w == home.w ? glm::abs(ivec3(cornerPos) - ivec3(home)) + 1 : size;
+          extent                = glm::max(extent, glm::min(distance, size));
+        }
+
+        // Within the grid only
+        const ivec3 first = glm::max(-extent, -ivec3(home));
+        const ivec3 last  = glm::min(extent, size - 1 - ivec3(home));
+        uint32_t    found = 0, outside = 0, clipped = 0;
+        for(int x = first.x; x <= last.x; x++)
+          for(int y = first.y; y <= last.y; y++)
+            for(int z = first.z; z <= last.z; z++)
+            {
+              const ivec4 pos = home + ivec4(x, y, z, 0);
+              if(!isCellValid(pos) || !isSurfelIntersectCellNonUniform(surfel, pos, m_gridOrigin))
+                continue;
+              found++;
+              outside += isCellInMask(masks[i], ivec3(x, y, z)) ? 0 : 1;
+              clipped |= glm::max(std::abs(x), glm::max(std::abs(y), std::abs(z))) > kCellRangeMax ? 1 : 0;
+            }
+        clippedFlags[i] = clipped;
+        missing[i]      = outside;
+        cells[i]        = found;
+        extra[i]        = getCellMaskSlotCount(masks[i]) - (found - outside);
+      },
+      m_settings.numThreads);
+
+  uint32_t mismatches = 0, aliveMismatches = 0, missed = 0, ranged = 0, aliveRanged = 0, clipped = 0, aliveClipped = 0;
+  uint32_t checked = 0, checkedRanged = 0;
+  uint64_t overlaps = 0, extraCells = 0, entries = 0, randomEntries = 0;
+  for(uint32_t i = 0; i < count; i++)
+  {
+    const bool isRange   = (masks[i].x & kCellRangeFlag) != 0;
+    const bool isChecked = i < alive || (i - alive) % sampling == 0;
+    (i < alive ? entries : randomEntries) += getCellMaskSlotCount(masks[i]);
+    if((!isRange && masks[i].x != expected[i]) || missing[i] != 0)
+    {
+      mismatches++;
+      aliveMismatches += i < alive ? 1 : 0;
+    }
+    ranged += isRange ? 1 : 0;
+    aliveRanged += isRange && i < alive ? 1 : 0;
+    if(!isChecked)
+      continue;
+    checked++;
+    missed += missing[i];
+    overlaps += cells[i];
+    if(isRange)
+    {
+      checkedRanged++;
+      extraCells += extra[i];
+    }
+    clipped += clippedFlags[i];
+    aliveClipped += i < alive ? clippedFlags[i] : 0;
+  }
+
+  LOGI("Surfel cell overlap: %u surfels (%u alive, %u random), %u threads\n", count, alive, count - alive, m_settings.numThreads);
+  LOGI("  27 tests     : %8.3f ms\n", bruteTime);
+  LOGI("  overlap range: %8.3f ms\n", rangeTime);
+  LOGI("  %u surfels past the 3x3x3 neighbourhood (%u alive) binned over their range\n", ranged, aliveRanged);
+  LOGI("  %u surfels tested cell by cell: %.2f cells per surfel, %.2f extra corner cells per range\n", checked,
+       double(overlaps) / checked, checkedRanged > 0 ? double(extraCells) / checkedRanged : 0.0);
+  LOGI("  %u masks differ or miss a cell (%u alive, %u cells missed)\n", mismatches, aliveMismatches, missed);
+  LOGI("  %u tested surfels clipped past %d cells from home (%u alive)\n", clipped, kCellRangeMax, aliveClipped);
+  LOGI("  cellToSurfel entries: %llu for the alive surfels (at most %u), %.1f per random surfel\n",
+       (unsigned long long)entries, kCellToSurfelMaxSize, count > alive ? double(randomEntries) / (count - alive) : 0.0);
+  SURFEL_EXPECT(mismatches == 0);
+  SURFEL_EXPECT(clipped == 0);
+  SURFEL_EXPECT(entries <= kCellToSurfelMaxSize);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// A camera sliding forward: most frames keep the snapped grid origin and only patch the cells of
+// the surfels whose radius moved them, every kCellGridSnap / step frames the grid is rebuilt. Both
+// runs start from a copy of the current state.
+//
+void SurfelReferenceTest::testCellPatching(const Frame& frame, uint32_t frames, float step)
+{
+  if(!SURFEL_EXPECT(frames > 0))
+    return;
+
+  struct Result
+  {
+    PassTimes times;
+    uint32_t  rebuilt{0};
+    uint32_t  reused{0};
+    uint64_t  changedSurfels{0};
+    uint32_t  errors{0};
+  };
+  auto measure = [&](bool patching) {
+    SurfelReferenceTest reference     = *this;
+    reference.m_settings.cellPatching = patching;
+
+    Result          result;
+    SceneCamera     camera  = frame.camera;
+    const glm::vec4 forward = -frame.camera.viewInverse[2];
+    for(uint32_t f = 0; f < frames; f++)
+    {
+      camera.viewInverse[3] = frame.camera.viewInverse[3] + forward * (step * float(f + 1));
+      camera.view           = glm::inverse(camera.viewInverse);
+
+      const FrameStats s = reference.runFrame(camera, frame.sky, frame.envSH);
+      result.times.prepare += s.times.prepare / frames;
+      result.times.update += s.times.update / frames;
+      result.times.cellInfo += s.times.cellInfo / frames;
+      result.times.cellToSurfel += s.times.cellToSurfel / frames;
+      result.rebuilt += s.cellRebuild ? 1 : 0;
+      result.reused += s.cellsReused ? 1 : 0;
+      result.changedSurfels += s.changedSurfels;
+      result.errors += s.mismatchedCells + s.scanErrors + s.missingBinning + s.staleBinning + s.outOfGrid + s.droppedWrites;
+    }
+    return result;
+  };
+
+  const Result patched = measure(true);
+  const Result rebuilt = measure(false);
+
+  LOGI("Surfel cell patching: %u frames, camera step %.3f, grid snap %.3f, %u threads\n", frames, step, kCellGridSnap,
+       m_settings.numThreads);
+  for(const auto& [name, r] : {std::pair{"patch  ", &patched}, std::pair{"rebuild", &rebuilt}})
+  {
+    LOGI("  %s: avg ms prepare %.3f, update %.3f, cellInfo %.3f, cellToSurfel %.3f, total %.3f\n", name, r->times.prepare,
+         r->times.update, r->times.cellInfo, r->times.cellToSurfel,
+         r->times.prepare + r->times.update + r->times.cellInfo + r->times.cellToSurfel);
+    LOGI("           %u rebuilt, %u patched (%u reused) frames, %.0f surfels re-binned per frame, %u binning errors\n",
+         r->rebuilt, frames - r->rebuilt, r->reused, double(r->changedSurfels) / frames, r->errors);
+  }
+  SURFEL_EXPECT(patched.errors == 0);
+  SURFEL_EXPECT(rebuilt.errors == 0);
+}
@@ -0,0 +1,333 @@
+// Tests of the surfel ray directions guided by the tile CDF of the irradiance atlas.
+
+#include "src/surfel_reference_common.hpp"
+#include "surfel_reference_test.hpp"
+
+
+//--------------------------------------------------------------------------------------------------
+// The scan picks the first texel whose running sum reaches u * sum, so texel t comes with the
+// probability irradiance_t / sum. The CDF picks it with its unorm16 step, which rounds both ends of
+// the interval: the two differ by less than 1 / 65535. Both run on the tile mixed with the even
+// share kSurfelGuideUniform, as the integrate pass builds the CDF.
+//
+void SurfelReferenceTest::testGuideSampling(uint32_t raysPerSurfel)
+{
+  using Tile = std::array<float, kSurfelGuideEntries>;
+
+  // Tiles the integrate pass wrote a CDF for, in the order of the alive list. The CDF is built again
+  // from the tile as it is now, only its own surfel writes to a tile.
+  const uint32_t           alive       = std::min(m_counter.aliveSurfelCnt, kMaxSurfelCount);
+  const uint32_t           tilesPerRow = m_atlasSize.x / kSurfelTileSize;
+  std::vector<uint32_t>    surfelIndices;
+  std::vector<Tile>        tiles;
+  std::vector<float>       sums, atlasSums;
+  std::vector<SurfelGuide> guides;
+  uint32_t                 staleGuides = 0;
+  for(uint32_t i = 0; i < alive; i++)
+  {
+    const uint32_t surfelIndex = m_alive[i];
+    const ivec2    base = ivec2(surfelIndex % tilesPerRow, surfelIndex / tilesPerRow) * int(kSurfelTileSize);
+    Tile           tile, cumulative;
+    float          sum = 0.f;
+    for(uint32_t t = 0; t < kSurfelGuideEntries; t++)
+    {
+      tile[t] = m_irradianceMap[size_t(base.y + t / kSurfelTileSize) * m_atlasSize.x + base.x + t % kSurfelTileSize];
+      sum += tile[t];
+      cumulative[t] = sum;
+    }
+    if(!(sum > 1e-12f))
+      continue;
+    const SurfelGuide guide = makeSurfelGuide(cumulative.data(), sum);
+    if(!std::equal(std::begin(guide.cdf), std::end(guide.cdf), std::begin(m_surfelGuide[surfelIndex].cdf)))
+      staleGuides++;
+    float mixedSum = 0.f;
+    for(float& irr : tile)
+    {
+      irr = mix(irr / sum, 1.f / float(kSurfelGuideEntries), kSurfelGuideUniform);
+      mixedSum += irr;
+    }
+    surfelIndices.push_back(surfelIndex);
+    guides.push_back(guide);
+    tiles.push_back(tile);
+    sums.push_back(mixedSum);
+    atlasSums.push_back(sum);
+  }
+  const uint32_t count = uint32_t(tiles.size());
+  if(!SURFEL_EXPECT(count > 0))
+    return;
+
+  // surfel_raytrace.comp before the CDF
+  auto scanTexel = [](const Tile& tile, float sum, float u, float& pdf, uint32_t& fetches) {
+    const float threshold  = u * sum;
+    float       cumulative = 0.f;
+    for(uint32_t t = 0; t < kSurfelGuideEntries; t++)
+    {
+      fetches++;
+      cumulative += tile[t];
+      if(cumulative >= threshold)
+      {
+        pdf = tile[t] / sum;
+        return t;
+      }
+    }
+    return kSurfelGuideEntries;  // Rounding left u * sum past the last sum, no texel
+  };
+
+  // Probabilities of the texels
+  double   maxError = 0.0, droppedMass = 0.0;
+  uint32_t droppedTexels = 0;
+  for(uint32_t s = 0; s < count; s++)
+  {
+    const SurfelGuide& guide   = guides[s];
+    uint32_t           fetches = 0, below = 0;
+    for(uint32_t t = 0; t < kSurfelGuideEntries; t++)
+    {
+      const uint32_t entry    = getGuideCdf(guide, fetches, t);
+      const double   expected = double(tiles[s][t]) / sums[s];
+      maxError                = std::max(maxError, std::abs(double(entry - below) / 65535.0 - expected));
+      if(entry == below && tiles[s][t] > 0.f)
+      {
+        droppedTexels++;
+        droppedMass += expected;
+      }
+      below = entry;
+    }
+  }
+
+  // Both samplers on the same numbers, the CDF must pick the step holding u with a non-zero pdf
+  std::vector<uint32_t> scanFetches(count, 0), guideFetches(count, 0), sameTexel(count, 0), searchErrors(count, 0),
+      scanMisses(count, 0);
+  nvh::parallel_batches<64>(
+      count,
+      [&](uint64_t s) {
+        const SurfelGuide& guide = guides[s];
+        uint               seed  = tea(uint(s), 0x6a09e667u);
+        for(uint32_t r = 0; r < raysPerSurfel; r++)
+        {
+          const float u = rand(seed);
+          float       scanPdf = 0.f, guidePdf = 0.f;
+          uint32_t    unused      = 0;
+          uint32_t    scanned     = scanTexel(tiles[s], sums[s], u, scanPdf, scanFetches[s]);
+          uint32_t    texel       = sampleGuideTexel(guide, guideFetches[s], u, guidePdf);
+          uint32_t    below       = texel > 0 ? getGuideCdf(guide, unused, texel - 1) : 0u;
+          uint32_t    x           = uint32_t(u * 65535.f);
+          sameTexel[s] += scanned == texel ? 1 : 0;
+          scanMisses[s] += scanned == kSurfelGuideEntries ? 1 : 0;
+          searchErrors[s] += below > x || getGuideCdf(guide, unused, texel) <= x || guidePdf <= 0.f ? 1 : 0;
+        }
+      },
+      m_settings.numThreads);
+  auto total = [](const std::vector<uint32_t>& values) {
+    uint64_t sum = 0;
+    for(uint32_t v : values)
+      sum += v;
+    return sum;
+  };
+  const uint64_t rays = uint64_t(count) * raysPerSurfel;
+
+  // Total variation distance of the histograms to the tile distribution, on a few surfels with many rays
+  const uint32_t histogramSurfels = std::min(count, 64u);
+  const uint32_t histogramRays    = 1u << 16;
+  double         scanDistance = 0.0, guideDistance = 0.0;
+  for(uint32_t s = 0; s < histogramSurfels; s++)
+  {
+    std::array<uint32_t, kSurfelGuideEntries + 1> scanHistogram{}, guideHistogram{};
+    uint     seed    = tea(uint(s), 0xbb67ae85u);
+    uint32_t fetches = 0;
+    for(uint32_t r = 0; r < histogramRays; r++)
+    {
+      const float u   = rand(seed);
+      float       pdf = 0.f;
+      scanHistogram[scanTexel(tiles[s], sums[s], u, pdf, fetches)]++;
+      guideHistogram[sampleGuideTexel(guides[s], fetches, u, pdf)]++;
+    }
+    double scan = double(scanHistogram[kSurfelGuideEntries]) / histogramRays, guide = 0.0;
+    for(uint32_t t = 0; t < kSurfelGuideEntries; t++)
+    {
+      const double expected = double(tiles[s][t]) / sums[s];
+      scan += std::abs(double(scanHistogram[t]) / histogramRays - expected);
+      guide += std::abs(double(guideHistogram[t]) / histogramRays - expected);
+    }
+    scanDistance += 0.5 * scan / histogramSurfels;
+    guideDistance += 0.5 * guide / histogramSurfels;
+  }
+
+  // Ray generation over the atlas and over the CDF buffer
+  std::vector<float> sink(count, 0.f);
+  const double       scanTime = surfel_test::timeAverage(1, [&] {
+    nvh::parallel_batches<64>(
+        count,
+        [&](uint64_t s) {
+          const uint32_t surfelIndex = surfelIndices[s];
+          const ivec2 base = ivec2(surfelIndex % tilesPerRow, surfelIndex / tilesPerRow) * int(kSurfelTileSize);
+          uint        seed = tea(uint(s), 0x3c6ef372u);
+          for(uint32_t r = 0; r < raysPerSurfel; r++)
+          {
+            const float threshold  = rand(seed) * atlasSums[s];
+            float       cumulative = 0.f;
+            for(uint32_t t = 0; t < kSurfelGuideEntries; t++)
+            {
+              const float irr = m_irradianceMap[size_t(base.y + t / kSurfelTileSize) * m_atlasSize.x + base.x + t % kSurfelTileSize];
+              cumulative += irr;
+              if(cumulative >= threshold)
+              {
+                sink[s] += irr / atlasSums[s] + float(t);
+                break;
+              }
+            }
+          }
+        },
+        m_settings.numThreads);
+  });
+  const double guideTime = surfel_test::timeAverage(1, [&] {
+    nvh::parallel_batches<64>(
+        count,
+        [&](uint64_t s) {
+          const SurfelGuide& guide   = m_surfelGuide[surfelIndices[s]];
+          uint               seed    = tea(uint(s), 0x3c6ef372u);
+          uint32_t           fetches = 0;
+          for(uint32_t r = 0; r < raysPerSurfel; r++)
+          {
+            float pdf = 0.f;
+            sink[s] += float(sampleGuideTexel(guide, fetches, rand(seed), pdf)) + pdf;
+          }
+        },
+        m_settings.numThreads);
+  });
+
+  // Directions of the surfels the trace guides: with a pdf per solid angle covering the hemisphere,
+  // the mean of 1 / pdf is its solid angle
+  uint32_t guidedSurfels = 0;
+  double   inversePdf    = 0.0;
+  uint64_t guidedRays    = 0;
+  for(uint32_t s = 0; s < count; s++)
+  {
+    uint  seed = tea(uint(s), 0x510e527fu);
+    vec3  dirL;
+    float pdf    = 0.f;
+    bool  guided = false;
+    for(uint32_t r = 0; r < raysPerSurfel * 16; r++)
+    {
+      getSurfelRay(surfelIndices[s], seed, dirL, pdf, guided);
+      if(!guided)
+        break;
+      inversePdf += 1.0 / double(pdf);
+      guidedRays++;
+    }
+    guidedSurfels += guided ? 1 : 0;
+  }
+  const double solidAngle = guidedRays > 0 ? inversePdf / double(guidedRays) / (2.0 * M_PI) : 1.0;
+
+  LOGI("Surfel guide sampling: %u surfels with irradiance, %u rays each, %u threads\n", count, raysPerSurfel,
+       m_settings.numThreads);
+  LOGI("  tile scan: %8.3f ms, %.2f texels read per ray\n", scanTime, double(total(scanFetches)) / rays);
+  LOGI("  CDF      : %8.3f ms, %.2f entries read per ray\n", guideTime, double(total(guideFetches)) / rays);
+  LOGI("  texel probabilities differ by %.3g at most (step %.3g), %u texels dropped (mass %.3g)\n", maxError,
+       1.0 / 65535.0, droppedTexels, droppedMass);
+  LOGI("  %u CDFs older than their tile\n", staleGuides);
+  LOGI("  same texel for %.4f%% of the rays, %u wrong CDF steps, %u scans without a texel\n",
+       100.0 * double(total(sameTexel)) / rays, uint32_t(total(searchErrors)), uint32_t(total(scanMisses)));
+  LOGI("  distance to the tile distribution over %u x %u rays: scan %.5f, CDF %.5f\n", histogramSurfels,
+       histogramRays, scanDistance, guideDistance);
+  LOGI("  %u surfels with guided rays, mean 1 / pdf of their directions %.4f x 2 pi\n", guidedSurfels, solidAngle);
+  SURFEL_EXPECT(maxError <= 1.0 / 65535.0 + 1e-6);
+  SURFEL_EXPECT(total(searchErrors) == 0);
+  SURFEL_EXPECT(staleGuides == 0);
+  SURFEL_EXPECT(guidedSurfels > 0);
+  SURFEL_EXPECT(std::abs(solidAngle - 1.0) < 0.02);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// The pdf of the guided directions, from the code of surfel_guide.glsl on synthetic tiles: the
+// texels of the CDF carry their whole unorm16 step and sum to 1, the pdf per solid angle integrates
+// to 1 over the hemisphere the texel footprints cover once, and the mean 1 / pdf of the sampled
+// directions is 2 pi. The integral sums the pdf at the center of a grid of cells over each texel
+// times the solid angle of the cell, two spherical triangles between the directions at its corners.
+//
+void SurfelReferenceTest::testGuidePdf(uint32_t samples)
+{
+  using Tile = std::array<float, kSurfelGuideEntries>;
+
+  // Even, one hot texel, a gradient, and random with a third of the texels dark
+  std::vector<Tile> tiles(4);
+  uint              seed = tea(0u, 0x9b05688cu);
+  for(uint32_t t = 0; t < kSurfelGuideEntries; t++)
+  {
+    tiles[0][t] = 1.f;
+    tiles[1][t] = t == kSurfelGuideEntries / 2 - 3 ? 1000.f : 0.f;
+    tiles[2][t] = float(t + 1) * float(t + 1);
+    tiles[3][t] = rand(seed) < 0.33f ? 0.f : rand(seed) * 100.f;
+  }
+
+  auto getSolidAngle = [](vec3 a, vec3 b, vec3 c) {
+    return 2.0 * std::atan2(std::abs(double(dot(a, cross(b, c)))), 1.0 + double(dot(a, b) + dot(b, c) + dot(c, a)));
+  };
+
+  const uint32_t cells = 32;  // Per side of a texel
+  for(size_t i = 0; i < tiles.size(); i++)
+  {
+    Tile  cumulative;
+    float sum = 0.f;
+    for(uint32_t t = 0; t < kSurfelGuideEntries; t++)
+    {
+      sum += tiles[i][t];
+      cumulative[t] = sum;
+    }
+    const SurfelGuide guide = makeSurfelGuide(cumulative.data(), sum);
+
+    // Each texel is picked over its step, with its step as pdf
+    uint32_t fetches = 0, below = 0, wrongSteps = 0;
+    double   texelSum = 0.0, integral = 0.0, hemisphere = 0.0;
+    for(uint32_t t = 0; t < kSurfelGuideEntries; t++)
+    {
+      const uint32_t entry    = getGuideCdf(guide, fetches, t);
+      const float    texelPdf = float(entry - below) / 65535.f;
+      float          pdf      = 0.f;
+      const uint32_t picked   = sampleGuideTexel(guide, fetches, (float(below) + 0.5f) / 65535.f, pdf);
+      wrongSteps += entry <= below || picked != t || pdf != texelPdf ? 1 : 0;
+      texelSum += double(texelPdf);
+      below = entry;
+
+      for(uint32_t y = 0; y < cells; y++)
+      {
+        for(uint32_t x = 0; x < cells; x++)
+        {
+          vec3 corners[4];
+          for(uint32_t c = 0; c < 4; c++)
+          {
+            float cornerPdf = 1.f;
+            corners[c] = sampleGuideDirection(t, vec2(float(x + (c & 1)), float(y + (c >> 1))) / float(cells), cornerPdf);
+          }
+          const double cellAngle =
+              getSolidAngle(corners[0], corners[1], corners[3]) + getSolidAngle(corners[0], corners[3], corners[2]);
+          pdf = texelPdf;
+          sampleGuideDirection(t, (vec2(x, y) + 0.5f) / float(cells), pdf);
+          integral += double(pdf) * cellAngle;
+          hemisphere += cellAngle;
+        }
+      }
+    }
+
+    // Monte Carlo estimate of the solid angle of the hemisphere
+    double inversePdf = 0.0;
+    seed              = tea(uint(i), 0x1f83d9abu);
+    for(uint32_t s = 0; s < samples; s++)
+    {
+      float pdf   = 0.f;
+      uint  texel = sampleGuideTexel(guide, fetches, rand(seed), pdf);
+      vec2  r     = rand2(seed);
+      sampleGuideDirection(texel, r, pdf);
+      inversePdf += 1.0 / double(pdf);
+    }
+    const double solidAngle = inversePdf / double(samples) / (2.0 * M_PI);
+
+    LOGI("Surfel guide pdf, tile %zu: texels sum to %.6f (%u wrong steps)\n", i, texelSum, wrongSteps);
+    LOGI("  integral %.5f over %.5f x 2 pi, mean 1 / pdf %.4f x 2 pi\n", integral, hemisphere / (2.0 * M_PI), solidAngle);
+    SURFEL_EXPECT(wrongSteps == 0);
+    SURFEL_EXPECT(std::abs(texelSum - 1.0) < 1e-6);
+    SURFEL_EXPECT(std::abs(hemisphere / (2.0 * M_PI) - 1.0) < 1e-4);
+    SURFEL_EXPECT(std::abs(integral - 1.0) < 1e-3);
+    SURFEL_EXPECT(std::abs(solidAngle - 1.0) < 0.03);
+  }
+}
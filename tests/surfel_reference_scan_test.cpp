@@ -0,0 +1,151 @@
+// Tests of the binning of the surfels in their cells: the scan of the counts and the scatter.
+
+#include "src/surfel_reference_common.hpp"
+#include "surfel_reference_test.hpp"
+
+
+//--------------------------------------------------------------------------------------------------
+// The former binning (atomic offsets in cell processing order, 27 tests again for the scatter)
+// against the current one, on the surfels of the last frame. Each is also run with another thread
+// count: the layouts should match for the scan, they usually do not for the atomics.
+//
+void SurfelReferenceTest::testBinning(uint32_t iterations)
+{
+  const uint32_t alive = std::min(m_counter.aliveSurfelCnt, kMaxSurfelCount);
+  if(!SURFEL_EXPECT(alive > 0))
+    return;
+
+  const uint32_t numThreads = m_settings.numThreads;
+  m_settings.cellHash       = false;  // Both run on the dense grid
+  iterations                = std::max(iterations, 1u);  // The layouts are compared after the last one
+
+  auto countCells = [&](bool masked, uint32_t threads) {
+    std::fill(m_cells.begin(), m_cells.end(), CellInfo{0, 0});
+    nvh::parallel_batches<32>(
+        alive,
+        [&](uint64_t i) {
+          const uint   surfelIndex  = m_alive[i];
+          const Surfel surfel       = m_surfels[surfelIndex];
+          const ivec4  cellPosIndex = getCellPosNonUniform(surfel.position, m_gridOrigin);
+          if(masked)
+          {
+            const uvec2 mask        = getSurfelCellMask(surfel, cellPosIndex, m_gridOrigin);
+            m_cellMask[surfelIndex] = mask;
+            const uint slots        = getCellMaskSlotCount(mask);
+            for(uint j = 0; j < slots; j++)
+            {
+              const ivec4 cellPos = getCellMaskCellPos(cellPosIndex, mask, j);
+              if(cellPos.w >= 0)
+                atomicAdd(m_cells[getFlattenCellIndexNonUniform(cellPos)].surfelCount, 1u);
+            }
+            return;
+          }
+          for(uint j = 0; j < 27; j++)
+          {
+            const ivec4 neighbourPos = getNeighbourCellPos(cellPosIndex, j);
+            const uint  flattenIndex = getFlattenCellIndexNonUniform(neighbourPos);
+            if(isSurfelIntersectCellNonUniform(surfel, neighbourPos, m_gridOrigin) && flattenIndex < m_totalCellCount)
+              atomicAdd(m_cells[flattenIndex].surfelCount, 1u);
+          }
+        },
+        threads);
+  };
+
+  auto binAtomic = [&](uint32_t threads) {
+    countCells(false, threads);
+    m_cellCounter.aliveSurfelInCell = 0;
+    nvh::parallel_batches<256>(
+        m_totalCellCount,
+        [&](uint64_t c) {
+          const uint count = m_cells[c].surfelCount;
+          if(count == 0)
+            return;
+          m_cells[c].surfelOffset = atomicAdd(m_cellCounter.aliveSurfelInCell, count);
+          m_cells[c].surfelCount  = 0;
+        },
+        threads);
+    nvh::parallel_batches<32>(
+        alive,
+        [&](uint64_t i) {
+          const uint   surfelIndex  = m_alive[i];
+          const Surfel surfel       = m_surfels[surfelIndex];
+          const ivec4  cellPosIndex = getCellPosNonUniform(surfel.position, m_gridOrigin);
+          for(uint j = 0; j < 27; j++)
+          {
+            const ivec4 neighbourPos = getNeighbourCellPos(cellPosIndex, j);
+            const uint  flattenIndex = getFlattenCellIndexNonUniform(neighbourPos);
+            if(!isSurfelIntersectCellNonUniform(surfel, neighbourPos, m_gridOrigin) || flattenIndex >= m_totalCellCount)
+              continue;
+            const uint dst = m_cells[flattenIndex].surfelOffset + atomicAdd(m_cells[flattenIndex].surfelCount, 1u);
+            if(dst < m_cellToSurfel.size())
+              atomicStore(m_cellToSurfel[dst], surfelIndex);
+          }
+        },
+        threads);
+  };
+
+  auto binScan = [&](uint32_t threads) {
+    m_settings.numThreads = threads;
+    countCells(true, threads);
+    passCellInfo();
+    passCellToSurfel();
+    m_settings.numThreads = numThreads;
+  };
+
+  auto offsets = [&]() {
+    std::vector<uint32_t> result(m_totalCellCount);
+    for(uint32_t c = 0; c < m_totalCellCount; c++)
+      result[c] = m_cells[c].surfelOffset;
+    return result;
+  };
+  // Per cell lists, and the mean distance between consecutive surfel indices of a list
+  auto snapshot = [&]() {
+    std::vector<std::vector<uint32_t>> lists(m_totalCellCount);
+    for(uint32_t c = 0; c < m_totalCellCount; c++)
+    {
+      const CellInfo cell = m_cells[c];
+      if(size_t(cell.surfelOffset) + cell.surfelCount <= m_cellToSurfel.size())
+        lists[c].assign(m_cellToSurfel.begin() + cell.surfelOffset, m_cellToSurfel.begin() + cell.surfelOffset + cell.surfelCount);
+    }
+    return lists;
+  };
+  auto meanStride = [](const std::vector<std::vector<uint32_t>>& lists) {
+    double   sum   = 0.0;
+    uint64_t count = 0;
+    for(const auto& list : lists)
+      for(size_t i = 1; i < list.size(); i++, count++)
+        sum += std::abs(double(list[i]) - double(list[i - 1]));
+    return count > 0 ? sum / double(count) : 0.0;
+  };
+
+  struct Result
+  {
+    double time{0.0};
+    bool   deterministic{false};
+    double stride{0.0};
+    size_t entries{0};
+  };
+  const uint32_t otherThreads = numThreads > 1 ? 1 : 4;
+  auto           measure      = [&](const auto& bin) {
+    Result result;
+    result.time = surfel_test::timeAverage(iterations, [&] { bin(numThreads); });
+
+    const auto cellOffsets = offsets();
+    const auto lists       = snapshot();
+    result.stride          = meanStride(lists);
+    result.entries         = m_cellCounter.aliveSurfelInCell;
+    bin(otherThreads);
+    result.deterministic = offsets() == cellOffsets && snapshot() == lists;
+    return result;
+  };
+
+  const Result atomicResult = measure(binAtomic);
+  const Result scanResult   = measure(binScan);
+
+  LOGI("Surfel binning: %u surfels, %u cells, %u threads (compared with %u)\n", alive, m_totalCellCount, numThreads, otherThreads);
+  LOGI("  atomic offsets: %8.3f ms, %7zu entries, %s, mean index stride in a cell %.0f\n", atomicResult.time,
+       atomicResult.entries, atomicResult.deterministic ? "same layout" : "layout differs", atomicResult.stride);
+  LOGI("  scan          : %8.3f ms, %7zu entries, %s, mean index stride in a cell %.0f\n", scanResult.time,
+       scanResult.entries, scanResult.deterministic ? "same layout" : "layout differs", scanResult.stride);
+  SURFEL_EXPECT(scanResult.deterministic);
+}
@@ -0,0 +1,99 @@
+// Tests of the amortized schedule of the surfel updates, simulated on its own.
+
+#include "src/surfel_reference_common.hpp"
+#include "surfel_reference_test.hpp"
+
+
+//--------------------------------------------------------------------------------------------------
+// The schedule of surfel_update.comp alone, one step per frame: the threshold from the ranking of
+// the frame before, the hash of the shader and the update forced at getScheduleMaxStale. A third of
+// the surfels start in view and one in twenty flips each frame. The variance only moves on an
+// update, halfway to a level of its own, as the integrate pass does not touch the surfels left out.
+//
+void SurfelReferenceTest::testSchedule(float fraction, uint32_t frames)
+{
+  if(!SURFEL_EXPECT(frames > 0 && fraction > 0.f))
+    return;
+  fraction             = std::min(fraction, 1.f);
+  const uint32_t alive = std::min(m_counter.aliveSurfelCnt, kMaxSurfelCount);
+  const uint32_t count = alive != 0 ? alive : 1u << 16;
+
+  std::vector<uint8_t>  visible(count);
+  std::vector<float>    variance(count), noise(count);
+  std::vector<uint32_t> staleFrames(count, 0), updates(count, 0), visibleUpdates(count, 0);
+  uint                  seed = 0x9b05688cu;
+  for(uint32_t i = 0; i < count; i++)
+  {
+    visible[i]  = rand(seed) < 0.33f ? 1 : 0;
+    variance[i] = alive != 0 ? length(m_surfelCold[m_alive[i]].msmeData.variance) : rand(seed);
+    noise[i]    = rand(seed) * rand(seed);
+  }
+
+  const uint32_t maxStale = getScheduleMaxStale(fraction);
+  const uint32_t quota    = uint32_t(std::ceil(float(count) * fraction));
+  SurfelCounter  counter{};
+  uint64_t       scheduledSum = 0, forced = 0, visibleFrames = 0;
+  uint32_t       scheduledMax = 0, longestWait = 0;
+  for(uint32_t f = 0; f < frames; f++)
+  {
+    const uvec2 threshold = getScheduleThreshold(counter, fraction);
+    counter.scheduleLevel = threshold.x;
+    counter.scheduleShare = threshold.y;
+    std::fill(std::begin(counter.scheduleHistogram), std::end(counter.scheduleHistogram), 0u);
+
+    uint32_t scheduled = 0;
+    for(uint32_t i = 0; i < count; i++)
+    {
+      visible[i] ^= rand(seed) < 0.05f ? 1 : 0;
+      visibleFrames += visible[i];
+      const uint level  = getScheduleLevel(visible[i] != 0, variance[i], staleFrames[i], maxStale);
+      const bool picked = isSurfelScheduled(level, lowbias32(i ^ lowbias32(f)), counter);
+      const bool due    = staleFrames[i] + 1 >= maxStale;
+      counter.scheduleHistogram[getScheduleLevel(visible[i] != 0, variance[i], picked || due ? 0 : staleFrames[i] + 1, maxStale)]++;
+      if(!picked && !due)
+      {
+        staleFrames[i]++;
+        continue;
+      }
+      forced += picked ? 0 : 1;
+      longestWait    = std::max(longestWait, staleFrames[i] + 1);
+      staleFrames[i] = 0;
+      variance[i] = mix(variance[i], noise[i], 0.5f);
+      updates[i]++;
+      visibleUpdates[i] += visible[i];
+      scheduled++;
+    }
+    scheduledSum += scheduled;
+    scheduledMax = f > 0 ? std::max(scheduledMax, scheduled) : 0;  // The first frame has no ranking yet
+  }
+
+  // Update rates in and out of view, Jain's index (sum x)^2 / (n sum x^2) of the update counts
+  uint64_t updateSum = 0, visibleSum = 0;
+  double   squareSum = 0.0;
+  uint32_t fewest    = ~0u;
+  for(uint32_t i = 0; i < count; i++)
+  {
+    updateSum += updates[i];
+    visibleSum += visibleUpdates[i];
+    squareSum += double(updates[i]) * double(updates[i]);
+    fewest = std::min(fewest, updates[i]);
+  }
+  const uint64_t hiddenFrames = uint64_t(count) * frames - visibleFrames;
+  const double   meanShare    = double(scheduledSum) / (double(count) * frames);
+  const double   fairness     = squareSum > 0.0 ? double(updateSum) * double(updateSum) / (double(count) * squareSum) : 1.0;
+
+  LOGI("Surfel schedule: %u %s surfels, update fraction %.2f (quota %u), %u frames, wait bound %u frames\n", count,
+       alive != 0 ? "alive" : "synthetic", fraction, quota, frames, maxStale);
+  LOGI("  scheduled per frame: mean %.0f (%.3f of the surfels), max %u, %.2f%% of the updates forced at the bound\n",
+       double(scheduledSum) / frames, meanShare, scheduledMax, scheduledSum ? 100.0 * double(forced) / double(scheduledSum) : 0.0);
+  LOGI("  longest wait %u frames, fewest updates %u, update rate in view %.3f, out of view %.3f\n", longestWait,
+       fewest, visibleFrames ? double(visibleSum) / double(visibleFrames) : 0.0,
+       hiddenFrames ? double(updateSum - visibleSum) / double(hiddenFrames) : 0.0);
+  LOGI("  fairness of the update counts (Jain) %.3f\n", fairness);
+
+  // The ranking lags a frame, the surfels that came into view since and the updates forced past a
+  // full top level come on top of the quota
+  SURFEL_EXPECT(longestWait <= maxStale);
+  SURFEL_EXPECT(frames < maxStale || fewest > 0);
+  SURFEL_EXPECT(meanShare <= double(fraction) + 1.0 / maxStale + 1.0 / count);
+}
@@ -0,0 +1,190 @@
+// Tests of the order of the work: the radix sort of the alive list and the binning of the rays.
+
+#include "src/surfel_reference_common.hpp"
+#include "surfel_reference_test.hpp"
+
+
+//--------------------------------------------------------------------------------------------------
+// Coherence of the passes that walk the alive list a thread per surfel. Lanes of a warp far apart
+// read other cells and other BVH nodes, what the sort is for. The Surfel records stay where the
+// dead list put them, only the list is sorted.
+//
+void SurfelReferenceTest::testAliveOrder(uint32_t raysPerSurfel)
+{
+  const uint32_t alive = std::min(m_counter.aliveSurfelCnt, kMaxSurfelCount);
+  if(!SURFEL_EXPECT(alive >= 2))
+    return;
+
+  const std::vector<uint32_t> current(m_alive.begin(), m_alive.begin() + alive);
+  std::vector<uint32_t>       shuffled = current;
+  uint                        seed     = 0x1f83d9abu;
+  for(uint32_t i = alive - 1; i > 0; i--)
+    std::swap(shuffled[i], shuffled[pcg(seed) % (i + 1)]);
+
+  // The pass on the list as it is, restored after each run
+  FrameStats   sortStats;
+  const double sortTime = surfel_test::timeAverage(8, [&] {
+    std::copy(current.begin(), current.end(), m_alive.begin());
+    sortStats = {};
+    passSort(sortStats);
+  });
+  const std::vector<uint32_t> sorted(m_alive.begin(), m_alive.begin() + alive);
+  std::copy(current.begin(), current.end(), m_alive.begin());
+
+  std::vector<uint32_t> expected = current;
+  std::stable_sort(expected.begin(), expected.end(), [&](uint32_t a, uint32_t b) { return m_sortKeys[a] < m_sortKeys[b]; });
+  const bool valid = SURFEL_EXPECT(sorted == expected) && SURFEL_EXPECT(sortStats.sortErrors == 0);
+
+  const uint32_t warpCount = (alive + 31) / 32;
+  LOGI("Surfel alive order: %u surfels, %u warps of 32, %u rays per surfel, sort %.3f ms (%u passes)%s\n", alive,
+       warpCount, raysPerSurfel, sortTime, kSortPasses, valid ? "" : ", NOT the stable key order");
+
+  const std::array<std::pair<const char*, const std::vector<uint32_t>*>, 3> orders{
+      {{"current ", &current}, {"shuffled", &shuffled}, {"sorted  ", &sorted}}};
+  for(const auto& [name, order] : orders)
+  {
+    const std::vector<uint32_t>& list = *order;
+    double                       distance = 0.0;
+    for(uint32_t i = 1; i < alive; i++)
+      distance += glm::distance(m_surfels[list[i - 1]].position, m_surfels[list[i]].position);
+
+    // Per warp: distinct cells and 64 byte lines of the Surfel records, then the rays of one sample
+    // index of all lanes traced together
+    std::atomic<uint64_t> cells{0}, lines{0}, visits{0}, distinctNodes{0};
+    const double traceTime = surfel_test::timeAverage(1, [&] {
+      nvh::parallel_batches<1>(
+          warpCount,
+          [&](uint64_t w) {
+            const uint32_t        first = uint32_t(w) * 32;
+            const uint32_t        last  = std::min(first + 32, alive);
+            std::vector<uint32_t> warpCells, warpLines, visited;
+            for(uint32_t i = first; i < last; i++)
+            {
+              const uint32_t surfelIndex = list[i];
+              warpCells.push_back(getFlattenCellIndexNonUniform(getCellPosNonUniform(m_surfels[surfelIndex].position, m_gridOrigin)));
+              warpLines.push_back(uint32_t(surfelIndex * sizeof(Surfel) / 64));
+            }
+            for(uint32_t r = 0; r < raysPerSurfel; r++)
+            {
+              visited.clear();
+              for(uint32_t i = first; i < last; i++)
+              {
+                const Surfel& surfel   = m_surfels[list[i]];
+                uint          randSeed = tea(list[i], r);
+                const vec2    uv       = rand2(randSeed);
+                const vec3    dirL     = CosineSampleHemisphere(uv.x, uv.y);
+                const vec3    N        = decompress_unit_vec(surfel.normal);
+                vec3          T, B;
+                CreateCoordinateSystem(N, T, B);
+
+                CpuBvh::Ray ray;
+                ray.direction = normalize(dirL.x * T + dirL.y * B + dirL.z * N);
+                ray.origin    = surfel.position + 0.05f * N;
+                CpuBvh::Hit hit;
+                m_bvh->intersect(ray, hit, visited);
+              }
+              visits += visited.size();
+              std::sort(visited.begin(), visited.end());
+              distinctNodes += std::unique(visited.begin(), visited.end()) - visited.begin();
+            }
+            std::sort(warpCells.begin(), warpCells.end());
+            std::sort(warpLines.begin(), warpLines.end());
+            cells += std::unique(warpCells.begin(), warpCells.end()) - warpCells.begin();
+            lines += std::unique(warpLines.begin(), warpLines.end()) - warpLines.begin();
+          },
+          m_settings.numThreads);
+    });
+
+    const double batches = double(warpCount) * std::max(raysPerSurfel, 1u);
+    LOGI("  %s: neighbour distance %.3f, per warp %.1f cells %.1f Surfel lines, per batch %.0f nodes visited "
+         "%.0f distinct (x%.2f reuse), trace %.2f ms\n",
+         name, distance / double(alive - 1), double(cells) / warpCount, double(lines) / warpCount,
+         double(visits) / batches, double(distinctNodes) / batches,
+         distinctNodes ? double(visits) / double(distinctNodes) : 0.0, traceTime);
+  }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// Ray coherence of the trace. Allocation order is surfel by surfel, the rays of a warp leave the
+// same point in all directions. The bins group the rays of a region by direction, the direction
+// first variant groups the rays of a direction across the whole grid. The lanes of a warp are busy
+// for the sum of their node visits out of 32 times the longest one, as in a ray query loop.
+//
+void SurfelReferenceTest::testRayCoherence()
+{
+  const uint32_t rayCount = std::min(m_counter.surfelRayCnt, kMaxRayCount);
+  if(!SURFEL_EXPECT(rayCount > 0))
+    return;
+
+  const uint               frameHash = lowbias32(m_totalFrames);
+  std::vector<CpuBvh::Ray> rays(rayCount);
+  std::vector<uint32_t>    directionFirst(rayCount);  // Bins with the direction above the cell
+  nvh::parallel_batches<64>(
+      rayCount,
+      [&](uint64_t i) {
+        uint  randSeed = tea(lowbias32(uint(i)), frameHash);
+        vec3  dirL;
+        float pdf;
+        bool  guided;
+        rays[i]           = getSurfelRay(m_rays[i].surfelID, randSeed, dirL, pdf, guided);
+        const uint bin    = getSurfelRayBin(rays[i].origin, rays[i].direction, m_gridOrigin);
+        directionFirst[i] = (bin % kRayBinDirections) << kRayBinCellBits | bin / kRayBinDirections;
+      },
+      m_settings.numThreads);
+
+  // The pass itself, its scratch state is rewritten every frame
+  FrameStats   binStats;
+  const double binTime = surfel_test::timeAverage(4, [&] {
+    binStats = {};
+    passRayBinning(binStats);
+  });
+
+  std::vector<uint32_t> allocation(rayCount), binned(m_raySortIndex.begin(), m_raySortIndex.begin() + rayCount);
+  for(uint32_t i = 0; i < rayCount; i++)
+    allocation[i] = i;
+  std::vector<uint32_t> byDirection = allocation;
+  std::stable_sort(byDirection.begin(), byDirection.end(),
+                   [&](uint32_t a, uint32_t b) { return directionFirst[a] < directionFirst[b]; });
+
+  const bool     valid     = SURFEL_EXPECT(binStats.sortErrors == 0);
+  const uint32_t warpCount = (rayCount + 31) / 32;
+  LOGI("Surfel ray coherence: %u rays, %u warps of 32, %u bins, binning %.3f ms%s\n", rayCount, warpCount, kRayBinCount,
+       binTime, valid ? "" : ", NOT a permutation in bin order");
+
+  const std::array<std::pair<const char*, const std::vector<uint32_t>*>, 3> orders{
+      {{"allocation     ", &allocation}, {"binned         ", &binned}, {"direction first", &byDirection}}};
+  for(const auto& [name, order] : orders)
+  {
+    const std::vector<uint32_t>& list = *order;
+    std::atomic<uint64_t>        visits{0}, distinctNodes{0}, hits{0}, laneSteps{0};
+    const double traceTime = surfel_test::timeAverage(1, [&] {
+      nvh::parallel_batches<1>(
+          warpCount,
+          [&](uint64_t w) {
+            const uint32_t        first = uint32_t(w) * 32;
+            const uint32_t        last  = std::min(first + 32, rayCount);
+            std::vector<uint32_t> visited;
+            uint32_t              warpHits = 0;
+            size_t                longest  = 0;
+            for(uint32_t i = first; i < last; i++)
+            {
+              CpuBvh::Hit  hit;
+              const size_t before = visited.size();
+              warpHits += m_bvh->intersect(rays[list[i]], hit, visited) ? 1 : 0;
+              longest = std::max(longest, visited.size() - before);
+            }
+            laneSteps += longest * 32;
+            visits += visited.size();
+            hits += warpHits;
+            std::sort(visited.begin(), visited.end());
+            distinctNodes += std::unique(visited.begin(), visited.end()) - visited.begin();
+          },
+          m_settings.numThreads);
+    });
+
+    LOGI("  %s: %.1f nodes per ray, lanes busy %.1f%%, %.0f distinct nodes per warp (x%.2f reuse), %llu hits, trace %.2f ms\n",
+         name, double(visits) / rayCount, 100.0 * double(visits) / double(laneSteps), double(distinctNodes) / warpCount,
+         distinctNodes ? double(visits) / double(distinctNodes) : 0.0, (unsigned long long)hits.load(), traceTime);
+  }
+}
@@ -0,0 +1,89 @@
+// Tests of the frame of SurfelReference: the layout of the surfel records.
+
+#include "src/surfel_reference_common.hpp"
+#include "surfel_reference_test.hpp"
+
+
+//--------------------------------------------------------------------------------------------------
+// The generation lookup (cell list walk and coverage of each G-buffer pixel) over the surfel
+// buffer as it was, one record with the ray range and the MSME state, and over the hot records.
+// Both sum the same contributions, the difference is the memory fetched per lookup.
+//
+void SurfelReferenceTest::testSurfelLayout(uint32_t iterations)
+{
+  static_assert(sizeof(Surfel) == 32, "The hot record should fit two per 64-byte cache line");
+
+  struct SurfelAoS  // Layout of the Surfel structure before the split
+  {
+    Surfel     hot;
+    SurfelCold cold;
+  };
+
+  const uint32_t alive = std::min(m_counter.aliveSurfelCnt, kMaxSurfelCount);
+  if(!SURFEL_EXPECT(alive > 0) || !SURFEL_EXPECT(!m_gbuffer.depth.empty()))
+    return;
+  iterations = std::max(iterations, 1u);  // The coverage is compared below
+
+  std::vector<SurfelAoS> aos(m_surfels.size());
+  for(size_t i = 0; i < aos.size(); i++)
+    aos[i] = {m_surfels[i], m_surfelCold[i]};
+
+  const ivec2    imageRes   = ivec2(m_settings.width / 2, m_settings.height / 2);
+  const uint32_t numThreads = m_settings.numThreads;
+
+  struct Result
+  {
+    double   time{0.0};
+    uint64_t lookups{0};
+    double   coverage{0.0};
+  };
+  auto measure = [&](const auto& getSurfel) {
+    std::vector<uint64_t> lookups(numThreads, 0);
+    std::vector<double>   coverage(numThreads, 0.0);
+    Result                result;
+    result.time = surfel_test::timeAverage(iterations, [&] {
+      nvh::parallel_batches<64>(
+          uint64_t(imageRes.x) * imageRes.y,
+          [&](uint64_t pixel, uint32_t threadIdx) {
+            if(m_gbuffer.depth[pixel] == 1.f)
+              return;
+            const vec3     normal       = decompress_unit_vec(m_gbuffer.normal[pixel]);
+            const vec3     worldPos     = m_gbuffer.position[pixel];
+            const CellInfo cellInfo     = getCellInfo(getCellPosNonUniform(worldPos, m_gridOrigin));
+            float          sum          = 0.f;
+            for(uint i = 0; i < cellInfo.surfelCount && cellInfo.surfelOffset + i < m_cellToSurfel.size(); i++)
+            {
+              const Surfel& surfel = getSurfel(m_cellToSurfel[cellInfo.surfelOffset + i]);
+              const float   dist   = length(surfel.position - worldPos);
+              const float   dotN   = dot(normal, decompress_unit_vec(surfel.normal));
+              if(dist < surfel.radius && dotN > 0.f)
+                sum += smoothstep(0.f, 1.f, min(dotN, 1.f) * clamp(1.f - dist / surfel.radius, 0.f, 1.f));
+            }
+            lookups[threadIdx] += cellInfo.surfelCount;
+            coverage[threadIdx] += sum;
+          },
+          numThreads);
+    });
+    for(uint32_t t = 0; t < numThreads; t++)
+    {
+      result.lookups += lookups[t] / iterations;
+      result.coverage += coverage[t] / iterations;
+    }
+    return result;
+  };
+
+  const Result aosResult = measure([&](uint i) -> const Surfel& { return aos[i].hot; });
+  const Result hotResult = measure([&](uint i) -> const Surfel& { return m_surfels[i]; });
+
+  auto report = [](const char* name, const Result& r, size_t stride) {
+    const double bytes = double(r.lookups) * double(stride);
+    LOGI("  %-12s (%2zu B): %8.3f ms, %6.1f MB of records per pass, %6.2f GB/s\n", name, stride, r.time, bytes / (1 << 20),
+         r.time > 0.0 ? bytes / (r.time * 1e6) : 0.0);
+  };
+  const bool same = std::abs(aosResult.coverage - hotResult.coverage) <= 1e-3 * std::abs(aosResult.coverage);
+  LOGI("Surfel layout: %u surfels, %llu lookups per pass at %dx%d, %u threads%s\n", alive,
+       (unsigned long long)hotResult.lookups, imageRes.x, imageRes.y, numThreads, same ? "" : ", RESULTS DIFFER");
+  report("before split", aosResult, sizeof(SurfelAoS));
+  report("hot records", hotResult, sizeof(Surfel));
+  SURFEL_EXPECT(same);
+}
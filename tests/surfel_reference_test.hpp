@@ -0,0 +1,75 @@
+#pragma once
+
+#include "src/surfel_reference.hpp"
+#include "surfel_test.hpp"
+
+//--------------------------------------------------------------------------------------------------
+// Tests of the units of SurfelReference, split like them in surfel_reference_<unit>_test.cpp.
+// They start from the surfels and the grid origin of the last frame, expect the invariants of their
+// unit with SURFEL_EXPECT and log what they measure against the code the unit replaced. The state
+// may be left changed: surfel_test.cpp runs each test on its own copy of the reference.
+//
+class SurfelReferenceTest : public SurfelReference
+{
+public:
+  // What the frames of a test run from
+  struct Frame
+  {
+    SceneCamera camera{};
+    SunAndSky   sky{};
+    EnvSH       envSH{};
+  };
+
+  // surfel_reference_scan_test.cpp
+  // The scan binning lays the cells out the same way for two thread counts; the atomic offsets it
+  // replaced are timed next to it.
+  void testBinning(uint32_t iterations = 16);
+
+  // surfel_reference_test.cpp
+  // The generation lookup sums the same coverage over the hot records as over the records before
+  // the hot/cold split, with the bytes fetched by each.
+  void testSurfelLayout(uint32_t iterations = 16);
+
+  // surfel_reference_cells_test.cpp
+  // Dense grid and sparse hash give the same cell lists, every key is found from its home slot.
+  void testCellHash(uint32_t iterations = 16);
+  // The overlap ranges give the masks of the 27 neighbour tests, hold every overlapped cell of a
+  // large surfel unclipped, and the cells of the alive surfels fit in cellToSurfel.
+  void testCellOverlap(uint32_t iterations = 4);
+  // `frames` frames with the camera moving `step` along its view, patching the cells and rebuilding
+  // them: neither run reports a frame error.
+  void testCellPatching(const Frame& frame, uint32_t frames, float step);
+
+  // surfel_reference_guide_test.cpp
+  // The tile CDF picks texels with the probabilities of the tile scan it replaced within one unorm16
+  // step, matches its tile, and the pdf of the guided directions covers the hemisphere.
+  void testGuideSampling(uint32_t raysPerSurfel = 64);
+  // On synthetic tiles: the texel probabilities sum to 1, and the pdf of the guided directions
+  // integrates to 1 over the hemisphere with a mean 1 / pdf of 2 pi over `samples` directions.
+  void testGuidePdf(uint32_t samples = 1u << 20);
+
+  // surfel_reference_budget_test.cpp
+  // Scan grants of the ray budget from all the requests down to a tenth: the same for every order of
+  // the alive list and within the budget, against the atomic allocation with roll back.
+  void testRayBudget(uint32_t iterations = 16);
+
+  // surfel_reference_schedule_test.cpp
+  // Amortized schedule alone over the variance of the current surfels (synthetic ones when none is
+  // alive): no surfel waits past getScheduleMaxStale nor goes without an update, and the forced
+  // updates stay within their bound.
+  void testSchedule(float fraction, uint32_t frames = 256);
+
+  // surfel_reference_sort_test.cpp
+  // The radix sort gives the stable order of the keys; warp coherence of the alive list as it is,
+  // shuffled and sorted, with `raysPerSurfel` cosine rays per surfel.
+  void testAliveOrder(uint32_t raysPerSurfel = 4);
+  // The ray binning gives every ray once and in bin order; warp coherence of the rays in allocation
+  // order, in bin order and binned by direction first.
+  void testRayCoherence();
+
+  // surfel_reference_cache_test.cpp
+  // A cache of the current surfels saved after a load has the same bytes, and `frames` frames from
+  // it and from no surfel report no error. Frames until each is within `tolerance` of the current
+  // surfels carried on go to the log.
+  void testWarmStart(const Frame& frame, uint32_t frames, float tolerance = 0.1f);
+};
@@ -0,0 +1,174 @@
+//--------------------------------------------------------------------------------------------------
+// Tests of the CPU surfel pipeline, one ctest case per test (tests/CMakeLists.txt).
+// The fixture is a room with a box and a ground plane reaching the frustum cells of the grid, lit by
+// the default sun & sky of the application. SurfelReference runs its frames from a camera at the
+// door, then each test starts from its own copy of that state. The exit code is the number of tests
+// that failed an expectation or a frame check.
+//
+// surfel_tests [<test>...] [-frames <n>] [-threads <n>] [-list]
+//
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "nvh/gltfscene.hpp"
+#include "src/spherical_harmonics.hpp"
+#include "surfel_reference_test.hpp"
+
+namespace surfel_test {
+std::atomic<uint32_t>& getFailureCount()
+{
+  static std::atomic<uint32_t> count{0};
+  return count;
+}
+}  // namespace surfel_test
+
+namespace {
+struct Test
+{
+  const char* name;
+  void (*run)(SurfelReferenceTest& reference, const SurfelReferenceTest::Frame& frame, uint32_t frames);
+};
+
+const Test s_tests[] = {
+    {"scan", [](SurfelReferenceTest& r, const SurfelReferenceTest::Frame&, uint32_t) { r.testBinning(); }},
+    {"layout", [](SurfelReferenceTest& r, const SurfelReferenceTest::Frame&, uint32_t) { r.testSurfelLayout(); }},
+    {"hash", [](SurfelReferenceTest& r, const SurfelReferenceTest::Frame&, uint32_t) { r.testCellHash(); }},
+    {"overlap", [](SurfelReferenceTest& r, const SurfelReferenceTest::Frame&, uint32_t) { r.testCellOverlap(); }},
+    {"guide", [](SurfelReferenceTest& r, const SurfelReferenceTest::Frame&, uint32_t) { r.testGuideSampling(); }},
+    {"pdf", [](SurfelReferenceTest& r, const SurfelReferenceTest::Frame&, uint32_t) { r.testGuidePdf(); }},
+    {"budget", [](SurfelReferenceTest& r, const SurfelReferenceTest::Frame&, uint32_t) { r.testRayBudget(); }},
+    {"schedule",
+     [](SurfelReferenceTest& r, const SurfelReferenceTest::Frame&, uint32_t) {
+       for(float fraction : {0.25f, 0.5f, 0.1f})
+         r.testSchedule(fraction);
+     }},
+    {"sort", [](SurfelReferenceTest& r, const SurfelReferenceTest::Frame&, uint32_t) { r.testAliveOrder(); }},
+    {"rays", [](SurfelReferenceTest& r, const SurfelReferenceTest::Frame&, uint32_t) { r.testRayCoherence(); }},
+    {"patch",
+     [](SurfelReferenceTest& r, const SurfelReferenceTest::Frame& frame, uint32_t frames) {
+       r.testCellPatching(frame, frames, kCellGridSnap / 16.f);
+     }},
+    {"warm",
+     [](SurfelReferenceTest& r, const SurfelReferenceTest::Frame& frame, uint32_t frames) {
+       r.testWarmStart(frame, frames);
+     }},
+};
+
+void addQuad(nvh::GltfScene& scene, const glm::vec3& origin, const glm::vec3& a, const glm::vec3& b)
+{
+  const uint32_t base = uint32_t(scene.m_positions.size());
+  scene.m_positions.insert(scene.m_positions.end(), {origin, origin + a, origin + a + b, origin + b});
+  for(uint32_t i : {0u, 1u, 2u, 0u, 2u, 3u})
+    scene.m_indices.push_back(base + i);
+}
+
+// Room of 40 x 10 x 40 open on one side, with a box inside, on a ground plane of 400 x 400
+nvh::GltfScene makeRoom()
+{
+  nvh::GltfScene scene;
+  addQuad(scene, {-200, 0, -200}, {400, 0, 0}, {0, 0, 400});
+  addQuad(scene, {-20, 0, -20}, {40, 0, 0}, {0, 10, 0});
+  addQuad(scene, {-20, 0, -20}, {0, 10, 0}, {0, 0, 40});
+  addQuad(scene, {20, 0, -20}, {0, 0, 40}, {0, 10, 0});
+  addQuad(scene, {-5, 0, -5}, {10, 0, 0}, {0, 4, 0});
+  addQuad(scene, {-5, 4, -5}, {10, 0, 0}, {0, 0, 10});
+
+  nvh::GltfPrimMesh mesh;
+  mesh.indexCount  = uint32_t(scene.m_indices.size());
+  mesh.vertexCount = uint32_t(scene.m_positions.size());
+  scene.m_primMeshes.push_back(mesh);
+  scene.m_nodes.push_back(nvh::GltfNode{});
+  return scene;
+}
+}  // namespace
+
+int main(int argc, char** argv)
+{
+  std::vector<std::string> names;
+  uint32_t                 frames     = 32;
+  uint32_t                 numThreads = std::thread::hardware_concurrency();
+  for(int i = 1; i < argc; i++)
+  {
+    if(std::strcmp(argv[i], "-list") == 0)
+    {
+      for(const Test& test : s_tests)
+        LOGI("%s\n", test.name);
+      return 0;
+    }
+    if(std::strcmp(argv[i], "-frames") == 0 && i + 1 < argc)
+      frames = uint32_t(std::max(std::atoi(argv[++i]), 1));
+    else if(std::strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+      numThreads = uint32_t(std::max(std::atoi(argv[++i]), 1));
+    else
+      names.push_back(argv[i]);
+  }
+  for(const std::string& name : names)
+  {
+    if(std::none_of(std::begin(s_tests), std::end(s_tests), [&](const Test& test) { return name == test.name; }))
+    {
+      LOGE("Surfel test %s: unknown, see -list\n", name.c_str());
+      return 1;
+    }
+  }
+
+  const nvh::GltfScene scene = makeRoom();
+  CpuBvh               bvh;
+  bvh.build(scene, numThreads);
+
+  SurfelReferenceTest::Frame frame;
+  frame.sky = {
+      {1, 1, 1},            // rgb_unit_conversion;
+      0.0000101320f,        // multiplier;
+      0.0f,                 // haze;
+      0.0f,                 // redblueshift;
+      1.0f,                 // saturation;
+      0.0f,                 // horizon_height;
+      {0.4f, 0.4f, 0.4f},   // ground_color;
+      0.1f,                 // horizon_blur;
+      {0.0, 0.0, 0.01f},    // night_color;
+      0.8f,                 // sun_disk_intensity;
+      {0.00, 0.78, 0.62f},  // sun_direction;
+      0.0f,                 // sun_disk_scale;
+      1.0f,                 // sun_glow_intensity;
+      1,                    // y_is_up;
+      1,                    // physically_scaled_sun;
+      1,                    // in_use;
+  };
+  frame.envSH             = EnvSHProjection::projectSunAndSky(frame.sky);
+  frame.envSH.coeffs[0].w = 1.f;  // Seeded spawns, as SampleExample::m_surfelSHSeed
+  frame.camera = SurfelReference::makeCamera(glm::lookAt(glm::vec3(0, 6, 30), glm::vec3(0, 2, 0), glm::vec3(0, 1, 0)),
+                                             60.f, 16.f / 9.f);
+
+  SurfelReference::Settings settings;
+  settings.width      = 640;
+  settings.height     = 360;
+  settings.numThreads = numThreads;
+  SurfelReferenceTest fixture;
+  fixture.setup(&bvh, settings);
+  if(!fixture.run(frame.camera, frame.sky, frame.envSH, frames))
+  {
+    LOGE("Surfel tests: the frames of the fixture reported errors\n");
+    return 1;
+  }
+
+  int failed = 0;
+  for(const Test& test : s_tests)
+  {
+    if(!names.empty() && std::find(names.begin(), names.end(), test.name) == names.end())
+      continue;
+    surfel_test::getFailureCount() = 0;
+    SurfelReferenceTest reference  = fixture;
+    MilliTimer          timer;
+    test.run(reference, frame, frames);
+    const uint32_t failures = surfel_test::getFailureCount();
+    LOGI("Surfel test %s: %s in %.1f ms\n", test.name, failures == 0 ? "passed" : "FAILED", timer.elapsed());
+    failed += failures == 0 ? 0 : 1;
+  }
+  return failed;
+}
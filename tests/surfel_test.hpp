@@ -0,0 +1,43 @@
+#pragma once
+
+// Harness of the surfel tests: expectations that log where they failed and count against the test
+// running, and the timing of the measurements. The test executable (surfel_test.cpp) runs one test
+// per ctest case and fails it on the first expectation that did not hold.
+
+#include <atomic>
+#include <cstdint>
+
+#include "nvh/nvprint.hpp"
+#include "src/tools.hpp"
+
+namespace surfel_test {
+
+// Failed expectations since the start of the test
+std::atomic<uint32_t>& getFailureCount();
+
+inline bool expect(bool condition, const char* expression, const char* file, int line)
+{
+  if(!condition)
+  {
+    LOGE("%s(%d): expected %s\n", file, line, expression);
+    getFailureCount()++;
+  }
+  return condition;
+}
+
+// Mean time of `iterations` calls of `fn` in ms
+template <typename Fn>
+double timeAverage(uint32_t iterations, Fn&& fn)
+{
+  if(iterations == 0)
+    return 0.0;
+  MilliTimer timer;
+  for(uint32_t i = 0; i < iterations; i++)
+    fn();
+  return timer.elapsed() / double(iterations);
+}
+
+}  // namespace surfel_test
+
+// Logs the expression and fails the test when `condition` is false, returns `condition`
+#define SURFEL_EXPECT(condition) surfel_test::expect(bool(condition), #condition, __FILE__, __LINE__)
@@ -0,0 +1,270 @@
+//--------------------------------------------------------------------------------------------------
+// Offline surfel bake of a static scene, without a window nor a GPU.
+// The scene is loaded as Scene::load does, then the CPU surfel pipeline (SurfelReference) flies
+// through a set of viewpoints: the glTF cameras, the camera widget presets of the scene or an orbit
+// around it. At each viewpoint the frames run until the indirect lighting settles, between two
+// viewpoints the camera is moved along a straight path. The alive surfels are written as a
+// SurfelCache next to the scene, where the application started with -surfelcache picks them up and
+// only updates them incrementally.
+//
+// surfel_bake -f <scene> [-o <file>] [-cameras <json>] [-orbit <views>] [-pathframes <frames>]
+//             [-maxframes <frames>] [-tolerance <change>] [-width <w>] [-height <h>] [-threads <n>]
+//             [-sun <x> <y> <z>] [-cellhash] [-force] [-surfelconfig <file>] [SurfelConfig options]
+//
+// A viewpoint that does not settle within -maxframes fails the bake: nothing is written and the exit
+// code is 2, as a cache of unconverged lighting would seed the application with it. -force writes it
+// anyway, still reporting the viewpoints that did not settle.
+//
+// The bake has the approximations of SurfelReference: diffuse bounces of a constant albedo lit by
+// the sun & sky only. Surfels out of view do not age during the bake, so the first viewpoints keep
+// theirs until the end. The cache is flagged as baked (SurfelCache::Source::eBake): the application
+// loads it as a seed, with the MSME confidence of new surfels, and its rays replace the radiance.
+// No Vulkan nor window library is linked, the bake runs on machines without a GPU.
+//
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "json.hpp"
+#include "nvh/cameramanipulator.hpp"
+#include "nvh/fileoperations.hpp"
+#include "nvh/gltfscene.hpp"
+#include "nvh/inputparser.h"
+#include "nvh/nvprint.hpp"
+#include "tiny_gltf.h"
+
+#include "src/spherical_harmonics.hpp"
+#include "src/surfel_cache.hpp"
+#include "src/surfel_config.hpp"
+#include "src/surfel_reference.hpp"
+#include "src/tools.hpp"
+
+namespace fs = std::filesystem;
+using Viewpoint = nvh::CameraManipulator::Camera;
+
+// Directory of the executable with a trailing separator, as NVPSystem::exePath without linking nvp
+static std::string getExeDirectory(const char* argv0)
+{
+  std::error_code ec;
+  const fs::path  exe = fs::weakly_canonical(fs::absolute(argv0, ec), ec);
+  return ec ? std::string("./") : exe.parent_path().string() + "/";
+}
+
+// Geometry imported with the attributes of Scene::load, so the hash matches the one of the application
+static bool loadScene(const std::string& filename, nvh::GltfScene& gltf)
+{
+  tinygltf::TinyGLTF tcontext;
+  tinygltf::Model    tmodel;
+  std::string        warn, error;
+  const bool         result = fs::path(filename).extension() == ".gltf" ?
+                                  tcontext.LoadASCIIFromFile(&tmodel, &error, &warn, filename) :
+                                  tcontext.LoadBinaryFromFile(&tmodel, &error, &warn, filename);
+  if(!result)
+  {
+    LOGE("Surfel bake: cannot load %s: %s\n", filename.c_str(), error.c_str());
+    return false;
+  }
+  gltf.importMaterials(tmodel);
+  gltf.importDrawableNodes(tmodel, nvh::GltfAttributes::Normal | nvh::GltfAttributes::Texcoord_0
+                                       | nvh::GltfAttributes::Tangent | nvh::GltfAttributes::Color_0);
+  return true;
+}
+
+// Cameras saved by the camera widget (ImGuiH::SetCameraJsonFile)
+static std::vector<Viewpoint> loadCameraPresets(const std::string& filename)
+{
+  std::vector<Viewpoint> viewpoints;
+  std::ifstream          file(filename);
+  if(!file)
+    return viewpoints;
+
+  const nlohmann::json j = nlohmann::json::parse(file, nullptr, false);
+  if(j.is_discarded() || !j.contains("cameras"))
+  {
+    LOGE("Surfel bake: no camera in %s\n", filename.c_str());
+    return viewpoints;
+  }
+  auto toVec3 = [](const nlohmann::json& v, glm::vec3 value) {
+    return v.is_array() && v.size() == 3 ? glm::vec3(v[0].get<float>(), v[1].get<float>(), v[2].get<float>()) : value;
+  };
+  for(const auto& c : j["cameras"])
+  {
+    Viewpoint viewpoint;
+    viewpoint.eye = toVec3(c.value("eye", nlohmann::json()), viewpoint.eye);
+    viewpoint.ctr = toVec3(c.value("ctr", nlohmann::json()), viewpoint.ctr);
+    viewpoint.up  = toVec3(c.value("up", nlohmann::json()), viewpoint.up);
+    viewpoint.fov = c.value("fov", viewpoint.fov);
+    viewpoints.push_back(viewpoint);
+  }
+  return viewpoints;
+}
+
+// Views on a horizontal circle around the scene center, looking at it
+static std::vector<Viewpoint> makeOrbit(const nvh::GltfScene& gltf, uint32_t count)
+{
+  const auto&            dim = gltf.m_dimensions;
+  std::vector<Viewpoint> viewpoints;
+  for(uint32_t i = 0; i < count; i++)
+  {
+    const float angle = glm::two_pi<float>() * float(i) / float(count);
+    Viewpoint   viewpoint;
+    viewpoint.ctr = dim.center;
+    viewpoint.eye = dim.center + glm::vec3(std::cos(angle), 0.f, std::sin(angle)) * dim.radius * 0.75f;
+    viewpoint.up  = {0.f, 1.f, 0.f};
+    viewpoint.fov = 60.f;
+    viewpoints.push_back(viewpoint);
+  }
+  return viewpoints;
+}
+
+int main(int argc, char** argv)
+{
+  InputParser       parser(argc, argv);
+  std::string       sceneFile    = parser.getString("-f", "late_night_office.glb");
+  const std::string exeDirectory = getExeDirectory(argv[0]);
+
+  // Same search paths as the application
+  const std::vector<std::string> searchPaths = {
+      exeDirectory + PROJECT_NAME,
+      exeDirectory + R"(media)",
+      exeDirectory + PROJECT_RELDIRECTORY,
+      exeDirectory + PROJECT_DOWNLOAD_RELDIRECTORY,
+  };
+
+  // Surfel capacity and grid of the application that loads the bake
+  SurfelConfig surfelConfig;
+  if(parser.exist("-surfelconfig")
+     && !surfelConfig.load(nvh::findFile(parser.getString("-surfelconfig"), searchPaths, true)))
+    return 1;
+  if(!surfelConfig.parse(parser) || !surfelConfig.validate())
+    return 1;
+  surfelConfig.apply();
+
+  sceneFile = nvh::findFile(sceneFile, searchPaths, true);
+  MilliTimer     timer;
+  nvh::GltfScene gltf;
+  if(sceneFile.empty() || !loadScene(sceneFile, gltf))
+    return 1;
+  CpuBvh bvh;
+  bvh.build(gltf);
+  if(bvh.empty())
+  {
+    LOGE("Surfel bake: %s has no triangle\n", sceneFile.c_str());
+    return 1;
+  }
+  LOGI("Surfel bake: %s loaded in %.0f ms\n", sceneFile.c_str(), timer.elapsed());
+
+  // Viewpoints: the glTF cameras and the presets of the scene, or an orbit
+  std::vector<Viewpoint> viewpoints;
+  for(const auto& c : gltf.m_cameras)
+    viewpoints.push_back({c.eye, c.center, c.up, float(glm::degrees(c.cam.perspective.yfov))});
+  const std::string presetFile =
+      parser.getString("-cameras", exeDirectory + fs::path(sceneFile).stem().string() + ".json");
+  const std::vector<Viewpoint> presets = loadCameraPresets(presetFile);
+  viewpoints.insert(viewpoints.end(), presets.begin(), presets.end());
+  if(viewpoints.empty() || parser.exist("-orbit"))
+    viewpoints = makeOrbit(gltf, uint32_t(std::max(parser.getInt("-orbit", 8), 1)));
+
+  SurfelReference::Settings settings;
+  settings.width        = uint32_t(std::max(parser.getInt("-width", 1920), 2));
+  settings.height       = uint32_t(std::max(parser.getInt("-height", 1080), 2));
+  settings.numThreads   = uint32_t(std::max(parser.getInt("-threads", int(settings.numThreads)), 1));
+  settings.cellHash     = parser.exist("-cellhash");
+  settings.sortInterval = 32;  // SampleExample::m_surfelSortInterval
+  settings.ageUnseen    = false;
+
+  SunAndSky sky{
+      {1, 1, 1},            // rgb_unit_conversion;
+      0.0000101320f,        // multiplier;
+      0.0f,                 // haze;
+      0.0f,                 // redblueshift;
+      1.0f,                 // saturation;
+      0.0f,                 // horizon_height;
+      {0.4f, 0.4f, 0.4f},   // ground_color;
+      0.1f,                 // horizon_blur;
+      {0.0, 0.0, 0.01f},    // night_color;
+      0.8f,                 // sun_disk_intensity;
+      {0.00, 0.78, 0.62f},  // sun_direction;
+      0.0f,                 // sun_disk_scale;
+      1.0f,                 // sun_glow_intensity;
+      1,                    // y_is_up;
+      1,                    // physically_scaled_sun;
+      1,                    // in_use;
+  };
+  if(parser.exist("-sun"))
+  {
+    const std::vector<std::string> sun = parser.getString("-sun", 3);
+    if(sun.size() == 3)
+      sky.sun_direction = glm::normalize(glm::vec3(std::stof(sun[0]), std::stof(sun[1]), std::stof(sun[2])));
+  }
+  EnvSH envSH       = EnvSHProjection::projectSunAndSky(sky);
+  envSH.coeffs[0].w = 1.f;  // Seeded spawns, as SampleExample::m_surfelSHSeed
+
+  const uint32_t pathFrames  = uint32_t(std::max(parser.getInt("-pathframes", 32), 0));
+  const uint32_t maxFrames   = uint32_t(std::max(parser.getInt("-maxframes", 1024), 1));
+  const float    tolerance   = parser.getFloat("-tolerance", 0.02f);
+  const float    aspectRatio = float(settings.width) / float(settings.height);
+  auto           makeCamera  = [&](const Viewpoint& v) {
+    return SurfelReference::makeCamera(glm::lookAt(v.eye, v.ctr, v.up), v.fov, aspectRatio);
+  };
+
+  SurfelReference reference;
+  reference.setup(&bvh, settings);
+  LOGI("Surfel bake: %zu viewpoints at %ux%u, %u threads\n", viewpoints.size(), settings.width, settings.height,
+       settings.numThreads);
+
+  timer.reset();
+  uint32_t errors = 0, totalFrames = 0, unsettled = 0;
+  for(size_t i = 0; i < viewpoints.size(); i++)
+  {
+    // Flight from the previous viewpoint
+    for(uint32_t f = 1; i > 0 && f <= pathFrames; f++)
+    {
+      const float     t    = float(f) / float(pathFrames + 1);
+      const Viewpoint& a   = viewpoints[i - 1];
+      const Viewpoint& b   = viewpoints[i];
+      const Viewpoint  mid = {glm::mix(a.eye, b.eye, t), glm::mix(a.ctr, b.ctr, t), glm::normalize(glm::mix(a.up, b.up, t)),
+                             glm::mix(a.fov, b.fov, t)};
+      errors += reference.runFrame(makeCamera(mid), sky, envSH).getErrorCount();
+      totalFrames++;
+    }
+
+    const SurfelReference::Convergence c = reference.runUntilConverged(makeCamera(viewpoints[i]), sky, envSH, maxFrames, tolerance);
+    errors += c.errors;
+    totalFrames += c.frames;
+    unsettled += c.converged ? 0 : 1;
+    LOGI("  viewpoint %zu: %s after %u frames (change %.3f), %u surfels\n", i, c.converged ? "settled" : "NOT settled",
+         c.frames, c.change, c.aliveSurfels);
+  }
+  // A moving camera reports the surfels the update pass skips after a recycling swap, see FrameStats
+  LOGI("Surfel bake: %u frames in %.1f s, %u viewpoints not settled, %u frame errors\n", totalFrames,
+       timer.elapsed() / 1000.0, unsettled, errors);
+  if(unsettled > 0)
+  {
+    LOGE("Surfel bake: %u of %zu viewpoints NOT settled below the tolerance %.3f in %u frames\n", unsettled,
+         viewpoints.size(), tolerance, maxFrames);
+    if(!parser.exist("-force"))
+    {
+      LOGE("Surfel bake: no cache written, raise -maxframes or -tolerance, or pass -force to write it anyway\n");
+      return 2;
+    }
+    LOGW("Surfel bake: -force, writing the cache of unsettled viewpoints\n");
+  }
+
+  SurfelCache cache;
+  cache.sceneHash = bvh.getGeometryHash();
+  cache.source    = SurfelCache::Source::eBake;
+  reference.saveCache(cache);
+  const std::string outFile = parser.getString("-o", SurfelCache::getFilename(sceneFile));
+  if(!cache.save(outFile))
+    return 1;
+  LOGI("Surfel bake: %u surfels, %.1f MB written to %s\n", cache.getSurfelCount(), cache.getByteSize() / (1024.0 * 1024.0),
+       outFile.c_str());
+  return 0;
+}